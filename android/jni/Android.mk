@@ -19,6 +19,10 @@ LOCAL_LDFLAGS += -fopenmp
 LOCAL_MODULE    := hdr
 LOCAL_SRC_FILES := hdr.cpp \
 	$(SRC_PATH)/Filter.cpp \
+	$(SRC_PATH)/Metrics.cpp \
+	$(SRC_PATH)/Trace.cpp \
+	$(SRC_PATH)/ReferenceCache.cpp \
+	$(SRC_PATH)/FrameScheduler.cpp \
 	$(SRC_PATH)/HistEq.cpp \
 	$(SRC_PATH)/GradDom.cpp \
 	$(SRC_PATH)/ReinhardLocal.cpp \
@@ -18,6 +18,162 @@
 
 #define LOG_TAG "hdr"
 
+#define CHECK_ERROR_SETUP(err, op)									\
+	if (err != CL_SUCCESS) {										\
+		status("Error during operation '%s' (%d)", op, err);		\
+		cleanup();													\
+		return false;												\
+	}
+
+
+TextureScheduler::TextureScheduler() : FrameScheduler(1) {
+	m_filter = NULL;
+	m_context = 0;
+	m_queue = 0;
+	m_glQueue = 0;
+	m_textures[0] = m_textures[1] = 0;
+	m_width = 0;
+	m_height = 0;
+	m_recompute = true;
+	m_filterReady = false;
+}
+
+TextureScheduler::~TextureScheduler() {
+	cleanup();
+}
+
+bool TextureScheduler::setup(Filter* filter, cl_context_properties context_prop[], const Filter::Params& params,
+	int width, int height, GLuint in_tex, GLuint out_tex) {
+	cleanup();
+	m_filter = filter;
+	m_width = width;
+	m_height = height;
+
+	//the context shares the GL one, for the textures, and the filter runs in it
+	//on host style images, as a pipeline stage does
+	cl_int err;
+	cl_platform_id platform;
+	cl_device_id device;
+	err = clGetPlatformIDs(1, &platform, NULL);
+	CHECK_ERROR_SETUP(err, "getting platforms");
+	err = clGetDeviceIDs(platform, params.type, 1, &device, NULL);
+	CHECK_ERROR_SETUP(err, "getting devices");
+	context_prop[5] = (cl_context_properties) platform;
+
+	m_context = clCreateContext(context_prop, 1, &device, NULL, NULL, &err);
+	CHECK_ERROR_SETUP(err, "creating context");
+	m_queue = clCreateCommandQueue(m_context, device, 0, &err);
+	CHECK_ERROR_SETUP(err, "creating command queue");
+	m_glQueue = clCreateCommandQueue(m_context, device, 0, &err);
+	CHECK_ERROR_SETUP(err, "creating texture command queue");
+
+	m_textures[0] = clCreateFromGLTexture2D(m_context, CL_MEM_READ_ONLY, GL_TEXTURE_2D, 0, in_tex, &err);
+	CHECK_ERROR_SETUP(err, "creating gl input texture");
+	m_textures[1] = clCreateFromGLTexture2D(m_context, CL_MEM_WRITE_ONLY, GL_TEXTURE_2D, 0, out_tex, &err);
+	CHECK_ERROR_SETUP(err, "creating gl output texture");
+
+	//in the textures' formats, so that they can be copied and the kernels read
+	//and write them as they would the textures
+	cl_image_format format;
+	err = clGetImageInfo(m_textures[0], CL_IMAGE_FORMAT, sizeof(format), &format, NULL);
+	CHECK_ERROR_SETUP(err, "getting input texture format");
+	m_captured.slot(0).memory = clCreateImage2D(m_context, CL_MEM_READ_WRITE, &format, width, height, 0, NULL, &err);
+	CHECK_ERROR_SETUP(err, "creating capture image memory");
+	err = clGetImageInfo(m_textures[1], CL_IMAGE_FORMAT, sizeof(format), &format, NULL);
+	CHECK_ERROR_SETUP(err, "getting output texture format");
+	m_processed.slot(0).memory = clCreateImage2D(m_context, CL_MEM_READ_WRITE, &format, width, height, 0, NULL, &err);
+	CHECK_ERROR_SETUP(err, "creating present image memory");
+
+	Filter::Params filterParams = params;
+	filterParams.opengl = false;
+	m_filter->setImageSize(width, height);
+	m_filter->setSharedContext(m_context, m_queue, device);
+	m_filter->setInputImage(m_captured.slot(0).memory);
+	m_filter->setOutputImage(m_processed.slot(0).memory);
+	if (!m_filter->setupOpenCL(NULL, filterParams)) {
+		cleanup();
+		return false;
+	}
+	m_filterReady = true;
+
+	m_recompute = true;
+	start();
+	return true;
+}
+
+void TextureScheduler::cleanup() {
+	finish();
+	if (m_filter) {
+		if (m_filterReady) m_filter->cleanupOpenCL();
+		m_filter->setSharedContext(0, 0, 0);
+		m_filter->setInputImage(0);
+		m_filter->setOutputImage(0);
+		m_filter = NULL;
+		m_filterReady = false;
+	}
+
+	cl_mem images[] = {m_textures[0], m_textures[1], m_captured.slot(0).memory, m_processed.slot(0).memory};
+	for (int i = 0; i < 4; i++) {
+		if (images[i]) clReleaseMemObject(images[i]);
+	}
+	m_textures[0] = m_textures[1] = 0;
+	m_captured.slot(0).memory = 0;
+	m_processed.slot(0).memory = 0;
+
+	if (m_glQueue) clReleaseCommandQueue(m_glQueue);
+	if (m_queue) clReleaseCommandQueue(m_queue);
+	if (m_context) clReleaseContext(m_context);
+	m_glQueue = 0;
+	m_queue = 0;
+	m_context = 0;
+}
+
+void TextureScheduler::frame(bool recomputeMapping) {
+	if (!m_context) return;
+	if (recomputeMapping) __atomic_store_n(&m_recompute, true, __ATOMIC_RELEASE);
+	//presenting first frees the present slot, for the frame captured next
+	presentFrame();
+	captureFrame();
+}
+
+//a frame with nothing to copy into is one capture drops, the camera has
+//moved on by the time there's room
+bool TextureScheduler::capture(Frame& frame) {
+	if (frame.memory) copyTexture(m_textures[0], frame.memory, m_textures[0]);
+	return true;
+}
+
+bool TextureScheduler::process(Frame& input, Frame& output) {
+	const bool recompute = __atomic_exchange_n(&m_recompute, false, __ATOMIC_ACQ_REL);
+	Image none = {NULL, m_width, m_height};
+	if (!m_filter->runOpenCLOnDevice(none, recompute)) return false;
+	//done before the slots are handed back
+	return clFinish(m_queue) == CL_SUCCESS;
+}
+
+void TextureScheduler::present(Frame& frame) {
+	copyTexture(frame.memory, m_textures[1], m_textures[1]);
+}
+
+//GL draws into or from the texture as soon as processFrame returns, and the
+//other thread reads the image once the slot is handed over, so the copy is
+//finished here
+bool TextureScheduler::copyTexture(cl_mem source, cl_mem destination, cl_mem texture) {
+	const size_t origin[] = {0, 0, 0};
+	const size_t region[] = {m_width, m_height, 1};
+	cl_int err = clEnqueueAcquireGLObjects(m_glQueue, 1, &texture, 0, NULL, NULL);
+	if (err == CL_SUCCESS) {
+		err = clEnqueueCopyImage(m_glQueue, source, destination, origin, origin, region, 0, NULL, NULL);
+		cl_int release = clEnqueueReleaseGLObjects(m_glQueue, 1, &texture, 0, NULL, NULL);
+		if (err == CL_SUCCESS) err = release;
+	}
+	cl_int finish = clFinish(m_glQueue);
+	if (err == CL_SUCCESS) err = finish;
+
+	if (err != CL_SUCCESS) status("Error during operation '%s' (%d)", "copying frame texture", err);
+	return err == CL_SUCCESS;
+}
+
 
 JNIEXPORT void JNICALL Java_com_uob_achohan_hdr_MyGLRenderer_initCL(JNIEnv* jenv, jobject obj, jint width, jint height, jint in_tex, jint out_tex) {
 	filter = new ReinhardLocal(0.18f, 1.1f);
@@ -43,19 +199,22 @@ JNIEXPORT void JNICALL Java_com_uob_achohan_hdr_MyGLRenderer_initCL(JNIEnv* jenv
 
 	params.opengl = true;
 
-	filter->setImageSize(width, height);
-	filter->setImageTextures(in_tex, out_tex);
-	filter->setupOpenCL(cl_prop, params);
+	scheduler = new TextureScheduler();
+	scheduler->setup(filter, cl_prop, params, width, height, in_tex, out_tex);
 
 	return;
 }
 
+//the filter runs on the scheduler's thread, the textures are the ones given to initCL
 JNIEXPORT void JNICALL Java_com_uob_achohan_hdr_MyGLRenderer_processFrame(JNIEnv* jenv, jobject obj, jint input_texid, jint output_texid, jboolean recomputeMapping) {
-	filter->runOpenCL(input_texid, output_texid, recomputeMapping);
+	scheduler->frame(recomputeMapping);
 }
 
 JNIEXPORT void JNICALL Java_com_uob_achohan_hdr_MyGLRenderer_killCL(JNIEnv* jenv, jobject obj) {
-	filter->cleanupOpenCL();
+	delete scheduler;
+	scheduler = NULL;
+	delete filter;
+	filter = NULL;
 }
 
 
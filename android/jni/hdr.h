@@ -13,9 +13,45 @@
 #include "ReinhardLocal.h"
 #include "ReinhardGlobal.h"
 #include "GradDom.h"
+#include "FrameScheduler.h"
 
 using namespace hdr;
 
+//Runs the filter on camera frames off the GL thread. Each frame, the GL thread
+//copies the camera texture into the capture slot's image and the newest
+//filtered frame from the present slot's image into the output texture, so it
+//only waits for those copies, never for the filter. The rings are a slot deep,
+//the filter reads and writes the slots' images directly
+class TextureScheduler : public FrameScheduler {
+public:
+	TextureScheduler();
+	virtual ~TextureScheduler();
+
+	//on the GL thread, context_prop as for setupOpenCL with params.opengl
+	bool setup(Filter* filter, cl_context_properties context_prop[], const Filter::Params& params,
+		int width, int height, GLuint in_tex, GLuint out_tex);
+	void cleanup();
+
+	//on the GL thread, once GL is done drawing the camera frame into in_tex:
+	//out_tex then holds the newest frame filtered since the last call, if any
+	void frame(bool recomputeMapping);
+
+protected:
+	virtual bool capture(Frame& frame);
+	virtual bool process(Frame& input, Frame& output);
+	virtual void present(Frame& frame);
+	bool copyTexture(cl_mem source, cl_mem destination, cl_mem texture);
+
+	Filter* m_filter;
+	cl_context m_context;
+	cl_command_queue m_queue;		//the filter's, used on the process thread
+	cl_command_queue m_glQueue;		//the copies', used on the GL thread
+	cl_mem m_textures[2];			//in_tex, out_tex
+	size_t m_width, m_height;
+	bool m_recompute;				//set on the GL thread, taken by the next frame processed
+	bool m_filterReady;
+};
+
 extern "C" {
 	// Variadic argument wrapper for updateStatus
 	void status(const char *fmt, ...);
@@ -23,6 +59,7 @@ extern "C" {
 
 	Filter* filter;
 	Filter::Params params;
+	TextureScheduler* scheduler;
 
     cl_context_properties cl_prop[7];
 
@@ -65,7 +65,7 @@ static GLubyte indices[] = {
 using namespace hdr;
 
 Renderer::Renderer()
-	: _msg(MSG_NONE), _display(0), _surface(0), _context(0), _angle(0)
+	: _msg(MSG_NONE), _window(0), _display(0), _surface(0), _context(0), _angle(0)
 {
 	status("Renderer instance created");
 	pthread_mutex_init(&_mutex, 0);
@@ -144,13 +144,19 @@ void Renderer::renderLoop()
 
 	while (renderingEnabled) {
 
+		// take the message, the lock isn't held while the frame is drawn
+		// so start, stop and setWindow never wait on a frame
 		pthread_mutex_lock(&_mutex);
+		enum RenderThreadMessage msg = _msg;
+		ANativeWindow* window = _window;
+		_msg = MSG_NONE;
+		pthread_mutex_unlock(&_mutex);
 
 		// process incoming messages
-		switch (_msg) {
+		switch (msg) {
 
 			case MSG_WINDOW_SET:
-				initialize();
+				initialize(window);
 				filter->setupOpenCL(cl_prop, params, input.width*input.height);
 				params.deviceIndex = cameraTexture;		//just hardcoding it in params for now, so don't have to change the code
 				filter->runOpenCL(input, output);
@@ -164,7 +170,6 @@ void Renderer::renderLoop()
 			default:
 				break;
 		}
-		_msg = MSG_NONE;
 		
 		if (_display) {
 			drawFrame();
@@ -173,8 +178,6 @@ void Renderer::renderLoop()
 				LOG_ERROR("eglSwapBuffers() returned error %d", eglGetError());
 			}
 		}
-		
-		pthread_mutex_unlock(&_mutex);
 	}
 	
 	status("Render loop exits");
@@ -182,7 +185,7 @@ void Renderer::renderLoop()
 	return;
 }
 
-bool Renderer::initialize()
+bool Renderer::initialize(ANativeWindow* window)
 {
 	const EGLint attribs[] = {
 		EGL_SURFACE_TYPE, EGL_WINDOW_BIT,
@@ -224,9 +227,9 @@ bool Renderer::initialize()
 		return false;
 	}
 
-	ANativeWindow_setBuffersGeometry(_window, 0, 0, format);
+	ANativeWindow_setBuffersGeometry(window, 0, 0, format);
 
-	if (!(surface = eglCreateWindowSurface(display, config, _window, 0))) {
+	if (!(surface = eglCreateWindowSurface(display, config, window, 0))) {
 		LOG_ERROR("eglCreateWindowSurface() returned error %d", eglGetError());
 		destroy();
 		return false;
@@ -84,7 +84,8 @@ private:
     void renderLoop();
     void getImageTexture();
 
-    bool initialize();
+    // window is the one setWindow gave, read under _mutex
+    bool initialize(ANativeWindow* window);
     void destroy();
 
     void drawFrame();
@@ -4,22 +4,36 @@
 #include <iostream>
 #include <stdlib.h>
 #include <sys/stat.h>
+#include <unistd.h>
 #include <map>
+#include <vector>
+#include <algorithm>
 #include <sys/types.h>
 #include <dirent.h>
 #include <exception>
 #include <stdexcept>
 
-#include "jpeglib.h"
 #include <GL/glx.h>
 #include <SDL2/SDL.h>
-#include <SDL2/SDL_image.h>
 #include <SDL2/SDL_opengl.h>
 
 #include "HistEq.h"
 #include "ReinhardLocal.h"
 #include "ReinhardGlobal.h"
 #include "GradDom.h"
+#include "BilateralLocal.h"
+#include "Stitch.h"
+#include "Pipeline.h"
+#include "ImageIO.h"
+#include "Batch.h"
+#include "Tiled.h"
+#include "MultiDevice.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "ReferenceCache.h"
+#include "Sweep.h"
+#include "GLInterop.h"
+#include "FrameScheduler.h"
 
 #define PIXEL_RANGE 255
 #define NUM_CHANNELS 4
@@ -33,36 +47,74 @@ struct _options_ {
 
 	_options_() {
 		filters["histEq"] = new HistEq();
+		filters["clahe"] = new HistEq(8);	//8x8 tiles
 		filters["reinhardGlobal"] = new ReinhardGlobal();
 		filters["reinhardLocal"] = new ReinhardLocal();
 		filters["gradDom"] = new GradDom();
+		filters["bilateralLocal"] = new BilateralLocal();
 
 		methods["reference"] = METHOD_REFERENCE;
 		methods["opencl"] = METHOD_OPENCL;
+		methods["cpu"] = METHOD_CPU;
 
 #if ENABLE_HALIDE
 		methods["halide_cpu"] = METHOD_HALIDE_CPU;
 		methods["halide_gpu"] = METHOD_HALIDE_GPU;
+		methods["halide_auto"] = METHOD_HALIDE_AUTO;
 #endif
 	}
 } Options;
 
+Metrics* metrics = NULL;	//recorded into by every filter with -metrics, written at exit
+string metrics_path;
+Trace* trace = NULL;	//host and device spans with -trace, written at exit
+string trace_path;
+ReferenceCache* reference_cache = NULL;	//shared by every filter, persisted with -refcache
 
 void clinfo();
 void printUsage();
 int updateStatus(const char *format, va_list args);
+void writeMetrics();
+void writeTrace();
+Image readInput(const char* path);
 void checkError(const char* message, int err);
 bool is_dir(const char* path);
 bool hasEnding (string const &fullString, string const &ending);
-Image readJPG(const char* filePath);
-void writeJPG(Image &image, const char* filePath);
+Image runPinned(Filter* filter, const char* filePath, Filter::Params params);
+Image runStitched(vector<Filter*> stages, const char* dirPath, Filter::Params params, unsigned int method);
+Image runChain(vector<Filter*> stages, Image input, size_t width, size_t height, Filter::Params params, unsigned int method);
+string outputPath(string image_path, Filter* filter);
+vector<string> listInputs(const char* path);
+int runBatch(Filter* filter, const char* path, Filter::Params params, int decoders, int encoders, vector<cl_device_id> devices);
+int runLive(Filter* filter, const char* path, Filter::Params params, double fps);
+Image runMultiDevice(Filter* filter, Image input, Filter::Params params, vector<cl_device_id> devices);
+int runTiled(Filter* filter, const char* path, Filter::Params params, unsigned int method, size_t tileSize);
+int runSweep(Filter* filter, const char* path, Filter::Params params, unsigned int method, vector<string> ranges, string sheet_path, string sweep_dir);
+int runInterop(Filter* filter, const char* path, Filter::Params params, int frames);
+int runHalideBench(Filter* filter, Image input, Filter::Params params);
+bool runHalideSchedule(Filter* filter, unsigned int method, Image input, Image output, Filter::Params params);
 
 
 int main(int argc, char *argv[]) {
 	Filter *filter = NULL;
+	vector<Filter*> stages;		//filter, then any given with -then
 	Filter::Params params;
 	unsigned int method = 0;
 	string image_path;
+	string batch_path;
+	int decoders = 0, encoders = 0;
+	double live_fps = 0;	//replay a batch as a camera at this frame rate when non-zero
+	size_t tileSize = 0;	//process in tiles of this size when non-zero
+	vector<pair<cl_uint, cl_uint> > device_indices;	//every -cldevice given
+	bool all_devices = false;
+	int subdevices = 0;
+	int verify = -1;	//single images are verified unless told otherwise, batches aren't
+	bool halide_bench = false;
+	int rolling = 0;	//subsample of a rolling histogram, histEq over a batch of frames
+	vector<pair<Filter*, string> > parameters;	//-param settings, for the filter named before them
+	vector<string> sweeps;	//-sweep ranges, tonemapping with every combination when given
+	string sheet_path, sweep_dir;
+	int interop_frames = 0;	//benchmark GL texture sharing over this many frames when non-zero
 
 	// Parse arguments
 	for (int i = 1; i < argc; i++) {
@@ -89,6 +141,31 @@ int main(int argc, char *argv[]) {
 				cout << "Invalid platform/device index." << endl;
 				exit(1);
 			}
+			device_indices.push_back(make_pair(params.platformIndex, params.deviceIndex));
+		}
+		else if (!strcmp(argv[i], "-alldevices")) {	//split the work across every device
+			all_devices = true;
+		}
+		else if (!strcmp(argv[i], "-subdevices")) {	//split each device into sub-devices
+			++i;
+			subdevices = i < argc ? atoi(argv[i]) : 0;
+			if (subdevices <= 0) {
+				cout << "Positive sub-device count required with -subdevices." << endl;
+				exit(1);
+			}
+		}
+		else if (!strcmp(argv[i], "-then")) {	//chain another filter after the previous one
+			++i;
+			if (i >= argc || Options.filters.find(argv[i]) == Options.filters.end()) {
+				cout << "Filter name required with -then." << endl;
+				exit(1);
+			}
+			Filter* next = Options.filters[argv[i]];
+			if (next == filter || find(stages.begin(), stages.end(), next) != stages.end()) {
+				cout << "Each filter can only appear once in a chain." << endl;
+				exit(1);
+			}
+			stages.push_back(next);
 		}
 		else if (!strcmp(argv[i], "-image")) {	//apply filter on the given image
 			++i;
@@ -98,35 +175,769 @@ int main(int argc, char *argv[]) {
 			}
 			image_path = argv[i];
 		}		
+		else if (!strcmp(argv[i], "-batch")) {	//apply filter on every image in a directory or list
+			++i;
+			if (i >= argc) {
+				cout << "Directory or file list required with -batch." << endl;
+				exit(1);
+			}
+			batch_path = argv[i];
+		}
+		else if (!strcmp(argv[i], "-decoders") || !strcmp(argv[i], "-encoders")) {	//batch stage threads
+			const char* option = argv[i];
+			++i;
+			int threads = i < argc ? atoi(argv[i]) : 0;
+			if (threads <= 0) {
+				cout << "Positive thread count required with " << option << "." << endl;
+				exit(1);
+			}
+			if (!strcmp(option, "-decoders")) decoders = threads;
+			else encoders = threads;
+		}
+		else if (!strcmp(argv[i], "-live")) {	//treat a batch as camera frames, dropping late ones
+			++i;
+			live_fps = i < argc ? atof(argv[i]) : 0;
+			if (live_fps <= 0) {
+				cout << "Positive frame rate required with -live." << endl;
+				exit(1);
+			}
+		}
+		else if (!strcmp(argv[i], "-tile")) {	//process the image in tiles, for images too large to hold
+			++i;
+			int size = i < argc ? atoi(argv[i]) : 0;
+			if (size <= 0) {
+				cout << "Positive tile size required with -tile." << endl;
+				exit(1);
+			}
+			tileSize = size;
+		}
+		else if (!strcmp(argv[i], "-verify")) {
+			verify = 1;
+		}
+		else if (!strcmp(argv[i], "-noverify")) {
+			verify = 0;
+		}
+		else if (!strcmp(argv[i], "-verifyevery")) {	//verify one frame in N
+			++i;
+			int interval = i < argc ? atoi(argv[i]) : 0;
+			if (interval <= 0) {
+				cout << "Positive frame interval required with -verifyevery." << endl;
+				exit(1);
+			}
+			params.verifyInterval = interval;
+			verify = 1;
+		}
+		else if (!strcmp(argv[i], "-verifytile")) {	//verify a random tile rather than the whole image
+			++i;
+			int size = i < argc ? atoi(argv[i]) : 0;
+			if (size <= 0) {
+				cout << "Positive tile size required with -verifytile." << endl;
+				exit(1);
+			}
+			params.verifyTile = size;
+			verify = 1;
+		}
+		else if (!strcmp(argv[i], "-param")) {	//set a filter parameter, NAME=VALUE
+			++i;
+			if (i >= argc || !strchr(argv[i], '=') || !filter) {
+				cout << "NAME=VALUE required with -param, after the filter it applies to." << endl;
+				exit(1);
+			}
+			parameters.push_back(make_pair(stages.empty() ? filter : stages.back(), string(argv[i])));
+		}
+		else if (!strcmp(argv[i], "-sweep")) {	//tonemap with a range of a parameter, NAME=MIN:MAX:STEPS or NAME=V,V...
+			++i;
+			if (i >= argc || !strchr(argv[i], '=')) {
+				cout << "NAME=MIN:MAX:STEPS or NAME=VALUE,VALUE... required with -sweep." << endl;
+				exit(1);
+			}
+			sweeps.push_back(argv[i]);
+		}
+		else if (!strcmp(argv[i], "-sheet")) {	//where the sweep's contact sheet goes
+			++i;
+			if (i >= argc) {
+				cout << "Output path required with -sheet." << endl;
+				exit(1);
+			}
+			sheet_path = argv[i];
+		}
+		else if (!strcmp(argv[i], "-sweepdir")) {	//also write each setting of the sweep
+			++i;
+			if (i >= argc) {
+				cout << "Directory required with -sweepdir." << endl;
+				exit(1);
+			}
+			sweep_dir = argv[i];
+		}
+		else if (!strcmp(argv[i], "-glinterop")) {	//compare shared GL textures with host copies, headless
+			++i;
+			interop_frames = i < argc ? atoi(argv[i]) : 0;
+			if (interop_frames <= 0) {
+				cout << "Positive frame count required with -glinterop." << endl;
+				exit(1);
+			}
+		}
+		else if (!strcmp(argv[i], "-halidebench")) {	//compare the Halide schedules
+			halide_bench = true;
+		}
+		else if (!strcmp(argv[i], "-rolling")) {	//keep a running histogram across frames
+			++i;
+			rolling = i < argc ? atoi(argv[i]) : 0;
+			if (rolling != 1 && rolling != 4 && rolling != 16) {
+				cout << "Subsample of 1, 4 or 16 required with -rolling." << endl;
+				exit(1);
+			}
+		}
+		else if (!strcmp(argv[i], "-metrics")) {	//export counters and latencies at exit
+			++i;
+			if (i >= argc) {
+				cout << "Output path required with -metrics." << endl;
+				exit(1);
+			}
+			metrics_path = argv[i];
+		}
+		else if (!strcmp(argv[i], "-trace")) {	//write a timeline of host and device work at exit
+			++i;
+			if (i >= argc) {
+				cout << "Output path required with -trace." << endl;
+				exit(1);
+			}
+			trace_path = argv[i];
+		}
+		else if (!strcmp(argv[i], "-refcache")) {	//keep reference results on disk between runs
+			++i;
+			if (i >= argc) {
+				cout << "Directory required with -refcache." << endl;
+				exit(1);
+			}
+			reference_cache = new ReferenceCache(REFERENCE_CACHE_BYTES, argv[i]);
+		}
+		else if (!strcmp(argv[i], "-half")) {	//store intermediate planes as half floats
+			params.halfPrecision = true;
+		}
 		else if (!strcmp(argv[i], "-clinfo")) {
 			clinfo();
 			exit(0);
 		}
 	}
-	if (filter == NULL || method == 0) {	//invalid arguments
+	if (filter == NULL || (method == 0 && !halide_bench)) {	//invalid arguments
 		printUsage();
 		exit(1);
 	}
 
+	if (rolling) {
+		HistEq* histEq = dynamic_cast<HistEq*>(filter);
+		if (!histEq || batch_path == "") {
+			cout << "-rolling only applies to histEq over a batch of frames." << endl;
+			exit(1);
+		}
+		histEq->setRolling(rolling);
+	}
+
+	for (size_t i = 0; i < parameters.size(); i++) {
+		const string& setting = parameters[i].second;
+		const size_t equals = setting.find('=');
+		char* end;
+		const float value = strtof(setting.c_str() + equals + 1, &end);
+		parameters[i].first->setStatusCallback(updateStatus);
+		if (*end || end == setting.c_str() + equals + 1 || !parameters[i].first->setParameter(setting.substr(0, equals).c_str(), value)) {
+			cout << "Invalid parameter " << setting << " for " << parameters[i].first->getName() << "." << endl;
+			exit(1);
+		}
+	}
+
+	if (metrics_path != "") {
+		metrics = new Metrics();
+		atexit(writeMetrics);
+	}
+	if (trace_path != "") {
+		trace = new Trace();
+		atexit(writeTrace);
+	}
+
+	stages.insert(stages.begin(), filter);
+	for (size_t i = 0; i < stages.size(); i++) {
+		stages[i]->setStatusCallback(updateStatus);
+		stages[i]->setMetrics(metrics);
+		stages[i]->setTrace(trace);
+		stages[i]->setReferenceCache(reference_cache);
+	}
+
+	//devices to split the work across, if more than one
+	vector<cl_device_id> devices;
+	if (all_devices || subdevices || device_indices.size() > 1) {
+		if (all_devices) devices = MultiDevice::allDevices(params.type);
+		if (device_indices.empty()) device_indices.push_back(make_pair(params.platformIndex, params.deviceIndex));
+		for (size_t i = 0; i < device_indices.size() && !all_devices; i++) {
+			cl_device_id device = MultiDevice::getDevice(device_indices[i].first, device_indices[i].second, params.type);
+			if (!device) {
+				cout << "No device " << device_indices[i].first << ":" << device_indices[i].second << "." << endl;
+				exit(1);
+			}
+			devices.push_back(device);
+		}
+		if (subdevices) devices = MultiDevice::subDevices(devices, subdevices);
+
+		if (devices.size() == 1) params.device = devices[0];
+		else if (method != METHOD_OPENCL || stages.size() > 1 || tileSize) {
+			cout << "Multiple devices only run a single filter with the opencl method." << endl;
+			exit(1);
+		}
+	}
+	if (devices.size() < 2) devices.clear();
+
+	if (batch_path != "") {
+		if (method != METHOD_OPENCL) {
+			cout << "Batch mode only runs the opencl method." << endl;
+			exit(1);
+		}
+		if (stages.size() > 1) {
+			cout << "Batch mode runs a single filter." << endl;
+			exit(1);
+		}
+		params.verify = verify == 1;
+		if (live_fps) {
+			if (!devices.empty()) {
+				cout << "Live mode runs on a single device." << endl;
+				exit(1);
+			}
+			return runLive(filter, batch_path.c_str(), params, live_fps) ? 1 : 0;
+		}
+		return runBatch(filter, batch_path.c_str(), params, decoders, encoders, devices) ? 1 : 0;
+	}
+
 	if (image_path == "") image_path = "../test_images/lena-300x300.jpg";
-	Image input = readJPG(image_path.c_str());
+
+	if (halide_bench) {
+		if (stages.size() > 1 || is_dir(image_path.c_str())) {
+			cout << "The Halide bench runs a single filter on a single image." << endl;
+			exit(1);
+		}
+		Image input = readInput(image_path.c_str());
+		int ret = runHalideBench(filter, input, params);
+		free(input.data);
+		return ret;
+	}
+
+	if (tileSize) {
+		if (stages.size() > 1 || is_dir(image_path.c_str())) {
+			cout << "Tiled mode runs a single filter on a single image." << endl;
+			exit(1);
+		}
+		//every tile would be checked against its own reference run
+		params.verify = verify == 1;
+		return runTiled(filter, image_path.c_str(), params, method, tileSize) ? 0 : 1;
+	}
+
+	if (!sweeps.empty()) {
+		if (stages.size() > 1 || is_dir(image_path.c_str()) || !devices.empty()) {
+			cout << "Sweeps run a single filter on a single image." << endl;
+			exit(1);
+		}
+		//every setting would be checked against its own reference run
+		params.verify = verify == 1;
+		return runSweep(filter, image_path.c_str(), params, method, sweeps, sheet_path, sweep_dir) ? 0 : 1;
+	}
+
+	if (interop_frames) {
+		if (method != METHOD_OPENCL || stages.size() > 1 || is_dir(image_path.c_str()) || !devices.empty()) {
+			cout << "The GL interop benchmark runs a single filter with the opencl method on a single image." << endl;
+			exit(1);
+		}
+		return runInterop(filter, image_path.c_str(), params, interop_frames) ? 0 : 1;
+	}
+	params.verify = verify != 0;
 
 	// Run filter
-	filter->setStatusCallback(updateStatus);
-	Image output = filter->runFilter(input, params, method);
+	Image output;
+	if (is_dir(image_path.c_str())) {
+		if (!devices.empty()) {
+			cout << "Multiple devices can't be used for stitching." << endl;
+			exit(1);
+		}
+		output = runStitched(stages, image_path.c_str(), params, method);
+	}
+	else if (!devices.empty()) {
+		Image input = readInput(image_path.c_str());
+		output = runMultiDevice(filter, input, params, devices);
+		free(input.data);
+	}
+	else if (stages.size() == 1 && method == METHOD_OPENCL && !isHDRFile(image_path.c_str())) {
+		output = runPinned(filter, image_path.c_str(), params);
+	}
+	else {
+		Image input = readInput(image_path.c_str());
+		if (stages.size() == 1) output = filter->runFilter(input, params, method);
+		else output = runChain(stages, input, input.width, input.height, params, method);
+		free(input.data);
+	}
+	if (!output.data) {
+		cout << "Tonemapping failed, no output was written." << endl;
+		return 1;
+	}
 
 	//Save the file
-	int lastindex;
-	if (is_dir(image_path.c_str()))	image_path = image_path.substr(0, image_path.find_last_of("/"));
+	{
+		TraceScope scope(trace, "writeJPG");
+		writeJPG(output, outputPath(image_path, filter).c_str());
+	}
+	free(output.data);
+
+	return 0;
+}
+
+//merges the bracketed exposures in a directory and tonemaps the result
+Image runStitched(vector<Filter*> stages, const char* dirPath, Filter::Params params, unsigned int method) {
+	vector<string> paths = listInputs(dirPath);
+	vector<Image> exposures;
+	for (size_t i = 0; i < paths.size(); i++) {
+		if (!isHDRFile(paths[i].c_str())) exposures.push_back(readInput(paths[i].c_str()));
+	}
+	if (exposures.empty()) {
+		cout << "No exposures found in " << dirPath << "." << endl;
+		exit(1);
+	}
+
+	Stitch stitch;
+	stitch.setStatusCallback(updateStatus);
+	stitch.setMetrics(metrics);
+	stitch.setTrace(trace);
+	Image stack = stitch.stackExposures(exposures);
+	for (size_t i = 0; i < exposures.size(); i++) free(exposures[i].data);
+	if (!stack.data) exit(1);
+
+	stages.insert(stages.begin(), &stitch);
+	Image output = runChain(stages, stack, stack.width, stack.height/exposures.size(), params, method);
+	free(stack.data);
+	return output;
+}
+
+//runs each stage on the previous one's output. With OpenCL the stages share a
+//context and the intermediate images never leave the device
+Image runChain(vector<Filter*> stages, Image input, size_t width, size_t height, Filter::Params params, unsigned int method) {
+	if (method != METHOD_OPENCL) {
+		Image image = input;
+		for (size_t i = 0; i < stages.size(); i++) {
+			Image next = stages[i]->runFilter(image, params, method);
+			if (image.data != input.data) free(image.data);
+			image = next;
+			if (!image.data) break;
+		}
+		return image;
+	}
+
+	Image output = createImage(width, height);
+
+	cout << "--------------------------------Running " << stages[0]->getName();
+	for (size_t i = 1; i < stages.size(); i++) cout << " -> " << stages[i]->getName();
+	cout << endl;
+
+	Pipeline pipeline;
+	for (size_t i = 0; i < stages.size(); i++) pipeline.addStage(stages[i]);
+	pipeline.setStatusCallback(updateStatus);
+
+	if (!pipeline.setup(params, width, height, input.format)) exit(1);
+	pipeline.run(input, output);
+	pipeline.cleanup();
+
+	return output;
+}
+
+string outputPath(string image_path, Filter* filter) {
+	if (is_dir(image_path.c_str())) {
+		while (hasEnding(image_path, "/")) image_path.erase(image_path.length()-1);
+	}
 	else image_path = image_path.substr(0, image_path.find_last_of("."));
 
 	string image_name = image_path.substr(image_path.find_last_of("/")+1, 100);
 	string output_path = "../output_images/" + image_name + "_";
-	output_path = output_path + filter->getName() + ".jpg";
+	return output_path + filter->getName() + ".jpg";
+}
+
+//images in a directory, or the paths listed one per line in a file
+vector<string> listInputs(const char* path) {
+	vector<string> inputs;
+
+	if (is_dir(path)) {
+		DIR* dir = opendir(path);
+		if (!dir) throw std::runtime_error("Problem opening input directory");
+
+		struct dirent* entry;
+		while ((entry = readdir(dir))) {
+			string name = entry->d_name;
+			string lower = name;
+			transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+			if (hasEnding(lower, ".jpg") || hasEnding(lower, ".jpeg") || isHDRFile(name.c_str()))
+				inputs.push_back(string(path) + "/" + name);
+		}
+		closedir(dir);
+		sort(inputs.begin(), inputs.end());
+	}
+	else {
+		FILE* list = fopen(path, "r");
+		if (!list) throw std::runtime_error("Problem opening input list");
 
-	writeJPG(output, output_path.c_str());
+		char line[4096];
+		while (fgets(line, sizeof(line), list)) {
+			line[strcspn(line, "\r\n")] = 0;
+			if (line[0]) inputs.push_back(line);
+		}
+		fclose(list);
+	}
+
+	return inputs;
+}
+
+int runBatch(Filter* filter, const char* path, Filter::Params params, int decoders, int encoders, vector<cl_device_id> devices) {
+	vector<string> inputs = listInputs(path);
+	vector<string> outputs;
+	for (size_t i = 0; i < inputs.size(); i++) outputs.push_back(outputPath(inputs[i], filter));
+
+	cout << "--------------------------------Tonemapping " << inputs.size() << " images using " << filter->getName() << endl;
+
+	//each device takes the next frame when it's free
+	MultiDevice multi(filter, params, devices);
+	multi.setStatusCallback(updateStatus);
+	multi.setMetrics(metrics);
+	multi.setTrace(trace);
+	multi.setReferenceCache(reference_cache);
+
+	Batch batch(filter, devices.empty() ? params : multi.getParams(0));
+	for (size_t d = 1; d < multi.getNumDevices(); d++) batch.addDevice(multi.getFilter(d), multi.getParams(d));
+	batch.setTrace(trace);
+	batch.setThreads(decoders, encoders);
+	int failed = batch.run(inputs, outputs);
+
+	double elapsed = batch.getElapsedTime();
+	printf("Finished %lu images in %lf s (%lf images/s), %d failed\n",
+		inputs.size(), elapsed, inputs.size()/elapsed, failed);
+	printf("Devices waited %lf ms for decoded images\n", batch.getDeviceIdleTime()*1000);
+	for (size_t d = 0; d < batch.getNumDevices() && batch.getNumDevices() > 1; d++) {
+		printf("Device %lu: %lu images in %lf s busy\n", d, batch.getDeviceFrames(d), batch.getDeviceBusyTime(d));
+	}
+
+	return failed;
+}
+
+//replays a batch as camera frames arriving at a fixed rate, see -live
+class LiveStream : public FrameScheduler {
+public:
+	LiveStream(Filter* filter, const Filter::Params& params, const vector<string>& inputs, const vector<string>& outputs, double fps)
+		: m_filter(filter), m_params(params), m_inputs(inputs), m_outputs(outputs), m_fps(fps) {
+		m_start = 0;
+		m_ready = false;
+		m_width = 0;
+		m_height = 0;
+		m_format = IMAGE_RGBA8;
+	}
+
+	void cleanup() {
+		if (m_ready) m_filter->cleanupOpenCL();
+		m_ready = false;
+	}
+
+protected:
+	Filter* m_filter;
+	Filter::Params m_params;
+	const vector<string>& m_inputs;
+	const vector<string>& m_outputs;
+	double m_fps;
+	double m_start;		//when the first frame was captured
+	bool m_ready;		//set up for the size and format of the last frame
+	size_t m_width, m_height;
+	int m_format;
+
+	bool capture(Frame& frame) {
+		if (frame.seq >= m_inputs.size()) return false;
+
+		//frames arrive on the camera's clock, whether or not they're taken in time
+		if (frame.seq == 0) m_start = getCurrentTime();
+		const double due = m_start + frame.seq*1e6/m_fps;
+		const double now = getCurrentTime();
+		if (due > now) usleep(due - now);
+
+		const char* path = m_inputs[frame.seq].c_str();
+		try {
+			TraceScope scope(trace, isHDRFile(path) ? "readHDR" : "readJPG", "live");
+			if (isHDRFile(path)) {
+				Image image = readHDR(path);
+				releaseImage(frame.image);
+				frame.image = image;
+			}
+			else {
+				//decoded straight into the slot's buffer once it's the right size
+				size_t width, height;
+				readJPGSize(path, &width, &height);
+				if (!frame.image.data || frame.image.width != width || frame.image.height != height || frame.image.format != IMAGE_RGBA8) {
+					releaseImage(frame.image);
+					frame.image = createImage(width, height);
+				}
+				readJPG(path, frame.image);
+			}
+		}
+		catch (std::exception& e) {
+			cerr << path << ": " << e.what() << endl;
+			releaseImage(frame.image);
+		}
+		return true;
+	}
+
+	bool process(Frame& input, Frame& output) {
+		if (!input.image.data) return false;
+		const Image& image = input.image;
+		if (!m_ready || image.width != m_width || image.height != m_height || image.format != m_format) {
+			cleanup();
+			m_width = image.width;
+			m_height = image.height;
+			m_format = image.format;
+			m_filter->setImageSize(m_width, m_height);
+			m_filter->setImageFormat(m_format);
+			m_ready = m_filter->setupOpenCL(NULL, m_params);
+		}
+		if (!output.image.data || output.image.width != image.width || output.image.height != image.height) {
+			releaseImage(output.image);
+			output.image = createImage(image.width, image.height);
+		}
+		return m_ready && m_filter->runOpenCL(input.image, output.image);
+	}
+
+	void present(Frame& frame) {
+		if (!frame.passed) return;
+		const char* path = m_outputs[frame.seq].c_str();
+		try {
+			TraceScope scope(trace, "writeJPG", "live");
+			writeJPG(frame.image, path);
+		}
+		catch (std::exception& e) {
+			cerr << path << ": " << e.what() << endl;
+		}
+	}
+};
+
+//tonemaps a batch as if it were a camera stream, frames that can't be kept up
+//with are dropped, so only some outputs are written
+int runLive(Filter* filter, const char* path, Filter::Params params, double fps) {
+	vector<string> inputs = listInputs(path);
+	vector<string> outputs;
+	for (size_t i = 0; i < inputs.size(); i++) outputs.push_back(outputPath(inputs[i], filter));
+
+	cout << "--------------------------------Streaming " << inputs.size() << " frames at " << fps << " fps using " << filter->getName() << endl;
+
+	LiveStream stream(filter, params, inputs, outputs, fps);
+	stream.setMetrics(metrics);
+	stream.run();
+	stream.cleanup();
+
+	printf("Presented %lu of %lu frames (%lu dropped, %lu failed), latency mean %lf ms, max %lf ms\n",
+		stream.getPresented(), stream.getCaptured(), stream.getDropped(), stream.getFailed(),
+		stream.getMeanLatency()*1000, stream.getMaxLatency()*1000);
+	return stream.getFailed();
+}
+
+//tonemaps one band of the image on each device
+Image runMultiDevice(Filter* filter, Image input, Filter::Params params, vector<cl_device_id> devices) {
+	Image output = createImage(input.width, input.height);
+
+	cout << "--------------------------------Tonemapping on " << devices.size() << " devices using " << filter->getName() << endl;
+
+	MultiDevice multi(filter, params, devices);
+	multi.setStatusCallback(updateStatus);
+	multi.setMetrics(metrics);
+	multi.setTrace(trace);
+	multi.setReferenceCache(reference_cache);
+	if (!multi.run(input, output)) cout << "Tonemapping failed on at least one device." << endl;
+
+	for (size_t d = 0; d < multi.getNumDevices(); d++) {
+		printf("Device %lu: %lu rows at %lf Mpixels/s\n", d, multi.getRows(d), multi.getThroughput(d)/1e6);
+	}
+	multi.cleanup();
+
+	return output;
+}
+
+//tonemaps an image in bounded memory, streaming it from and to disk
+int runTiled(Filter* filter, const char* path, Filter::Params params, unsigned int method, size_t tileSize) {
+	cout << "--------------------------------Tonemapping in tiles using " << filter->getName() << endl;
+
+	Tiled tiled(filter, params);
+	tiled.setTileSize(tileSize);
+	bool passed = tiled.run(path, outputPath(path, filter).c_str(), method);
+
+	printf("Finished %lu tiles in %lf s (statistics pass %lf s)\n",
+		tiled.getNumTiles(), tiled.getElapsedTime(), tiled.getStatisticsTime());
+	return passed;
+}
+
+//tonemaps the image with every combination of the ranges, reading it and
+//setting up the filter once, into a contact sheet
+int runSweep(Filter* filter, const char* path, Filter::Params params, unsigned int method, vector<string> ranges, string sheet_path, string sweep_dir) {
+	Sweep sweep(filter, params);
+	for (size_t i = 0; i < ranges.size(); i++) {
+		const size_t equals = ranges[i].find('=');
+		const string name = ranges[i].substr(0, equals);
+		const char* spec = ranges[i].c_str() + equals + 1;
+		char *end;
+		vector<float> values;
+		bool added = false;
+		if (strchr(spec, ':')) {
+			float min = strtof(spec, &end);
+			float max = *end == ':' ? strtof(end + 1, &end) : 0.f;
+			long steps = *end == ':' ? strtol(end + 1, &end, 10) : 0;
+			added = !*end && sweep.addRange(name.c_str(), min, max, steps);
+		}
+		else {
+			while (true) {
+				values.push_back(strtof(spec, &end));
+				if (end == spec || *end != ',') break;
+				spec = end + 1;
+			}
+			added = !*end && end != spec && sweep.addValues(name.c_str(), values);
+		}
+		if (!added) {
+			cout << "Invalid sweep " << ranges[i] << " for " << filter->getName() << "." << endl;
+			exit(1);
+		}
+	}
+
+	if (sheet_path == "") {
+		sheet_path = outputPath(path, filter);
+		sheet_path.insert(sheet_path.length() - 4, "_sweep");
+	}
+
+	cout << "--------------------------------Sweeping " << sweep.getNumSettings() << " settings of " << filter->getName() << endl;
+
+	Image input = readInput(path);
+	bool passed = sweep.run(input, method, sheet_path.c_str(), sweep_dir == "" ? NULL : sweep_dir.c_str());
+	free(input.data);
+
+	for (size_t s = 0; s < sweep.getNumRun(); s++) {
+		printf("Setting %lu: %s in %lf ms%s\n", s, sweep.describe(s).c_str(),
+			sweep.getSettingTime(s)*1000, sweep.getSettingPassed(s) ? "" : " (failed)");
+	}
+	printf("Finished %lu settings in %lf s (first setting, with setup, %lf s), contact sheet in %s\n",
+		sweep.getNumSettings(), sweep.getElapsedTime(), sweep.getSetupTime(), sheet_path.c_str());
+	return passed;
+}
+
+//times the filter on shared GL textures, as on Android, against copying them
+//through the host, in an offscreen EGL context
+int runInterop(Filter* filter, const char* path, Filter::Params params, int frames) {
+	cout << "--------------------------------GL interop using " << filter->getName() << endl;
+
+	Image input = readInput(path);
+	GLInterop interop;
+	bool passed = interop.benchmark(filter, input, params, frames);
+	free(input.data);
+
+	if (interop.getHostTime() > 0) printf("Host copies: %lf ms per frame\n", interop.getHostTime()*1000);
+	if (interop.getTextureTime() > 0) {
+		printf("Shared textures: %lf ms per frame (max difference %d)\n", interop.getTextureTime()*1000, interop.getMaxDifference());
+	}
+	return passed;
+}
+
+//times each Halide schedule of the filter on the image, repeated to fill a few sizes
+int runHalideBench(Filter* filter, Image input, Filter::Params params) {
+#if ENABLE_HALIDE
+	const size_t sizes[] = {512, 1024, 2048, 4096};
+	const unsigned int schedules[] = {METHOD_HALIDE_CPU, METHOD_HALIDE_AUTO, METHOD_HALIDE_GPU};
+	const char* names[] = {"halide_cpu", "halide_auto", "halide_gpu"};
+	const int num_schedules = sizeof(schedules)/sizeof(schedules[0]);
+	const int runs = 5;	//the fastest of these is reported, after a warm-up run
+
+	cout << "--------------------------------Comparing Halide schedules of " << filter->getName() << endl;
+
+	//converted up front, so that the runs don't include it
+	toFloat(input);
+	const size_t pixel_size = bytesPerPixel(input.format);
+
+	params.verify = false;
+	filter->setStatusCallback(NULL);	//a few lines per run would bury the table
+
+	printf("%10s", "size");
+	for (int s = 0; s < num_schedules; s++) printf(" %14s", names[s]);
+	printf("  fastest\n");
+
+	for (size_t i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+		const size_t size = sizes[i];
+		Image image = createImage(size, size, input.format);
+		Image output = createImage(size, size);
+		for (size_t y = 0; y < size; y++) {
+			for (size_t x = 0; x < size; x += input.width) {
+				memcpy(&image.data[(y*size + x)*pixel_size], &input.data[(y%input.height)*input.width*pixel_size],
+					min(input.width, size - x)*pixel_size);
+			}
+		}
+
+		char label[32];
+		sprintf(label, "%lux%lu", size, size);
+		printf("%10s", label);
 
+		int fastest = -1;
+		double times[num_schedules];
+		for (int s = 0; s < num_schedules; s++) {
+			times[s] = -1;
+			if (!runHalideSchedule(filter, schedules[s], image, output, params)) {
+				printf(" %14s", "failed");
+				continue;
+			}
+			for (int r = 0; r < runs; r++) {
+				double start = getCurrentTime();
+				runHalideSchedule(filter, schedules[s], image, output, params);
+				double time = (getCurrentTime() - start)/1000;
+				if (times[s] < 0 || time < times[s]) times[s] = time;
+			}
+			printf(" %11.2lf ms", times[s]);
+			if (fastest < 0 || times[s] < times[fastest]) fastest = s;
+		}
+		printf("  %s\n", fastest < 0 ? "-" : names[fastest]);
+
+		free(image.data);
+		free(output.data);
+	}
+
+	filter->setStatusCallback(updateStatus);
+	free(input.data);
 	return 0;
+#else
+	cout << "Built without Halide, build with HALIDE=1 to compare its schedules." << endl;
+	return 1;
+#endif
+}
+
+bool runHalideSchedule(Filter* filter, unsigned int method, Image input, Image output, Filter::Params params) {
+	switch (method) {
+		case METHOD_HALIDE_GPU:  return filter->runHalideGPU(input, output, params);
+		case METHOD_HALIDE_AUTO: return filter->runHalideAuto(input, output, params);
+		default:                 return filter->runHalideCPU(input, output, params);
+	}
+}
+
+//decodes the JPEG straight into pinned memory from the filter's OpenCL context
+Image runPinned(Filter* filter, const char* filePath, Filter::Params params) {
+	size_t width, height;
+	readJPGSize(filePath, &width, &height);
+
+	Image output = createImage(width, height);
+
+	cout << "--------------------------------Tonemapping using " << filter->getName() << endl;
+
+	filter->setImageSize(width, height);
+	filter->setImageFormat(IMAGE_RGBA8);
+	if (!filter->setupOpenCL(NULL, params)) exit(1);
+
+	Image input = filter->mapStagingImage();
+	if (!input.data) exit(1);
+	{
+		TraceScope scope(trace, "readJPG");
+		readJPG(filePath, input);
+	}
+
+	filter->runOpenCL(input, output);
+	filter->unmapStagingImage(input);
+	filter->cleanupOpenCL();
+
+	return output;
 }
 
 void clinfo() {
@@ -168,13 +979,29 @@ void clinfo() {
 
 
 void printUsage() {
-	cout << endl << "Usage: hdr FILTER METHOD [-image PATH] [-cldevice P:D]";
+	cout << endl << "Usage: hdr FILTER METHOD [-then FILTER]... [-image PATH] [-cldevice P:D] [-half] [-verify|-noverify]";
+	cout << endl << "       hdr FILTER opencl [-image PATH|-batch PATH] [-cldevice P:D]... [-alldevices] [-subdevices N]";
+	cout << endl << "       hdr FILTER opencl -batch PATH [-decoders N] [-encoders M] [-cldevice P:D] [-half] [-rolling 1|4|16]";
+	cout << endl << "       hdr FILTER opencl -batch PATH -live FPS [-cldevice P:D] [-half] [-rolling 1|4|16]";
+	cout << endl << "       hdr FILTER METHOD -image PATH -tile SIZE [-cldevice P:D] [-half] [-verify]";
+	cout << endl << "       hdr ... [-verifyevery N] [-verifytile SIZE]";
+	cout << endl << "       hdr FILTER -halidebench [-image PATH]";
+	cout << endl << "       hdr FILTER opencl -glinterop FRAMES [-image PATH] [-cldevice P:D]";
+	cout << endl << "       hdr ... -metrics FILE -trace FILE -refcache DIR";
+	cout << endl << "       hdr FILTER [-param NAME=VALUE]... [-then FILTER [-param NAME=VALUE]...]...";
+	cout << endl << "       hdr FILTER METHOD -image PATH -sweep NAME=MIN:MAX:STEPS|NAME=V,V... [-sheet PATH] [-sweepdir DIR]";
 	cout << endl << "       hdr -clinfo" << endl;
 
 	cout << endl << "Where FILTER is one of:" << endl;
 	map<string, Filter*>::iterator fItr;
 	for (fItr = Options.filters.begin(); fItr != Options.filters.end(); fItr++) {
 		cout << "\t" << fItr->first << endl;
+		const vector<Filter::Parameter>& params = fItr->second->getParameters();
+		for (size_t i = 0; i < params.size(); i++) {
+			float value = 0.f;
+			fItr->second->getParameter(params[i].name, value);
+			printf("\t\t%-10s %g (%g to %g) %s\n", params[i].name, value, params[i].min, params[i].max, params[i].description);
+		}
 	}
 
 	cout << endl << "Where METHOD is one of:" << endl;
@@ -183,10 +1010,11 @@ void printUsage() {
 		cout << "\t" << mItr->first << endl;
 	}
 
-	//cout << endl
-	//<< "If STITCHING is used then the image PATH, " << endl
-	//<< "should be the directory to the input images."
-	//<< endl;
+	cout << endl
+	<< "If the image PATH is a directory, the bracketed " << endl
+	<< "exposures in it are stitched into a radiance map " << endl
+	<< "first, which is then tonemapped."
+	<< endl;
 
 	cout << endl
 	<< "If specifying an OpenCL device with -cldevice, " << endl
@@ -194,80 +1022,137 @@ void printUsage() {
 	<< "indices reported by running -clinfo."
 	<< endl;
 
-	cout << endl;
-}
+	cout << endl
+	<< "Giving -cldevice more than once, or -alldevices, " << endl
+	<< "splits the work across the devices: a batch hands " << endl
+	<< "each device the next image when it's free, a single " << endl
+	<< "image is split into bands sized by each device's " << endl
+	<< "measured speed. -subdevices N first splits each " << endl
+	<< "device into N sub-devices (OpenCL 1.2)."
+	<< endl;
 
+	cout << endl
+	<< "PATH may be a JPEG or a floating point HDR image " << endl
+	<< "(Radiance .hdr, .pfm, or .exr when built with OPENEXR=1)."
+	<< endl;
 
-Image readJPG(const char* filePath) {
-	SDL_Surface *input = IMG_Load(filePath);
-	if (!input) throw std::runtime_error("Problem opening input file");
- 
- 	uchar* udata = (uchar*) input->pixels;
-  	uchar* data = (uchar*) calloc(NUM_CHANNELS*(input->w * input->h), sizeof(uchar));
+	cout << endl
+	<< "With -then, each FILTER runs on the output of the " << endl
+	<< "one before it; with opencl they share one context " << endl
+	<< "and the intermediate images stay on the device."
+	<< endl;
 
-	for (int y = 0; y < input->h; y++) {
-		for (int x = 0; x < input->w; x++) {
-			for (int j=0; j<3; j++) {
- 		 		data[(x + y*input->w)*NUM_CHANNELS + j] = (uchar)udata[(x + y*input->w)*3 + j];
- 		 	}
- 		 	data[(x + y*input->w)*NUM_CHANNELS + 3] = 0;
- 		 }
- 	}
+	cout << endl
+	<< "-param NAME=VALUE sets a parameter of the FILTER " << endl
+	<< "named before it, from those listed above. Most are " << endl
+	<< "kernel arguments and can also be changed between " << endl
+	<< "frames with Filter::setParameter without rebuilding " << endl
+	<< "the OpenCL program; tiles and sigma_s/sigma_r change " << endl
+	<< "the kernels' layout and only apply before setup."
+	<< endl;
 
- 	Image image = {data, input->w, input->h};
+	cout << endl
+	<< "-sweep tonemaps the image with every combination " << endl
+	<< "of the given parameter ranges: STEPS values from " << endl
+	<< "MIN to MAX, or the listed values. The image is read " << endl
+	<< "and the filter set up once, and what doesn't depend " << endl
+	<< "on the parameters is computed once. Thumbnails go " << endl
+	<< "to a contact sheet, by default the output path with " << endl
+	<< "_sweep, in the order listed, and with -sweepdir each " << endl
+	<< "setting to DIR/N.jpg. Only -verify checks them."
+	<< endl;
 
- 	free(input);
+	cout << endl
+	<< "With -batch, PATH is a directory of images or a file " << endl
+	<< "listing one image per line. N threads decode, one " << endl
+	<< "submits to the device and M encode the results. " << endl
+	<< "Single images are verified against the reference " << endl
+	<< "unless -noverify is given, batches only with -verify."
+	<< endl;
 
-	return image;
-}
+	cout << endl
+	<< "With -live, the batch is replayed as a camera " << endl
+	<< "delivering FPS frames a second. Capture, tonemapping " << endl
+	<< "and writing run on their own threads, and frames " << endl
+	<< "that arrive while the stages are busy are dropped " << endl
+	<< "rather than queued, so latency stays bounded. The " << endl
+	<< "frames presented, dropped and their latency are " << endl
+	<< "reported."
+	<< endl;
 
+	cout << endl
+	<< "-verifyevery N only verifies one frame in N, and " << endl
+	<< "-verifytile SIZE only a random SIZE x SIZE tile of " << endl
+	<< "it, run through the reference with statistics from " << endl
+	<< "the whole image (filters that can't be tiled check " << endl
+	<< "all of it). Either turns verification on. Each " << endl
+	<< "check reports the max and mean error, PSNR and the " << endl
+	<< "number of channels beyond the tolerance."
+	<< endl;
 
-void init_buffer(jpeg_compress_struct* cinfo) {}
-void term_buffer(jpeg_compress_struct* cinfo) {}
-boolean empty_buffer(jpeg_compress_struct* cinfo) {
-	return TRUE;
-}
+	cout << endl
+	<< "With -rolling N, histEq treats a batch as the frames " << endl
+	<< "of a video: it counts 1 in N pixels, keeps a running " << endl
+	<< "histogram across frames and only changes the mapping " << endl
+	<< "once that drifts, so the brightness doesn't pump."
+	<< endl;
 
-void writeJPG(Image &img, const char* filePath) {
-	FILE *outfile  = fopen(filePath, "wb");
-
-	if (!outfile) throw std::runtime_error("Problem opening output file");
- 
-	struct jpeg_compress_struct cinfo;
-	struct jpeg_error_mgr       jerr;
- 
-	cinfo.err = jpeg_std_error(&jerr);
-	jpeg_create_compress(&cinfo);
-	jpeg_stdio_dest(&cinfo, outfile);
-
-	cinfo.image_width      = img.width;
-	cinfo.image_height     = img.height;
-	cinfo.input_components = 3;
-	cinfo.in_color_space   = JCS_RGB;
-
-	jpeg_set_defaults(&cinfo);
-	/*set the quality [0..100]  */
-	jpeg_set_quality (&cinfo, 75, true);
-	jpeg_start_compress(&cinfo, true);
-
-	uchar* charImageData = (uchar*) calloc(3*img.width*img.height, sizeof(uchar));
-	for (int y = 0; y < img.height; y++) {
-		for (int x = 0; x < img.width; x++) {
-			for (int i=0; i < 3; i++)
-				charImageData[(x + y*img.width)*3 + i] = getPixel(img, x, y, i);
-		}
-	}
-
-	JSAMPROW row_pointer;          /* pointer to a single row */
- 	while (cinfo.next_scanline < cinfo.image_height) {
-		row_pointer = (JSAMPROW) &charImageData[cinfo.next_scanline*cinfo.input_components*img.width];
-		jpeg_write_scanlines(&cinfo, &row_pointer, 1);
-	} 
-	jpeg_finish_compress(&cinfo);
-}
+	cout << endl
+	<< "With -tile, the image is streamed from disk and " << endl
+	<< "tonemapped in SIZE x SIZE tiles, using statistics " << endl
+	<< "from a first pass over the whole image, so images " << endl
+	<< "larger than memory can be processed. Tiles are " << endl
+	<< "only verified with -verify. gradDom, " << endl
+	<< "bilateralLocal and histEq with tiles=N (CLAHE) " << endl
+	<< "can't be tiled."
+	<< endl;
+
+	cout << endl
+	<< "With -halidebench, each Halide schedule (hand " << endl
+	<< "written for the CPU, autoscheduled, and for the " << endl
+	<< "GPU) is timed on the image repeated to fill sizes " << endl
+	<< "from 512x512 to 4096x4096, and the fastest for " << endl
+	<< "each size is reported. Needs a build with HALIDE=1."
+	<< endl;
+
+	cout << endl
+	<< "With -glinterop, an offscreen EGL context (Mesa's " << endl
+	<< "llvmpipe will do) holds the image in a GL texture " << endl
+	<< "and FRAMES frames are timed two ways: reading the " << endl
+	<< "texture back and uploading the result, and, if the " << endl
+	<< "device has cl_khr_gl_sharing, with the kernels on " << endl
+	<< "the shared textures as on Android. The outputs of " << endl
+	<< "the two are compared."
+	<< endl;
+
+	cout << endl
+	<< "With -half, the OpenCL intermediates (pyramids, " << endl
+	<< "gradients) are stored as half floats."
+	<< endl;
+
+	cout << endl
+	<< "With -metrics, frame counts, bytes transferred and " << endl
+	<< "latency histograms of each stage are written to " << endl
+	<< "FILE at exit, as JSON if it ends in .json and as " << endl
+	<< "Prometheus text otherwise. - writes to stdout."
+	<< endl;
 
+	cout << endl
+	<< "With -trace, a timeline of image I/O, OpenCL setup " << endl
+	<< "and kernel runs on the host, and of every command on " << endl
+	<< "each device queue, is written to FILE at exit. Load " << endl
+	<< "it in chrome://tracing or ui.perfetto.dev."
+	<< endl;
 
+	cout << endl
+	<< "Reference results are cached by a hash of the " << endl
+	<< "input and the filter's parameters. With -refcache " << endl
+	<< "they're also kept in DIR, which must exist, so " << endl
+	<< "later runs on the same images skip the reference."
+	<< endl;
 
+	cout << endl;
+}
 
 
 int updateStatus(const char *format, va_list args) {
@@ -276,6 +1161,34 @@ int updateStatus(const char *format, va_list args) {
 	return 0;
 }
 
+//registered with atexit, so every way out of main writes them
+void writeMetrics() {
+	string text = hasEnding(metrics_path, ".json") ? metrics->toJSON() : metrics->toPrometheus();
+	if (metrics_path == "-") {
+		cout << text;
+		return;
+	}
+
+	FILE* file = fopen(metrics_path.c_str(), "w");
+	if (!file) {
+		cout << "Problem writing metrics to " << metrics_path << "." << endl;
+		return;
+	}
+	fputs(text.c_str(), file);
+	fclose(file);
+}
+
+void writeTrace() {
+	if (!trace->write(trace_path.c_str())) cout << "Problem writing trace to " << trace_path << "." << endl;
+	else cout << "Wrote " << trace->getNumSpans() << " spans to " << trace_path << endl;
+}
+
+//a JPEG or floating point image, traced
+Image readInput(const char* path) {
+	TraceScope scope(trace, isHDRFile(path) ? "readHDR" : "readJPG");
+	return isHDRFile(path) ? readHDR(path) : readJPG(path);
+}
+
 void checkError(const char* message, int err) {
 	if (err != CL_SUCCESS) {
 		printf("%s %d\n", message, err);
@@ -285,7 +1198,7 @@ void checkError(const char* message, int err) {
 
 bool is_dir(const char* path) {
 	struct stat buf;
-	stat(path, &buf);
+	if (stat(path, &buf)) return false;
 	return S_ISDIR(buf.st_mode);
 }
 
@@ -0,0 +1,222 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <iostream>
+#include <exception>
+#include <stdexcept>
+
+#include "Batch.h"
+#include "ImageIO.h"
+
+using namespace hdr;
+
+Batch::Batch(Filter* filter, const Filter::Params& params) {
+	addDevice(filter, params);
+
+	//decoding is the slowest stage, give it half the cores
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	m_decoders = cpus > 1 ? cpus/2 : 1;
+	m_encoders = cpus > 3 ? cpus/4 : 1;
+	m_depth = 2*m_decoders;
+
+	m_inputs = NULL;
+	m_outputs = NULL;
+	m_decoded = NULL;
+	m_processed = NULL;
+	m_elapsed = 0;
+	m_trace = NULL;
+}
+
+void Batch::addDevice(Filter* filter, const Filter::Params& params) {
+	m_filters.push_back(filter);
+	m_params.push_back(params);
+	m_deviceFrames.push_back(0);
+	m_deviceBusy.push_back(0);
+	m_deviceIdle.push_back(0);
+}
+
+void Batch::setTrace(Trace* trace) {
+	m_trace = trace;
+}
+
+void Batch::setThreads(int decoders, int encoders) {
+	if (decoders > 0) m_decoders = decoders;
+	if (encoders > 0) m_encoders = encoders;
+}
+
+void Batch::setQueueDepth(int depth) {
+	if (depth > 0) m_depth = depth;
+}
+
+double Batch::getElapsedTime() const {
+	return m_elapsed;
+}
+
+double Batch::getDeviceIdleTime() const {
+	double idle = 0;
+	for (size_t d = 0; d < m_deviceIdle.size(); d++) idle += m_deviceIdle[d];
+	return idle;
+}
+
+size_t Batch::getNumDevices() const {
+	return m_filters.size();
+}
+
+size_t Batch::getDeviceFrames(size_t device) const {
+	return m_deviceFrames[device];
+}
+
+double Batch::getDeviceBusyTime(size_t device) const {
+	return m_deviceBusy[device];
+}
+
+int Batch::run(const std::vector<std::string>& inputs, const std::vector<std::string>& outputs) {
+	assert(inputs.size() == outputs.size());
+
+	m_inputs = &inputs;
+	m_outputs = &outputs;
+	m_nextInput = 0;
+	m_failed = 0;
+	for (size_t d = 0; d < m_filters.size(); d++) {
+		m_deviceFrames[d] = 0;
+		m_deviceBusy[d] = 0;
+		m_deviceIdle[d] = 0;
+	}
+
+	m_decoded = new OrderedQueue<Image>(m_depth);
+	m_processed = new OrderedQueue<Image>(m_depth);
+
+	double start = getCurrentTime();
+
+	const size_t num_devices = m_filters.size();
+	pthread_t* devices = new pthread_t[num_devices];
+	DeviceThread* device_args = new DeviceThread[num_devices];
+	pthread_t* decoders = new pthread_t[m_decoders];
+	pthread_t* encoders = new pthread_t[m_encoders];
+	for (int i = 0; i < m_decoders; i++) pthread_create(&decoders[i], NULL, decodeThread, this);
+	for (size_t d = 0; d < num_devices; d++) {
+		device_args[d].batch = this;
+		device_args[d].device = d;
+		pthread_create(&devices[d], NULL, deviceThread, &device_args[d]);
+	}
+	for (int i = 0; i < m_encoders; i++) pthread_create(&encoders[i], NULL, encodeThread, this);
+
+	for (int i = 0; i < m_decoders; i++) pthread_join(decoders[i], NULL);
+	m_decoded->close();
+	for (size_t d = 0; d < num_devices; d++) pthread_join(devices[d], NULL);
+	m_processed->close();	//every decoded image has been pushed on by now
+	for (int i = 0; i < m_encoders; i++) pthread_join(encoders[i], NULL);
+
+	m_elapsed = (getCurrentTime() - start)/1e6;
+
+	delete[] devices;
+	delete[] device_args;
+	delete[] decoders;
+	delete[] encoders;
+	delete m_decoded;
+	delete m_processed;
+	m_decoded = NULL;
+	m_processed = NULL;
+
+	return m_failed;
+}
+
+
+void Batch::decodeLoop() {
+	while (true) {
+		size_t i = __sync_fetch_and_add(&m_nextInput, 1);
+		if (i >= m_inputs->size()) break;
+
+		const char* path = (*m_inputs)[i].c_str();
+		Image image = {NULL, 0, 0, IMAGE_RGBA8, 0};
+		try {
+			TraceScope trace(m_trace, isHDRFile(path) ? "readHDR" : "readJPG", "batch");
+			image = isHDRFile(path) ? readHDR(path) : readJPG(path);
+		}
+		catch (std::exception& e) {
+			std::cerr << path << ": " << e.what() << std::endl;
+			__sync_fetch_and_add(&m_failed, 1);
+		}
+		m_decoded->push(i, image);
+	}
+}
+
+void Batch::deviceLoop(size_t device) {
+	Filter* filter = m_filters[device];
+	const Filter::Params& params = m_params[device];
+	bool ready = false;
+	size_t width = 0, height = 0;
+	int format = IMAGE_RGBA8;
+
+	Image input;
+	size_t i;
+	while (true) {
+		double wait = getCurrentTime();
+		if (!m_decoded->pop(input, &i)) break;
+		double busy = getCurrentTime();
+		m_deviceIdle[device] += (busy - wait)/1e6;
+		if (m_trace) m_trace->addSpan("wait for decoder", "batch", wait/1e6, busy/1e6);
+
+		Image output = {NULL, input.width, input.height, IMAGE_RGBA8, 0};
+		if (input.data) {
+			//kernels are built for a fixed size and format, rebuild only when they change
+			if (!ready || input.width != width || input.height != height || input.format != format) {
+				if (ready) filter->cleanupOpenCL();
+				width = input.width;
+				height = input.height;
+				format = input.format;
+				filter->setImageSize(width, height);
+				filter->setImageFormat(format);
+				ready = filter->setupOpenCL(NULL, params);
+			}
+
+			output = createImage(width, height);
+			if (!ready || !filter->runOpenCL(input, output)) {
+				free(output.data);
+				output.data = NULL;
+				__sync_fetch_and_add(&m_failed, 1);
+			}
+			free(input.data);
+			m_deviceFrames[device]++;
+		}
+		m_deviceBusy[device] += (getCurrentTime() - busy)/1e6;
+		m_processed->push(i, output);
+	}
+
+	if (ready) filter->cleanupOpenCL();
+}
+
+void Batch::encodeLoop() {
+	Image output;
+	size_t i;
+	while (m_processed->pop(output, &i)) {
+		if (!output.data) continue;
+
+		const char* path = (*m_outputs)[i].c_str();
+		try {
+			TraceScope trace(m_trace, "writeJPG", "batch");
+			writeJPG(output, path);
+		}
+		catch (std::exception& e) {
+			std::cerr << path << ": " << e.what() << std::endl;
+			__sync_fetch_and_add(&m_failed, 1);
+		}
+		free(output.data);
+	}
+}
+
+void* Batch::decodeThread(void* batch) {
+	((Batch*) batch)->decodeLoop();
+	return NULL;
+}
+
+void* Batch::deviceThread(void* device) {
+	DeviceThread* thread = (DeviceThread*) device;
+	thread->batch->deviceLoop(thread->device);
+	return NULL;
+}
+
+void* Batch::encodeThread(void* batch) {
+	((Batch*) batch)->encodeLoop();
+	return NULL;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "Filter.h"
+#include "OrderedQueue.h"
+
+namespace hdr
+{
+//Tonemaps a list of images with decode, device and encode stages on their own
+//threads, connected by bounded OrderedQueues. Decoders run ahead of the device
+//thread by up to the queue depth, so it doesn't wait on libjpeg, and it keeps one
+//OpenCL context for as long as the image size and format stay the same.
+//With more than one device, each has its own thread taking the next decoded
+//image whenever it's free, so faster devices take a larger share of the frames.
+class Batch {
+public:
+	Batch(Filter* filter, const Filter::Params& params);
+
+	//another device to run frames on, filter must be a separate instance (see Filter::clone)
+	void addDevice(Filter* filter, const Filter::Params& params);
+
+	void setThreads(int decoders, int encoders);
+	void setQueueDepth(int depth);
+	//records decoding, waits for decoded images and encoding, the filters trace their own work
+	void setTrace(Trace* trace);
+
+	//returns the number of images that couldn't be decoded, tonemapped or written
+	int run(const std::vector<std::string>& inputs, const std::vector<std::string>& outputs);
+
+	//in seconds
+	double getElapsedTime() const;
+	double getDeviceIdleTime() const;	//time the device threads spent waiting for decoded images
+
+	size_t getNumDevices() const;
+	size_t getDeviceFrames(size_t device) const;
+	double getDeviceBusyTime(size_t device) const;	//in seconds
+
+protected:
+	std::vector<Filter*> m_filters;			//one per device
+	std::vector<Filter::Params> m_params;
+	std::vector<size_t> m_deviceFrames;
+	std::vector<double> m_deviceBusy;
+	std::vector<double> m_deviceIdle;
+	int m_decoders, m_encoders;
+	size_t m_depth;
+	Trace* m_trace;
+
+	const std::vector<std::string>* m_inputs;
+	const std::vector<std::string>* m_outputs;
+	size_t m_nextInput;		//next input a decoder will claim
+	int m_failed;
+	double m_elapsed;
+
+	OrderedQueue<Image>* m_decoded;		//input images, data is NULL if decoding failed
+	OrderedQueue<Image>* m_processed;	//output images, data is NULL if tonemapping failed
+
+	typedef struct {
+		Batch* batch;
+		size_t device;
+	} DeviceThread;
+
+	void decodeLoop();
+	void deviceLoop(size_t device);
+	void encodeLoop();
+	static void* decodeThread(void* batch);
+	static void* deviceThread(void* device);
+	static void* encodeThread(void* batch);
+};
+}
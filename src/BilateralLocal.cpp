@@ -0,0 +1,427 @@
+#include <string.h>
+#include <iostream>
+#include <cstdio>
+#include <algorithm>
+#include <omp.h>
+#include <vector>
+
+#include "BilateralLocal.h"
+#include "opencl/bilateralLocal.h"
+
+/*
+Local tone mapping with a fast bilateral filter, as proposed here:
+http://people.csail.mit.edu/fredo/PUBLI/Siggraph2002/DurandBilateral.pdf
+using the bilateral grid from here:
+http://groups.csail.mit.edu/graphics/bilagrid/bilagrid_web.pdf
+*/
+
+//log10 luminance covered by the grid's range axis, darker and brighter pixels are clamped to it
+#define GRID_LOG_MIN -6.f
+#define GRID_LOG_MAX 4.f
+
+using namespace hdr;
+
+BilateralLocal::BilateralLocal(float _sigma_s, float _sigma_r, float _contrast, float _sat, float _gamma) : Filter() {
+	m_name = "BilateralLocal";
+	sigma_s = _sigma_s;
+	sigma_r = _sigma_r;
+	contrast = _contrast;
+	sat = _sat;
+	gamma = _gamma;
+	addParameter("sigma_s", &sigma_s, 1.f, 256.f, "spatial extent of the bilateral filter in pixels", PARAMETER_SETUP);
+	addParameter("sigma_r", &sigma_r, 0.05f, 4.f, "range of the bilateral filter in log10 luminance", PARAMETER_SETUP);
+	addParameter("contrast", &contrast, 1.f, 10000.f, "contrast ratio the base layer is compressed to");
+	addParameter("sat", &sat, 0.f, 4.f, "colour saturation");
+	addParameter("gamma", &gamma, 0.1f, 10.f, "display gamma");
+}
+
+Filter* BilateralLocal::clone() const {
+	return new BilateralLocal(sigma_s, sigma_r, contrast, sat, gamma);
+}
+
+//a cell per sigma in each dimension, with one more along each axis so slicing
+//can always interpolate towards the next cell
+void BilateralLocal::gridSize(int width, int height, int &cells, int &gwidth, int &gheight, int &gdepth) const {
+	cells = std::max((int)(sigma_s + 0.5f), 1);
+	gwidth = (width-1)/cells + 2;
+	gheight = (height-1)/cells + 2;
+	gdepth = (int)((GRID_LOG_MAX - GRID_LOG_MIN)/sigma_r) + 2;
+}
+
+bool BilateralLocal::setupOpenCL(cl_context_properties context_prop[], const Params& params) {
+	TraceScope trace(m_trace, "setupOpenCL", m_name);
+
+	gridSize(image_width, image_height, cell_size, grid_width, grid_height, grid_depth);
+	const int grid_size = grid_width*grid_height*grid_depth;
+
+	char flags[1024];
+	sprintf(flags, "-cl-fast-relaxed-math -D NUM_CHANNELS=%d -D WIDTH=%d -D HEIGHT=%d -D CELL_SIZE=%d -D GRID_WIDTH=%d -D GRID_HEIGHT=%d -D GRID_DEPTH=%d -D GRID_SIZE=%d -D GRID_LOG_MIN=%ff -D GRID_LOG_MAX=%ff -D SIGMA_R=%ff",
+				NUM_CHANNELS, image_width, image_height, cell_size, grid_width, grid_height, grid_depth, grid_size,
+				GRID_LOG_MIN, GRID_LOG_MAX, sigma_r);
+
+	if (!initCL(context_prop, params, bilateralLocal_kernel, flags)) {
+		return false;
+	}
+
+	cl_int err;
+
+	/////////////////////////////////////////////////////////////////kernels
+
+	//this kernel accumulates the log luminance of the image into the grid
+	kernels["splat"] = clCreateKernel(m_program, "splat", &err);
+	CHECK_ERROR_OCL(err, "creating splat kernel", return false);
+
+	//this kernel blurs the grid along one of its axes
+	kernels["blur"] = clCreateKernel(m_program, "blur", &err);
+	CHECK_ERROR_OCL(err, "creating blur kernel", return false);
+
+	//this kernel computes the range of the base layer
+	kernels["baseRange"] = clCreateKernel(m_program, "baseRange", &err);
+	CHECK_ERROR_OCL(err, "creating baseRange kernel", return false);
+
+	//this kernel reduces the per workgroup ranges
+	kernels["finalReduc"] = clCreateKernel(m_program, "finalReduc", &err);
+	CHECK_ERROR_OCL(err, "creating finalReduc kernel", return false);
+
+	//performs the actual tonemapping by slicing the blurred grid
+	kernels["tonemap"] = clCreateKernel(m_program, "tonemap", &err);
+	CHECK_ERROR_OCL(err, "creating tonemap kernel", return false);
+
+	/////////////////////////////////////////////////////////////////kernel sizes
+
+	kernel2DSizes("splat");
+	kernel1DSizes("blur");
+	kernel2DSizes("baseRange");
+	kernel2DSizes("tonemap");
+
+
+	reportStatus("---------------------------------Kernel finalReduc:");
+
+		int num_wg = (global_sizes["baseRange"][0]*global_sizes["baseRange"][1])
+						/(local_sizes["baseRange"][0]*local_sizes["baseRange"][1]);
+		reportStatus("Number of work groups in baseRange: %lu", num_wg);
+
+		size_t* local = (size_t*) calloc(2, sizeof(size_t));
+		size_t* global = (size_t*) calloc(2, sizeof(size_t));
+		local[0] = num_wg;	//workgroup size for normal kernels
+		global[0] = num_wg;
+
+		local_sizes["finalReduc"] = local;
+		global_sizes["finalReduc"] = global;
+		reportStatus("Kernel sizes: Local=%lu Global=%lu", local[0], global[0]);
+
+
+	/////////////////////////////////////////////////////////////////allocating memory
+
+	reportStatus("Bilateral grid: %dx%dx%d cells of %d pixels", grid_width, grid_height, grid_depth, cell_size);
+
+	//live ranges in kernel steps: 0 splat, 1-3 blur along x, y and z, 4 baseRange, 5 finalReduc, 6 tonemap.
+	//the blur ping-pongs between the two grids and ends in blurred, which runs that
+	//don't recompute the mapping reuse
+	planBuffer("grid", sizeof(cl_float2)*grid_size, 0, 3);
+	planBuffer("blurred", sizeof(cl_float2)*grid_size, 1, 6);
+	planBuffer("baseMin", sizeof(float)*num_wg, 4, 6);
+	planBuffer("baseMax", sizeof(float)*num_wg, 4, 6);
+	if (!allocateBuffers()) {
+		return false;
+	}
+
+	if (!createImageMemory(params)) {
+		return false;
+	}
+
+	/////////////////////////////////////////////////////////////////setting kernel arguements
+
+	err  = clSetKernelArg(kernels["splat"], 0, sizeof(cl_mem), &mem_images[0]);
+	err  = clSetKernelArg(kernels["splat"], 1, sizeof(cl_mem), &mems["grid"]);
+	CHECK_ERROR_OCL(err, "setting splat arguments", return false);
+
+	err  = clSetKernelArg(kernels["baseRange"], 0, sizeof(cl_mem), &mem_images[0]);
+	err  = clSetKernelArg(kernels["baseRange"], 1, sizeof(cl_mem), &mems["blurred"]);
+	err  = clSetKernelArg(kernels["baseRange"], 2, sizeof(cl_mem), &mems["baseMin"]);
+	err  = clSetKernelArg(kernels["baseRange"], 3, sizeof(cl_mem), &mems["baseMax"]);
+	err  = clSetKernelArg(kernels["baseRange"], 4, sizeof(float)*local_sizes["baseRange"][0]*local_sizes["baseRange"][1], NULL);
+	err  = clSetKernelArg(kernels["baseRange"], 5, sizeof(float)*local_sizes["baseRange"][0]*local_sizes["baseRange"][1], NULL);
+	CHECK_ERROR_OCL(err, "setting baseRange arguments", return false);
+
+	err  = clSetKernelArg(kernels["finalReduc"], 0, sizeof(cl_mem), &mems["baseMin"]);
+	err  = clSetKernelArg(kernels["finalReduc"], 1, sizeof(cl_mem), &mems["baseMax"]);
+	err  = clSetKernelArg(kernels["finalReduc"], 2, sizeof(unsigned int), &num_wg);
+	CHECK_ERROR_OCL(err, "setting finalReduc arguments", return false);
+
+	err  = clSetKernelArg(kernels["tonemap"], 0, sizeof(cl_mem), &mem_images[0]);
+	err  = clSetKernelArg(kernels["tonemap"], 1, sizeof(cl_mem), &mem_images[1]);
+	err  = clSetKernelArg(kernels["tonemap"], 2, sizeof(cl_mem), &mems["blurred"]);
+	err  = clSetKernelArg(kernels["tonemap"], 3, sizeof(cl_mem), &mems["baseMin"]);
+	err  = clSetKernelArg(kernels["tonemap"], 4, sizeof(cl_mem), &mems["baseMax"]);
+	CHECK_ERROR_OCL(err, "setting tonemap arguments", return false);
+	if (!updateParameters()) return false;
+
+	reportStatus("\n\n");
+
+	return true;
+}
+
+bool BilateralLocal::updateParameters() {
+	const float logContrast = log10(contrast);
+	const float invGamma = 1.f/gamma;
+	cl_int err;
+	err  = clSetKernelArg(kernels["tonemap"], 5, sizeof(float), &logContrast);
+	err |= clSetKernelArg(kernels["tonemap"], 6, sizeof(float), &sat);
+	err |= clSetKernelArg(kernels["tonemap"], 7, sizeof(float), &invGamma);
+	CHECK_ERROR_OCL(err, "setting tonemap parameters", return false);
+	return true;
+}
+
+double BilateralLocal::runCLKernels(bool recomputeMapping) {
+	TraceScope trace(m_trace, "runCLKernels", m_name);
+	double start = omp_get_wtime();
+
+	cl_int err;
+	if (recomputeMapping) {
+		err = clEnqueueNDRangeKernel(m_queue, kernels["splat"], 2, NULL, global_sizes["splat"], local_sizes["splat"], 0, NULL, traceEvent("splat"));
+		CHECK_ERROR_OCL(err, "enqueuing splat kernel", return false);
+
+		//separable blur, one pass per axis
+		const char* src[3] = {"grid", "blurred", "grid"};
+		const char* dst[3] = {"blurred", "grid", "blurred"};
+		const int stride[3] = {1, grid_width, grid_width*grid_height};
+		const int extent[3] = {grid_width, grid_height, grid_depth};
+		for (int axis = 0; axis < 3; axis++) {
+			err  = clSetKernelArg(kernels["blur"], 0, sizeof(cl_mem), &mems[src[axis]]);
+			err  = clSetKernelArg(kernels["blur"], 1, sizeof(cl_mem), &mems[dst[axis]]);
+			err  = clSetKernelArg(kernels["blur"], 2, sizeof(int), &stride[axis]);
+			err  = clSetKernelArg(kernels["blur"], 3, sizeof(int), &extent[axis]);
+			CHECK_ERROR_OCL(err, "setting blur arguments", return false);
+
+			err = clEnqueueNDRangeKernel(m_queue, kernels["blur"], 1, NULL, global_sizes["blur"], local_sizes["blur"], 0, NULL, traceEvent("blur"));
+			CHECK_ERROR_OCL(err, "enqueuing blur kernel", return false);
+		}
+
+		err = clEnqueueNDRangeKernel(m_queue, kernels["baseRange"], 2, NULL, global_sizes["baseRange"], local_sizes["baseRange"], 0, NULL, traceEvent("baseRange"));
+		CHECK_ERROR_OCL(err, "enqueuing baseRange kernel", return false);
+
+		err = clEnqueueNDRangeKernel(m_queue, kernels["finalReduc"], 1, NULL, &global_sizes["finalReduc"][0], &local_sizes["finalReduc"][0], 0, NULL, traceEvent("finalReduc"));
+		CHECK_ERROR_OCL(err, "enqueuing finalReduc kernel", return false);
+	}
+
+	err = clEnqueueNDRangeKernel(m_queue, kernels["tonemap"], 2, NULL, global_sizes["tonemap"], local_sizes["tonemap"], 0, NULL, traceEvent("tonemap"));
+	CHECK_ERROR_OCL(err, "enqueuing tonemap kernel", return false);
+
+	err = clFinish(m_queue);
+
+	CHECK_ERROR_OCL(err, "running kernels", return false);
+	return omp_get_wtime() - start;
+}
+
+
+bool BilateralLocal::runOpenCL(int input_texid, int output_texid, bool recomputeMapping) {
+	cl_int err;
+
+	err = clEnqueueAcquireGLObjects(m_queue, 2, &mem_images[0], 0, 0, 0);
+	CHECK_ERROR_OCL(err, "acquiring GL objects", return false);
+
+	double runTime = runCLKernels(recomputeMapping);
+
+	err = clEnqueueReleaseGLObjects(m_queue, 2, &mem_images[0], 0, 0, 0);
+	CHECK_ERROR_OCL(err, "releasing GL objects", return false);
+
+	recordFrame(0, runTime, 0, 0, 0);
+	reportStatus("Finished OpenCL kernels in %lf ms", runTime*1000);
+
+	return true;
+}
+
+//when image data is provided in form of Image data structure as opposed to an OpenGL texture
+bool BilateralLocal::runOpenCL(Image input, Image output, bool recomputeMapping) {
+
+	cl_int err;
+
+ 	const size_t origin[] = {0, 0, 0};
+ 	const size_t region[] = {input.width, input.height, 1};
+	double upload = metricsTime();
+	err = clEnqueueWriteImage(m_queue, mem_images[0], CL_TRUE, origin, region, rowBytes(input), 0, input.data, 0, NULL, traceEvent("upload"));
+	CHECK_ERROR_OCL(err, "writing image memory", return false);
+	upload = metricsTime() - upload;
+
+	//let it begin
+	double runTime = runCLKernels(recomputeMapping);
+
+	//read results back
+	double download = metricsTime();
+	err = clEnqueueReadImage(m_queue, mem_images[1], CL_TRUE, origin, region, rowBytes(output), 0, output.data, 0, NULL, traceEvent("download"));
+	CHECK_ERROR_OCL(err, "reading image memory", return false);
+	recordFrame(upload, runTime, metricsTime() - download, bytesPerPixel(input.format)*input.width*input.height, sizeof(uchar)*input.width*input.height*NUM_CHANNELS);
+
+	reportStatus("Finished OpenCL kernel");
+
+	bool passed = true;
+	if (m_params.verify) {
+		passed = verify(input, output);
+		reportStatus(
+			"Finished in %lf ms (verification %s)",
+			runTime*1000, passed ? "passed" : "failed");
+	}
+	else reportStatus("Finished in %lf ms", runTime*1000);
+
+	return passed;
+}
+
+
+bool BilateralLocal::cleanupOpenCL() {
+	clReleaseMemObject(mem_images[0]);
+	clReleaseMemObject(mem_images[1]);
+	clReleaseMemObject(mems["grid"]);
+	clReleaseMemObject(mems["blurred"]);
+	clReleaseMemObject(mems["baseMin"]);
+	clReleaseMemObject(mems["baseMax"]);
+	clReleaseKernel(kernels["splat"]);
+	clReleaseKernel(kernels["blur"]);
+	clReleaseKernel(kernels["baseRange"]);
+	clReleaseKernel(kernels["finalReduc"]);
+	clReleaseKernel(kernels["tonemap"]);
+	releaseCL();
+	return true;
+}
+
+
+//same steps as the kernels, see bilateralLocal.cl
+static float logLuminance(Image &image, int x, int y) {
+	float3 rgb = {getPixel(image, x, y, 0), getPixel(image, x, y, 1), getPixel(image, x, y, 2)};
+	return log10(getPixelLuminance(rgb)/PIXEL_RANGE + 0.000001f);
+}
+
+uint64_t BilateralLocal::hashParameters(uint64_t hash) const {
+	const float parameters[] = {sigma_s, sigma_r, contrast, sat, gamma};
+	hash = Filter::hashParameters(hash);
+	return hashBytes(parameters, sizeof(parameters), hash);
+}
+
+bool BilateralLocal::runReference(Image input, Image output) {
+
+	// Check for cached result
+	if (lookupReference(input, output)) {
+		reportStatus("Finished reference (cached)");
+		return true;
+	}
+
+	reportStatus("Running reference");
+
+	//the input may be a tile or band of what the kernels were set up for,
+	//so the members stay as setupOpenCL left them
+	int cell_size, grid_width, grid_height, grid_depth;
+	gridSize(input.width, input.height, cell_size, grid_width, grid_height, grid_depth);
+	const int grid_size = grid_width*grid_height*grid_depth;
+	const int plane = grid_width*grid_height;
+
+	float* logLum = (float*) calloc(input.width*input.height, sizeof(float));
+	#pragma omp parallel for
+	for (int y = 0; y < input.height; y++) {
+		for (int x = 0; x < input.width; x++) {
+			logLum[x + y*input.width] = logLuminance(input, x, y);
+		}
+	}
+
+	//(sum, count) pairs, rows of cells are splatted independently
+	float* grid = (float*) calloc(grid_size*2, sizeof(float));
+	float* blurred = (float*) calloc(grid_size*2, sizeof(float));
+	#pragma omp parallel for
+	for (int gy = 0; gy < grid_height; gy++) {
+		const int y0 = std::max(gy*cell_size - cell_size/2, 0);
+		const int y1 = std::min(gy*cell_size - cell_size/2 + cell_size, (int)input.height);
+		for (int y = y0; y < y1; y++) {
+			for (int x = 0; x < input.width; x++) {
+				const float l = logLum[x + y*input.width];
+				const int gx = (int)(x/(float)cell_size + 0.5f);
+				const int gz = (int)((std::min(std::max(l, GRID_LOG_MIN), GRID_LOG_MAX) - GRID_LOG_MIN)/sigma_r + 0.5f);
+				float* cell = grid + (gx + gy*grid_width + gz*plane)*2;
+				cell[0] += l;
+				cell[1] += 1.f;
+			}
+		}
+	}
+
+	const float weights[5] = {1.f/16, 4.f/16, 6.f/16, 4.f/16, 1.f/16};
+	const int stride[3] = {1, grid_width, plane};
+	const int extent[3] = {grid_width, grid_height, grid_depth};
+	for (int axis = 0; axis < 3; axis++) {
+		#pragma omp parallel for
+		for (int i = 0; i < grid_size; i++) {
+			const int coord = (i/stride[axis])%extent[axis];
+			float sum = 0.f, count = 0.f;
+			for (int k = -2; k <= 2; k++) {
+				if (coord+k < 0 || coord+k >= extent[axis]) continue;
+				sum += grid[(i + k*stride[axis])*2]*weights[k+2];
+				count += grid[(i + k*stride[axis])*2 + 1]*weights[k+2];
+			}
+			blurred[i*2] = sum;
+			blurred[i*2 + 1] = count;
+		}
+		std::swap(grid, blurred);
+	}
+
+	//trilinear slicing of the blurred grid gives the base layer
+	float* base = (float*) calloc(input.width*input.height, sizeof(float));
+	float baseMin = GRID_LOG_MAX, baseMax = GRID_LOG_MIN;
+	#pragma omp parallel for reduction(min:baseMin) reduction(max:baseMax)
+	for (int y = 0; y < input.height; y++) {
+		for (int x = 0; x < input.width; x++) {
+			const float l = logLum[x + y*input.width];
+			const float fx = x/(float)cell_size;
+			const float fy = y/(float)cell_size;
+			const float fz = (std::min(std::max(l, GRID_LOG_MIN), GRID_LOG_MAX) - GRID_LOG_MIN)/sigma_r;
+			const int gx = (int)fx, gy = (int)fy, gz = (int)fz;
+			const float dx = fx - gx, dy = fy - gy, dz = fz - gz;
+
+			float sum = 0.f, count = 0.f;
+			for (int k = 0; k < 2; k++) {
+				for (int j = 0; j < 2; j++) {
+					for (int i = 0; i < 2; i++) {
+						const float w = (k ? dz : 1.f-dz)*(j ? dy : 1.f-dy)*(i ? dx : 1.f-dx);
+						const float* cell = grid + (gx+i + (gy+j)*grid_width + (gz+k)*plane)*2;
+						sum += cell[0]*w;
+						count += cell[1]*w;
+					}
+				}
+			}
+			const float b = count > 0.f ? sum/count : l;
+			base[x + y*input.width] = b;
+			baseMin = std::min(baseMin, b);
+			baseMax = std::max(baseMax, b);
+		}
+	}
+
+	//only the base layer is compressed, the brightest base maps to 1
+	const float range = baseMax - baseMin;
+	const float compression = range > 0.000001f ? std::min(log10(contrast)/range, 1.f) : 1.f;
+
+	#pragma omp parallel for
+	for (int y = 0; y < input.height; y++) {
+		for (int x = 0; x < input.width; x++) {
+			float3 rgb = {getPixel(input, x, y, 0), getPixel(input, x, y, 1), getPixel(input, x, y, 2)};
+			const float lum = getPixelLuminance(rgb)/PIXEL_RANGE;
+			const float l = logLum[x + y*input.width];
+			const float b = base[x + y*input.width];
+			const float Ld = pow(10.f, (b - baseMax)*compression + l - b);
+
+			const float channel[3] = {rgb.x, rgb.y, rgb.z};
+			for (int c = 0; c < 3; c++) {
+				const float value = lum > 0.f ? pow(channel[c]/PIXEL_RANGE/lum, sat)*Ld : 0.f;
+				setPixel(output, x, y, c, pow(value, 1.f/gamma)*PIXEL_RANGE);
+			}
+			setPixel(output, x, y, 3, getPixel(input, x, y, 3));
+		}
+	}
+
+	free(logLum);
+	free(grid);
+	free(blurred);
+	free(base);
+
+	reportStatus("Finished reference");
+
+	// Cache result
+	cacheReference(output);
+
+	return true;
+}
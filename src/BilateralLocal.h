@@ -0,0 +1,38 @@
+#include "Filter.h"
+
+namespace hdr
+{
+//Durand and Dorsey's local operator: log luminance is split into a base layer,
+//by an edge-aware bilateral filter, and the detail on top of it. Only the base
+//layer is compressed, so local contrast survives. The bilateral filter is
+//computed on a bilateral grid, which costs O(pixels) whatever the spatial sigma
+class BilateralLocal : public Filter {
+public:
+	BilateralLocal(float _sigma_s=16.f, float _sigma_r=0.4f, float _contrast=50.f, float _sat=1.f, float _gamma=2.2f);
+
+	virtual Filter* clone() const;
+
+	virtual bool setupOpenCL(cl_context_properties context_prop[], const Params& params);
+	virtual double runCLKernels(bool recomputeMapping);
+	virtual bool runOpenCL(int input_texid, int output_texid, bool recomputeMapping);
+	virtual bool runOpenCL(Image input, Image output, bool recomputeMapping);
+	virtual bool cleanupOpenCL();
+	virtual bool runReference(Image input, Image output);
+
+protected:
+	//some parameters
+	float sigma_s;		//spatial sigma in pixels, the size of a grid cell
+	float sigma_r;		//range sigma in log10 luminance, the depth of a grid cell
+	float contrast;		//the base layer is compressed to this contrast ratio
+	float sat;
+	float gamma;
+
+	//grid dimensions of the OpenCL pass, see bilateralLocal.cl
+	int cell_size;
+	int grid_width, grid_height, grid_depth;
+	void gridSize(int width, int height, int &cells, int &gwidth, int &gheight, int &gdepth) const;
+
+	virtual uint64_t hashParameters(uint64_t hash) const;
+	virtual bool updateParameters();
+};
+}
@@ -4,61 +4,142 @@
 #include <iostream>
 #include <exception>
 #include <stdexcept>
+#include <string>
+#include <algorithm>
 
 #include "Filter.h"
+#include "ReferenceCache.h"
 
 namespace hdr
 {
+static size_t roundUp(size_t x, size_t multiple) {
+	return (x + multiple-1)/multiple*multiple;
+}
+
 Filter::Filter() {
 	m_statusCallback = NULL;
+	m_metrics = NULL;
+	m_trace = NULL;
 	m_clContext = 0;
 	m_queue = 0;
 	m_program = 0;
-	m_reference.data = NULL;
+	m_staging = 0;
+	m_pool = 0;
+	m_sharedContext = 0;
+	m_sharedQueue = 0;
+	m_sharedDevice = 0;
+	m_inputImage = 0;
+	m_outputImage = 0;
+	m_ownReferenceCache = new ReferenceCache();
+	m_referenceCache = m_ownReferenceCache;
+	m_referenceKey = 0;
+	m_mappingChanged = false;
+	m_fixedStatistics = false;
+	memset(&m_verifyReport, 0, sizeof(m_verifyReport));
+	m_verifyFrames = 0;
+	m_verifySeed = 1;
+	image_format = IMAGE_RGBA8;
 }
 
 Filter::~Filter() {
-	clearReferenceCache();
+	delete m_ownReferenceCache;
 }
 
 void Filter::clearReferenceCache() {
-	if (m_reference.data) {
-		delete[] m_reference.data;
-		m_reference.data = NULL;
-	}
+	m_referenceCache->clear();
+}
+
+void Filter::setReferenceCache(ReferenceCache* cache) {
+	m_referenceCache = cache ? cache : m_ownReferenceCache;
+}
+
+ReferenceCache* Filter::getReferenceCache() const {
+	return m_referenceCache;
 }
 
 const char* Filter::getName() const {
 	return m_name;
 }
 
+Filter* Filter::clone() const {
+	return NULL;
+}
+
 
 bool Filter::initCL(cl_context_properties context_prop[], const Params& params, const char *source, const char *options) {
 	// Ensure no existing context
 	releaseCL();
+	m_params = params;
 
 	cl_int err;
-	cl_uint numPlatforms, numDevices;
-
-	cl_platform_id platform, platforms[params.platformIndex+1];
-	err = clGetPlatformIDs(params.platformIndex+1, platforms, &numPlatforms);
-	CHECK_ERROR_OCL(err, "getting platforms", return false);
-	if (params.platformIndex >= numPlatforms) {
-		reportStatus("Platform index %d out of range (%d platforms found)",
-			params.platformIndex, numPlatforms);
+	if (m_sharedContext) {
+		//retained so that releaseCL is the same either way
+		m_clContext = m_sharedContext;
+		m_queue = m_sharedQueue;
+		m_device = m_sharedDevice;
+		clRetainContext(m_clContext);
+		clRetainCommandQueue(m_queue);
+		clGetDeviceInfo(m_device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(size_t), &max_cu, NULL);
+	}
+	else if (!createContext(context_prop, params)) {
 		return false;
 	}
-	platform = platforms[params.platformIndex];
 
-	cl_device_id devices[params.deviceIndex+1];
-	err = clGetDeviceIDs(platform, params.type, params.deviceIndex+1, devices, &numDevices);
-	CHECK_ERROR_OCL(err, "getting devices", return false);
-	if (params.deviceIndex >= numDevices) {
-		reportStatus("Device index %d out of range (%d devices found)",
-			params.deviceIndex, numDevices);
-		return false;
+	m_program = clCreateProgramWithSource(m_clContext, 1, &source, NULL, &err);
+	CHECK_ERROR_OCL(err, "creating program", return false);
+
+	//float input images are read with read_imagef instead of read_imageui
+	std::string build_options = options;
+	if (!params.opengl && image_format != IMAGE_RGBA8) build_options += " -D FLOAT_INPUT";
+
+	err = clBuildProgram(m_program, 1, &m_device, build_options.c_str(), NULL, NULL);
+	if (err == CL_BUILD_PROGRAM_FAILURE) {
+		size_t sz;
+		clGetProgramBuildInfo(
+			m_program, m_device, CL_PROGRAM_BUILD_LOG, 0, NULL, &sz);
+		char *log = (char*)malloc(++sz);
+		clGetProgramBuildInfo(
+			m_program, m_device, CL_PROGRAM_BUILD_LOG, sz, log, NULL);
+		reportStatus(log);
+		free(log);
+	}
+	CHECK_ERROR_OCL(err, "building program", return false);
+
+	reportStatus("OpenCL context initialised.");
+	return true;
+}
+
+bool Filter::createContext(cl_context_properties context_prop[], const Params& params) {
+	cl_int err;
+	cl_uint numPlatforms, numDevices;
+
+	cl_platform_id platform;
+	if (params.device) {
+		m_device = params.device;
+		err = clGetDeviceInfo(m_device, CL_DEVICE_PLATFORM, sizeof(platform), &platform, NULL);
+		CHECK_ERROR_OCL(err, "getting device platform", return false);
+	}
+	else {
+		cl_platform_id platforms[params.platformIndex+1];
+		err = clGetPlatformIDs(params.platformIndex+1, platforms, &numPlatforms);
+		CHECK_ERROR_OCL(err, "getting platforms", return false);
+		if (params.platformIndex >= numPlatforms) {
+			reportStatus("Platform index %d out of range (%d platforms found)",
+				params.platformIndex, numPlatforms);
+			return false;
+		}
+		platform = platforms[params.platformIndex];
+
+		cl_device_id devices[params.deviceIndex+1];
+		err = clGetDeviceIDs(platform, params.type, params.deviceIndex+1, devices, &numDevices);
+		CHECK_ERROR_OCL(err, "getting devices", return false);
+		if (params.deviceIndex >= numDevices) {
+			reportStatus("Device index %d out of range (%d devices found)",
+				params.deviceIndex, numDevices);
+			return false;
+		}
+		m_device = devices[params.deviceIndex];
 	}
-	m_device = devices[params.deviceIndex];
 
 	char name[64];
 	clGetDeviceInfo(m_device, CL_DEVICE_NAME, 64, name, NULL);
@@ -75,50 +156,283 @@ bool Filter::initCL(cl_context_properties context_prop[], const Params& params,
 	reportStatus("CL_DEVICE_MAX_COMPUTE_UNITS: %lu", max_cu);
 
 
-	// Initialize SDL2
-	/*SDL_Init(SDL_INIT_VIDEO);
-	// Window mode MUST include SDL_WINDOW_OPENGL for use with OpenGL.
-	SDL_Window *window = SDL_CreateWindow( "SDL2/OpenGL Demo", 0, 0, 640, 480, SDL_WINDOW_OPENGL|SDL_WINDOW_RESIZABLE);
-	// Create an OpenGL context associated with the window.
-	m_glContext = SDL_GL_CreateContext(window);
-
-	// Create CL context properties, add GLX context & handle to DC 
-	cl_context_properties properties[] = { 
-		CL_GL_CONTEXT_KHR, (cl_context_properties)glXGetCurrentContext(), // GLX Context 
-		CL_GLX_DISPLAY_KHR, (cl_context_properties)glXGetCurrentDisplay(), // GLX Display
-		CL_CONTEXT_PLATFORM, (cl_context_properties)platform, // OpenCL platform
-		0 
-	};*/
-
+	//with opengl, context_prop names the GL context and display (an EGL one on
+	//Android, see GLInterop for Linux) and leaves the platform to fill in
 	if (params.opengl) context_prop[5] = (cl_context_properties) platform;
 
 	m_clContext = clCreateContext(context_prop, 1, &m_device, NULL, NULL, &err);
 	CHECK_ERROR_OCL(err, "creating context", return false);
 
-	m_queue = clCreateCommandQueue(m_clContext, m_device, 0, &err);
+	m_queue = clCreateCommandQueue(m_clContext, m_device, m_trace ? CL_QUEUE_PROFILING_ENABLE : 0, &err);
 	CHECK_ERROR_OCL(err, "creating command queue", return false);
 
-	m_program = clCreateProgramWithSource(m_clContext, 1, &source, NULL, &err);
-	CHECK_ERROR_OCL(err, "creating program", return false);
+	return true;
+}
 
-	err = clBuildProgram(m_program, 1, &m_device, options, NULL, NULL);
-	if (err == CL_BUILD_PROGRAM_FAILURE) {
-		size_t sz;
-		clGetProgramBuildInfo(
-			m_program, m_device, CL_PROGRAM_BUILD_LOG, 0, NULL, &sz);
-		char *log = (char*)malloc(++sz);
-		clGetProgramBuildInfo(
-			m_program, m_device, CL_PROGRAM_BUILD_LOG, sz, log, NULL);
-		reportStatus(log);
-		free(log);
+//creates mem_images from the GL textures, or as RGBA images matching the input format
+bool Filter::createImageMemory(const Params& params) {
+	cl_int err;
+
+	if (params.opengl) {
+		mem_images[0] = clCreateFromGLTexture2D(m_clContext, CL_MEM_READ_ONLY, GL_TEXTURE_2D, 0, in_tex, &err);
+		CHECK_ERROR_OCL(err, "creating gl input texture", return false);
+		
+		mem_images[1] = clCreateFromGLTexture2D(m_clContext, CL_MEM_WRITE_ONLY, GL_TEXTURE_2D, 0, out_tex, &err);
+		CHECK_ERROR_OCL(err, "creating gl output texture", return false);
 	}
-	CHECK_ERROR_OCL(err, "building program", return false);
+	else {
+		cl_image_format format;
+		format.image_channel_order = CL_RGBA;
+		if (m_inputImage) {
+			//released along with our own images by cleanupOpenCL
+			mem_images[0] = m_inputImage;
+			clRetainMemObject(mem_images[0]);
+		}
+		else {
+			switch (image_format) {
+				case IMAGE_RGBA32F: format.image_channel_data_type = CL_FLOAT; break;
+				case IMAGE_RGBA16F: format.image_channel_data_type = CL_HALF_FLOAT; break;
+				default:			format.image_channel_data_type = CL_UNSIGNED_INT8; break;
+			}
+			mem_images[0] = clCreateImage2D(m_clContext, CL_MEM_READ_ONLY, &format, image_width, image_height, 0, NULL, &err);
+			CHECK_ERROR_OCL(err, "creating input image memory", return false);
+		}
 
-	reportStatus("OpenCL context initialised.");
+		if (m_outputImage) {
+			mem_images[1] = m_outputImage;
+			clRetainMemObject(mem_images[1]);
+		}
+		else {
+			//tonemapped output is always 8-bit, and readable so that it can feed another filter
+			format.image_channel_data_type = CL_UNSIGNED_INT8;
+			mem_images[1] = clCreateImage2D(m_clContext, CL_MEM_READ_WRITE, &format, image_width, image_height, 0, NULL, &err);
+			CHECK_ERROR_OCL(err, "creating output image memory", return false);
+		}
+	}
 	return true;
 }
 
+//pinned host memory for the input image, sized from setImageSize/setImageFormat.
+//Decoding straight into it lets clEnqueueWriteImage DMA from it without a staging copy
+Image Filter::mapStagingImage() {
+	cl_int err;
+	Image image = {NULL, (size_t) image_width, (size_t) image_height, image_format};
+	size_t size = bytesPerPixel(image_format)*image_width*image_height;
+
+	if (m_staging) clReleaseMemObject(m_staging);
+	m_staging = clCreateBuffer(m_clContext, CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR, size, NULL, &err);
+	CHECK_ERROR_OCL(err, "creating staging memory", return image);
+
+	image.data = (uchar*) clEnqueueMapBuffer(m_queue, m_staging, CL_TRUE, CL_MAP_WRITE, 0, size, 0, NULL, NULL, &err);
+	CHECK_ERROR_OCL(err, "mapping staging memory", return image);
+	return image;
+}
+
+void Filter::unmapStagingImage(Image image) {
+	if (!m_staging) return;
+	clEnqueueUnmapMemObject(m_queue, m_staging, image.data, 0, NULL, NULL);
+	clFinish(m_queue);
+	clReleaseMemObject(m_staging);
+	m_staging = 0;
+}
+
+//Buffers only used between two kernels can share memory with buffers used at other
+//times. first and last are the steps, in the order runCLKernels enqueues kernels,
+//at which the buffer is first written and last read; mems[name] is created by
+//allocateBuffers as a sub-buffer of one pooled allocation.
+void Filter::planBuffer(const char* name, size_t size, int first, int last) {
+	PlannedBuffer buffer;
+	buffer.name = name;
+	buffer.size = size;
+	buffer.offset = 0;
+	buffer.first = first;
+	buffer.last = last;
+	m_plan.push_back(buffer);
+}
+
+bool Filter::largerBuffer(const PlannedBuffer* a, const PlannedBuffer* b) {
+	return a->size > b->size;
+}
+
+bool Filter::allocateBuffers() {
+	cl_int err;
+
+	//sub-buffer origins must be aligned to CL_DEVICE_MEM_BASE_ADDR_ALIGN (in bits)
+	cl_uint align_bits;
+	err = clGetDeviceInfo(m_device, CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(cl_uint), &align_bits, NULL);
+	CHECK_ERROR_OCL(err, "getting base address alignment", return false);
+	size_t align = align_bits/8;
+
+	//largest first, each at the lowest offset clear of every placed buffer it is live with
+	std::vector<PlannedBuffer*> order;
+	for (size_t i = 0; i < m_plan.size(); i++) order.push_back(&m_plan[i]);
+	std::stable_sort(order.begin(), order.end(), largerBuffer);
+
+	size_t pool_size = 0, unpooled_size = 0;
+	for (size_t i = 0; i < order.size(); i++) {
+		PlannedBuffer* buffer = order[i];
+		size_t offset = 0;
+		bool moved = true;
+		while (moved) {
+			moved = false;
+			for (size_t j = 0; j < i; j++) {
+				PlannedBuffer* placed = order[j];
+				bool live = placed->first <= buffer->last && buffer->first <= placed->last;
+				bool overlaps = offset < placed->offset + placed->size && placed->offset < offset + buffer->size;
+				if (live && overlaps) {
+					offset = (placed->offset + placed->size + align-1)/align*align;
+					moved = true;
+				}
+			}
+		}
+		buffer->offset = offset;
+		pool_size = std::max(pool_size, offset + buffer->size);
+		unpooled_size += buffer->size;
+	}
+
+	m_pool = clCreateBuffer(m_clContext, CL_MEM_READ_WRITE, pool_size, NULL, &err);
+	CHECK_ERROR_OCL(err, "creating pooled buffer memory", return false);
+
+	for (size_t i = 0; i < m_plan.size(); i++) {
+		cl_buffer_region region = {m_plan[i].offset, m_plan[i].size};
+		mems[m_plan[i].name] = clCreateSubBuffer(m_pool, CL_MEM_READ_WRITE, CL_BUFFER_CREATE_TYPE_REGION, &region, &err);
+		CHECK_ERROR_OCL(err, ("creating " + m_plan[i].name + " memory").c_str(), return false);
+	}
+
+	size_t image_size = image_width*image_height*(bytesPerPixel(image_format) + bytesPerPixel(IMAGE_RGBA8));
+	reportStatus("Peak device footprint: %lu bytes (%lu for %lu buffers, %lu unpooled; %lu for images)",
+		pool_size + image_size, pool_size, m_plan.size(), unpooled_size, image_size);
+	return true;
+}
+
+void Filter::setSharedContext(cl_context context, cl_command_queue queue, cl_device_id device) {
+	m_sharedContext = context;
+	m_sharedQueue = queue;
+	m_sharedDevice = device;
+}
+
+void Filter::setInputImage(cl_mem image) {
+	m_inputImage = image;
+}
+
+void Filter::setOutputImage(cl_mem image) {
+	m_outputImage = image;
+}
+
+//IMAGE_* format of mem_images[1]
+int Filter::getOutputFormat() const {
+	return IMAGE_RGBA8;
+}
+
+//copies a host image into mem_images[0], for runOpenCLOnDevice
+bool Filter::uploadInput(Image input) {
+	cl_int err;
+	const size_t origin[] = {0, 0, 0};
+	const size_t region[] = {input.width, input.height, 1};
+	double start = metricsTime();
+	err = clEnqueueWriteImage(m_queue, mem_images[0], CL_TRUE, origin, region, rowBytes(input), 0, input.data, 0, NULL, traceEvent("upload"));
+	CHECK_ERROR_OCL(err, "writing image memory", return false);
+	recordLatency("upload", metricsTime() - start);
+	countMetric("upload_bytes", bytesPerPixel(input.format)*input.width*input.height);
+	return true;
+}
+
+//runs on whatever mem_images[0] already holds, e.g. another filter's output
+//given with setInputImage, and reads the result back if output.data is set
+bool Filter::runOpenCLOnDevice(Image output, bool recomputeMapping) {
+	cl_int err;
+	double runTime = runCLKernels(recomputeMapping);
+
+	double download = metricsTime();
+	if (output.data) {
+		const size_t origin[] = {0, 0, 0};
+		const size_t region[] = {output.width, output.height, 1};
+		err = clEnqueueReadImage(m_queue, mem_images[1], CL_TRUE, origin, region, rowBytes(output), 0, output.data, 0, NULL, traceEvent("download"));
+		CHECK_ERROR_OCL(err, "reading image memory", return false);
+	}
+	//the upload, if any, was recorded by uploadInput
+	recordFrame(0, runTime, output.data ? metricsTime() - download : 0, 0, output.data ? bytesPerPixel(output.format)*output.width*output.height : 0);
+
+	//verification needs the input on the host as well
+	if (!m_params.verify || !output.data || !mem_images[0]) {
+		reportStatus("Finished in %lf ms", runTime*1000);
+		return true;
+	}
+
+	Image input = createImage(image_width, image_height, image_format);
+	const size_t origin[] = {0, 0, 0};
+	const size_t region[] = {input.width, input.height, 1};
+	err = clEnqueueReadImage(m_queue, mem_images[0], CL_TRUE, origin, region, bytesPerPixel(input.format)*input.width, 0, input.data, 0, NULL, NULL);
+	CHECK_ERROR_OCL(err, "reading input image memory", free(input.data); return false);
+
+	bool passed = verify(input, output, m_params.halfPrecision ? VERIFY_TOLERANCE_HALF : VERIFY_TOLERANCE);
+	reportStatus(
+		"Finished in %lf ms (verification %s)",
+		runTime*1000, passed ? "passed" : "failed");
+	free(input.data);
+
+	return passed;
+}
+
+cl_context Filter::getContext() const {
+	return m_clContext;
+}
+
+cl_command_queue Filter::getQueue() const {
+	return m_queue;
+}
+
+cl_device_id Filter::getDevice() const {
+	return m_device;
+}
+
+cl_mem Filter::getOutputImage() const {
+	return mem_images[1];
+}
+
+bool Filter::supportsTiling() const {
+	return false;
+}
+
+int Filter::getTileHalo() const {
+	return 0;
+}
+
+int Filter::getTileAlignment() const {
+	return 1;
+}
+
+void Filter::beginStatistics() {
+	m_fixedStatistics = false;
+}
+
+void Filter::accumulateStatistics(Image rows) {
+}
+
+void Filter::endStatistics() {
+	m_fixedStatistics = true;
+}
+
+void Filter::clearStatistics() {
+	m_fixedStatistics = false;
+}
+
+void Filter::copyStatistics(const Filter& other) {
+	m_fixedStatistics = other.m_fixedStatistics;
+}
+
 void Filter::releaseCL() {
+	flushTraceEvents();
+	//sub-buffers keep the pool alive until the filter releases them
+	if (m_pool) {
+		clReleaseMemObject(m_pool);
+		m_pool = 0;
+	}
+	m_plan.clear();
+	if (m_staging) {
+		clReleaseMemObject(m_staging);
+		m_staging = 0;
+	}
 	if (m_program) {
 		clReleaseProgram(m_program);
 		m_program = 0;
@@ -131,10 +445,6 @@ void Filter::releaseCL() {
 		clReleaseContext(m_clContext);
 		m_clContext = 0;
 	}
-	/*if (m_glContext) {
-		SDL_GL_DeleteContext(m_glContext);
-		m_glContext = 0;
-	}*/
 }
 
 void Filter::reportStatus(const char *format, ...) const {
@@ -150,59 +460,342 @@ void Filter::setStatusCallback(int (*callback)(const char*, va_list args)) {
 	m_statusCallback = callback;
 }
 
+int (*Filter::getStatusCallback() const)(const char*, va_list args) {
+	return m_statusCallback;
+}
+
+void Filter::setMetrics(Metrics* metrics) {
+	m_metrics = metrics;
+}
+
+Metrics* Filter::getMetrics() const {
+	return m_metrics;
+}
+
+void Filter::setTrace(Trace* trace) {
+	m_trace = trace;
+}
+
+Trace* Filter::getTrace() const {
+	return m_trace;
+}
+
+const Filter::VerifyReport& Filter::getVerifyReport() const {
+	return m_verifyReport;
+}
+
+void Filter::addParameter(const char* name, float* value, float min, float max, const char* description, int scope) {
+	Parameter parameter = {name, description, PARAMETER_FLOAT, value, min, max, scope};
+	m_parameters.push_back(parameter);
+}
+
+void Filter::addParameter(const char* name, int* value, int min, int max, const char* description, int scope) {
+	Parameter parameter = {name, description, PARAMETER_INT, value, (float) min, (float) max, scope};
+	m_parameters.push_back(parameter);
+}
+
+bool Filter::setParameter(const char* name, float value) {
+	for (size_t i = 0; i < m_parameters.size(); i++) {
+		const Parameter& parameter = m_parameters[i];
+		if (strcmp(parameter.name, name)) continue;
+
+		if (!(value >= parameter.min && value <= parameter.max)) {
+			reportStatus("%s %s must be between %g and %g", m_name, name, parameter.min, parameter.max);
+			return false;
+		}
+		if (parameter.scope == PARAMETER_SETUP && m_program) {
+			reportStatus("%s %s can only be changed before setupOpenCL", m_name, name);
+			return false;
+		}
+		if (parameter.type == PARAMETER_INT) *(int*) parameter.value = (int) (value + 0.5f);
+		else *(float*) parameter.value = value;
+		countMetric("parameter_updates");
+		if (parameter.scope == PARAMETER_MAPPING) m_mappingChanged = true;
+
+		return m_program ? updateParameters() : true;
+	}
+	reportStatus("%s has no parameter %s", m_name, name);
+	return false;
+}
+
+bool Filter::getParameter(const char* name, float &value) const {
+	for (size_t i = 0; i < m_parameters.size(); i++) {
+		const Parameter& parameter = m_parameters[i];
+		if (strcmp(parameter.name, name)) continue;
+		value = parameter.type == PARAMETER_INT ? *(int*) parameter.value : *(float*) parameter.value;
+		return true;
+	}
+	return false;
+}
+
+const std::vector<Filter::Parameter>& Filter::getParameters() const {
+	return m_parameters;
+}
+
+bool Filter::updateParameters() {
+	return true;
+}
+
+void Filter::flushTraceEvents() {
+	for (size_t i = 0; i < m_traceEvents.size(); i++) {
+		TracedCommand& command = m_traceEvents[i];
+		if (!command.event) continue;	//the enqueue failed
+		if (m_trace) m_trace->addDeviceSpan(command.name, m_name, command.event, command.queued, m_queue, m_name);
+		clReleaseEvent(command.event);
+	}
+	m_traceEvents.clear();
+}
+
+//one frame through runOpenCL, times in seconds. Stages that didn't happen,
+//e.g. the upload of an input another filter left on the device, are 0
+void Filter::recordFrame(double upload, double kernels, double download, size_t uploadBytes, size_t downloadBytes) {
+	flushTraceEvents();
+	if (!m_metrics) return;
+
+	countMetric("frames");
+	if (uploadBytes) {
+		recordLatency("upload", upload);
+		countMetric("upload_bytes", uploadBytes);
+	}
+	recordLatency("kernels", kernels);
+	if (downloadBytes) {
+		recordLatency("download", download);
+		countMetric("download_bytes", downloadBytes);
+	}
+	recordLatency("frame", upload + kernels + download);
+}
+
 bool Filter::verify(Image input, Image output, float tolerance) {
-	// Compute reference image8
-	Image ref = {(uchar*) calloc(output.width*output.height*NUM_CHANNELS, sizeof(uchar)), output.width, output.height};
-	runReference(input, ref);
+	memset(&m_verifyReport, 0, sizeof(m_verifyReport));
+	const unsigned int interval = std::max(m_params.verifyInterval, 1u);
+	if (m_verifyFrames++ % interval) {
+		countMetric("verify_skipped");
+		return true;
+	}
+	double start = metricsTime();
+
+	//a tile is run through the reference on its own, with its halo and the
+	//statistics of the whole image, and only its core is compared
+	const size_t tile = m_params.verifyTile;
+	Image in = input, out = output;
+	size_t x0 = 0, y0 = 0;	//of the core, in the reference's input
+	bool tiled = tile && supportsTiling() && (tile < output.width || tile < output.height);
+	if (tiled) {
+		const size_t alignment = getTileAlignment();
+		const size_t halo = getTileHalo();
+		const size_t w = std::min(tile, (size_t) output.width);
+		const size_t h = std::min(tile, (size_t) output.height);
+		const size_t cx = rand_r(&m_verifySeed) % (output.width - w + 1);
+		const size_t cy = rand_r(&m_verifySeed) % (output.height - h + 1);
+		const size_t ex0 = (cx > halo ? cx - halo : 0)/alignment*alignment;
+		const size_t ey0 = (cy > halo ? cy - halo : 0)/alignment*alignment;
+		//the ends too, so the extent is laid out as Tiled would lay out a tile
+		const size_t ex1 = std::min(roundUp(cx + w + halo, alignment), (size_t) output.width);
+		const size_t ey1 = std::min(roundUp(cy + h + halo, alignment), (size_t) output.height);
+		in = subImage(input, ex0, ey0, ex1 - ex0, ey1 - ey0);
+		out = subImage(output, cx, cy, w, h);
+		x0 = cx - ex0;
+		y0 = cy - ey0;
+	}
 
-	// Compare pixels
-	int errors = 0;
+	// Compute reference image
+	Image ref = createImage(in.width, in.height, output.format);
+	if (tiled) {
+		//statistics may already be fixed by Tiled
+		bool fixed = m_fixedStatistics;
+		if (!fixed) {
+			beginStatistics();
+			accumulateStatistics(input);
+			endStatistics();
+		}
+		runReference(in, ref);
+		if (!fixed) clearStatistics();
+	}
+	else {
+		runReference(in, ref);
+	}
+
+	m_verifyReport = compare(subImage(ref, x0, y0, out.width, out.height), out, tolerance);
+	const VerifyReport& report = m_verifyReport;
+	reportStatus("Error against reference%s: max %f, mean %f, PSNR %.2f dB, %lu mismatches (tolerance %f)",
+		tiled ? " in a tile" : "", report.maxError, report.meanError, report.psnr, report.mismatches, tolerance);
+	countMetric(report.mismatches ? "verify_failed" : "verify_passed");
+	countMetric("verify_mismatches", report.mismatches);
+	recordLatency("verify", metricsTime() - start);
+
+	releaseImage(ref);
+	return report.mismatches == 0;
+}
+
+//one pass over rows in parallel, the first few mismatches are reported
+Filter::VerifyReport Filter::compare(const Image &ref, const Image &output, float tolerance) const {
 	const int maxErrors = 16;
-	for (int y = 0; y < output.height; y++) {
-		for (int x = 0; x < output.width; x++) {
-			for (int c = 0; c < NUM_CHANNELS; c++) {
-				float r = getPixel(ref, x, y, c);
-				float o = getPixel(output, x, y, c);
-				float diff = r - o;
-				diff = diff >= 0 ? diff : -diff;
-
-				if (diff > tolerance) {
-					// Only report first few errors
-					if (errors < maxErrors) {
-						reportStatus("Mismatch at (%d,%d,%d): %f vs %f", x, y, c, r, o);
-					}
-					if (++errors == maxErrors) {
-						reportStatus("Supressing further errors");
+	int reported = 0;
+	size_t mismatches = 0;
+	float maxDiff = 0.f;
+	double sumDiff = 0.0, sumSquared = 0.0;
+	const size_t n = output.width*NUM_CHANNELS;
+
+	#pragma omp parallel reduction(+:mismatches, sumDiff, sumSquared) reduction(max:maxDiff)
+	{
+		float* r = (float*) malloc(n*sizeof(float));
+		float* o = (float*) malloc(n*sizeof(float));
+
+		#pragma omp for schedule(static)
+		for (int y = 0; y < (int) output.height; y++) {
+			readRow(ref, y, r);
+			readRow(output, y, o);
+
+			float rowMax = 0.f;
+			float rowSum = 0.f, rowSquared = 0.f;
+			int rowMismatches = 0;
+			#pragma omp simd reduction(max:rowMax) reduction(+:rowSum, rowSquared, rowMismatches)
+			for (size_t i = 0; i < n; i++) {
+				const float diff = i%NUM_CHANNELS == 3 ? 0.f : fabsf(r[i] - o[i]);	//alpha is passed through, not tonemapped
+				rowMax = std::max(rowMax, diff);
+				rowSum += diff;
+				rowSquared += diff*diff;
+				rowMismatches += diff > tolerance;
+			}
+			maxDiff = std::max(maxDiff, rowMax);
+			sumDiff += rowSum;
+			sumSquared += rowSquared;
+			mismatches += rowMismatches;
+			if (!rowMismatches) continue;
+
+			#pragma omp critical(verify_report)
+			for (int x = 0; x < (int) output.width && reported < maxErrors; x++) {
+				for (int c = 0; c < 3 && reported < maxErrors; c++) {
+					const size_t i = x*NUM_CHANNELS + c;
+					if (fabsf(r[i] - o[i]) > tolerance) {
+						reportStatus("Mismatch at (%d,%d,%d): %f vs %f", x, y, c, r[i], o[i]);
+						if (++reported == maxErrors) reportStatus("Supressing further errors");
 					}
 				}
 			}
 		}
+
+		free(r);
+		free(o);
 	}
 
-	free(ref.data);
-	return errors == 0;
+	VerifyReport report;
+	report.pixels = output.width*output.height;
+	report.mismatches = mismatches;
+	report.maxError = maxDiff;
+	const double channels = report.pixels*3.0;
+	report.meanError = channels ? sumDiff/channels : 0.0;
+	const double mse = channels ? sumSquared/channels : 0.0;
+	report.psnr = mse > 0 ? 10*log10(PIXEL_RANGE*PIXEL_RANGE/mse) : INFINITY;
+	return report;
+}
+
+bool Filter::runHalideCPU(Image input, Image output, const Params& params) {
+	reportStatus("%s has no Halide CPU implementation", m_name);
+	return false;
+}
+
+bool Filter::runHalideGPU(Image input, Image output, const Params& params) {
+	reportStatus("%s has no Halide GPU implementation", m_name);
+	return false;
+}
+
+bool Filter::runHalideAuto(Image input, Image output, const Params& params) {
+	reportStatus("%s has no autoscheduled Halide implementation", m_name);
+	return false;
+}
+
+bool Filter::runCPU(Image input, Image output, const Params& params) {
+	reportStatus("%s has no optimised CPU implementation", m_name);
+	return false;
+}
+
+bool Filter::lookupReference(const Image &input, Image output) {
+	uint64_t hash = hashImage(input);
+	const int format = output.format;
+	hash = hashBytes(&format, sizeof(format), hash);
+	m_referenceKey = hashParameters(hash);
+
+	bool found = m_referenceCache->lookup(m_referenceKey, output);
+	countMetric(found ? "reference_cache_hits" : "reference_cache_misses");
+	return found;
+}
+
+void Filter::cacheReference(const Image &output) {
+	m_referenceCache->insert(m_referenceKey, output);
+}
+
+uint64_t Filter::hashParameters(uint64_t hash) const {
+	const int version = REFERENCE_VERSION;
+	hash = hashBytes(m_name, strlen(m_name), hash);
+	hash = hashBytes(&version, sizeof(version), hash);
+	return hashBytes(&m_fixedStatistics, sizeof(m_fixedStatistics), hash);
+}
+
+//reports a finished Halide pipeline the way runOpenCL does
+bool Filter::finishHalide(Image input, Image output, const Params& params, double runTime) {
+	reportStatus("Finished Halide pipeline");
+
+	bool passed = true;
+	if (params.verify) {
+		passed = verify(input, output);
+		reportStatus(
+			"Finished in %lf ms (verification %s)",
+			runTime*1000, passed ? "passed" : "failed");
+	}
+	else reportStatus("Finished in %lf ms", runTime*1000);
+
+	return passed;
 }
 
 Image Filter::runFilter(Image input, Params params, unsigned int method) {
-	Image output = {(uchar*) calloc(input.width*input.height*NUM_CHANNELS, sizeof(uchar)), input.width, input.height};
+	Image output = createImage(input.width, input.height);
 
 	std::cout << "--------------------------------Tonemapping using " << m_name << std::endl;
 
+	double start = metricsTime();
+	const char* stage = "";
+	bool ran = true;	//an OpenCL run that only failed verification still has an output
 	switch (method)
 	{
 		case METHOD_REFERENCE:
+			stage = "reference";
 			runReference(input, output);
 			break;
 		case METHOD_OPENCL:
+			stage = "opencl";
 			image_width = input.width;
 			image_height = input.height;
-			setupOpenCL(NULL, params);
-			runOpenCL(input, output);
+			image_format = input.format;
+			ran = setupOpenCL(NULL, params);
+			if (ran) runOpenCL(input, output);
 			cleanupOpenCL();
 			break;
+		case METHOD_HALIDE_CPU:
+			stage = "halide_cpu";
+			ran = runHalideCPU(input, output, params);
+			break;
+		case METHOD_HALIDE_GPU:
+			stage = "halide_gpu";
+			ran = runHalideGPU(input, output, params);
+			break;
+		case METHOD_HALIDE_AUTO:
+			stage = "halide_auto";
+			ran = runHalideAuto(input, output, params);
+			break;
+		case METHOD_CPU:
+			stage = "cpu";
+			ran = runCPU(input, output, params);
+			break;
 		default:
 			assert(false && "Invalid method.");
 	}
+	if (!ran) {
+		releaseImage(output);
+		return output;
+	}
+	//the whole run, including OpenCL setup and the reference if verifying
+	recordLatency(stage, metricsTime() - start);
 	return output;
 }
 
@@ -288,6 +881,10 @@ void Filter::setImageSize(int width, int height) {
 	image_height = height;
 }
 
+void Filter::setImageFormat(int format) {
+	image_format = format;
+}
+
 void Filter::setImageTextures(GLuint input_texture, GLuint output_texture) {
 	in_tex = input_texture;
 	out_tex = output_texture;
@@ -314,15 +911,33 @@ Image image_mipmap(Image &input, int level) {
 	int m_width = input.width/scale_factor;
 	int m_height = input.height/scale_factor;
 
-	Image output = {(uchar*) calloc(m_width*m_height*NUM_CHANNELS, sizeof(uchar)), m_width, m_height};
-	for (int y = 0; y < m_height; y++) {
-		for (int x = 0; x < m_width; x++) {
-			int _x = scale_factor*x;
-			int _y = scale_factor*y;
-			setPixel(output, x, y, 0, (getPixel(input, _x, _y, 0) + getPixel(input, _x+1, _y, 0) + getPixel(input, _x, _y+1, 0) + getPixel(input, _x+1, _y+1, 0))/4.f);
-			setPixel(output, x, y, 1, (getPixel(input, _x, _y, 1) + getPixel(input, _x+1, _y, 1) + getPixel(input, _x, _y+1, 1) + getPixel(input, _x+1, _y+1, 1))/4.f);
-			setPixel(output, x, y, 2, (getPixel(input, _x, _y, 2) + getPixel(input, _x+1, _y, 2) + getPixel(input, _x, _y+1, 2) + getPixel(input, _x+1, _y+1, 2))/4.f);
+	//each pixel is the mean of the 2x2 block at its top left corner at full
+	//resolution, clamped to the edge
+	Image output = createImage(m_width, m_height, input.format);
+	#pragma omp parallel
+	{
+		float* top = (float*) malloc(input.width*NUM_CHANNELS*sizeof(float));
+		float* bottom = (float*) malloc(input.width*NUM_CHANNELS*sizeof(float));
+		float* out = (float*) malloc(m_width*NUM_CHANNELS*sizeof(float));
+
+		#pragma omp for
+		for (int y = 0; y < m_height; y++) {
+			const int _y = scale_factor*y;
+			readRow(input, _y, top);
+			readRow(input, std::min(_y+1, (int) input.height-1), bottom);
+			for (int x = 0; x < m_width; x++) {
+				const int _x = scale_factor*x*NUM_CHANNELS;
+				const int _x1 = std::min(scale_factor*x+1, (int) input.width-1)*NUM_CHANNELS;
+				for (int c = 0; c < NUM_CHANNELS; c++) {
+					out[x*NUM_CHANNELS + c] = (top[_x + c] + top[_x1 + c] + bottom[_x + c] + bottom[_x1 + c])/4.f;
+				}
+			}
+			writeRow(output, y, out);
 		}
+
+		free(top);
+		free(bottom);
+		free(out);
 	}
 	return output;
 }
@@ -342,16 +957,260 @@ float getValue(float* data, int x, int y, int width, int height) {
 	return data[_x + _y*width];
 }
 
+size_t bytesPerPixel(int format) {
+	return channelsPerPixel(format)*(format == IMAGE_RGBA8 ? sizeof(uchar) : format == IMAGE_RGBA16F ? sizeof(uint16_t) : sizeof(float));
+}
+
+size_t channelsPerPixel(int format) {
+	return format == IMAGE_L32F ? 1 : NUM_CHANNELS;
+}
+
+size_t rowBytes(const Image &image) {
+	return image.stride ? image.stride : image.width*bytesPerPixel(image.format);
+}
+
+Image createImage(size_t width, size_t height, int format, bool padRows) {
+	Image image = {NULL, width, height, format};
+	if (padRows) image.stride = (rowBytes(image) + IMAGE_ALIGNMENT-1)/IMAGE_ALIGNMENT*IMAGE_ALIGNMENT;
+
+	const size_t size = rowBytes(image)*height;
+	void* data;
+	if (posix_memalign(&data, IMAGE_ALIGNMENT, size ? size : 1)) return image;
+	memset(data, 0, size);
+	image.data = (uchar*) data;
+	return image;
+}
+
+void releaseImage(Image &image) {
+	free(image.data);
+	image.data = NULL;
+}
+
+Image subImage(const Image &image, size_t x, size_t y, size_t width, size_t height) {
+	Image view = {image.data + y*rowBytes(image) + x*bytesPerPixel(image.format), width, height, image.format, rowBytes(image)};
+	return view;
+}
+
+void copyImage(const Image &src, Image &dst) {
+	const size_t width = std::min(src.width, dst.width);
+	const size_t height = std::min(src.height, dst.height);
+
+	if (src.format == dst.format) {
+		for (size_t y = 0; y < height; y++) {
+			memcpy(dst.data + y*rowBytes(dst), src.data + y*rowBytes(src), width*bytesPerPixel(src.format));
+		}
+		return;
+	}
+
+	//rows are converted whole, so narrower destinations are written from a view
+	Image out = subImage(dst, 0, 0, width, height);
+	Image in = subImage(src, 0, 0, width, height);
+	#pragma omp parallel
+	{
+		float* row = (float*) malloc(src.width*NUM_CHANNELS*sizeof(float));
+		#pragma omp for
+		for (int y = 0; y < (int) height; y++) {
+			readRow(in, y, row);
+			writeRow(out, y, row);
+		}
+		free(row);
+	}
+}
+
+//finished with MurmurHash3's mixer, as xoring whole words leaves the high bits
+//poorly mixed
+uint64_t hashBytes(const void* data, size_t size, uint64_t hash) {
+	const uint64_t prime = 0x100000001b3ull;
+	const uchar* bytes = (const uchar*) data;
+	size_t i = 0;
+	for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, bytes + i, sizeof(word));
+		hash = (hash ^ word)*prime;
+	}
+	for (; i < size; i++) hash = (hash ^ bytes[i])*prime;
+
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdull;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ull;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+uint64_t hashImage(const Image &image, uint64_t hash) {
+	const uint64_t extent[3] = {image.width, image.height, (uint64_t) image.format};
+	hash = hashBytes(extent, sizeof(extent), hash);
+	const size_t row_size = image.width*bytesPerPixel(image.format);
+	for (size_t y = 0; y < image.height; y++) hash = hashBytes(imageRow(image, y), row_size, hash);
+	return hash;
+}
+
+void ucharToFloat(const uchar* in, float* out, size_t n) {
+	#pragma omp simd
+	for (size_t i = 0; i < n; i++) out[i] = in[i];
+}
+
+void floatToUchar(const float* in, uchar* out, size_t n) {
+	#pragma omp simd
+	for (size_t i = 0; i < n; i++) {
+		const float v = in[i] < 0.f ? 0.f : in[i] > PIXEL_RANGE ? PIXEL_RANGE : in[i];
+		out[i] = (uchar) v;
+	}
+}
+
+void readRow(const Image &image, size_t y, float* rgba) {
+	const size_t n = image.width*NUM_CHANNELS;
+	const uchar* row = imageRow(image, y);
+	switch (image.format) {
+		case IMAGE_RGBA32F: {
+			const float* in = (const float*) row;
+			#pragma omp simd
+			for (size_t i = 0; i < n; i++) rgba[i] = in[i]*PIXEL_RANGE;
+			break;
+		}
+		case IMAGE_RGBA16F: {
+			const uint16_t* in = (const uint16_t*) row;
+			for (size_t i = 0; i < n; i++) rgba[i] = halfToFloat(in[i])*PIXEL_RANGE;
+			break;
+		}
+		case IMAGE_L32F: {
+			const float* in = (const float*) row;
+			for (size_t x = 0; x < image.width; x++) {
+				rgba[x*NUM_CHANNELS + 0] = rgba[x*NUM_CHANNELS + 1] = rgba[x*NUM_CHANNELS + 2] = in[x]*PIXEL_RANGE;
+				rgba[x*NUM_CHANNELS + 3] = PIXEL_RANGE;
+			}
+			break;
+		}
+		default:
+			ucharToFloat(row, rgba, n);
+			break;
+	}
+}
+
+void writeRow(Image &image, size_t y, const float* rgba) {
+	const size_t n = image.width*NUM_CHANNELS;
+	uchar* row = imageRow(image, y);
+	switch (image.format) {
+		case IMAGE_RGBA32F: {
+			float* out = (float*) row;
+			#pragma omp simd
+			for (size_t i = 0; i < n; i++) out[i] = rgba[i]/PIXEL_RANGE;
+			break;
+		}
+		case IMAGE_RGBA16F: {
+			uint16_t* out = (uint16_t*) row;
+			for (size_t i = 0; i < n; i++) out[i] = floatToHalf(rgba[i]/PIXEL_RANGE);
+			break;
+		}
+		case IMAGE_L32F: {
+			float* out = (float*) row;
+			#pragma omp simd
+			for (size_t x = 0; x < image.width; x++) {
+				const float3 pixel = {rgba[x*NUM_CHANNELS + 0], rgba[x*NUM_CHANNELS + 1], rgba[x*NUM_CHANNELS + 2]};
+				out[x] = getPixelLuminance(pixel)/PIXEL_RANGE;
+			}
+			break;
+		}
+		default:
+			floatToUchar(rgba, row, n);
+			break;
+	}
+}
+
+//float formats are scaled to the 8-bit range, but are not clamped to it
 float getPixel(Image &image, int x, int y, int c) {
 	int _x = clamp(x, 0, image.width-1);
 	int _y = clamp(y, 0, image.height-1);
-	return ((float)image.data[(_x + _y*image.width)*NUM_CHANNELS + c]);
+	const uchar* pixel = image.data + _y*rowBytes(image) + _x*bytesPerPixel(image.format);
+	switch (image.format) {
+		case IMAGE_RGBA32F: return ((float*)pixel)[c]*PIXEL_RANGE;
+		case IMAGE_RGBA16F: return halfToFloat(((uint16_t*)pixel)[c])*PIXEL_RANGE;
+		case IMAGE_L32F:	return c < 3 ? *(float*)pixel*PIXEL_RANGE : PIXEL_RANGE;
+		default:			return ((float)pixel[c]);
+	}
 }
 
+//channel 0 of an IMAGE_L32F image is its luminance, the others are ignored
 void setPixel(Image &image, int x, int y, int c, float value) {
 	int _x = clamp(x, 0, image.width-1);
 	int _y = clamp(y, 0, image.height-1);
-	image.data[(_x + _y*image.width)*NUM_CHANNELS + c] = clamp(value, 0.f, PIXEL_RANGE*1.f);
+	uchar* pixel = image.data + _y*rowBytes(image) + _x*bytesPerPixel(image.format);
+	switch (image.format) {
+		case IMAGE_RGBA32F: ((float*)pixel)[c] = value/PIXEL_RANGE; break;
+		case IMAGE_RGBA16F: ((uint16_t*)pixel)[c] = floatToHalf(value/PIXEL_RANGE); break;
+		case IMAGE_L32F:	if (c == 0) *(float*)pixel = value/PIXEL_RANGE; break;
+		default:			pixel[c] = clamp(value, 0.f, PIXEL_RANGE*1.f); break;
+	}
+}
+
+//the original data is left alone, it still belongs to whoever allocated it
+void toFloat(Image &input) {
+	Image output = createImage(input.width, input.height, IMAGE_RGBA32F);
+	float* data = (float*) output.data;
+	#pragma omp parallel for
+	for (int y = 0; y < input.height; y++) {
+		for (int x = 0; x < input.width; x++) {
+			for (int c = 0; c < NUM_CHANNELS; c++) {
+				data[(x + y*input.width)*NUM_CHANNELS + c] = getPixel(input, x, y, c)/PIXEL_RANGE;
+			}
+		}
+	}
+	input = output;
+}
+
+//IEEE 754 binary16 to float, used to inspect half precision buffers on the host
+float halfToFloat(uint16_t h) {
+	uint32_t sign = (h & 0x8000) << 16;
+	uint32_t exponent = (h >> 10) & 0x1f;
+	uint32_t mantissa = h & 0x3ff;
+	uint32_t bits;
+
+	if (exponent == 0) {
+		if (mantissa == 0) bits = sign;		//zero
+		else {								//subnormal, renormalise
+			exponent = 127 - 15 + 1;
+			while (!(mantissa & 0x400)) {
+				mantissa <<= 1;
+				exponent--;
+			}
+			bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+		}
+	}
+	else if (exponent == 0x1f) bits = sign | 0x7f800000 | (mantissa << 13);	//inf or nan
+	else bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+
+	float value;
+	memcpy(&value, &bits, sizeof(float));
+	return value;
+}
+
+//float to IEEE 754 binary16, rounding to nearest even
+uint16_t floatToHalf(float f) {
+	uint32_t bits;
+	memcpy(&bits, &f, sizeof(float));
+
+	uint32_t sign = (bits >> 16) & 0x8000;
+	int32_t exponent = ((bits >> 23) & 0xff) - 127 + 15;
+	uint32_t mantissa = bits & 0x7fffff;
+
+	if (((bits >> 23) & 0xff) == 0xff) return sign | 0x7c00 | (mantissa ? 0x200 : 0);	//inf or nan
+	if (exponent >= 0x1f) return sign | 0x7c00;		//overflow to inf
+	if (exponent <= 0) {							//subnormal or zero
+		if (exponent < -10) return sign;
+		mantissa |= 0x800000;
+		uint32_t shift = 14 - exponent;
+		uint32_t half = mantissa >> shift;
+		uint32_t rest = mantissa & ((1 << shift) - 1);
+		uint32_t halfway = 1 << (shift - 1);
+		if (rest > halfway || (rest == halfway && (half & 1))) half++;
+		return sign | half;
+	}
+
+	uint32_t half = sign | (exponent << 10) | (mantissa >> 13);
+	uint32_t rest = mantissa & 0x1fff;
+	if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) half++;	//may carry into the exponent, which is correct
+	return half;
 }
 
 float getPixelLuminance(float3 pixel_val) {
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <map>
+#include <string>
+#include <vector>
 #include <math.h>
 #include <cassert>
 #include <cstdio>
@@ -12,6 +14,9 @@
 #include <CL/cl.h>
 #include <CL/cl_gl.h>
 
+#include "Metrics.h"
+#include "Trace.h"
+
 #ifdef __ANDROID_API__
 	#include <GLES/gl.h>
 #else
@@ -22,10 +27,26 @@
 #define METHOD_HALIDE_CPU (1<<2)
 #define METHOD_HALIDE_GPU (1<<3)
 #define METHOD_OPENCL     (1<<4)
+#define METHOD_HALIDE_AUTO (1<<5)	//CPU pipeline scheduled by the Halide autoscheduler
+#define METHOD_CPU        (1<<6)	//optimised CPU implementation, unlike the reference
 
 #define PIXEL_RANGE	255	//8-bit
 #define NUM_CHANNELS 4	//RGBA
 
+#define VERIFY_TOLERANCE		4.f	//max difference per channel against the reference
+#define VERIFY_TOLERANCE_HALF	8.f	//intermediates stored as half floats lose a few bits
+
+#define PARAMETER_FLOAT	0
+#define PARAMETER_INT	1
+
+//what a parameter feeds, and so what changing it reruns
+#define PARAMETER_OUTPUT	0	//only the final pass, a mapping that isn't recomputed is reused
+#define PARAMETER_MAPPING	1	//the mapping, which the next run recomputes
+#define PARAMETER_SETUP		2	//the kernels' layout, it can't change once they're set up
+
+#define REFERENCE_VERSION		1	//bump when a reference implementation changes, cached results are then ignored
+#define REFERENCE_CACHE_BYTES	(64 << 20)	//held in memory by each filter's own cache
+
 #define CHECK_ERROR_OCL(err, op, action)							\
 	if (err != CL_SUCCESS) {										\
 		reportStatus("Error during operation '%s' (%d)", op, err);	\
@@ -33,13 +54,27 @@
 		action;														\
 	}
 
+//pixel formats of Image data, the RGBA ones with NUM_CHANNELS interleaved channels
+#define IMAGE_RGBA8		0	//8-bit unsigned, 0..PIXEL_RANGE
+#define IMAGE_RGBA32F	1	//32-bit float, linear radiance (1.0 == PIXEL_RANGE)
+#define IMAGE_RGBA16F	2	//16-bit half float, linear radiance (1.0 == PIXEL_RANGE)
+#define IMAGE_L32F		3	//one 32-bit float luminance plane, as RGBA32F. Host side only,
+							//reads as grey and opaque through getPixel
+
+#define IMAGE_ALIGNMENT	64	//bytes, of createImage data and of its padded rows
+
 namespace hdr
 {
+class ReferenceCache;
 typedef unsigned char uchar;
 
+//a view of pixels owned elsewhere, usually by whoever called createImage or
+//calloc. Row y starts at data + y*rowBytes(image)
 typedef struct {
 	uchar* data;
 	size_t width, height;
+	int format;		//one of IMAGE_*, zero initialised to IMAGE_RGBA8
+	size_t stride;	//bytes from one row to the next, zero initialised to packed rows
 } Image;
 
 typedef struct {
@@ -53,49 +88,204 @@ public:
 	typedef struct _Params_ {
 		cl_device_type type;
 		cl_uint platformIndex, deviceIndex;
+		cl_device_id device;	//used instead of the indices when set, e.g. a sub-device
 		bool opengl, verify;
+		bool halfPrecision;	//store intermediate planes as half floats
+		//with verify, check one frame in verifyInterval, and only a random
+		//verifyTile x verifyTile tile of it when non-zero and the filter can be
+		//tiled, so that the reference doesn't dominate video
+		unsigned int verifyInterval;
+		unsigned int verifyTile;
 		_Params_() {
 			type = CL_DEVICE_TYPE_ALL;
 			opengl = false;
 			platformIndex = 0;
 			deviceIndex = 0;
+			device = 0;
 			verify = false;
+			halfPrecision = false;
+			verifyInterval = 1;
+			verifyTile = 0;
 		}
 	} Params;
 
+	//a tunable of the filter, see setParameter
+	typedef struct {
+		const char* name;
+		const char* description;
+		int type;		//PARAMETER_FLOAT or PARAMETER_INT
+		void* value;	//the filter's member
+		float min, max;
+		int scope;		//one of PARAMETER_OUTPUT, PARAMETER_MAPPING or PARAMETER_SETUP
+	} Parameter;
+
+	//the last verification, errors are over the colour channels on getPixel's scale
+	typedef struct {
+		size_t pixels;		//compared, 0 if the frame wasn't verified
+		size_t mismatches;	//channels differing by more than the tolerance
+		float maxError, meanError;
+		double psnr;		//dB, infinite for identical images
+	} VerifyReport;
+
 public:
 	Filter();
 	virtual ~Filter();
 
 	virtual void clearReferenceCache();
+	//reference results are looked up in cache, which may be shared by several
+	//filters and persisted to disk, instead of the filter's own. NULL goes back
+	//to the filter's own
+	virtual void setReferenceCache(ReferenceCache* cache);
+	ReferenceCache* getReferenceCache() const;
 	virtual const char* getName() const;
 
+	//a new instance with the same parameters, to run on another device.
+	//NULL if the filter can't be duplicated
+	virtual Filter* clone() const;
+
 	virtual bool setupOpenCL(cl_context_properties context_prop[], const Params& params) = 0;
 	virtual double runCLKernels(bool recomputeMapping) = 0;
 	virtual bool runOpenCL(int input_texid, int output_texid, bool recomputeMapping=true) = 0;
 	virtual bool runOpenCL(Image input, Image output, bool recomputeMapping=true) = 0;
 	virtual bool cleanupOpenCL() = 0;
 	virtual bool runReference(Image input, Image output) = 0;
+	//the generated Halide pipelines (see src/halide), false if the filter has none
+	//or the build doesn't include them
+	virtual bool runHalideCPU(Image input, Image output, const Params& params);
+	virtual bool runHalideGPU(Image input, Image output, const Params& params);
+	virtual bool runHalideAuto(Image input, Image output, const Params& params);
+	//a fast CPU implementation, false if the filter has none
+	virtual bool runCPU(Image input, Image output, const Params& params);
+	//the output, with data NULL if the method couldn't run, e.g. one the filter
+	//has no implementation of
 	virtual Image runFilter(Image input, Params params, unsigned int method);
 	virtual bool kernel1DSizes(const char* kernel_name);
 	virtual bool kernel2DSizes(const char* kernel_name);
 	virtual void setImageSize(int width, int height);
+	virtual void setImageFormat(int format);
 	virtual void setImageTextures(GLuint input_texture, GLuint output_texture);
 
+	virtual Image mapStagingImage();
+	virtual void unmapStagingImage(Image image);
+
+	//run in another filter's context and take its output as input, so that
+	//stages can be chained without reading intermediate images back to the host
+	virtual void setSharedContext(cl_context context, cl_command_queue queue, cl_device_id device);
+	virtual void setInputImage(cl_mem image);
+	virtual void setOutputImage(cl_mem image);
+	virtual bool uploadInput(Image input);
+	virtual bool runOpenCLOnDevice(Image output, bool recomputeMapping=true);
+	virtual int getOutputFormat() const;
+	cl_context getContext() const;
+	cl_command_queue getQueue() const;
+	cl_device_id getDevice() const;
+	cl_mem getOutputImage() const;
+
+	//tiled processing of images too large for one pass (see Tiled). Statistics a
+	//filter would compute over its input are accumulated over the whole image
+	//first and then held fixed, so that every tile is mapped the same way
+	virtual bool supportsTiling() const;
+	virtual int getTileHalo() const;		//pixels of context needed around each tile
+	virtual int getTileAlignment() const;	//tile origins must be a multiple of this
+	virtual void beginStatistics();
+	virtual void accumulateStatistics(Image rows);
+	virtual void endStatistics();
+	virtual void clearStatistics();
+	//takes the fixed statistics of other, a filter of the same kind (see clone),
+	//instead of accumulating them again
+	virtual void copyStatistics(const Filter& other);
+
 	virtual void setStatusCallback(int (*callback)(const char*, va_list args));
+	int (*getStatusCallback() const)(const char*, va_list args);
+
+	//counters and latencies are recorded into metrics under the filter's name
+	//once set, NULL (the default) turns recording off
+	virtual void setMetrics(Metrics* metrics);
+	Metrics* getMetrics() const;
+
+	//host spans and, from OpenCL profiling events, device spans are recorded into
+	//trace once set. Set it before setupOpenCL, which enables queue profiling
+	virtual void setTrace(Trace* trace);
+	Trace* getTrace() const;
+
+	const VerifyReport& getVerifyReport() const;
+
+	//named parameters, settable between frames. All but PARAMETER_SETUP ones are
+	//passed to the kernels as arguments, so changing them doesn't rebuild the
+	//program. False, with a status message, if there's no such parameter or the
+	//value is out of its range
+	bool setParameter(const char* name, float value);
+	bool getParameter(const char* name, float &value) const;
+	const std::vector<Parameter>& getParameters() const;
 
 protected:
 	const char *m_name;
-	Image m_reference;
 	int (*m_statusCallback)(const char*, va_list args);
 	void reportStatus(const char *format, ...) const;
-	virtual bool verify(Image input, Image output, float tolerance=4.f);
+
+	//no-ops without metrics, so the clock isn't even read
+	Metrics* m_metrics;
+	void countMetric(const char* name, uint64_t value=1) const;
+	void recordLatency(const char* stage, double seconds) const;
+	double metricsTime() const;	//seconds, 0 without metrics
+	void recordFrame(double upload, double kernels, double download, size_t uploadBytes, size_t downloadBytes);
+
+	//commands enqueued with traceEvent(name) as their event are added to the
+	//trace by flushTraceEvents once finished, which recordFrame calls
+	Trace* m_trace;
+	typedef struct {
+		const char* name;
+		double queued;
+		cl_event event;
+	} TracedCommand;
+	std::vector<TracedCommand> m_traceEvents;
+	cl_event* traceEvent(const char* name);	//NULL without a trace
+	void flushTraceEvents();
+	//checks output against the reference when params.verifyInterval and
+	//verifyTile select this frame, true for the frames they skip
+	virtual bool verify(Image input, Image output, float tolerance=VERIFY_TOLERANCE);
+	VerifyReport compare(const Image &ref, const Image &output, float tolerance) const;
+	VerifyReport m_verifyReport;
+	unsigned long m_verifyFrames;	//frames seen by verify
+	unsigned int m_verifySeed;		//picks the tiles
+	bool finishHalide(Image input, Image output, const Params& params, double runTime);
+
+	std::vector<Parameter> m_parameters;
+	void addParameter(const char* name, float* value, float min, float max, const char* description, int scope=PARAMETER_OUTPUT);
+	void addParameter(const char* name, int* value, int min, int max, const char* description, int scope=PARAMETER_OUTPUT);
+	//set by a PARAMETER_MAPPING change, runCLKernels then recomputes the
+	//mapping even if not asked to and clears it
+	bool m_mappingChanged;
+	//passes the parameters to kernels that are already set up, called by
+	//setParameter. Overrides set the kernel arguments that hold them
+	virtual bool updateParameters();
+
+	//runReference starts with lookupReference, which keys the input and
+	//hashParameters, and ends with cacheReference under the same key
+	ReferenceCache* m_referenceCache;
+	ReferenceCache* m_ownReferenceCache;
+	uint64_t m_referenceKey;
+	bool lookupReference(const Image &input, Image output);
+	void cacheReference(const Image &output);
+	//mixes everything but the input that the reference output depends on into
+	//hash: overrides add their parameters and, with fixed statistics, those
+	virtual uint64_t hashParameters(uint64_t hash) const;
+
+	Params m_params;	//parameters the OpenCL context was initialised with
+	bool m_fixedStatistics;	//set by endStatistics, use them instead of computing per image
 
 	cl_device_id m_device;
 	cl_context m_clContext;
 	cl_command_queue m_queue;
 	cl_program m_program;
 	cl_mem mem_images[2];
+	cl_mem m_staging;	//pinned host buffer handed out by mapStagingImage
+
+	cl_context m_sharedContext;	//set by setSharedContext, used instead of creating one
+	cl_command_queue m_sharedQueue;
+	cl_device_id m_sharedDevice;
+	cl_mem m_inputImage;		//set by setInputImage, used instead of creating mem_images[0]
+	cl_mem m_outputImage;		//set by setOutputImage, used instead of creating mem_images[1]
 
 	size_t max_cu;	//max compute units
 
@@ -106,20 +296,54 @@ protected:
 	std::map<std::string, size_t*> local_sizes;
 	std::map<std::string, size_t*> global_sizes;
 
+	//intermediate buffers planned with planBuffer, sub-allocated from m_pool
+	typedef struct {
+		std::string name;
+		size_t size, offset;
+		int first, last;
+	} PlannedBuffer;
+	std::vector<PlannedBuffer> m_plan;
+	cl_mem m_pool;
+	static bool largerBuffer(const PlannedBuffer* a, const PlannedBuffer* b);
 
 
 	int image_width;
 	int image_height;
+	int image_format;	//IMAGE_* format of the input image
 	GLuint in_tex;
 	GLuint out_tex;
 
 	bool initCL(cl_context_properties context_prop[], const Params& params, const char *source, const char *options);
+	bool createContext(cl_context_properties context_prop[], const Params& params);
+	bool createImageMemory(const Params& params);
+	void planBuffer(const char* name, size_t size, int first, int last);
+	bool allocateBuffers();
 	void releaseCL();
 };
 
 // Timing utils
 double getCurrentTime();
 
+inline void Filter::countMetric(const char* name, uint64_t value) const {
+	if (m_metrics) m_metrics->count(m_name, name, value);
+}
+
+inline void Filter::recordLatency(const char* stage, double seconds) const {
+	if (m_metrics) m_metrics->recordLatency(m_name, stage, seconds);
+}
+
+inline double Filter::metricsTime() const {
+	return m_metrics ? getCurrentTime()/1e6 : 0;
+}
+
+//the pointer is only valid until the next call, which is long enough to enqueue
+inline cl_event* Filter::traceEvent(const char* name) {
+	if (!m_trace) return NULL;
+	TracedCommand command = {name, Trace::now(), 0};
+	m_traceEvents.push_back(command);
+	return &m_traceEvents.back().event;
+}
+
 // Image utils
 float* channel_mipmap(float* input, int width, int height, int level=1);
 Image image_mipmap(Image &input, int level=1);
@@ -132,7 +356,66 @@ float getValue(float* data, int x, int y, int width, int height);
 float getPixel(Image &image, int x, int y, int c);
 void setPixel(Image &image, int x, int y, int c, float value);
 
-void toFloat(Image &input);
+size_t bytesPerPixel(int format);
+size_t channelsPerPixel(int format);
+size_t rowBytes(const Image &image);	//the stride, or the width of packed rows
+
+//zeroed and IMAGE_ALIGNMENT aligned, released with releaseImage or free. Rows are
+//packed unless padRows, which rounds the stride up to IMAGE_ALIGNMENT so every
+//row starts aligned
+Image createImage(size_t width, size_t height, int format=IMAGE_RGBA8, bool padRows=false);
+void releaseImage(Image &image);
+//a view of a rectangle of image, sharing its pixels
+Image subImage(const Image &image, size_t x, size_t y, size_t width, size_t height);
+//copies the pixels of the smaller of the two extents, converting formats
+void copyImage(const Image &src, Image &dst);
+
+//64-bit FNV-1a, a word at a time, continuing from hash
+#define HASH_SEED	0xcbf29ce484222325ull
+uint64_t hashBytes(const void* data, size_t size, uint64_t hash=HASH_SEED);
+uint64_t hashImage(const Image &image, uint64_t hash=HASH_SEED);	//extent, format and pixels, not padding
+
+//Row access, for loops that would otherwise call getPixel and setPixel per
+//channel. Floats are on getPixel's scale, 0..PIXEL_RANGE for every format
+inline uchar* imageRow(const Image &image, size_t y) {
+	return image.data + y*rowBytes(image);
+}
+void readRow(const Image &image, size_t y, float* rgba);	//width RGBA pixels, alpha PIXEL_RANGE for IMAGE_L32F
+void writeRow(Image &image, size_t y, const float* rgba);	//IMAGE_L32F stores the luminance
+//n values, narrowing saturates and truncates as setPixel does
+void ucharToFloat(const uchar* in, float* out, size_t n);
+void floatToUchar(const float* in, uchar* out, size_t n);
+
+//owns the pixels of an image from createImage, for scopes with several ways out
+class ImageBuffer {
+public:
+	ImageBuffer(size_t width, size_t height, int format=IMAGE_RGBA8, bool padRows=false) {
+		m_image = createImage(width, height, format, padRows);
+	}
+	~ImageBuffer() {
+		releaseImage(m_image);
+	}
+	Image& image() {
+		return m_image;
+	}
+	//hands the pixels over to the caller, who then frees them
+	Image release() {
+		Image image = m_image;
+		m_image.data = NULL;
+		return image;
+	}
+
+protected:
+	Image m_image;
+
+private:
+	ImageBuffer(const ImageBuffer&);
+	ImageBuffer& operator=(const ImageBuffer&);
+};
+
+void toFloat(Image &input);	//replaces data with an RGBA32F copy, which the caller frees
+float halfToFloat(uint16_t h);
+uint16_t floatToHalf(float f);
 
 float3 RGBtoHSV(float3 rgb);
 float3 HSVtoRGB(float3 hsv);
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <vector>
+
+#define CACHE_LINE 64	//bytes, the producer's and consumer's indices are kept on separate lines
+
+namespace hdr
+{
+//Fixed ring of slots between exactly one producer thread and one consumer
+//thread, without locks. Slots are filled and read in place, so their buffers
+//are allocated once and reused. The producer owns m_head and the consumer
+//m_tail, each only reads the other's, with acquire and release ordering so a
+//slot's contents are visible before it's counted. Nothing here blocks: a full
+//ring gives the producer no slot, an empty one the consumer nothing, and the
+//caller decides whether to wait or drop.
+template <typename T>
+class FrameRing {
+public:
+	FrameRing(size_t capacity) : m_slots(capacity > 0 ? capacity : 1) {
+		m_head = 0;
+		m_tail = 0;
+	}
+
+	//producer: the slot to fill next, NULL if every slot is waiting to be read
+	T* beginWrite() {
+		const size_t tail = __atomic_load_n(&m_tail, __ATOMIC_ACQUIRE);
+		if (m_head - tail >= m_slots.size()) return NULL;
+		return &m_slots[m_head % m_slots.size()];
+	}
+
+	//producer: hands the slot from beginWrite to the consumer
+	void commitWrite() {
+		__atomic_store_n(&m_head, m_head + 1, __ATOMIC_RELEASE);
+	}
+
+	//consumer: the oldest filled slot, NULL if there is none
+	T* beginRead() {
+		const size_t head = __atomic_load_n(&m_head, __ATOMIC_ACQUIRE);
+		if (m_tail == head) return NULL;
+		return &m_slots[m_tail % m_slots.size()];
+	}
+
+	//consumer: gives the slot from beginRead back to the producer
+	void commitRead() {
+		__atomic_store_n(&m_tail, m_tail + 1, __ATOMIC_RELEASE);
+	}
+
+	//consumer: drops every filled slot but the newest, returns how many
+	size_t skipToLatest() {
+		const size_t head = __atomic_load_n(&m_head, __ATOMIC_ACQUIRE);
+		if (head - m_tail <= 1) return 0;
+		const size_t skipped = head - 1 - m_tail;
+		__atomic_store_n(&m_tail, head - 1, __ATOMIC_RELEASE);
+		return skipped;
+	}
+
+	size_t capacity() const {
+		return m_slots.size();
+	}
+
+	//every slot, e.g. to release their buffers once both threads are done
+	T& slot(size_t i) {
+		return m_slots[i];
+	}
+
+protected:
+	std::vector<T> m_slots;
+	size_t m_head;		//slots written, only the producer changes it
+	char m_padding[CACHE_LINE];
+	size_t m_tail;		//slots read, only the consumer changes it
+};
+}
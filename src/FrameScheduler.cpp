@@ -0,0 +1,207 @@
+#include <unistd.h>
+#include <pthread.h>
+#include <algorithm>
+
+#include "FrameScheduler.h"
+
+#define FRAME_POLL_US 200	//how long a stage with nothing to do sleeps before looking again
+
+using namespace hdr;
+
+FrameScheduler::FrameScheduler(size_t depth) : m_captured(depth), m_processed(depth) {
+	m_scratch = Frame();
+	m_dropLate = true;
+	m_metrics = NULL;
+	m_stopped = false;
+	m_captureDone = false;
+	m_processDone = false;
+	m_presentDone = false;
+	m_running = false;
+	m_numCaptured = 0;
+	m_numPresented = 0;
+	m_numFailed = 0;
+	m_droppedCapture = 0;
+	m_droppedProcess = 0;
+	m_droppedPresent = 0;
+	m_latencySum = 0;
+	m_latencyMax = 0;
+}
+
+FrameScheduler::~FrameScheduler() {
+	for (size_t i = 0; i < m_captured.capacity(); i++) releaseImage(m_captured.slot(i).image);
+	for (size_t i = 0; i < m_processed.capacity(); i++) releaseImage(m_processed.slot(i).image);
+	releaseImage(m_scratch.image);
+}
+
+void FrameScheduler::setDropLateFrames(bool drop) {
+	m_dropLate = drop;
+}
+
+void FrameScheduler::setMetrics(Metrics* metrics) {
+	m_metrics = metrics;
+}
+
+size_t FrameScheduler::getCaptured() const {
+	return m_numCaptured;
+}
+
+size_t FrameScheduler::getDropped() const {
+	return m_droppedCapture + m_droppedProcess + m_droppedPresent;
+}
+
+size_t FrameScheduler::getPresented() const {
+	return m_numPresented;
+}
+
+size_t FrameScheduler::getFailed() const {
+	return m_numFailed;
+}
+
+double FrameScheduler::getMeanLatency() const {
+	return m_numPresented ? m_latencySum/m_numPresented : 0;
+}
+
+double FrameScheduler::getMaxLatency() const {
+	return m_latencyMax;
+}
+
+void FrameScheduler::stop() {
+	__atomic_store_n(&m_stopped, true, __ATOMIC_RELEASE);
+}
+
+void FrameScheduler::run() {
+	start();
+	pthread_t capturer;
+	pthread_create(&capturer, NULL, captureThread, this);
+	presentLoop();
+	pthread_join(capturer, NULL);
+	finish();
+}
+
+void FrameScheduler::start() {
+	finish();
+	m_captureDone = false;
+	m_processDone = false;
+	m_presentDone = false;
+	m_running = true;
+	pthread_create(&m_processor, NULL, processThread, this);
+}
+
+void FrameScheduler::finish() {
+	if (!m_running) return;
+	//process may be waiting for room that present won't make any more
+	__atomic_store_n(&m_captureDone, true, __ATOMIC_RELEASE);
+	__atomic_store_n(&m_presentDone, true, __ATOMIC_RELEASE);
+	pthread_join(m_processor, NULL);
+	m_running = false;
+}
+
+void FrameScheduler::drop(size_t frames) {
+	if (m_metrics && frames) m_metrics->count("scheduler", "frames_dropped", frames);
+}
+
+bool FrameScheduler::captureFrame() {
+	Frame* frame = m_captured.beginWrite();
+	while (!frame && !m_dropLate) {
+		if (__atomic_load_n(&m_stopped, __ATOMIC_ACQUIRE)) return false;
+		usleep(FRAME_POLL_US);
+		frame = m_captured.beginWrite();
+	}
+	//a late frame is still taken from the source, or it would queue up there instead
+	if (!frame) frame = &m_scratch;
+
+	frame->seq = m_numCaptured;
+	if (!capture(*frame)) return false;
+	frame->captured = getCurrentTime();
+	m_numCaptured++;
+	if (m_metrics) m_metrics->count("scheduler", "frames_captured");
+
+	if (frame == &m_scratch) {
+		m_droppedCapture++;
+		drop(1);
+	}
+	else m_captured.commitWrite();
+	return true;
+}
+
+void FrameScheduler::captureLoop() {
+	while (!__atomic_load_n(&m_stopped, __ATOMIC_ACQUIRE) && captureFrame());
+	__atomic_store_n(&m_captureDone, true, __ATOMIC_RELEASE);
+}
+
+void FrameScheduler::processLoop() {
+	while (true) {
+		//only take a frame once there's room for its result, the newest
+		//frame is the one to process by the time there is
+		Frame* output = m_processed.beginWrite();
+		if (!output) {
+			if (__atomic_load_n(&m_presentDone, __ATOMIC_ACQUIRE)) break;
+			usleep(FRAME_POLL_US);
+			continue;
+		}
+
+		//read before looking at the ring, so a frame committed before capture
+		//finished can't be missed
+		const bool done = __atomic_load_n(&m_captureDone, __ATOMIC_ACQUIRE);
+		if (m_dropLate) {
+			const size_t skipped = m_captured.skipToLatest();
+			m_droppedProcess += skipped;
+			drop(skipped);
+		}
+		Frame* input = m_captured.beginRead();
+		if (!input) {
+			if (done) break;
+			usleep(FRAME_POLL_US);
+			continue;
+		}
+
+		output->seq = input->seq;
+		output->captured = input->captured;
+		output->passed = process(*input, *output);
+		m_captured.commitRead();
+		m_processed.commitWrite();
+	}
+	__atomic_store_n(&m_processDone, true, __ATOMIC_RELEASE);
+}
+
+bool FrameScheduler::presentFrame() {
+	if (m_dropLate) {
+		const size_t skipped = m_processed.skipToLatest();
+		m_droppedPresent += skipped;
+		drop(skipped);
+	}
+	Frame* frame = m_processed.beginRead();
+	if (!frame) return false;
+
+	present(*frame);
+	const double latency = (getCurrentTime() - frame->captured)/1e6;
+	m_latencySum += latency;
+	m_latencyMax = std::max(m_latencyMax, latency);
+	m_numPresented++;
+	if (!frame->passed) m_numFailed++;
+	if (m_metrics) {
+		m_metrics->count("scheduler", "frames_presented");
+		m_metrics->recordLatency("scheduler", "frame", latency);
+	}
+	m_processed.commitRead();
+	return true;
+}
+
+void FrameScheduler::presentLoop() {
+	while (true) {
+		const bool done = __atomic_load_n(&m_processDone, __ATOMIC_ACQUIRE);
+		if (presentFrame()) continue;
+		if (done) break;
+		usleep(FRAME_POLL_US);
+	}
+}
+
+void* FrameScheduler::captureThread(void* scheduler) {
+	((FrameScheduler*) scheduler)->captureLoop();
+	return NULL;
+}
+
+void* FrameScheduler::processThread(void* scheduler) {
+	((FrameScheduler*) scheduler)->processLoop();
+	return NULL;
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <pthread.h>
+
+#include "Filter.h"
+#include "FrameRing.h"
+
+namespace hdr
+{
+//Runs a stream of frames, e.g. from a camera, through capture, process and
+//present stages. Capture and process each have a thread, present runs on the
+//thread that calls run, which can be the one with the display's GL context.
+//Stages hand frames over through FrameRings of preallocated slots, so no stage
+//waits on a lock another holds for a whole frame. With late frames dropped, the
+//default, a full ring makes capture drop the new frame and process and present
+//take only the newest frame waiting for them, so latency is bounded by the
+//ring depths however slow a stage gets. Otherwise every frame is kept and
+//stages wait for room, as a batch of files wants.
+//A thread that can't give run its loop, like Android's GL renderer calling back
+//once a frame, drives capture and present itself between start and finish,
+//with only process on a thread of the scheduler's.
+class FrameScheduler {
+public:
+	typedef struct {
+		Image image;		//owned by the slot, stages may replace it, releasing the old one
+		size_t seq;			//in capture order
+		double captured;	//getCurrentTime when capture finished
+		bool passed;		//whether process succeeded
+		cl_mem memory;		//for frames kept on the device, owned by the subclass that sets it
+	} Frame;
+
+	//depth slots between capture and process and as many between process and present
+	FrameScheduler(size_t depth=2);
+	virtual ~FrameScheduler();
+
+	void setDropLateFrames(bool drop);
+	//counts frames and records capture to present latency under "scheduler"
+	void setMetrics(Metrics* metrics);
+
+	//until capture returns false or stop is called, and every frame captured
+	//by then has been presented or dropped
+	void run();
+	//from any thread, capture ends before its next frame
+	void stop();
+
+	//run's stages driven by the caller: start starts the process thread, then
+	//one thread calls captureFrame and one presentFrame, neither waiting for
+	//process. captureFrame is false at the end of the stream, presentFrame if
+	//nothing had been processed since it was last called. finish joins the
+	//process thread, frames not presented by then are dropped. It has to be
+	//called before a subclass is destroyed, process is that subclass's
+	void start();
+	bool captureFrame();
+	bool presentFrame();
+	void finish();
+
+	size_t getCaptured() const;
+	size_t getDropped() const;
+	size_t getPresented() const;
+	size_t getFailed() const;		//presented frames that process failed
+	//capture to present, in seconds
+	double getMeanLatency() const;
+	double getMaxLatency() const;
+
+protected:
+	//capture thread, or captureFrame's caller: fills frame.image and returns
+	//true, or false at the end of the stream
+	virtual bool capture(Frame& frame) = 0;
+	//process thread: input.image to output.image
+	virtual bool process(Frame& input, Frame& output) = 0;
+	//the thread that called run, or presentFrame
+	virtual void present(Frame& frame) = 0;
+
+	FrameRing<Frame> m_captured;
+	FrameRing<Frame> m_processed;
+	Frame m_scratch;	//where capture puts the frames it drops
+	bool m_dropLate;
+	Metrics* m_metrics;
+
+	//set by one thread, polled by the others
+	bool m_stopped;
+	bool m_captureDone;
+	bool m_processDone;
+	bool m_presentDone;
+	bool m_running;		//between start and finish
+	pthread_t m_processor;
+
+	size_t m_numCaptured, m_numPresented, m_numFailed;
+	size_t m_droppedCapture, m_droppedProcess, m_droppedPresent;	//each changed by its own stage only
+	double m_latencySum, m_latencyMax;
+
+	void captureLoop();
+	void processLoop();
+	void presentLoop();
+	void drop(size_t frames);
+	static void* captureThread(void* scheduler);
+	static void* processThread(void* scheduler);
+};
+}
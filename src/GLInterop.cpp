@@ -0,0 +1,248 @@
+#include <string.h>
+#include <stdlib.h>
+#include <iostream>
+#include <string>
+#include <algorithm>
+
+#include "GLInterop.h"
+#include "MultiDevice.h"
+
+using namespace hdr;
+
+GLInterop::GLInterop() {
+	m_display = EGL_NO_DISPLAY;
+	m_context = EGL_NO_CONTEXT;
+	m_surface = EGL_NO_SURFACE;
+	m_textures[0] = m_textures[1] = 0;
+	m_width = 0;
+	m_height = 0;
+	m_textureTime = 0;
+	m_hostTime = 0;
+	m_maxDifference = 0;
+}
+
+GLInterop::~GLInterop() {
+	release();
+}
+
+bool GLInterop::init(size_t width, size_t height) {
+	release();
+
+	//without an X server, Mesa's surfaceless platform still has pbuffers
+	m_display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	if (m_display == EGL_NO_DISPLAY || !eglInitialize(m_display, NULL, NULL)) {
+		PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+		m_display = getPlatformDisplay ? getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL) : EGL_NO_DISPLAY;
+	}
+	if (m_display == EGL_NO_DISPLAY || !eglInitialize(m_display, NULL, NULL)) {
+		std::cerr << "No EGL display (error " << eglGetError() << ")" << std::endl;
+		m_display = EGL_NO_DISPLAY;
+		return false;
+	}
+
+	const EGLint config_attributes[] = {
+		EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+		EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_ALPHA_SIZE, 8,
+		EGL_NONE
+	};
+	EGLConfig config;
+	EGLint configs = 0;
+	if (!eglChooseConfig(m_display, config_attributes, &config, 1, &configs) || configs < 1) {
+		std::cerr << "No EGL pbuffer config for desktop OpenGL" << std::endl;
+		release();
+		return false;
+	}
+
+	//nothing is drawn to the surface, the images are in the textures
+	const EGLint pbuffer_attributes[] = {EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE};
+	m_surface = eglCreatePbufferSurface(m_display, config, pbuffer_attributes);
+	eglBindAPI(EGL_OPENGL_API);
+	m_context = eglCreateContext(m_display, config, EGL_NO_CONTEXT, NULL);
+	if (m_surface == EGL_NO_SURFACE || m_context == EGL_NO_CONTEXT || !eglMakeCurrent(m_display, m_surface, m_surface, m_context)) {
+		std::cerr << "Creating the EGL pbuffer context failed (error " << eglGetError() << ")" << std::endl;
+		release();
+		return false;
+	}
+
+	//integer textures, which the kernels read with read_imageui like host images
+	glGenTextures(2, m_textures);
+	for (int i = 0; i < 2; i++) {
+		glBindTexture(GL_TEXTURE_2D, m_textures[i]);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8UI, width, height, 0, GL_RGBA_INTEGER, GL_UNSIGNED_BYTE, NULL);
+	}
+	if (glGetError() != GL_NO_ERROR) {
+		std::cerr << "Creating RGBA8UI textures failed" << std::endl;
+		release();
+		return false;
+	}
+	m_width = width;
+	m_height = height;
+
+	m_properties[0] = CL_GL_CONTEXT_KHR;
+	m_properties[1] = (cl_context_properties) m_context;
+	m_properties[2] = CL_EGL_DISPLAY_KHR;
+	m_properties[3] = (cl_context_properties) m_display;
+	m_properties[4] = CL_CONTEXT_PLATFORM;
+	m_properties[5] = 0;
+	m_properties[6] = 0;
+	return true;
+}
+
+void GLInterop::release() {
+	if (m_display == EGL_NO_DISPLAY) return;
+
+	if (m_context != EGL_NO_CONTEXT) {
+		if (m_textures[0]) glDeleteTextures(2, m_textures);
+		eglMakeCurrent(m_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+		eglDestroyContext(m_display, m_context);
+	}
+	if (m_surface != EGL_NO_SURFACE) eglDestroySurface(m_display, m_surface);
+	eglTerminate(m_display);
+
+	m_display = EGL_NO_DISPLAY;
+	m_context = EGL_NO_CONTEXT;
+	m_surface = EGL_NO_SURFACE;
+	m_textures[0] = m_textures[1] = 0;
+	m_width = 0;
+	m_height = 0;
+}
+
+bool GLInterop::sharingSupported(const Filter::Params& params) {
+	cl_device_id device = params.device ? params.device : MultiDevice::getDevice(params.platformIndex, params.deviceIndex, params.type);
+	if (!device) return false;
+
+	size_t size = 0;
+	if (clGetDeviceInfo(device, CL_DEVICE_EXTENSIONS, 0, NULL, &size) != CL_SUCCESS) return false;
+	std::string extensions(size, '\0');
+	clGetDeviceInfo(device, CL_DEVICE_EXTENSIONS, size, &extensions[0], NULL);
+	return extensions.find("cl_khr_gl_sharing") != std::string::npos;
+}
+
+cl_context_properties* GLInterop::getContextProperties() {
+	return m_properties;
+}
+
+GLuint GLInterop::getInputTexture() const {
+	return m_textures[0];
+}
+
+GLuint GLInterop::getOutputTexture() const {
+	return m_textures[1];
+}
+
+void GLInterop::writeTexture(GLuint texture, Image image) {
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, rowBytes(image)/bytesPerPixel(image.format));
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, image.width, image.height, GL_RGBA_INTEGER, GL_UNSIGNED_BYTE, image.data);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+}
+
+void GLInterop::readTexture(GLuint texture, Image image) {
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glPixelStorei(GL_PACK_ROW_LENGTH, rowBytes(image)/bytesPerPixel(image.format));
+	glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA_INTEGER, GL_UNSIGNED_BYTE, image.data);
+	glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+}
+
+double GLInterop::getTextureTime() const {
+	return m_textureTime;
+}
+
+double GLInterop::getHostTime() const {
+	return m_hostTime;
+}
+
+int GLInterop::getMaxDifference() const {
+	return m_maxDifference;
+}
+
+bool GLInterop::benchmark(Filter* filter, Image input, Filter::Params params, int frames) {
+	m_textureTime = 0;
+	m_hostTime = 0;
+	m_maxDifference = 0;
+	frames = std::max(frames, 1);
+
+	//the textures hold 8 bit integers, like the camera frames on Android
+	ImageBuffer rgba(input.width, input.height);
+	if (!rgba.image().data) return false;
+	copyImage(input, rgba.image());
+
+	if (m_context == EGL_NO_CONTEXT || m_width != input.width || m_height != input.height) {
+		if (!init(input.width, input.height)) return false;
+	}
+
+	//the paths are checked against each other, not the reference every frame
+	params.verify = false;
+	ImageBuffer hostOutput(input.width, input.height);
+	ImageBuffer textureOutput(input.width, input.height);
+	if (!hostOutput.image().data || !textureOutput.image().data) return false;
+
+	writeTexture(m_textures[0], rgba.image());
+	if (!runHost(filter, rgba.image(), hostOutput.image(), params, frames)) return false;
+
+	if (!sharingSupported(params)) {
+		std::cerr << "The device doesn't have cl_khr_gl_sharing, only the host copy path was run" << std::endl;
+		return true;
+	}
+	bool passed = runTextures(filter, rgba.image(), textureOutput.image(), params, frames);
+
+	for (size_t y = 0; y < input.height; y++) {
+		const uchar* a = imageRow(hostOutput.image(), y);
+		const uchar* b = imageRow(textureOutput.image(), y);
+		for (size_t i = 0; i < input.width*NUM_CHANNELS; i++) m_maxDifference = std::max(m_maxDifference, abs(a[i] - b[i]));
+	}
+	return passed && m_maxDifference <= VERIFY_TOLERANCE;
+}
+
+//what an app without sharing does every frame: read the input texture back,
+//run on host images and upload the result
+bool GLInterop::runHost(Filter* filter, Image input, Image output, Filter::Params params, int frames) {
+	params.opengl = false;
+	filter->setImageSize(input.width, input.height);
+	filter->setImageFormat(IMAGE_RGBA8);
+	if (!filter->setupOpenCL(NULL, params)) return false;
+
+	ImageBuffer frame(input.width, input.height);
+	bool passed = true;
+	double start = 0;
+	for (int f = 0; f <= frames; f++) {
+		if (f == 1) start = getCurrentTime();	//the first frame warms up
+		readTexture(m_textures[0], frame.image());
+		passed = filter->runOpenCL(frame.image(), output) && passed;
+		writeTexture(m_textures[1], output);
+		glFinish();
+	}
+	m_hostTime = (getCurrentTime() - start)/1e6/frames;
+
+	filter->cleanupOpenCL();
+	return passed;
+}
+
+//the kernels read and write the textures themselves, as processFrame does on Android
+bool GLInterop::runTextures(Filter* filter, Image input, Image output, Filter::Params params, int frames) {
+	params.opengl = true;
+	filter->setImageSize(input.width, input.height);
+	filter->setImageFormat(IMAGE_RGBA8);
+	filter->setImageTextures(m_textures[0], m_textures[1]);
+	glFinish();
+	if (!filter->setupOpenCL(m_properties, params)) return false;
+
+	bool passed = true;
+	double start = 0;
+	for (int f = 0; f <= frames; f++) {
+		if (f == 1) start = getCurrentTime();
+		glFinish();		//GL is done with the textures before OpenCL acquires them
+		passed = filter->runOpenCL(m_textures[0], m_textures[1]) && passed;
+		clFinish(filter->getQueue());	//and the release is done before GL uses them again
+	}
+	m_textureTime = (getCurrentTime() - start)/1e6/frames;
+
+	readTexture(m_textures[1], output);
+	filter->cleanupOpenCL();
+	return passed;
+}
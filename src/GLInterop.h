@@ -0,0 +1,63 @@
+#pragma once
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#include "Filter.h"
+
+namespace hdr
+{
+//Runs a filter on GL textures shared with OpenCL, as the Android app does with
+//runOpenCL(input_texid, output_texid), but without a window: an EGL pbuffer
+//context, which Mesa's llvmpipe can provide, owns an input and an output
+//texture. benchmark times that zero copy path against what an app without
+//cl_khr_gl_sharing has to do, reading the input texture back to the host,
+//running the filter on host images and uploading the result to the output
+//texture, and compares the two outputs.
+class GLInterop {
+public:
+	GLInterop();
+	~GLInterop();
+
+	//creates the context and width x height RGBA8UI textures, and makes the
+	//context current on this thread
+	bool init(size_t width, size_t height);
+	void release();
+
+	//whether the device params select has cl_khr_gl_sharing
+	static bool sharingSupported(const Filter::Params& params);
+	//for Filter::setupOpenCL with params.opengl, the platform is filled in there
+	cl_context_properties* getContextProperties();
+
+	GLuint getInputTexture() const;
+	GLuint getOutputTexture() const;
+	//an RGBA8 image the size of the textures
+	void writeTexture(GLuint texture, Image image);
+	void readTexture(GLuint texture, Image image);
+
+	//runs frames frames each way on input, which is converted to RGBA8 if need
+	//be. The texture path is skipped if the device can't share textures. False if
+	//either path failed or their outputs differ
+	bool benchmark(Filter* filter, Image input, Filter::Params params, int frames);
+
+	//per frame, in seconds, from the last benchmark. 0 if the path wasn't run
+	double getTextureTime() const;
+	double getHostTime() const;
+	int getMaxDifference() const;	//per channel, between the two paths' outputs
+
+protected:
+	EGLDisplay m_display;
+	EGLContext m_context;
+	EGLSurface m_surface;
+	GLuint m_textures[2];	//input, output
+	size_t m_width, m_height;
+	cl_context_properties m_properties[7];
+
+	double m_textureTime;
+	double m_hostTime;
+	int m_maxDifference;
+
+	bool runHost(Filter* filter, Image input, Image output, Filter::Params params, int frames);
+	bool runTextures(Filter* filter, Image input, Image output, Filter::Params params, int frames);
+};
+}
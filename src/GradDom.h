@@ -6,6 +6,8 @@ class GradDom : public Filter {
 public:
 	GradDom(float _adjust_alpha=0.1f, float _beta=0.85f, float _sat=0.5f);
 
+	virtual Filter* clone() const;
+
 	virtual bool setupOpenCL(cl_context_properties context_prop[], const Params& params);
 	virtual double runCLKernels(bool recomputeMapping);
 	virtual bool runOpenCL(int input_texid, int output_texid, bool recomputeMapping);
@@ -29,5 +31,7 @@ protected:
 	int* m_offset;		//at index i this contains the start point to store the mipmap at level i
 	float* m_divider;		//at index i this contains the value the pixels of gradient magnitude are going to be divided by	
 
+	virtual uint64_t hashParameters(uint64_t hash) const;
+	virtual bool updateParameters();
 };
 }
\ No newline at end of file
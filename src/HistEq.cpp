@@ -6,22 +6,98 @@
 #include "HistEq.h"
 #include "opencl/histEq.h"
 #if ENABLE_HALIDE
-#include "halide/blur_cpu.h"
-#include "halide/blur_gpu.h"
+#include "halide/histEq_cpu.h"
+#include "halide/histEq_gpu.h"
+#include "halide/histEq_auto.h"
+#include "halide/buffer.h"
 #endif
 
+#define FIXED_CDF_TOTAL (1 << 23)	//small enough that (HIST_SIZE-1)*cdf fits in a uint
+
 using namespace hdr;
 
-HistEq::HistEq() : Filter() {
-	m_name = "HistEq";
+//(1 << 16)/v for every brightness v, the fixed point mapping multiplies by these
+//instead of dividing, see hist_gain in histEq.cl
+static struct Reciprocals {
+	unsigned int lut[PIXEL_RANGE+1];
+	Reciprocals() {
+		for (int v = 0; v <= PIXEL_RANGE; v++) lut[v] = (1 << 16)/std::max(v, 1);
+	}
+} reciprocals;
+
+HistEq::HistEq(int _tiles, float _clipLimit) : Filter() {
+	m_name = _tiles ? "HistEq (CLAHE)" : "HistEq";
+	tiles = _tiles;
+	clipLimit = _clipLimit;
+	rolling_subsample = 0;
+	rolling_weight = 0.1f;
+	rolling_threshold = 0.02f;
+	rolling_frames = 0;
+	addParameter("tiles", &tiles, 0, 64, "CLAHE tiles across and down, 0 equalises the whole image at once", PARAMETER_SETUP);
+	addParameter("clip", &clipLimit, 0.f, PIXEL_RANGE+1, "CLAHE clip limit as a multiple of the mean bin count, 0 for none", PARAMETER_MAPPING);
+	addParameter("weight", &rolling_weight, 0.f, 1.f, "share of each frame in the rolling histogram", PARAMETER_MAPPING);
+	addParameter("threshold", &rolling_threshold, 0.f, 1.f, "drift of the rolling histogram that changes the mapping", PARAMETER_MAPPING);
+}
+
+Filter* HistEq::clone() const {
+	HistEq* filter = new HistEq(tiles, clipLimit);
+	filter->setRolling(rolling_subsample, rolling_weight, rolling_threshold);
+	return filter;
+}
+
+void HistEq::setRolling(int subsample, float weight, float threshold) {
+	rolling_subsample = subsample;
+	rolling_weight = weight;
+	rolling_threshold = threshold;
+}
+
+//tiles are rounded up to whole pixels, so for small images there may be fewer of them
+void HistEq::tileLayout(int width, int height) {
+	if (!tiles) {
+		tiles_x = tiles_y = 1;
+		tile_width = width;
+		tile_height = height;
+		clip_count = 0;
+		return;
+	}
+
+	tile_width = (width + tiles-1)/tiles;
+	tile_height = (height + tiles-1)/tiles;
+	tiles_x = (width + tile_width-1)/tile_width;
+	tiles_y = (height + tile_height-1)/tile_height;
+	clip_count = clipCount();
+}
+
+unsigned int HistEq::clipCount() const {
+	if (!tiles || clipLimit <= 0.f) return 0;
+	return std::max((unsigned int) (clipLimit*tile_width*tile_height/(PIXEL_RANGE+1)), 1u);
 }
 
 bool HistEq::setupOpenCL(cl_context_properties context_prop[], const Params& params) {
+	TraceScope trace(m_trace, "setupOpenCL", m_name);
 	char flags[1024];
 	int hist_size = PIXEL_RANGE+1;
 
-	sprintf(flags, "-cl-fast-relaxed-math -D PIXEL_RANGE=%d -D HIST_SIZE=%d -D NUM_CHANNELS=%d -D width=%d -D height=%d -Dimage_size=%d",
-			PIXEL_RANGE, hist_size, NUM_CHANNELS, image_width, image_height, image_width*image_height);
+	tileLayout(image_width, image_height);
+	const int num_tiles = tiles_x*tiles_y;
+	if (tiles) {
+		reportStatus("CLAHE: %dx%d tiles of %dx%d pixels, clip limit %u", tiles_x, tiles_y, tile_width, tile_height, clip_count);
+	}
+
+	//pixels are sampled on a square grid, so 1/4 is every other pixel of every other row
+	const bool rolling = rolling_subsample > 0 && !tiles;
+	const int sample_step = rolling ? std::max((int) (sqrt((float) rolling_subsample) + 0.5f), 1) : 1;
+	if (rolling) {
+		reportStatus("Rolling histogram of 1/%d of the pixels, weight %f, threshold %f", sample_step*sample_step, rolling_weight, rolling_threshold);
+	}
+	else if (rolling_subsample > 0) {
+		reportStatus("Rolling histograms are only kept for the whole image, not tiles");
+	}
+	rolling_frames = 0;
+
+	sprintf(flags, "-cl-fast-relaxed-math -D PIXEL_RANGE=%d -D HIST_SIZE=%d -D NUM_CHANNELS=%d -D width=%d -D height=%d -Dimage_size=%d -D TILES_X=%d -D TILES_Y=%d -D TILE_WIDTH=%d -D TILE_HEIGHT=%d -D SAMPLE_STEP=%d -D FIXED_CDF_TOTAL=%d",
+			PIXEL_RANGE, hist_size, NUM_CHANNELS, image_width, image_height, image_width*image_height,
+			tiles_x, tiles_y, tile_width, tile_height, sample_step, FIXED_CDF_TOTAL);
 
 	if (!initCL(context_prop, params, histEq_kernel, flags)) {
 		return false;
@@ -46,8 +122,21 @@ bool HistEq::setupOpenCL(cl_context_properties context_prop[], const Params& par
 	kernels["hist_cdf"] = clCreateKernel(m_program, "hist_cdf", &err);
 	CHECK_ERROR_OCL(err, "creating hist_cdf kernel", return false);
 
-	//perfrom histogram equalisation to the original image
-	kernels["hist_eq"] = clCreateKernel(m_program, "histogram_equalisation", &err);
+	if (rolling) {
+		//blend into the running histogram, update the cdf if it drifted
+		kernels["hist_rolling"] = clCreateKernel(m_program, "hist_rolling", &err);
+		CHECK_ERROR_OCL(err, "creating hist_rolling kernel", return false);
+	}
+
+	if (!tiles) {
+		//lut of fixed point gains from the cdf
+		kernels["hist_gain"] = clCreateKernel(m_program, "hist_gain", &err);
+		CHECK_ERROR_OCL(err, "creating hist_gain kernel", return false);
+	}
+
+	//perfrom histogram equalisation to the original image, a fixed point scaling by
+	//the gain lut for the whole image. Tiles blend four mappings, which is done in float
+	kernels["hist_eq"] = clCreateKernel(m_program, tiles ? "histogram_equalisation" : "histogram_equalisation_fixed", &err);
 	CHECK_ERROR_OCL(err, "creating histogram_equalisation kernel", return false);
 
 	//get info to set the global_reduc and local_reduc according to the GPU specs
@@ -68,12 +157,14 @@ bool HistEq::setupOpenCL(cl_context_properties context_prop[], const Params& par
 	reportStatus("CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE: %lu\nCL_DEVICE_MAX_WORK_GROUP_SIZE: %lu\nCL_DEVICE_MAX_COMPUTE_UNITS: %lu", preferred_wg_size, max_wg_size, max_cu);
 	reportStatus("CL_DEVICE_MAX_WORK_ITEM_SIZES: %lu, %lu, %lu", max_work_items[0], max_work_items[1], max_work_items[2]);
 
+	//every tile's histogram is built by the same number of workgroups, all in one launch
+	const int groups_per_tile = std::max((int)max_cu/num_tiles, 1);
 	const size_t local_reduc = preferred_wg_size;	//workgroup size for reduction kernels
-	const size_t global_reduc = ((int)preferred_wg_size)*((int)max_cu);	//global_reduc size for reduction kernels
+	const size_t global_reduc = ((int)preferred_wg_size)*groups_per_tile*num_tiles;	//global_reduc size for reduction kernels
 	const int num_wg_reduc = global_reduc/local_reduc;
 
 	const size_t merge_hist_local = preferred_wg_size;
-	const size_t merge_hist_global = hist_size;
+	const size_t merge_hist_global = hist_size*num_tiles;
 
 	const size_t local = preferred_wg_size;
 	const size_t global = ceil((float)image_width*image_height/(float)local) * local;
@@ -110,8 +201,16 @@ bool HistEq::setupOpenCL(cl_context_properties context_prop[], const Params& par
 	oneDlocal_sizes["merge_hist"] = merge_hist_local;
 	oneDglobal_sizes["merge_hist"] = merge_hist_global;
 
+	//one work item per tile
 	oneDlocal_sizes["hist_cdf"] = local_reduc;
-	oneDglobal_sizes["hist_cdf"] = hist_size;
+	oneDglobal_sizes["hist_cdf"] = ceil((float)num_tiles/(float)local_reduc) * local_reduc;
+
+	//a single work item
+	oneDlocal_sizes["hist_rolling"] = 1;
+	oneDglobal_sizes["hist_rolling"] = 1;
+
+	oneDlocal_sizes["hist_gain"] = merge_hist_local;
+	oneDglobal_sizes["hist_gain"] = hist_size;
 
 	oneDlocal_sizes["normal"] = local;
 	oneDglobal_sizes["normal"] = global;
@@ -121,31 +220,22 @@ bool HistEq::setupOpenCL(cl_context_properties context_prop[], const Params& par
 
 	/////////////////////////////////////////////////////////////////allocating memory
 
-	mems["partial_hist"] = clCreateBuffer(m_clContext, CL_MEM_READ_WRITE, sizeof(unsigned int)*hist_size*num_wg_reduc, NULL, &err);
-	CHECK_ERROR_OCL(err, "creating histogram memory", return false);
-
-	mems["hist"] = clCreateBuffer(m_clContext, CL_MEM_READ_WRITE, sizeof(unsigned int)*hist_size, NULL, &err);
-	CHECK_ERROR_OCL(err, "creating histogram memory", return false);
-
-	mems["image"] = clCreateBuffer(m_clContext, CL_MEM_READ_WRITE, sizeof(float)*image_width*image_height*NUM_CHANNELS, NULL, &err);
-	CHECK_ERROR_OCL(err, "creating image memory", return false);
-
-	if (params.opengl) {
-		mem_images[0] = clCreateFromGLTexture2D(m_clContext, CL_MEM_READ_ONLY, GL_TEXTURE_2D, 0, in_tex, &err);
-		CHECK_ERROR_OCL(err, "creating gl input texture", return false);
-		
-		mem_images[1] = clCreateFromGLTexture2D(m_clContext, CL_MEM_WRITE_ONLY, GL_TEXTURE_2D, 0, out_tex, &err);
-		CHECK_ERROR_OCL(err, "creating gl output texture", return false);
+	//live ranges in kernel steps: 0 transfer_data, 1 partial_hist, 2 hist, 3 hist_cdf, 4 hist_gain, 5 hist_eq
+	planBuffer("image", sizeof(float)*image_width*image_height*NUM_CHANNELS, 0, 5);
+	planBuffer("partial_hist", sizeof(unsigned int)*hist_size*num_wg_reduc, 1, 2);
+	planBuffer("hist", sizeof(unsigned int)*hist_size*num_tiles, 2, 5);
+	if (!tiles) planBuffer("gain", sizeof(unsigned int)*hist_size, 4, 5);
+	if (rolling) {
+		//carried over from frame to frame
+		planBuffer("running", sizeof(float)*hist_size, 0, 5);
+		planBuffer("rolling_cdf", sizeof(float)*hist_size, 0, 5);
 	}
-	else {
-		cl_image_format format;
-		format.image_channel_order = CL_RGBA;
-		format.image_channel_data_type = CL_UNSIGNED_INT8;
-		mem_images[0] = clCreateImage2D(m_clContext, CL_MEM_READ_ONLY, &format, image_width, image_height, 0, NULL, &err);
-		CHECK_ERROR_OCL(err, "creating input image memory", return false);
-	
-		mem_images[1] = clCreateImage2D(m_clContext, CL_MEM_WRITE_ONLY, &format, image_width, image_height, 0, NULL, &err);
-		CHECK_ERROR_OCL(err, "creating output image memory", return false);
+	if (!allocateBuffers()) {
+		return false;
+	}
+
+	if (!createImageMemory(params)) {
+		return false;
 	}
 
 	/////////////////////////////////////////////////////////////////setting kernel arguements
@@ -156,20 +246,35 @@ bool HistEq::setupOpenCL(cl_context_properties context_prop[], const Params& par
 
 	err  = clSetKernelArg(kernels["partial_hist"], 0, sizeof(cl_mem), &mems["image"]);
 	err |= clSetKernelArg(kernels["partial_hist"], 1, sizeof(cl_mem), &mems["partial_hist"]);
+	err |= clSetKernelArg(kernels["partial_hist"], 2, sizeof(int), &groups_per_tile);
 	CHECK_ERROR_OCL(err, "setting partial_hist arguments", return false);
 
 	err  = clSetKernelArg(kernels["hist"], 0, sizeof(cl_mem), &mems["partial_hist"]);
 	err |= clSetKernelArg(kernels["hist"], 1, sizeof(cl_mem), &mems["hist"]);
 	err |= clSetKernelArg(kernels["hist"], 2, sizeof(unsigned int)*oneDlocal_sizes["merge_hist"], NULL);
-	err |= clSetKernelArg(kernels["hist"], 3, sizeof(unsigned int), &num_wg_reduc);
+	err |= clSetKernelArg(kernels["hist"], 3, sizeof(unsigned int), &groups_per_tile);
 	CHECK_ERROR_OCL(err, "setting merge_hist arguments", return false);
 
 	err = clSetKernelArg(kernels["hist_cdf"], 0, sizeof(cl_mem), &mems["hist"]);
 	CHECK_ERROR_OCL(err, "setting hist_cdf arguments", return false);
 
+	if (rolling) {
+		err  = clSetKernelArg(kernels["hist_rolling"], 0, sizeof(cl_mem), &mems["hist"]);
+		err |= clSetKernelArg(kernels["hist_rolling"], 1, sizeof(cl_mem), &mems["running"]);
+		err |= clSetKernelArg(kernels["hist_rolling"], 2, sizeof(cl_mem), &mems["rolling_cdf"]);
+		CHECK_ERROR_OCL(err, "setting hist_rolling arguments", return false);
+	}
+	if (!updateParameters()) return false;
+
+	if (!tiles) {
+		err  = clSetKernelArg(kernels["hist_gain"], 0, sizeof(cl_mem), &mems["hist"]);
+		err |= clSetKernelArg(kernels["hist_gain"], 1, sizeof(cl_mem), &mems["gain"]);
+		CHECK_ERROR_OCL(err, "setting hist_gain arguments", return false);
+	}
+
 	err  = clSetKernelArg(kernels["hist_eq"], 0, sizeof(cl_mem), &mems["image"]);
 	err |= clSetKernelArg(kernels["hist_eq"], 1, sizeof(cl_mem), &mem_images[1]);
-	err |= clSetKernelArg(kernels["hist_eq"], 2, sizeof(cl_mem), &mems["hist"]);
+	err |= clSetKernelArg(kernels["hist_eq"], 2, sizeof(cl_mem), tiles ? &mems["hist"] : &mems["gain"]);
 	CHECK_ERROR_OCL(err, "setting histogram_equalisation arguments", return false);
 
 
@@ -177,24 +282,59 @@ bool HistEq::setupOpenCL(cl_context_properties context_prop[], const Params& par
 	return true;
 }
 
+//the clip limit in pixels depends on the tile size, which can't change here
+bool HistEq::updateParameters() {
+	cl_int err;
+	clip_count = clipCount();
+	err = clSetKernelArg(kernels["hist_cdf"], 1, sizeof(unsigned int), &clip_count);
+	if (rolling_subsample > 0 && !tiles) {
+		err |= clSetKernelArg(kernels["hist_rolling"], 3, sizeof(float), &rolling_weight);
+		err |= clSetKernelArg(kernels["hist_rolling"], 4, sizeof(float), &rolling_threshold);
+	}
+	CHECK_ERROR_OCL(err, "setting histEq parameters", return false);
+	return true;
+}
+
 double HistEq::runCLKernels(bool recomputeMapping) {
+	TraceScope trace(m_trace, "runCLKernels", m_name);
 	cl_int err;
 	//let it begin
 	double start = omp_get_wtime();
 
-	err = clEnqueueNDRangeKernel(m_queue, kernels["transfer_data"], 2, NULL, global_sizes["transfer_data"], local_sizes["transfer_data"], 0, NULL, NULL);
+	err = clEnqueueNDRangeKernel(m_queue, kernels["transfer_data"], 2, NULL, global_sizes["transfer_data"], local_sizes["transfer_data"], 0, NULL, traceEvent("transfer_data"));
 	CHECK_ERROR_OCL(err, "enqueuing transfer_data kernel", return false);
 
-	err = clEnqueueNDRangeKernel(m_queue, kernels["partial_hist"], 1, NULL, &oneDglobal_sizes["reduc"], &oneDlocal_sizes["reduc"], 0, NULL, NULL);
-	CHECK_ERROR_OCL(err, "enqueuing partial_hist kernel", return false);
+	if (m_fixedStatistics) {
+		err = clEnqueueWriteBuffer(m_queue, mems["hist"], CL_FALSE, 0, sizeof(stats_cdf), stats_cdf, 0, NULL, NULL);
+		CHECK_ERROR_OCL(err, "writing fixed statistics", return false);
+	}
+	else {
+		err = clEnqueueNDRangeKernel(m_queue, kernels["partial_hist"], 1, NULL, &oneDglobal_sizes["reduc"], &oneDlocal_sizes["reduc"], 0, NULL, traceEvent("partial_hist"));
+		CHECK_ERROR_OCL(err, "enqueuing partial_hist kernel", return false);
 
-	err = clEnqueueNDRangeKernel(m_queue, kernels["hist"], 1, NULL, &oneDglobal_sizes["merge_hist"], &oneDlocal_sizes["merge_hist"], 0, NULL, NULL);
-	CHECK_ERROR_OCL(err, "enqueuing merge_hist kernel", return false);
+		err = clEnqueueNDRangeKernel(m_queue, kernels["hist"], 1, NULL, &oneDglobal_sizes["merge_hist"], &oneDlocal_sizes["merge_hist"], 0, NULL, traceEvent("hist"));
+		CHECK_ERROR_OCL(err, "enqueuing merge_hist kernel", return false);
 
-	err = clEnqueueNDRangeKernel(m_queue, kernels["hist_cdf"], 1, NULL, &oneDglobal_sizes["hist_cdf"], &oneDlocal_sizes["hist_cdf"], 0, NULL, NULL);
-	CHECK_ERROR_OCL(err, "enqueuing hist_cdf kernel", return false);
+		if (rolling_subsample > 0 && !tiles) {
+			const int reset = rolling_frames++ == 0;	//the first frame starts the running histogram
+			err = clSetKernelArg(kernels["hist_rolling"], 5, sizeof(int), &reset);
+			CHECK_ERROR_OCL(err, "setting hist_rolling arguments", return false);
 
-	err = clEnqueueNDRangeKernel(m_queue, kernels["hist_eq"], 2, NULL, global_sizes["transfer_data"], local_sizes["transfer_data"], 0, NULL, NULL);
+			err = clEnqueueNDRangeKernel(m_queue, kernels["hist_rolling"], 1, NULL, &oneDglobal_sizes["hist_rolling"], &oneDlocal_sizes["hist_rolling"], 0, NULL, traceEvent("hist_rolling"));
+			CHECK_ERROR_OCL(err, "enqueuing hist_rolling kernel", return false);
+		}
+		else {
+			err = clEnqueueNDRangeKernel(m_queue, kernels["hist_cdf"], 1, NULL, &oneDglobal_sizes["hist_cdf"], &oneDlocal_sizes["hist_cdf"], 0, NULL, traceEvent("hist_cdf"));
+			CHECK_ERROR_OCL(err, "enqueuing hist_cdf kernel", return false);
+		}
+	}
+
+	if (!tiles) {
+		err = clEnqueueNDRangeKernel(m_queue, kernels["hist_gain"], 1, NULL, &oneDglobal_sizes["hist_gain"], &oneDlocal_sizes["hist_gain"], 0, NULL, traceEvent("hist_gain"));
+		CHECK_ERROR_OCL(err, "enqueuing hist_gain kernel", return false);
+	}
+
+	err = clEnqueueNDRangeKernel(m_queue, kernels["hist_eq"], 2, NULL, global_sizes["transfer_data"], local_sizes["transfer_data"], 0, NULL, traceEvent("hist_eq"));
 	CHECK_ERROR_OCL(err, "enqueuing histogram_equalisation kernel", return false);
 
 	err = clFinish(m_queue);
@@ -214,9 +354,10 @@ bool HistEq::runOpenCL(int input_texid, int output_texid, bool recomputeMapping)
 	err = clEnqueueReleaseGLObjects(m_queue, 2, &mem_images[0], 0, 0, 0);
 	CHECK_ERROR_OCL(err, "releasing GL objects", return false);
 
+	recordFrame(0, runTime, 0, 0, 0);
 	reportStatus("Finished OpenCL kernels in %lf ms", runTime*1000);
 
-	return false;
+	return true;
 }
 
 bool HistEq::runOpenCL(Image input, Image output, bool recomputeMapping) {
@@ -224,28 +365,170 @@ bool HistEq::runOpenCL(Image input, Image output, bool recomputeMapping) {
 
  	const size_t origin[] = {0, 0, 0};
  	const size_t region[] = {input.width, input.height, 1};
-	err = clEnqueueWriteImage(m_queue, mem_images[0], CL_TRUE, origin, region, sizeof(uchar)*input.width*NUM_CHANNELS, 0, input.data, 0, NULL, NULL);
+	double upload = metricsTime();
+	err = clEnqueueWriteImage(m_queue, mem_images[0], CL_TRUE, origin, region, rowBytes(input), 0, input.data, 0, NULL, traceEvent("upload"));
 	CHECK_ERROR_OCL(err, "writing image memory", return false);
+	upload = metricsTime() - upload;
 
 	double runTime = runCLKernels(recomputeMapping);
 
-	err = clEnqueueReadImage(m_queue, mem_images[1], CL_TRUE, origin, region, sizeof(uchar)*input.width*NUM_CHANNELS, 0, output.data, 0, NULL, NULL);
+	double download = metricsTime();
+	err = clEnqueueReadImage(m_queue, mem_images[1], CL_TRUE, origin, region, rowBytes(output), 0, output.data, 0, NULL, traceEvent("download"));
 	CHECK_ERROR_OCL(err, "reading image memory", return false);
+	recordFrame(upload, runTime, metricsTime() - download, bytesPerPixel(input.format)*input.width*input.height, sizeof(uchar)*input.width*input.height*NUM_CHANNELS);
 
 	reportStatus("Finished OpenCL kernel");
 
 	// Verification
-	bool passed = verify(input, output);
-	reportStatus(
-		"Finished in %lf ms (verification %s)",
-		runTime*1000, passed ? "passed" : "failed");
+	bool passed = true;
+	if (m_params.verify) {
+		passed = verify(input, output);
+		reportStatus(
+			"Finished in %lf ms (verification %s)",
+			runTime*1000, passed ? "passed" : "failed");
+	}
+	else reportStatus("Finished in %lf ms", runTime*1000);
 
 	return true;
 }
 
+bool HistEq::runHalideCPU(Image input, Image output, const Params& params) {
+	return runHalide(input, output, params, METHOD_HALIDE_CPU);
+}
+
+bool HistEq::runHalideGPU(Image input, Image output, const Params& params) {
+	return runHalide(input, output, params, METHOD_HALIDE_GPU);
+}
+
+bool HistEq::runHalideAuto(Image input, Image output, const Params& params) {
+	return runHalide(input, output, params, METHOD_HALIDE_AUTO);
+}
+
+bool HistEq::runHalide(Image input, Image output, const Params& params, unsigned int method) {
+#if ENABLE_HALIDE
+	//the pipelines take linear radiance, as the OpenCL kernels read it
+	Image in = input;
+	if (in.format != IMAGE_RGBA32F) toFloat(in);
+	HalideImage in_buf(in);
+	HalideImage out_buf(output);
+
+	reportStatus("Running Halide %s pipeline", halideScheduleName(method));
+	double start = getCurrentTime();
+	int err;
+	switch (method) {
+		case METHOD_HALIDE_GPU:  err = halide_histEq_gpu(&in_buf.buf, &out_buf.buf); break;
+		case METHOD_HALIDE_AUTO: err = halide_histEq_auto(&in_buf.buf, &out_buf.buf); break;
+		default:                 err = halide_histEq_cpu(&in_buf.buf, &out_buf.buf); break;
+	}
+	if (!err) err = halideFinish(&in_buf.buf, &out_buf.buf);
+	double runTime = (getCurrentTime() - start)/1e6;
+
+	if (in.data != input.data) free(in.data);
+	if (err) {
+		reportStatus("Error running Halide pipeline (%d)", err);
+		return false;
+	}
+	return finishHalide(input, output, params, runTime);
+#else
+	reportStatus("Built without Halide, build with HALIDE=1 to run %s with it", m_name);
+	return false;
+#endif
+}
+
+
+//the fixed point mapping of histogram_equalisation_fixed on 8-bit pixels. With no
+//branches or divisions in the loop it vectorises, leaving it bound by memory
+bool HistEq::runCPU(Image input, Image output, const Params& params) {
+	if (tiles) {
+		reportStatus("The CPU implementation only equalises the whole image, not tiles");
+		return false;
+	}
+
+	reportStatus("Running fixed point CPU implementation");
+	double start = omp_get_wtime();
+
+	const int hist_size = PIXEL_RANGE+1;
+	const int width = input.width;
+	const int height = input.height;
+
+	//brightness indexes the histogram, so radiance beyond the 8-bit range is clipped
+	Image pixels = input;
+	if (input.format != IMAGE_RGBA8) {
+		pixels = createImage(width, height);
+		copyImage(input, pixels);
+	}
+	const size_t in_stride = rowBytes(pixels);
+	const size_t out_stride = rowBytes(output);
+
+	unsigned int cdf[hist_size] = {0};
+	if (m_fixedStatistics) memcpy(cdf, stats_cdf, sizeof(stats_cdf));
+	else {
+		#pragma omp parallel
+		{
+			unsigned int hist[hist_size] = {0};
+
+			#pragma omp for
+			for (int y = 0; y < height; y++) {
+				const uchar* row = pixels.data + y*in_stride;
+				for (int x = 0; x < width; x++) {
+					hist[std::max(std::max(row[x*NUM_CHANNELS + 0], row[x*NUM_CHANNELS + 1]), row[x*NUM_CHANNELS + 2])]++;
+				}
+			}
+
+			#pragma omp critical
+			for (int i = 0; i < hist_size; i++) cdf[i] += hist[i];
+		}
+
+		for (int i = 1; i < hist_size; i++) {
+			cdf[i] += cdf[i-1];
+		}
+	}
+
+	//16.16 gain per brightness, equalised*255 << 16 still fits in a uint
+	unsigned int gain[hist_size];
+	const unsigned int range = std::max(cdf[hist_size-1] - cdf[0], 1u);
+	for (int v = 0; v < hist_size; v++) {
+		const unsigned int equalised = ((uint64_t) (hist_size-1)*(cdf[v] - cdf[0]))/range;
+		gain[v] = equalised*reciprocals.lut[v];
+	}
+
+	#pragma omp parallel for
+	for (int y = 0; y < height; y++) {
+		const uchar* in = pixels.data + y*in_stride;
+		uchar* out = output.data + y*out_stride;
+
+		#pragma omp simd
+		for (int x = 0; x < width; x++) {
+			const unsigned int r = in[x*NUM_CHANNELS + 0];
+			const unsigned int g = in[x*NUM_CHANNELS + 1];
+			const unsigned int b = in[x*NUM_CHANNELS + 2];
+			const unsigned int scale = gain[std::max(std::max(r, g), b)];
+			out[x*NUM_CHANNELS + 0] = (r*scale) >> 16;
+			out[x*NUM_CHANNELS + 1] = (g*scale) >> 16;
+			out[x*NUM_CHANNELS + 2] = (b*scale) >> 16;
+			out[x*NUM_CHANNELS + 3] = in[x*NUM_CHANNELS + 3];
+		}
+	}
+
+	double runTime = omp_get_wtime() - start;
+	if (pixels.data != input.data) releaseImage(pixels);
+
+	bool passed = true;
+	if (params.verify) {
+		passed = verify(input, output);
+		reportStatus(
+			"Finished in %lf ms (verification %s)",
+			runTime*1000, passed ? "passed" : "failed");
+	}
+	else reportStatus("Finished in %lf ms", runTime*1000);
+
+	return passed;
+}
+
+
 bool HistEq::cleanupOpenCL() {
-	clReleaseMemObject(mems["input_image"]);
-	clReleaseMemObject(mems["output_image"]);
+	clReleaseMemObject(mem_images[0]);
+	clReleaseMemObject(mem_images[1]);
 	clReleaseMemObject(mems["image"]);
 	clReleaseMemObject(mems["hist"]);
 	clReleaseMemObject(mems["partial_hist"]);
@@ -254,18 +537,95 @@ bool HistEq::cleanupOpenCL() {
 	clReleaseKernel(kernels["hist"]);
 	clReleaseKernel(kernels["hist_cdf"]);
 	clReleaseKernel(kernels["hist_eq"]);
+	if (!tiles) {
+		clReleaseMemObject(mems["gain"]);
+		clReleaseKernel(kernels["hist_gain"]);
+	}
+	if (rolling_subsample > 0 && !tiles) {
+		clReleaseMemObject(mems["running"]);
+		clReleaseMemObject(mems["rolling_cdf"]);
+		clReleaseKernel(kernels["hist_rolling"]);
+	}
 	releaseCL();
 	return true;
 }
 
 
+//CLAHE's tile layout and per tile CDFs depend on the whole image's extent, so
+//a tile of it would be laid out and equalised differently
+bool HistEq::supportsTiling() const {
+	return tiles == 0;
+}
+
+void HistEq::beginStatistics() {
+	Filter::beginStatistics();
+	memset(stats_hist, 0, sizeof(stats_hist));
+}
+
+void HistEq::accumulateStatistics(Image rows) {
+	#pragma omp parallel
+	{
+		uint64_t hist[PIXEL_RANGE+1] = {0};
+		float* row = (float*) malloc(rows.width*NUM_CHANNELS*sizeof(float));
+
+		#pragma omp for
+		for (int y = 0; y < rows.height; y++) {
+			readRow(rows, y, row);
+			for (int x = 0; x < rows.width; x++) {
+				const float* pixel = row + x*NUM_CHANNELS;
+				float red   = clamp(pixel[0], 0.f, (float)PIXEL_RANGE);
+				float green = clamp(pixel[1], 0.f, (float)PIXEL_RANGE);
+				float blue  = clamp(pixel[2], 0.f, (float)PIXEL_RANGE);
+				hist[(int) std::max(std::max(red, green), blue)]++;
+			}
+		}
+		free(row);
+
+		#pragma omp critical
+		for (int i = 0; i <= PIXEL_RANGE; i++) stats_hist[i] += hist[i];
+	}
+}
+
+//a gigapixel count overflows the uint cdf the kernels use, only its shape matters
+//so it is rescaled to FIXED_CDF_TOTAL pixels
+void HistEq::endStatistics() {
+	Filter::endStatistics();
+
+	uint64_t total = 0;
+	for (int i = 0; i <= PIXEL_RANGE; i++) total += stats_hist[i];
+
+	uint64_t cdf = 0;
+	for (int i = 0; i <= PIXEL_RANGE; i++) {
+		cdf += stats_hist[i];
+		stats_cdf[i] = total ? (unsigned int) ((double) cdf*FIXED_CDF_TOTAL/total + 0.5) : 0;
+	}
+	reportStatus("Whole image histogram of %lu pixels", total);
+}
+
+void HistEq::copyStatistics(const Filter& other) {
+	const HistEq* from = dynamic_cast<const HistEq*>(&other);
+	if (!from) return;
+	Filter::copyStatistics(other);
+	memcpy(stats_hist, from->stats_hist, sizeof(stats_hist));
+	memcpy(stats_cdf, from->stats_cdf, sizeof(stats_cdf));
+}
+
+
+uint64_t HistEq::hashParameters(uint64_t hash) const {
+	hash = Filter::hashParameters(hash);
+	hash = hashBytes(&tiles, sizeof(tiles), hash);
+	hash = hashBytes(&clipLimit, sizeof(clipLimit), hash);
+	if (m_fixedStatistics) hash = hashBytes(stats_cdf, sizeof(stats_cdf), hash);
+	return hash;
+}
+
 bool HistEq::runReference(Image input, Image output) {
 	// Check for cached result
-	if (m_reference.data) {
-		memcpy(output.data, m_reference.data, output.width*output.height*NUM_CHANNELS);
+	if (lookupReference(input, output)) {
 		reportStatus("Finished reference (cached)");
 		return true;
 	}
+	if (tiles) return runReferenceTiles(input, output);
 
 	const int hist_size = PIXEL_RANGE+1;
 	unsigned int brightness_hist[hist_size] = {0};
@@ -273,48 +633,168 @@ bool HistEq::runReference(Image input, Image output) {
 	float red, green, blue;
 
 	reportStatus("Running reference");
-	for (int y = 0; y < input.height; y++) {
-		for (int x = 0; x < input.width; x++) {
-			red   = getPixel(input, x, y, 0);
-			green = getPixel(input, x, y, 1);
-			blue  = getPixel(input, x, y, 2);
-			brightness = std::max(std::max(red, green), blue);
-			brightness_hist[brightness] ++;
+	if (m_fixedStatistics) memcpy(brightness_hist, stats_cdf, sizeof(stats_cdf));
+	else {
+		float* row = (float*) malloc(input.width*NUM_CHANNELS*sizeof(float));
+		for (int y = 0; y < input.height; y++) {
+			readRow(input, y, row);
+			for (int x = 0; x < input.width; x++) {
+				//brightness indexes the histogram, so radiance beyond the 8-bit range is clipped
+				const float* pixel = row + x*NUM_CHANNELS;
+				red   = clamp(pixel[0], 0.f, (float)PIXEL_RANGE);
+				green = clamp(pixel[1], 0.f, (float)PIXEL_RANGE);
+				blue  = clamp(pixel[2], 0.f, (float)PIXEL_RANGE);
+				brightness = std::max(std::max(red, green), blue);
+				brightness_hist[brightness] ++;
+			}
+		}
+		free(row);
+
+		for (int i = 1; i < hist_size; i++) {
+			brightness_hist[i] += brightness_hist[i-1];
 		}
 	}
 
-	for (int i = 1; i < hist_size; i++) {
-		brightness_hist[i] += brightness_hist[i-1];
+	//alpha is passed through as the kernels do
+	#pragma omp parallel
+	{
+		float* row = (float*) malloc(input.width*NUM_CHANNELS*sizeof(float));
+
+		#pragma omp for
+		for (int y = 0; y < input.height; y++) {
+			readRow(input, y, row);
+			for (int x = 0; x < input.width; x++) {
+				float* pixel = row + x*NUM_CHANNELS;
+				float3 rgb, hsv;
+				rgb.x = clamp(pixel[0], 0.f, (float)PIXEL_RANGE);
+				rgb.y = clamp(pixel[1], 0.f, (float)PIXEL_RANGE);
+				rgb.z = clamp(pixel[2], 0.f, (float)PIXEL_RANGE);
+				hsv = RGBtoHSV(rgb);		//Convert to HSV to get Hue and Saturation
+
+				hsv.z = ((hist_size-1)*(brightness_hist[(int)hsv.z] - brightness_hist[0]))
+							/(brightness_hist[hist_size-1] - brightness_hist[0]);
+
+				rgb = HSVtoRGB(hsv);	//Convert back to RGB with the modified brightness for V
+				pixel[0] = rgb.x;
+				pixel[1] = rgb.y;
+				pixel[2] = rgb.z;
+			}
+			writeRow(output, y, row);
+		}
+
+		free(row);
 	}
 
-	float3 rgb;
-	float3 hsv;
-	for (int y = 0; y < input.height; y++) {
-		for (int x = 0; x < input.width; x++) {
-			rgb.x = getPixel(input, x, y, 0);
-			rgb.y = getPixel(input, x, y, 1);
-			rgb.z = getPixel(input, x, y, 2);
-			hsv = RGBtoHSV(rgb);		//Convert to HSV to get Hue and Saturation
 
-			hsv.z = ((hist_size-1)*(brightness_hist[(int)hsv.z] - brightness_hist[0]))
-						/(input.height*input.width - brightness_hist[0]);
+	reportStatus("Finished reference");
+
+
+	// Cache result
+	cacheReference(output);
+
+	return true;
+}
 
-			rgb = HSVtoRGB(hsv);	//Convert back to RGB with the modified brightness for V
-			setPixel(output, x, y, 0, rgb.x);
-			setPixel(output, x, y, 1, rgb.y);
-			setPixel(output, x, y, 2, rgb.z);
+
+//clipped histograms and their cdfs per tile, then each pixel blends the brightness
+//its four nearest tiles map it to, as the kernels do
+bool HistEq::runReferenceTiles(Image input, Image output) {
+	reportStatus("Running reference");
+
+	const int hist_size = PIXEL_RANGE+1;
+	tileLayout(input.width, input.height);
+	unsigned int* cdf = (unsigned int*) calloc(tiles_x*tiles_y*hist_size, sizeof(unsigned int));
+
+	#pragma omp parallel for
+	for (int tile = 0; tile < tiles_x*tiles_y; tile++) {
+		unsigned int* hist = cdf + tile*hist_size;
+		const int x0 = (tile%tiles_x)*tile_width;
+		const int y0 = (tile/tiles_x)*tile_height;
+		//the tile's part of each row
+		Image view = subImage(input, x0, y0,
+			std::max(std::min(tile_width, (int)input.width - x0), 0),
+			std::max(std::min(tile_height, (int)input.height - y0), 0));
+		float* row = (float*) malloc(view.width*NUM_CHANNELS*sizeof(float));
+		for (int y = 0; y < view.height; y++) {
+			readRow(view, y, row);
+			for (int x = 0; x < view.width; x++) {
+				const float* pixel = row + x*NUM_CHANNELS;
+				float red   = clamp(pixel[0], 0.f, (float)PIXEL_RANGE);
+				float green = clamp(pixel[1], 0.f, (float)PIXEL_RANGE);
+				float blue  = clamp(pixel[2], 0.f, (float)PIXEL_RANGE);
+				hist[(int) std::max(std::max(red, green), blue)]++;
+			}
 		}
+		free(row);
+
+		if (clip_count) {
+			unsigned int excess = 0;
+			for (int i = 0; i < hist_size; i++) {
+				if (hist[i] > clip_count) {
+					excess += hist[i] - clip_count;
+					hist[i] = clip_count;
+				}
+			}
+			for (int i = 0; i < hist_size; i++) {
+				hist[i] += excess/hist_size + (i < excess%hist_size ? 1 : 0);
+			}
+		}
+
+		for (int i = 1; i < hist_size; i++) {
+			hist[i] += hist[i-1];
+		}
+	}
+
+	#pragma omp parallel
+	{
+		float* row = (float*) malloc(input.width*NUM_CHANNELS*sizeof(float));
+
+		#pragma omp for
+		for (int y = 0; y < input.height; y++) {
+			const float fy = clamp((y + 0.5f)/tile_height - 0.5f, 0.f, tiles_y-1.f);
+			const int ty0 = (int)fy, ty1 = std::min(ty0+1, tiles_y-1);
+			const float dy = fy - ty0;
+			readRow(input, y, row);
+			for (int x = 0; x < input.width; x++) {
+				const float fx = clamp((x + 0.5f)/tile_width - 0.5f, 0.f, tiles_x-1.f);
+				const int tx0 = (int)fx, tx1 = std::min(tx0+1, tiles_x-1);
+				const float dx = fx - tx0;
+
+				float* pixel = row + x*NUM_CHANNELS;
+				float3 rgb;
+				rgb.x = clamp(pixel[0], 0.f, (float)PIXEL_RANGE);
+				rgb.y = clamp(pixel[1], 0.f, (float)PIXEL_RANGE);
+				rgb.z = clamp(pixel[2], 0.f, (float)PIXEL_RANGE);
+				float3 hsv = RGBtoHSV(rgb);
+
+				const int v = (int)hsv.z;
+				float equalised[4];
+				const int corner[4] = {tx0 + ty0*tiles_x, tx1 + ty0*tiles_x, tx0 + ty1*tiles_x, tx1 + ty1*tiles_x};
+				for (int i = 0; i < 4; i++) {
+					const unsigned int* tile_cdf = cdf + corner[i]*hist_size;
+					const unsigned int range = tile_cdf[hist_size-1] - tile_cdf[0];
+					equalised[i] = range ? (hist_size-1)*(float)(tile_cdf[v] - tile_cdf[0])/range : v;
+				}
+				hsv.z = (equalised[0]*(1-dx) + equalised[1]*dx)*(1-dy)
+						+ (equalised[2]*(1-dx) + equalised[3]*dx)*dy;
+
+				rgb = HSVtoRGB(hsv);
+				pixel[0] = rgb.x;
+				pixel[1] = rgb.y;
+				pixel[2] = rgb.z;
+			}
+			writeRow(output, y, row);
+		}
+
+		free(row);
 	}
 
+	free(cdf);
 
 	reportStatus("Finished reference");
 
-
 	// Cache result
-	m_reference.width = output.width;
-	m_reference.height = output.height;
-	m_reference.data = new uchar[output.width*output.height*NUM_CHANNELS];
-	memcpy(m_reference.data, output.data, output.width*output.height*NUM_CHANNELS);
+	cacheReference(output);
 
 	return true;
 }
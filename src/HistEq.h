@@ -2,9 +2,20 @@
 
 namespace hdr
 {
+//with tiles, equalises each of tiles x tiles regions by its own histogram
+//(contrast limited adaptive histogram equalisation), clipping bins at
+//clipLimit times the mean count. Without, the whole image shares one histogram
 class HistEq : public Filter {
 public:
-	HistEq();
+	HistEq(int _tiles=0, float _clipLimit=3.f);
+
+	virtual Filter* clone() const;
+
+	//for video, with OpenCL: count one in subsample pixels (1, 4 or 16), blend
+	//each frame's histogram into a running one with the given weight and only
+	//replace the mapping when the running cdf drifts from it by more than threshold.
+	//A subsample of 0 builds every frame's histogram from scratch. Whole image only
+	void setRolling(int subsample, float weight=0.1f, float threshold=0.02f);
 
 	virtual bool setupOpenCL(cl_context_properties context_prop[], const Params& params);
 	virtual double runCLKernels(bool recomputeMapping);
@@ -12,5 +23,42 @@ public:
 	virtual bool runOpenCL(Image input, Image output, bool recomputeMapping);
 	virtual bool cleanupOpenCL();
 	virtual bool runReference(Image input, Image output);
+	virtual bool runHalideCPU(Image input, Image output, const Params& params);
+	virtual bool runHalideGPU(Image input, Image output, const Params& params);
+	virtual bool runHalideAuto(Image input, Image output, const Params& params);
+	virtual bool runCPU(Image input, Image output, const Params& params);
+
+	virtual bool supportsTiling() const;
+	virtual void beginStatistics();
+	virtual void accumulateStatistics(Image rows);
+	virtual void endStatistics();
+	virtual void copyStatistics(const Filter& other);
+
+protected:
+	//some parameters
+	int tiles;
+	float clipLimit;
+
+	//tile layout for an image, see histEq.cl
+	int tiles_x, tiles_y;
+	int tile_width, tile_height;
+	unsigned int clip_count;	//clip limit in pixels per bin, 0 for none
+	void tileLayout(int width, int height);
+	unsigned int clipCount() const;	//of clipLimit and the tile size
+
+	//rolling histogram, see setRolling
+	int rolling_subsample;
+	float rolling_weight, rolling_threshold;
+	unsigned int rolling_frames;	//since the kernels were set up
+
+	bool runHalide(Image input, Image output, const Params& params, unsigned int method);
+	bool runReferenceTiles(Image input, Image output);
+
+	//whole image statistics, see Filter::beginStatistics
+	uint64_t stats_hist[PIXEL_RANGE+1];
+	unsigned int stats_cdf[PIXEL_RANGE+1];	//scaled to FIXED_CDF_TOTAL pixels
+
+	virtual uint64_t hashParameters(uint64_t hash) const;
+	virtual bool updateParameters();
 };
 }
@@ -0,0 +1,543 @@
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string>
+#include <algorithm>
+#include <stdexcept>
+#include <setjmp.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "jpeglib.h"
+#include "ImageIO.h"
+#if ENABLE_OPENEXR
+#include <ImfRgbaFile.h>
+#endif
+
+/*
+Loaders for floating point HDR images. Pixels are stored as linear radiance,
+Filter::getPixel and the FLOAT_INPUT kernels scale them to the 8-bit range.
+
+JPEGs are decoded and encoded as RGBA rows in place through libjpeg-turbo,
+so no intermediate 3-channel frame is needed in either direction.
+*/
+
+using namespace hdr;
+
+static bool hasExtension(const char* filePath, const char* extension) {
+	std::string path = filePath;
+	std::string ext = extension;
+	if (path.length() < ext.length()) return false;
+	std::string end = path.substr(path.length() - ext.length());
+	std::transform(end.begin(), end.end(), end.begin(), ::tolower);
+	return end == ext;
+}
+
+ScanlineReader::ScanlineReader() {
+	m_file = NULL;
+	width = 0;
+	height = 0;
+	format = IMAGE_RGBA32F;
+	next_scanline = 0;
+}
+
+ScanlineReader::~ScanlineReader() {
+	if (m_file) fclose(m_file);
+}
+
+
+//////////
+// RGBE //
+//////////
+
+RGBEReader::RGBEReader(const char* filePath) : ScanlineReader() {
+	m_rgbe = NULL;
+	m_file = fopen(filePath, "rb");
+	if (!m_file) throw std::runtime_error("Problem opening input file");
+
+	char line[256];
+	if (!fgets(line, sizeof(line), m_file) || strncmp(line, "#?", 2))
+		throw std::runtime_error("Not a Radiance RGBE file");
+
+	//header lines until an empty line, only the pixel format matters to us
+	while (fgets(line, sizeof(line), m_file) && strcmp(line, "\n")) {
+		if (!strncmp(line, "FORMAT=", 7) && strcmp(line, "FORMAT=32-bit_rle_rgbe\n"))
+			throw std::runtime_error("Unsupported RGBE pixel format");
+	}
+
+	int w, h;
+	if (!fgets(line, sizeof(line), m_file) || sscanf(line, "-Y %d +X %d", &h, &w) != 2)
+		throw std::runtime_error("Unsupported RGBE orientation");
+
+	width = w;
+	height = h;
+	m_rgbe = (uchar*) calloc(width*4, sizeof(uchar));
+}
+
+RGBEReader::~RGBEReader() {
+	free(m_rgbe);
+}
+
+//new style scanlines store each component as a separate run-length encoded plane,
+//anything else is flat pixels (with old style repeat markers)
+void RGBEReader::readRLE(uchar* rgbe) {
+	int c0 = getc(m_file);
+	int c1 = getc(m_file);
+	int c2 = getc(m_file);
+	int c3 = getc(m_file);
+	if (c3 == EOF) throw std::runtime_error("Unexpected end of RGBE file");
+
+	if (width < 8 || width > 0x7fff || c0 != 2 || c1 != 2 || (c2 & 0x80)) {
+		rgbe[0] = c0;
+		rgbe[1] = c1;
+		rgbe[2] = c2;
+		rgbe[3] = c3;
+		int shift = 0;
+		for (size_t x = 1; x < width; ) {
+			uchar* pixel = &rgbe[x*4];
+			if (fread(pixel, 4, 1, m_file) != 1) throw std::runtime_error("Unexpected end of RGBE file");
+			if (pixel[0] == 1 && pixel[1] == 1 && pixel[2] == 1) {	//repeat the previous pixel
+				size_t count = pixel[3] << shift;
+				for (size_t i = 0; i < count && x < width; i++, x++)
+					memcpy(&rgbe[x*4], &rgbe[(x-1)*4], 4);
+				shift += 8;
+			}
+			else {
+				shift = 0;
+				x++;
+			}
+		}
+		return;
+	}
+
+	if ((size_t)((c2 << 8) | c3) != width) throw std::runtime_error("Bad RGBE scanline width");
+
+	for (int c = 0; c < 4; c++) {
+		for (size_t x = 0; x < width; ) {
+			int count = getc(m_file);
+			if (count == EOF) throw std::runtime_error("Unexpected end of RGBE file");
+			if (count > 128) {	//run of one value
+				count -= 128;
+				int value = getc(m_file);
+				if (value == EOF || x + count > width) throw std::runtime_error("Bad RGBE run length");
+				for (int i = 0; i < count; i++, x++) rgbe[x*4 + c] = value;
+			}
+			else {				//literal values
+				if (count == 0 || x + count > width) throw std::runtime_error("Bad RGBE run length");
+				for (int i = 0; i < count; i++, x++) rgbe[x*4 + c] = getc(m_file);
+			}
+		}
+	}
+}
+
+void RGBEReader::readScanline(uchar* data) {
+	float* row = (float*) data;
+	readRLE(m_rgbe);
+
+	for (size_t x = 0; x < width; x++) {
+		uchar* pixel = &m_rgbe[x*4];
+		float f = pixel[3] ? ldexp(1.0, pixel[3] - (128+8)) : 0.f;
+		row[x*NUM_CHANNELS + 0] = pixel[0]*f;
+		row[x*NUM_CHANNELS + 1] = pixel[1]*f;
+		row[x*NUM_CHANNELS + 2] = pixel[2]*f;
+		row[x*NUM_CHANNELS + 3] = 0.f;
+	}
+	next_scanline++;
+}
+
+
+/////////
+// PFM //
+/////////
+
+PFMReader::PFMReader(const char* filePath) : ScanlineReader() {
+	m_row = NULL;
+	m_map = NULL;
+	m_file = fopen(filePath, "rb");
+	if (!m_file) throw std::runtime_error("Problem opening input file");
+
+	char type[3] = {0};
+	int w, h;
+	float scale;
+	if (fscanf(m_file, "%2s %d %d %f", type, &w, &h, &scale) != 4 || fgetc(m_file) == EOF)
+		throw std::runtime_error("Not a PFM file");
+
+	if (!strcmp(type, "PF")) m_channels = 3;
+	else if (!strcmp(type, "Pf")) m_channels = 1;
+	else throw std::runtime_error("Not a PFM file");
+
+	//negative scale means little endian data
+	const uint16_t endian_test = 1;
+	bool host_little = *(const uchar*)&endian_test == 1;
+	m_swap = (scale < 0) != host_little;
+
+	width = w;
+	height = h;
+	m_dataStart = ftell(m_file);
+
+	fseek(m_file, 0, SEEK_END);
+	m_mapSize = ftell(m_file);
+	if (m_mapSize < m_dataStart + height*width*m_channels*sizeof(float))
+		throw std::runtime_error("Unexpected end of PFM file");
+
+	//rows are read with stdio if the file can't be mapped
+	void* map = mmap(NULL, m_mapSize, PROT_READ, MAP_PRIVATE, fileno(m_file), 0);
+	if (map != MAP_FAILED) m_map = (uchar*) map;
+	m_mapped = m_mapSize;
+
+	m_row = (float*) calloc(width*m_channels, sizeof(float));
+}
+
+PFMReader::~PFMReader() {
+	if (m_map) munmap(m_map, m_mapSize);
+	free(m_row);
+}
+
+void PFMReader::readScanline(uchar* data) {
+	float* row = (float*) data;
+
+	//rows are stored bottom to top
+	const size_t row_size = width*m_channels*sizeof(float);
+	const size_t offset = m_dataStart + (height-1 - next_scanline)*row_size;
+
+	const float* stored = m_row;
+	if (m_map && !m_swap && offset % sizeof(float) == 0) stored = (const float*) &m_map[offset];
+	else if (m_map) memcpy(m_row, &m_map[offset], row_size);
+	else if (fseek(m_file, offset, SEEK_SET) || fread(m_row, sizeof(float)*m_channels, width, m_file) != width)
+		throw std::runtime_error("Unexpected end of PFM file");
+
+	if (m_swap) {
+		uchar* bytes = (uchar*) m_row;
+		for (size_t i = 0; i < width*m_channels; i++) {
+			std::swap(bytes[i*4 + 0], bytes[i*4 + 3]);
+			std::swap(bytes[i*4 + 1], bytes[i*4 + 2]);
+		}
+	}
+
+	for (size_t x = 0; x < width; x++) {
+		for (int c = 0; c < 3; c++)
+			row[x*NUM_CHANNELS + c] = stored[x*m_channels + (m_channels == 3 ? c : 0)];
+		row[x*NUM_CHANNELS + 3] = 0.f;
+	}
+	next_scanline++;
+
+	//reading moves towards the start of the file, the pages after this row
+	//won't be needed again
+	if (m_map) {
+		const size_t page = sysconf(_SC_PAGESIZE);
+		const size_t start = (offset + page-1)/page*page;
+		if (start < m_mapped) {
+			madvise(&m_map[start], m_mapped - start, MADV_DONTNEED);
+			m_mapped = start;
+		}
+	}
+}
+
+
+//////////
+// JPEG //
+//////////
+
+//libjpeg reports errors by calling error_exit, jump back out of it instead of exiting
+struct jpeg_error_jmp {
+	struct jpeg_error_mgr mgr;
+	jmp_buf jump;
+};
+
+static void jpeg_error_longjmp(j_common_ptr cinfo) {
+	longjmp(((jpeg_error_jmp*) cinfo->err)->jump, 1);
+}
+
+//the caller opens infile before its setjmp, so the handler can always close it
+static void openJPGDecompress(FILE* infile, jpeg_decompress_struct* cinfo) {
+	jpeg_create_decompress(cinfo);
+	jpeg_stdio_src(cinfo, infile);
+	jpeg_read_header(cinfo, TRUE);
+}
+
+void hdr::readJPGSize(const char* filePath, size_t* width, size_t* height) {
+	struct jpeg_decompress_struct cinfo;
+	struct jpeg_error_jmp jerr;
+	FILE* infile = fopen(filePath, "rb");
+	if (!infile) throw std::runtime_error("Problem opening input file");
+
+	cinfo.err = jpeg_std_error(&jerr.mgr);
+	jerr.mgr.error_exit = jpeg_error_longjmp;
+	if (setjmp(jerr.jump)) {
+		jpeg_destroy_decompress(&cinfo);
+		fclose(infile);
+		throw std::runtime_error("Problem decoding JPEG header");
+	}
+
+	openJPGDecompress(infile, &cinfo);
+	*width  = cinfo.image_width;
+	*height = cinfo.image_height;
+
+	jpeg_destroy_decompress(&cinfo);
+	fclose(infile);
+}
+
+//decodes into image.data, which must already hold image.width*image.height RGBA8
+//pixels; it can be pinned or mapped OpenCL memory (see Filter::mapStagingImage)
+void hdr::readJPG(const char* filePath, Image &image) {
+	struct jpeg_decompress_struct cinfo;
+	struct jpeg_error_jmp jerr;
+	FILE* infile = fopen(filePath, "rb");
+	if (!infile) throw std::runtime_error("Problem opening input file");
+
+	cinfo.err = jpeg_std_error(&jerr.mgr);
+	jerr.mgr.error_exit = jpeg_error_longjmp;
+	if (setjmp(jerr.jump)) {
+		jpeg_destroy_decompress(&cinfo);
+		fclose(infile);
+		throw std::runtime_error("Problem decoding JPEG");
+	}
+
+	openJPGDecompress(infile, &cinfo);
+	if (cinfo.image_width != image.width || cinfo.image_height != image.height || image.format != IMAGE_RGBA8)
+		longjmp(jerr.jump, 1);
+
+	//greyscale and RGB sources are both expanded to RGBA by the decoder
+	cinfo.out_color_space = JCS_EXT_RGBA;
+	jpeg_start_decompress(&cinfo);
+
+	while (cinfo.output_scanline < cinfo.output_height) {
+		JSAMPROW row_pointer = imageRow(image, cinfo.output_scanline);
+		jpeg_read_scanlines(&cinfo, &row_pointer, 1);
+	}
+
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	fclose(infile);
+}
+
+JPGReader::JPGReader(const char* filePath) : ScanlineReader() {
+	m_file = fopen(filePath, "rb");
+	if (!m_file) throw std::runtime_error("Problem opening input file");
+
+	m_cinfo = new jpeg_decompress_struct;
+	m_jerr = new jpeg_error_jmp;
+	format = IMAGE_RGBA8;
+
+	m_cinfo->err = jpeg_std_error(&m_jerr->mgr);
+	m_jerr->mgr.error_exit = jpeg_error_longjmp;
+	if (setjmp(m_jerr->jump)) {
+		jpeg_destroy_decompress(m_cinfo);
+		delete m_cinfo;
+		delete m_jerr;
+		throw std::runtime_error("Problem decoding JPEG header");
+	}
+
+	jpeg_create_decompress(m_cinfo);
+	jpeg_stdio_src(m_cinfo, m_file);
+	jpeg_read_header(m_cinfo, TRUE);
+
+	m_cinfo->out_color_space = JCS_EXT_RGBA;
+	jpeg_start_decompress(m_cinfo);
+
+	width = m_cinfo->output_width;
+	height = m_cinfo->output_height;
+}
+
+JPGReader::~JPGReader() {
+	jpeg_destroy_decompress(m_cinfo);
+	delete m_cinfo;
+	delete m_jerr;
+}
+
+void JPGReader::readScanline(uchar* row) {
+	if (setjmp(m_jerr->jump)) throw std::runtime_error("Problem decoding JPEG");
+
+	JSAMPROW row_pointer = row;
+	jpeg_read_scanlines(m_cinfo, &row_pointer, 1);
+	next_scanline++;
+}
+
+Image hdr::readJPG(const char* filePath) {
+	size_t width, height;
+	readJPGSize(filePath, &width, &height);
+
+	Image image = createImage(width, height);
+	try {
+		readJPG(filePath, image);
+	}
+	catch (...) {
+		free(image.data);
+		throw;
+	}
+	return image;
+}
+
+void hdr::writeJPG(Image &image, const char* filePath, int quality) {
+	FILE *outfile  = fopen(filePath, "wb");
+	if (!outfile) throw std::runtime_error("Problem opening output file");
+
+	float* row = NULL;
+	uchar* converted = NULL;
+	if (image.format != IMAGE_RGBA8) {
+		row = (float*) malloc(image.width*NUM_CHANNELS*sizeof(float));
+		converted = (uchar*) malloc(image.width*NUM_CHANNELS);
+	}
+
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_jmp jerr;
+
+	cinfo.err = jpeg_std_error(&jerr.mgr);
+	jerr.mgr.error_exit = jpeg_error_longjmp;
+	if (setjmp(jerr.jump)) {
+		jpeg_destroy_compress(&cinfo);
+		fclose(outfile);
+		free(row);
+		free(converted);
+		throw std::runtime_error("Problem encoding JPEG");
+	}
+
+	jpeg_create_compress(&cinfo);
+	jpeg_stdio_dest(&cinfo, outfile);
+
+	cinfo.image_width      = image.width;
+	cinfo.image_height     = image.height;
+	cinfo.input_components = NUM_CHANNELS;
+	cinfo.in_color_space   = JCS_EXT_RGBA;	//alpha is ignored by the encoder
+
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, quality, TRUE);
+	jpeg_start_compress(&cinfo, TRUE);
+
+	while (cinfo.next_scanline < cinfo.image_height) {
+		JSAMPROW row_pointer = imageRow(image, cinfo.next_scanline);
+		if (converted) {
+			readRow(image, cinfo.next_scanline, row);
+			floatToUchar(row, converted, image.width*NUM_CHANNELS);
+			row_pointer = converted;
+		}
+		jpeg_write_scanlines(&cinfo, &row_pointer, 1);
+	}
+
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+	fclose(outfile);
+	free(row);
+	free(converted);
+}
+
+
+JPGWriter::JPGWriter(const char* filePath, size_t width, size_t height, int quality) {
+	next_scanline = 0;
+	m_file = fopen(filePath, "wb");
+	if (!m_file) throw std::runtime_error("Problem opening output file");
+
+	m_cinfo = new jpeg_compress_struct;
+	m_jerr = new jpeg_error_jmp;
+
+	m_cinfo->err = jpeg_std_error(&m_jerr->mgr);
+	m_jerr->mgr.error_exit = jpeg_error_longjmp;
+	if (setjmp(m_jerr->jump)) {
+		jpeg_destroy_compress(m_cinfo);
+		delete m_cinfo;
+		delete m_jerr;
+		fclose(m_file);
+		throw std::runtime_error("Problem encoding JPEG");
+	}
+
+	jpeg_create_compress(m_cinfo);
+	jpeg_stdio_dest(m_cinfo, m_file);
+
+	m_cinfo->image_width      = width;
+	m_cinfo->image_height     = height;
+	m_cinfo->input_components = NUM_CHANNELS;
+	m_cinfo->in_color_space   = JCS_EXT_RGBA;	//alpha is ignored by the encoder
+
+	jpeg_set_defaults(m_cinfo);
+	jpeg_set_quality(m_cinfo, quality, TRUE);
+	jpeg_start_compress(m_cinfo, TRUE);
+}
+
+//an unfinished file is abandoned
+JPGWriter::~JPGWriter() {
+	if (m_cinfo) {
+		jpeg_destroy_compress(m_cinfo);
+		delete m_cinfo;
+		delete m_jerr;
+		fclose(m_file);
+	}
+}
+
+void JPGWriter::writeScanline(const uchar* row) {
+	if (setjmp(m_jerr->jump)) throw std::runtime_error("Problem encoding JPEG");
+
+	JSAMPROW row_pointer = (JSAMPROW) row;
+	jpeg_write_scanlines(m_cinfo, &row_pointer, 1);
+	next_scanline++;
+}
+
+void JPGWriter::finish() {
+	if (setjmp(m_jerr->jump)) throw std::runtime_error("Problem encoding JPEG");
+
+	jpeg_finish_compress(m_cinfo);
+	jpeg_destroy_compress(m_cinfo);
+	delete m_cinfo;
+	delete m_jerr;
+	m_cinfo = NULL;
+
+	if (fclose(m_file)) throw std::runtime_error("Problem writing output file");
+}
+
+
+///////////
+// Utils //
+///////////
+
+bool hdr::isHDRFile(const char* filePath) {
+	return hasExtension(filePath, ".hdr") || hasExtension(filePath, ".pic")
+		|| hasExtension(filePath, ".pfm") || hasExtension(filePath, ".exr");
+}
+
+//the caller owns the returned reader
+ScanlineReader* hdr::openScanlineReader(const char* filePath) {
+	if (hasExtension(filePath, ".pfm")) return new PFMReader(filePath);
+	if (hasExtension(filePath, ".hdr") || hasExtension(filePath, ".pic")) return new RGBEReader(filePath);
+	if (hasExtension(filePath, ".jpg") || hasExtension(filePath, ".jpeg")) return new JPGReader(filePath);
+	throw std::runtime_error("No scanline reader for this file type");
+}
+
+//decodes straight into the rows of a single RGBA float image
+Image hdr::readHDR(const char* filePath) {
+#if ENABLE_OPENEXR
+	if (hasExtension(filePath, ".exr")) return readEXR(filePath);
+#endif
+	ScanlineReader* reader = openScanlineReader(filePath);
+
+	Image image = createImage(reader->width, reader->height, reader->format);
+	const size_t row_size = rowBytes(image);
+
+	try {
+		while (reader->next_scanline < reader->height)
+			reader->readScanline(&image.data[reader->next_scanline*row_size]);
+	}
+	catch (...) {
+		free(image.data);
+		delete reader;
+		throw;
+	}
+
+	delete reader;
+	return image;
+}
+
+#if ENABLE_OPENEXR
+//OpenEXR stores half RGBA, which is decoded directly into an IMAGE_RGBA16F image
+Image hdr::readEXR(const char* filePath) {
+	Imf::RgbaInputFile file(filePath);
+	Imath::Box2i dw = file.dataWindow();
+	size_t width  = dw.max.x - dw.min.x + 1;
+	size_t height = dw.max.y - dw.min.y + 1;
+
+	Image image = createImage(width, height, IMAGE_RGBA16F);
+	Imf::Rgba* pixels = (Imf::Rgba*) image.data;
+
+	file.setFrameBuffer(pixels - dw.min.x - dw.min.y*width, 1, width);
+	file.readPixels(dw.min.y, dw.max.y);
+	return image;
+}
+#endif
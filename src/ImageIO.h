@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstdio>
+
+#include "Filter.h"
+
+//libjpeg state, defined in jpeglib.h and ImageIO.cpp
+struct jpeg_decompress_struct;
+struct jpeg_compress_struct;
+struct jpeg_error_jmp;
+
+namespace hdr
+{
+//decodes an image file one scanline at a time, top to bottom, so that callers
+//can place rows wherever they need them without a full decode-then-convert copy
+class ScanlineReader {
+public:
+	ScanlineReader();
+	virtual ~ScanlineReader();
+
+	//decodes the next scanline into row, as width pixels of the reader's format
+	virtual void readScanline(uchar* row) = 0;
+
+	size_t width, height;
+	int format;				//IMAGE_* format of the decoded rows
+	size_t next_scanline;	//index of the row the next readScanline call returns
+
+protected:
+	FILE* m_file;
+};
+
+//Radiance RGBE (.hdr, .pic), flat or run-length encoded
+class RGBEReader : public ScanlineReader {
+public:
+	RGBEReader(const char* filePath);
+	virtual ~RGBEReader();
+	virtual void readScanline(uchar* row);
+
+protected:
+	uchar* m_rgbe;	//one scanline of RGBE bytes
+	void readRLE(uchar* rgbe);
+};
+
+//portable float map (.pfm), colour (PF) or greyscale (Pf). The file is memory
+//mapped and the pages of rows already read are dropped, so that panoramas much
+//larger than memory can be streamed through it
+class PFMReader : public ScanlineReader {
+public:
+	PFMReader(const char* filePath);
+	virtual ~PFMReader();
+	virtual void readScanline(uchar* row);
+
+protected:
+	int m_channels;
+	bool m_swap;		//file byte order differs from the host
+	long m_dataStart;	//file offset of the first (bottom) row
+	float* m_row;		//one scanline as stored in the file
+	uchar* m_map;		//whole file, NULL if it couldn't be mapped
+	size_t m_mapSize;
+	size_t m_mapped;	//file offset below which pages haven't been dropped yet
+};
+
+//8-bit RGBA rows from a JPEG, decoded in place by libjpeg-turbo
+class JPGReader : public ScanlineReader {
+public:
+	JPGReader(const char* filePath);
+	virtual ~JPGReader();
+	virtual void readScanline(uchar* row);
+
+protected:
+	struct jpeg_decompress_struct* m_cinfo;
+	struct jpeg_error_jmp* m_jerr;
+};
+
+//encodes an 8-bit RGBA image one scanline at a time, top to bottom, so that an
+//output larger than memory never has to be held whole
+class JPGWriter {
+public:
+	JPGWriter(const char* filePath, size_t width, size_t height, int quality=75);
+	virtual ~JPGWriter();
+
+	void writeScanline(const uchar* row);
+	void finish();		//without it the destructor abandons the file
+
+	size_t next_scanline;
+
+protected:
+	FILE* m_file;
+	struct jpeg_compress_struct* m_cinfo;
+	struct jpeg_error_jmp* m_jerr;
+};
+
+bool isHDRFile(const char* filePath);
+
+void readJPGSize(const char* filePath, size_t* width, size_t* height);
+void readJPG(const char* filePath, Image &image);
+Image readJPG(const char* filePath);
+//any format, float images are clipped to 8 bits
+void writeJPG(Image &image, const char* filePath, int quality=75);
+
+ScanlineReader* openScanlineReader(const char* filePath);
+
+Image readHDR(const char* filePath);
+#if ENABLE_OPENEXR
+Image readEXR(const char* filePath);
+#endif
+}
@@ -0,0 +1,200 @@
+#include <math.h>
+#include <string.h>
+#include <cstdio>
+#include <algorithm>
+
+#include "Metrics.h"
+
+#define SMALLEST_BUCKET 0.000001	//upper bound of the first latency bucket, in seconds
+
+using namespace hdr;
+
+Metrics::Metrics() {
+	pthread_mutex_init(&m_mutex, NULL);
+}
+
+Metrics::~Metrics() {
+	pthread_mutex_destroy(&m_mutex);
+}
+
+double Metrics::getBucketBound(int bucket) {
+	return SMALLEST_BUCKET*pow(2.0, bucket/2.0);
+}
+
+void Metrics::count(const char* filter, const char* name, uint64_t value) {
+	pthread_mutex_lock(&m_mutex);
+	m_counters[Key(filter, name)] += value;
+	pthread_mutex_unlock(&m_mutex);
+}
+
+void Metrics::recordLatency(const char* filter, const char* stage, double seconds) {
+	//the first bucket whose bound is at least seconds, the last one takes everything longer
+	int bucket = seconds > SMALLEST_BUCKET ? (int) ceil(2.0*log2(seconds/SMALLEST_BUCKET) - 1e-9) : 0;
+	bucket = std::min(bucket, NUM_BUCKETS-1);
+
+	pthread_mutex_lock(&m_mutex);
+	std::map<Key, Histogram>::iterator itr = m_latencies.find(Key(filter, stage));
+	if (itr == m_latencies.end()) {
+		Histogram histogram;
+		memset(&histogram, 0, sizeof(histogram));
+		histogram.min = seconds;
+		histogram.max = seconds;
+		itr = m_latencies.insert(std::make_pair(Key(filter, stage), histogram)).first;
+	}
+	Histogram& histogram = itr->second;
+	histogram.buckets[bucket]++;
+	histogram.count++;
+	histogram.sum += seconds;
+	histogram.min = std::min(histogram.min, seconds);
+	histogram.max = std::max(histogram.max, seconds);
+	pthread_mutex_unlock(&m_mutex);
+}
+
+void Metrics::clear() {
+	pthread_mutex_lock(&m_mutex);
+	m_counters.clear();
+	m_latencies.clear();
+	pthread_mutex_unlock(&m_mutex);
+}
+
+uint64_t Metrics::getCount(const char* filter, const char* name) const {
+	pthread_mutex_lock(&m_mutex);
+	std::map<Key, uint64_t>::const_iterator itr = m_counters.find(Key(filter, name));
+	uint64_t value = itr == m_counters.end() ? 0 : itr->second;
+	pthread_mutex_unlock(&m_mutex);
+	return value;
+}
+
+uint64_t Metrics::getLatencyCount(const char* filter, const char* stage) const {
+	pthread_mutex_lock(&m_mutex);
+	std::map<Key, Histogram>::const_iterator itr = m_latencies.find(Key(filter, stage));
+	uint64_t value = itr == m_latencies.end() ? 0 : itr->second.count;
+	pthread_mutex_unlock(&m_mutex);
+	return value;
+}
+
+double Metrics::getLatencyPercentile(const char* filter, const char* stage, double percentile) const {
+	pthread_mutex_lock(&m_mutex);
+	std::map<Key, Histogram>::const_iterator itr = m_latencies.find(Key(filter, stage));
+	double value = itr == m_latencies.end() ? 0 : Metrics::percentile(itr->second, percentile);
+	pthread_mutex_unlock(&m_mutex);
+	return value;
+}
+
+//interpolated geometrically within the bucket the percentile falls in, and kept
+//within the smallest and largest latency seen
+double Metrics::percentile(const Histogram& histogram, double percentile) {
+	if (!histogram.count) return 0;
+
+	const double rank = percentile/100.0*histogram.count;
+	uint64_t below = 0;
+	int bucket = 0;
+	while (bucket < NUM_BUCKETS-1 && below + histogram.buckets[bucket] < rank) {
+		below += histogram.buckets[bucket++];
+	}
+
+	const double lower = bucket ? getBucketBound(bucket-1) : 0;
+	const double upper = getBucketBound(bucket);
+	const double fraction = histogram.buckets[bucket] ? (rank - below)/histogram.buckets[bucket] : 1;
+	const double value = lower > 0 ? lower*pow(upper/lower, fraction) : upper*fraction;
+	return std::min(std::max(value, histogram.min), histogram.max);
+}
+
+//filter names may contain anything, metric names are identifiers
+static std::string escape(const std::string& name) {
+	std::string escaped;
+	for (size_t i = 0; i < name.size(); i++) {
+		if (name[i] == '"' || name[i] == '\\') escaped += '\\';
+		if (name[i] == '\n') escaped += "\\n";
+		else escaped += name[i];
+	}
+	return escaped;
+}
+
+//{"FILTER": {"counters": {"NAME": N, ...}, "latencies": {"STAGE": {"count": N, "sum": S, "min": S, "max": S, "p50": S, "p90": S, "p99": S}, ...}}, ...}
+//with latencies in seconds
+std::string Metrics::toJSON() const {
+	pthread_mutex_lock(&m_mutex);
+
+	//every filter that has either kind of metric
+	std::map<std::string, bool> filters;
+	for (std::map<Key, uint64_t>::const_iterator itr = m_counters.begin(); itr != m_counters.end(); itr++) filters[itr->first.first] = true;
+	for (std::map<Key, Histogram>::const_iterator itr = m_latencies.begin(); itr != m_latencies.end(); itr++) filters[itr->first.first] = true;
+
+	std::string json = "{";
+	char line[512];
+	for (std::map<std::string, bool>::iterator f = filters.begin(); f != filters.end(); f++) {
+		json += (f == filters.begin() ? "\n\t\"" : ",\n\t\"") + escape(f->first) + "\": {\n\t\t\"counters\": {";
+
+		bool first = true;
+		for (std::map<Key, uint64_t>::const_iterator itr = m_counters.begin(); itr != m_counters.end(); itr++) {
+			if (itr->first.first != f->first) continue;
+			sprintf(line, "%s\n\t\t\t\"%s\": %llu", first ? "" : ",", escape(itr->first.second).c_str(), (unsigned long long) itr->second);
+			json += line;
+			first = false;
+		}
+		json += first ? "},\n\t\t\"latencies\": {" : "\n\t\t},\n\t\t\"latencies\": {";
+
+		first = true;
+		for (std::map<Key, Histogram>::const_iterator itr = m_latencies.begin(); itr != m_latencies.end(); itr++) {
+			if (itr->first.first != f->first) continue;
+			const Histogram& histogram = itr->second;
+			sprintf(line, "%s\n\t\t\t\"%s\": {\"count\": %llu, \"sum\": %g, \"min\": %g, \"max\": %g, \"p50\": %g, \"p90\": %g, \"p99\": %g}",
+				first ? "" : ",", escape(itr->first.second).c_str(), (unsigned long long) histogram.count,
+				histogram.sum, histogram.min, histogram.max,
+				percentile(histogram, 50), percentile(histogram, 90), percentile(histogram, 99));
+			json += line;
+			first = false;
+		}
+		json += first ? "}\n\t}" : "\n\t\t}\n\t}";
+	}
+	json += filters.empty() ? "}\n" : "\n}\n";
+
+	pthread_mutex_unlock(&m_mutex);
+	return json;
+}
+
+//counters become PREFIX_NAME_total{filter="FILTER"} and latencies the histogram
+//PREFIX_latency_seconds{filter="FILTER",stage="STAGE"}
+std::string Metrics::toPrometheus(const char* prefix) const {
+	pthread_mutex_lock(&m_mutex);
+
+	std::string text;
+	char line[512];
+
+	//a family's samples have to follow its one TYPE line, but the counters
+	//are ordered by filter first, so they're gathered by metric name
+	std::map<std::string, std::string> families;
+	for (std::map<Key, uint64_t>::const_iterator itr = m_counters.begin(); itr != m_counters.end(); itr++) {
+		const std::string name = std::string(prefix) + "_" + itr->first.second + "_total";
+		sprintf(line, "%s{filter=\"%s\"} %llu\n", name.c_str(), escape(itr->first.first).c_str(), (unsigned long long) itr->second);
+		families[name] += line;
+	}
+	for (std::map<std::string, std::string>::const_iterator itr = families.begin(); itr != families.end(); itr++) {
+		text += "# TYPE " + itr->first + " counter\n" + itr->second;
+	}
+
+	if (!m_latencies.empty()) {
+		text += std::string("# TYPE ") + prefix + "_latency_seconds histogram\n";
+	}
+	for (std::map<Key, Histogram>::const_iterator itr = m_latencies.begin(); itr != m_latencies.end(); itr++) {
+		const Histogram& histogram = itr->second;
+		const std::string labels = "filter=\"" + escape(itr->first.first) + "\",stage=\"" + escape(itr->first.second) + "\"";
+
+		uint64_t cumulative = 0;
+		for (int bucket = 0; bucket < NUM_BUCKETS-1; bucket++) {
+			cumulative += histogram.buckets[bucket];
+			sprintf(line, "%s_latency_seconds_bucket{%s,le=\"%g\"} %llu\n", prefix, labels.c_str(), getBucketBound(bucket), (unsigned long long) cumulative);
+			text += line;
+		}
+		sprintf(line, "%s_latency_seconds_bucket{%s,le=\"+Inf\"} %llu\n", prefix, labels.c_str(), (unsigned long long) histogram.count);
+		text += line;
+		sprintf(line, "%s_latency_seconds_sum{%s} %g\n", prefix, labels.c_str(), histogram.sum);
+		text += line;
+		sprintf(line, "%s_latency_seconds_count{%s} %llu\n", prefix, labels.c_str(), (unsigned long long) histogram.count);
+		text += line;
+	}
+
+	pthread_mutex_unlock(&m_mutex);
+	return text;
+}
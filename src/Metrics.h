@@ -0,0 +1,49 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <pthread.h>
+#include <stdint.h>
+
+namespace hdr
+{
+//Counters and latency histograms, keyed by filter name and metric name, that can
+//be queried or exported as JSON or in the Prometheus text format. Filters only
+//record into one once it's attached with Filter::setMetrics, until then recording
+//is a null pointer test. One instance can be shared by filters on several threads
+class Metrics {
+public:
+	Metrics();
+	~Metrics();
+
+	//latencies fall into buckets whose upper bounds grow by sqrt(2), from 1us to
+	//about 50 minutes, so percentiles are within about 20% of the true value
+	static const int NUM_BUCKETS = 64;
+	static double getBucketBound(int bucket);	//in seconds
+
+	void count(const char* filter, const char* name, uint64_t value=1);
+	void recordLatency(const char* filter, const char* stage, double seconds);
+	void clear();
+
+	uint64_t getCount(const char* filter, const char* name) const;
+	uint64_t getLatencyCount(const char* filter, const char* stage) const;
+	double getLatencyPercentile(const char* filter, const char* stage, double percentile) const;	//in seconds, 0 if none were recorded
+
+	std::string toJSON() const;
+	std::string toPrometheus(const char* prefix="hdr") const;
+
+protected:
+	typedef std::pair<std::string, std::string> Key;	//filter, metric
+	typedef struct {
+		uint64_t buckets[NUM_BUCKETS];
+		uint64_t count;
+		double sum, min, max;
+	} Histogram;
+
+	std::map<Key, uint64_t> m_counters;
+	std::map<Key, Histogram> m_latencies;
+	mutable pthread_mutex_t m_mutex;
+
+	static double percentile(const Histogram& histogram, double percentile);
+};
+}
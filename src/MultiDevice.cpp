@@ -0,0 +1,306 @@
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <iostream>
+#include <algorithm>
+
+#include "MultiDevice.h"
+
+#define REBALANCE_THRESHOLD	1.1		//slowest over fastest band time before bands are resized
+#define THROUGHPUT_WEIGHT	0.5		//weight of the latest run in the smoothed throughput
+
+using namespace hdr;
+
+static size_t roundUp(size_t x, size_t multiple) {
+	return (x + multiple-1)/multiple*multiple;
+}
+
+MultiDevice::MultiDevice(Filter* filter, const Filter::Params& params, const std::vector<cl_device_id>& devices) {
+	for (size_t d = 0; d < devices.size(); d++) {
+		//the filter itself runs on the first device
+		Filter* device_filter = d == 0 ? filter : filter->clone();
+		if (!device_filter) {
+			std::cerr << filter->getName() << " can't be run on more than one device" << std::endl;
+			break;
+		}
+
+		Filter::Params device_params = params;
+		device_params.device = devices[d];
+
+		m_filters.push_back(device_filter);
+		m_params.push_back(device_params);
+		m_throughput.push_back(0);
+		m_rows.push_back(0);
+		m_ready.push_back(false);
+		m_width.push_back(0);
+		m_height.push_back(0);
+		m_format.push_back(IMAGE_RGBA8);
+	}
+}
+
+MultiDevice::~MultiDevice() {
+	cleanup();
+	for (size_t d = 1; d < m_filters.size(); d++) delete m_filters[d];
+}
+
+size_t MultiDevice::getNumDevices() const {
+	return m_filters.size();
+}
+
+Filter* MultiDevice::getFilter(size_t device) const {
+	return m_filters[device];
+}
+
+const Filter::Params& MultiDevice::getParams(size_t device) const {
+	return m_params[device];
+}
+
+double MultiDevice::getThroughput(size_t device) const {
+	return m_throughput[device];
+}
+
+size_t MultiDevice::getRows(size_t device) const {
+	return m_rows[device];
+}
+
+void MultiDevice::setStatusCallback(int (*callback)(const char*, va_list args)) {
+	for (size_t d = 0; d < m_filters.size(); d++) m_filters[d]->setStatusCallback(callback);
+}
+
+void MultiDevice::setMetrics(Metrics* metrics) {
+	for (size_t d = 0; d < m_filters.size(); d++) m_filters[d]->setMetrics(metrics);
+}
+
+void MultiDevice::setTrace(Trace* trace) {
+	for (size_t d = 0; d < m_filters.size(); d++) m_filters[d]->setTrace(trace);
+}
+
+void MultiDevice::setReferenceCache(ReferenceCache* cache) {
+	for (size_t d = 0; d < m_filters.size(); d++) m_filters[d]->setReferenceCache(cache);
+}
+
+bool MultiDevice::run(Image input, Image output) {
+	const size_t num_devices = m_filters.size();
+	if (num_devices == 0) return false;
+
+	std::vector<double> times(num_devices, 0.0);
+	for (size_t d = 0; d < num_devices; d++) {
+		if (m_rows[d] && m_throughput[d] > 0) times[d] = m_rows[d]*input.width/m_throughput[d];
+	}
+	splitRows(input.height, times);
+
+	//every band has to be mapped with the whole image's statistics, gathered
+	//once and copied to the other devices' filters
+	bool tiled = m_filters[0]->supportsTiling();
+	if (tiled) {
+		m_filters[0]->beginStatistics();
+		m_filters[0]->accumulateStatistics(input);
+		m_filters[0]->endStatistics();
+		for (size_t d = 1; d < num_devices; d++) {
+			if (m_rows[d]) m_filters[d]->copyStatistics(*m_filters[0]);
+		}
+	}
+
+	std::vector<Band> bands(num_devices);
+	std::vector<pthread_t> threads(num_devices);
+	size_t y = 0;
+	for (size_t d = 0; d < num_devices; d++) {
+		bands[d].owner = this;
+		bands[d].device = d;
+		bands[d].input = input;
+		bands[d].output = output;
+		bands[d].y0 = y;
+		bands[d].y1 = y + m_rows[d];
+		bands[d].passed = true;
+		bands[d].time = 0;
+		y += m_rows[d];
+		if (m_rows[d]) pthread_create(&threads[d], NULL, bandThread, &bands[d]);
+	}
+
+	bool passed = true;
+	for (size_t d = 0; d < num_devices; d++) {
+		if (!m_rows[d]) continue;
+		pthread_join(threads[d], NULL);
+		passed &= bands[d].passed;
+
+		if (bands[d].passed && bands[d].time > 0) {
+			double throughput = m_rows[d]*input.width/bands[d].time;
+			if (m_throughput[d] > 0) throughput = THROUGHPUT_WEIGHT*throughput + (1-THROUGHPUT_WEIGHT)*m_throughput[d];
+			m_throughput[d] = throughput;
+		}
+	}
+
+	for (size_t d = 0; d < num_devices && tiled; d++) m_filters[d]->clearStatistics();
+	return passed;
+}
+
+//bands are sized by throughput, or by compute units times clock speed for devices
+//that haven't been measured yet, and keep their size while they finish together
+void MultiDevice::splitRows(size_t height, const std::vector<double>& times) {
+	const size_t num_devices = m_filters.size();
+
+	size_t total = 0;
+	for (size_t d = 0; d < num_devices; d++) total += m_rows[d];
+
+	if (total == height) {
+		double fastest = 0, slowest = 0;
+		for (size_t d = 0; d < num_devices; d++) {
+			if (!m_rows[d]) continue;
+			if (fastest == 0 || times[d] < fastest) fastest = times[d];
+			slowest = std::max(slowest, times[d]);
+		}
+		if (fastest > 0 && slowest/fastest <= REBALANCE_THRESHOLD) return;
+	}
+
+	//estimates aren't comparable with measurements, so they're used until every device has been measured
+	bool measured = true;
+	for (size_t d = 0; d < num_devices; d++) {
+		if (m_throughput[d] <= 0) measured = false;
+	}
+
+	std::vector<double> weights(num_devices);
+	double sum = 0;
+	for (size_t d = 0; d < num_devices; d++) {
+		if (measured) weights[d] = m_throughput[d];
+		else {
+			cl_uint units = 1, clock = 1;
+			clGetDeviceInfo(m_params[d].device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(units), &units, NULL);
+			clGetDeviceInfo(m_params[d].device, CL_DEVICE_MAX_CLOCK_FREQUENCY, sizeof(clock), &clock, NULL);
+			weights[d] = (double) units*clock;
+		}
+		sum += weights[d];
+	}
+
+	//a filter that can't be split runs whole on the device expected to be fastest
+	if (!m_filters[0]->supportsTiling()) {
+		size_t best = 0;
+		for (size_t d = 1; d < num_devices; d++) {
+			if (weights[d] > weights[best]) best = d;
+		}
+		for (size_t d = 0; d < num_devices; d++) m_rows[d] = d == best ? height : 0;
+		return;
+	}
+
+	//band boundaries stay on the filter's tile alignment, so that every band
+	//builds the same intermediates the whole image would
+	const size_t alignment = m_filters[0]->getTileAlignment();
+	size_t y = 0;
+	for (size_t d = 0; d < num_devices; d++) {
+		size_t rows = roundUp((size_t) (height*weights[d]/sum), alignment);
+		if (d == num_devices-1 || y + rows > height) rows = height - y;
+		m_rows[d] = rows;
+		y += rows;
+	}
+}
+
+bool MultiDevice::runBand(Band& band) {
+	Filter* filter = m_filters[band.device];
+	const Filter::Params& params = m_params[band.device];
+
+	const size_t alignment = filter->getTileAlignment();
+	const size_t halo = roundUp(filter->getTileHalo(), alignment);
+	const size_t width = band.input.width;
+	const size_t ey0 = band.y0 > halo ? band.y0 - halo : 0;
+	const size_t ey1 = std::min(band.y1 + halo, band.input.height);
+
+	//the band's input is a view of the whole image, and so is its output when
+	//there's no halo to crop off
+	Image input = subImage(band.input, 0, ey0, width, ey1 - ey0);
+	Image output = halo ? createImage(width, ey1 - ey0) : subImage(band.output, 0, ey0, width, ey1 - ey0);
+
+	//kernels are built for a fixed size and format
+	const size_t device = band.device;
+	if (!m_ready[device] || input.height != m_height[device] || input.width != m_width[device] || input.format != m_format[device]) {
+		if (m_ready[device]) filter->cleanupOpenCL();
+		m_width[device] = input.width;
+		m_height[device] = input.height;
+		m_format[device] = input.format;
+		filter->setImageSize(input.width, input.height);
+		filter->setImageFormat(input.format);
+		m_ready[device] = filter->setupOpenCL(NULL, params);
+	}
+
+	//building kernels isn't part of the device's throughput
+	double start = getCurrentTime();
+	bool passed = m_ready[device] && filter->runOpenCL(input, output);
+	band.time = (getCurrentTime() - start)/1e6;
+
+	if (halo) {
+		Image core = subImage(band.output, 0, band.y0, width, band.y1 - band.y0);
+		copyImage(subImage(output, 0, band.y0 - ey0, width, band.y1 - band.y0), core);
+		releaseImage(output);
+	}
+	return passed;
+}
+
+void* MultiDevice::bandThread(void* band) {
+	Band* b = (Band*) band;
+	b->passed = b->owner->runBand(*b);
+	return NULL;
+}
+
+void MultiDevice::cleanup() {
+	for (size_t d = 0; d < m_filters.size(); d++) {
+		if (m_ready[d]) m_filters[d]->cleanupOpenCL();
+		m_ready[d] = false;
+	}
+}
+
+std::vector<cl_device_id> MultiDevice::allDevices(cl_device_type type) {
+	std::vector<cl_device_id> devices;
+
+	cl_uint num_platforms = 0;
+	if (clGetPlatformIDs(0, NULL, &num_platforms) != CL_SUCCESS || num_platforms == 0) return devices;
+	std::vector<cl_platform_id> platforms(num_platforms);
+	clGetPlatformIDs(num_platforms, &platforms[0], NULL);
+
+	for (cl_uint p = 0; p < num_platforms; p++) {
+		cl_uint num_devices = 0;
+		if (clGetDeviceIDs(platforms[p], type, 0, NULL, &num_devices) != CL_SUCCESS || num_devices == 0) continue;
+		std::vector<cl_device_id> platform_devices(num_devices);
+		clGetDeviceIDs(platforms[p], type, num_devices, &platform_devices[0], NULL);
+		devices.insert(devices.end(), platform_devices.begin(), platform_devices.end());
+	}
+	return devices;
+}
+
+cl_device_id MultiDevice::getDevice(cl_uint platformIndex, cl_uint deviceIndex, cl_device_type type) {
+	cl_uint num_platforms = 0;
+	cl_platform_id platforms[platformIndex+1];
+	if (clGetPlatformIDs(platformIndex+1, platforms, &num_platforms) != CL_SUCCESS || platformIndex >= num_platforms) return 0;
+
+	cl_uint num_devices = 0;
+	cl_device_id devices[deviceIndex+1];
+	if (clGetDeviceIDs(platforms[platformIndex], type, deviceIndex+1, devices, &num_devices) != CL_SUCCESS || deviceIndex >= num_devices) return 0;
+	return devices[deviceIndex];
+}
+
+std::vector<cl_device_id> MultiDevice::subDevices(const std::vector<cl_device_id>& devices, int count) {
+	std::vector<cl_device_id> sub_devices;
+
+	for (size_t d = 0; d < devices.size(); d++) {
+		cl_uint units = 0;
+		clGetDeviceInfo(devices[d], CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(units), &units, NULL);
+
+		//equal partitions of units/count compute units, of which there may be more than count
+		cl_uint num_sub = 0;
+		cl_int err = CL_INVALID_VALUE;
+		cl_device_partition_property properties[] = {CL_DEVICE_PARTITION_EQUALLY, (cl_device_partition_property) (units/count), 0};
+		if (count > 1 && units/count > 0) err = clCreateSubDevices(devices[d], properties, 0, NULL, &num_sub);
+		if (err != CL_SUCCESS || num_sub == 0) {
+			char name[64];
+			clGetDeviceInfo(devices[d], CL_DEVICE_NAME, sizeof(name), name, NULL);
+			std::cerr << "Couldn't split " << name << " into " << count << " sub-devices (" << err << ")" << std::endl;
+			sub_devices.push_back(devices[d]);
+			continue;
+		}
+
+		std::vector<cl_device_id> created(num_sub);
+		clCreateSubDevices(devices[d], properties, num_sub, &created[0], NULL);
+		for (cl_uint i = 0; i < num_sub; i++) {
+			if (i < (cl_uint) count) sub_devices.push_back(created[i]);
+			else clReleaseDevice(created[i]);
+		}
+	}
+	return sub_devices;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <vector>
+
+#include "Filter.h"
+
+namespace hdr
+{
+//Runs one filter on several OpenCL devices, each with its own clone of the filter
+//and so its own context, queue and program. run splits an image into one band of
+//rows per device and tonemaps the bands concurrently, with statistics gathered
+//over the whole image first (see Filter::beginStatistics) so the bands match.
+//Band heights follow each device's measured throughput, and are only changed
+//when the bands stop finishing together, since resizing them rebuilds kernels.
+//For streams of frames, the clones can be handed to Batch::addDevice instead.
+class MultiDevice {
+public:
+	MultiDevice(Filter* filter, const Filter::Params& params, const std::vector<cl_device_id>& devices);
+	~MultiDevice();
+
+	size_t getNumDevices() const;
+	Filter* getFilter(size_t device) const;
+	const Filter::Params& getParams(size_t device) const;
+	double getThroughput(size_t device) const;	//pixels per second, smoothed over the runs so far
+	size_t getRows(size_t device) const;		//height of the device's band in the last run
+
+	void setStatusCallback(int (*callback)(const char*, va_list args));
+	void setMetrics(Metrics* metrics);	//shared by every device's filter
+	void setTrace(Trace* trace);
+	void setReferenceCache(ReferenceCache* cache);
+
+	//output must hold input.width*input.height RGBA8 pixels
+	bool run(Image input, Image output);
+	void cleanup();
+
+	//every device of the given type on every platform
+	static std::vector<cl_device_id> allDevices(cl_device_type type);
+	//the device at the indices reported by -clinfo, 0 if there is none
+	static cl_device_id getDevice(cl_uint platformIndex, cl_uint deviceIndex, cl_device_type type);
+	//splits each device into count sub-devices with equal shares of its compute
+	//units, devices that can't be partitioned are kept whole
+	static std::vector<cl_device_id> subDevices(const std::vector<cl_device_id>& devices, int count);
+
+protected:
+	typedef struct {
+		MultiDevice* owner;
+		size_t device;
+		Image input, output;	//the whole image
+		size_t y0, y1;			//rows of the band
+		bool passed;
+		double time;			//seconds
+	} Band;
+
+	std::vector<Filter*> m_filters;
+	std::vector<Filter::Params> m_params;
+	std::vector<double> m_throughput;
+	std::vector<size_t> m_rows;
+
+	//each device is set up for the size and format of its last band. Not a
+	//vector<bool>, whose packed entries band threads couldn't set concurrently
+	std::vector<int> m_ready;
+	std::vector<size_t> m_width, m_height;
+	std::vector<int> m_format;
+
+	void splitRows(size_t height, const std::vector<double>& times);
+	bool runBand(Band& band);
+	static void* bandThread(void* band);
+};
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <map>
+#include <pthread.h>
+
+namespace hdr
+{
+//Bounded queue that hands items out in sequence order, whatever order they were
+//pushed in. push blocks while seq is capacity or more ahead of the next item to be
+//popped, so producers that finish out of order can't fill the queue with items
+//waiting behind a missing one: the missing item always has room.
+template <typename T>
+class OrderedQueue {
+public:
+	OrderedQueue(size_t capacity) {
+		m_capacity = capacity > 0 ? capacity : 1;
+		m_next = 0;
+		m_closed = false;
+		pthread_mutex_init(&m_mutex, NULL);
+		pthread_cond_init(&m_pushed, NULL);
+		pthread_cond_init(&m_popped, NULL);
+	}
+
+	~OrderedQueue() {
+		pthread_cond_destroy(&m_popped);
+		pthread_cond_destroy(&m_pushed);
+		pthread_mutex_destroy(&m_mutex);
+	}
+
+	void push(size_t seq, const T& item) {
+		pthread_mutex_lock(&m_mutex);
+		while (seq >= m_next + m_capacity) pthread_cond_wait(&m_popped, &m_mutex);
+		m_items[seq] = item;
+		pthread_cond_broadcast(&m_pushed);
+		pthread_mutex_unlock(&m_mutex);
+	}
+
+	//blocks until the next item in sequence is available,
+	//returns false once the queue is closed and drained
+	bool pop(T& item, size_t* seq=NULL) {
+		pthread_mutex_lock(&m_mutex);
+		typename std::map<size_t, T>::iterator it;
+		while ((it = m_items.find(m_next)) == m_items.end() && !(m_closed && m_items.empty()))
+			pthread_cond_wait(&m_pushed, &m_mutex);
+
+		if (it == m_items.end()) {
+			pthread_mutex_unlock(&m_mutex);
+			return false;
+		}
+
+		item = it->second;
+		if (seq) *seq = m_next;
+		m_items.erase(it);
+		m_next++;
+		pthread_cond_broadcast(&m_popped);
+		pthread_mutex_unlock(&m_mutex);
+		return true;
+	}
+
+	//called once every sequence number has been pushed
+	void close() {
+		pthread_mutex_lock(&m_mutex);
+		m_closed = true;
+		pthread_cond_broadcast(&m_pushed);
+		pthread_mutex_unlock(&m_mutex);
+	}
+
+protected:
+	std::map<size_t, T> m_items;
+	size_t m_capacity;
+	size_t m_next;		//sequence number of the next item to pop
+	bool m_closed;
+
+	pthread_mutex_t m_mutex;
+	pthread_cond_t m_pushed;
+	pthread_cond_t m_popped;
+};
+}
@@ -0,0 +1,155 @@
+#include <stdlib.h>
+
+#include "Pipeline.h"
+
+using namespace hdr;
+
+Pipeline::Pipeline() {
+	m_initialised = 0;
+	m_ready = false;
+	m_statusCallback = NULL;
+}
+
+Pipeline::~Pipeline() {
+	cleanup();
+}
+
+void Pipeline::addStage(Filter* filter) {
+	m_stages.push_back(filter);
+}
+
+void Pipeline::setStatusCallback(int (*callback)(const char*, va_list args)) {
+	m_statusCallback = callback;
+	for (size_t i = 0; i < m_stages.size(); i++) m_stages[i]->setStatusCallback(callback);
+}
+
+void Pipeline::setMetrics(Metrics* metrics) {
+	for (size_t i = 0; i < m_stages.size(); i++) m_stages[i]->setMetrics(metrics);
+}
+
+void Pipeline::setTrace(Trace* trace) {
+	for (size_t i = 0; i < m_stages.size(); i++) m_stages[i]->setTrace(trace);
+}
+
+void Pipeline::reportStatus(const char *format, ...) const {
+	if (m_statusCallback) {
+		va_list args;
+		va_start(args, format);
+		m_statusCallback(format, args);
+		va_end(args);
+	}
+}
+
+//stage i writes image i and stage i+1 reads it, so an image written at first can
+//reuse any pooled image of the same format whose last reader comes before it
+cl_mem Pipeline::acquireImage(cl_context context, int first, int last, int format, int width, int height) {
+	for (size_t i = 0; i < m_pool.size(); i++) {
+		if (m_pool[i].format == format && m_pool[i].last < first) {
+			m_pool[i].last = last;
+			return m_pool[i].mem;
+		}
+	}
+
+	cl_int err;
+	cl_image_format image_format;
+	image_format.image_channel_order = CL_RGBA;
+	switch (format) {
+		case IMAGE_RGBA32F: image_format.image_channel_data_type = CL_FLOAT; break;
+		case IMAGE_RGBA16F: image_format.image_channel_data_type = CL_HALF_FLOAT; break;
+		default:			image_format.image_channel_data_type = CL_UNSIGNED_INT8; break;
+	}
+
+	PooledImage image;
+	image.mem = clCreateImage2D(context, CL_MEM_READ_WRITE, &image_format, width, height, 0, NULL, &err);
+	if (err != CL_SUCCESS) {
+		reportStatus("Error during operation '%s' (%d)", "creating pipeline image memory", err);
+		return 0;
+	}
+	image.format = format;
+	image.last = last;
+	m_pool.push_back(image);
+	return image.mem;
+}
+
+bool Pipeline::setup(const Filter::Params& params, int width, int height, int format) {
+	cleanup();
+	if (m_stages.empty()) return false;
+
+	cl_context context = 0;
+	cl_command_queue queue = 0;
+	cl_device_id device = 0;
+	cl_mem input = 0;
+	size_t images = 0;
+
+	for (size_t i = 0; i < m_stages.size(); i++) {
+		Filter* stage = m_stages[i];
+		stage->setImageSize(width, height);
+		stage->setImageFormat(format);
+		stage->setSharedContext(context, queue, device);
+		stage->setInputImage(input);
+		stage->setOutputImage(0);
+
+		//the first stage creates the context, and its own output image
+		if (i > 0) {
+			cl_mem output = acquireImage(context, i, i+1, stage->getOutputFormat(), width, height);
+			if (!output) return false;
+			stage->setOutputImage(output);
+		}
+
+		if (!stage->setupOpenCL(NULL, params)) {
+			reportStatus("Pipeline stage %lu (%s) failed to initialise", i, stage->getName());
+			return false;
+		}
+		m_initialised++;
+
+		if (i == 0) {
+			context = stage->getContext();
+			queue = stage->getQueue();
+			device = stage->getDevice();
+
+			PooledImage image;
+			image.mem = stage->getOutputImage();
+			image.format = stage->getOutputFormat();
+			image.last = 1;
+			clRetainMemObject(image.mem);
+			m_pool.push_back(image);
+		}
+
+		input = stage->getOutputImage();
+		format = stage->getOutputFormat();
+		images++;
+	}
+
+	m_ready = true;
+	reportStatus("Pipeline of %lu stages passes %lu images in %lu allocations",
+		m_stages.size(), images, m_pool.size());
+	return true;
+}
+
+//output receives the last stage's result, and is verified if params.verify was set
+bool Pipeline::run(Image input, Image output) {
+	if (!m_ready) return false;
+
+	if (!m_stages[0]->uploadInput(input)) return false;
+
+	Image none = {NULL, output.width, output.height, output.format, output.stride};
+	for (size_t i = 0; i < m_stages.size(); i++) {
+		bool last = i == m_stages.size()-1;
+		if (!m_stages[i]->runOpenCLOnDevice(last ? output : none)) return false;
+	}
+	return true;
+}
+
+void Pipeline::cleanup() {
+	//later stages hold references to the first stage's context
+	for (size_t i = m_stages.size(); i-- > 0; ) {
+		if (i < m_initialised) m_stages[i]->cleanupOpenCL();
+		m_stages[i]->setSharedContext(0, 0, 0);
+		m_stages[i]->setInputImage(0);
+		m_stages[i]->setOutputImage(0);
+	}
+	for (size_t i = 0; i < m_pool.size(); i++) clReleaseMemObject(m_pool[i].mem);
+	m_pool.clear();
+	m_initialised = 0;
+	m_ready = false;
+}
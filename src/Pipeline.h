@@ -0,0 +1,46 @@
+#pragma once
+
+#include <vector>
+
+#include "Filter.h"
+
+namespace hdr
+{
+//Chains filters on the device. Every stage runs in the first stage's context and
+//queue and reads the previous stage's output image directly; only the pipeline
+//input is uploaded and only the last output is read back. Intermediate images
+//come from a pool, so stages whose images are no longer live share memory.
+class Pipeline {
+public:
+	Pipeline();
+	~Pipeline();
+
+	void addStage(Filter* filter);
+
+	//width and height of the images passed between stages, format of the input
+	bool setup(const Filter::Params& params, int width, int height, int format);
+	bool run(Image input, Image output);
+	void cleanup();
+
+	void setStatusCallback(int (*callback)(const char*, va_list args));
+	void setMetrics(Metrics* metrics);
+	void setTrace(Trace* trace);	//before setup, see Filter::setTrace
+
+protected:
+	typedef struct {
+		cl_mem mem;
+		int format;
+		int last;	//last stage that reads the image
+	} PooledImage;
+
+	std::vector<Filter*> m_stages;
+	std::vector<PooledImage> m_pool;
+	size_t m_initialised;	//stages set up so far, all of them once ready
+	bool m_ready;
+
+	int (*m_statusCallback)(const char*, va_list args);
+	void reportStatus(const char *format, ...) const;
+
+	cl_mem acquireImage(cl_context context, int first, int last, int format, int width, int height);
+};
+}
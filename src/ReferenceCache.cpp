@@ -0,0 +1,166 @@
+#include <cstdio>
+#include <unistd.h>
+
+#include "ReferenceCache.h"
+
+#define FILE_MAGIC	0x46455248	//"HREF"
+
+using namespace hdr;
+
+//header of a cache file, followed by packed rows
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t key;
+	uint32_t width, height, format;
+} FileHeader;
+
+ReferenceCache::ReferenceCache(size_t capacity, const char* directory) {
+	m_capacity = capacity;
+	if (directory) m_directory = directory;
+	m_size = 0;
+	m_hits = 0;
+	m_misses = 0;
+	pthread_mutex_init(&m_mutex, NULL);
+}
+
+ReferenceCache::~ReferenceCache() {
+	clear();
+	pthread_mutex_destroy(&m_mutex);
+}
+
+bool ReferenceCache::lookup(uint64_t key, Image output) {
+	pthread_mutex_lock(&m_mutex);
+	std::map<uint64_t, std::list<Entry>::iterator>::iterator itr = m_index.find(key);
+	bool found = itr != m_index.end();
+	if (found) m_entries.splice(m_entries.begin(), m_entries, itr->second);
+	else if (m_directory != "") {
+		Image image = {NULL, 0, 0, IMAGE_RGBA8, 0};
+		if (readFile(key, image)) {
+			add(key, image);
+			found = true;
+		}
+	}
+
+	//a hash collision, or a file from another build
+	if (found) {
+		const Image &image = m_entries.front().image;
+		found = image.width == output.width && image.height == output.height && image.format == output.format;
+		if (found) copyImage(image, output);
+	}
+
+	if (found) m_hits++;
+	else m_misses++;
+	pthread_mutex_unlock(&m_mutex);
+	return found;
+}
+
+void ReferenceCache::insert(uint64_t key, const Image &output) {
+	Image image = createImage(output.width, output.height, output.format);
+	if (!image.data) return;
+	copyImage(output, image);
+	if (m_directory != "") writeFile(key, image);
+
+	pthread_mutex_lock(&m_mutex);
+	add(key, image);
+	pthread_mutex_unlock(&m_mutex);
+}
+
+void ReferenceCache::add(uint64_t key, Image image) {
+	std::map<uint64_t, std::list<Entry>::iterator>::iterator itr = m_index.find(key);
+	if (itr != m_index.end()) {
+		m_size -= rowBytes(itr->second->image)*itr->second->image.height;
+		releaseImage(itr->second->image);
+		m_entries.erase(itr->second);
+	}
+
+	Entry entry = {key, image};
+	m_entries.push_front(entry);
+	m_index[key] = m_entries.begin();
+	m_size += rowBytes(image)*image.height;
+
+	//the newest entry stays even if it's larger than the capacity on its own
+	while (m_size > m_capacity && m_entries.size() > 1) {
+		Entry &oldest = m_entries.back();
+		m_size -= rowBytes(oldest.image)*oldest.image.height;
+		m_index.erase(oldest.key);
+		releaseImage(oldest.image);
+		m_entries.pop_back();
+	}
+}
+
+void ReferenceCache::clear() {
+	pthread_mutex_lock(&m_mutex);
+	for (std::list<Entry>::iterator itr = m_entries.begin(); itr != m_entries.end(); itr++) {
+		releaseImage(itr->image);
+	}
+	m_entries.clear();
+	m_index.clear();
+	m_size = 0;
+	pthread_mutex_unlock(&m_mutex);
+}
+
+size_t ReferenceCache::getHits() const {
+	pthread_mutex_lock(&m_mutex);
+	size_t hits = m_hits;
+	pthread_mutex_unlock(&m_mutex);
+	return hits;
+}
+
+size_t ReferenceCache::getMisses() const {
+	pthread_mutex_lock(&m_mutex);
+	size_t misses = m_misses;
+	pthread_mutex_unlock(&m_mutex);
+	return misses;
+}
+
+size_t ReferenceCache::getSize() const {
+	pthread_mutex_lock(&m_mutex);
+	size_t size = m_size;
+	pthread_mutex_unlock(&m_mutex);
+	return size;
+}
+
+std::string ReferenceCache::path(uint64_t key) const {
+	char name[32];
+	sprintf(name, "/%016llx.ref", (unsigned long long) key);
+	return m_directory + name;
+}
+
+bool ReferenceCache::readFile(uint64_t key, Image &image) const {
+	FILE* file = fopen(path(key).c_str(), "rb");
+	if (!file) return false;
+
+	FileHeader header;
+	bool read = fread(&header, sizeof(header), 1, file) == 1 && header.magic == FILE_MAGIC
+		&& header.version == REFERENCE_VERSION && header.key == key && header.format <= IMAGE_L32F;
+	if (read) {
+		image = createImage(header.width, header.height, header.format);
+		const size_t row_size = rowBytes(image);
+		for (size_t y = 0; y < image.height && read; y++) read = fread(image.data + y*row_size, row_size, 1, file) == 1;
+		if (!read) releaseImage(image);
+	}
+	fclose(file);
+	return read;
+}
+
+//written under a temporary name and renamed, so that a reader never sees half a file
+bool ReferenceCache::writeFile(uint64_t key, const Image &image) const {
+	const std::string final = path(key);
+	char suffix[64];
+	sprintf(suffix, ".%d.%lx.tmp", (int) getpid(), (unsigned long) pthread_self());
+	const std::string temporary = final + suffix;
+
+	FILE* file = fopen(temporary.c_str(), "wb");
+	if (!file) return false;
+
+	FileHeader header = {FILE_MAGIC, REFERENCE_VERSION, key, (uint32_t) image.width, (uint32_t) image.height, (uint32_t) image.format};
+	bool written = fwrite(&header, sizeof(header), 1, file) == 1;
+	const size_t row_size = image.width*bytesPerPixel(image.format);
+	for (size_t y = 0; y < image.height && written; y++) written = fwrite(image.data + y*rowBytes(image), row_size, 1, file) == 1;
+	written = fclose(file) == 0 && written;
+
+	if (written) written = rename(temporary.c_str(), final.c_str()) == 0;
+	if (!written) unlink(temporary.c_str());
+	return written;
+}
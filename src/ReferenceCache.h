@@ -0,0 +1,53 @@
+#pragma once
+
+#include <list>
+#include <map>
+#include <string>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "Filter.h"
+
+namespace hdr
+{
+//Reference outputs keyed by a hash of the input pixels and of everything else
+//the filter's reference depends on (see Filter::hashParameters), so a different
+//image never gets a stale result. The least recently used entries are dropped
+//once the images held exceed the capacity. Given a directory, entries are also
+//written there as they're added and read back on a miss, so that regression
+//runs over the same images can skip the reference across processes. One
+//instance can be shared by filters on several threads
+class ReferenceCache {
+public:
+	ReferenceCache(size_t capacity=REFERENCE_CACHE_BYTES, const char* directory=NULL);
+	~ReferenceCache();
+
+	//copies the entry into output, false if there's none of output's size
+	bool lookup(uint64_t key, Image output);
+	void insert(uint64_t key, const Image &output);
+	void clear();	//of memory, files are left alone
+
+	size_t getHits() const;
+	size_t getMisses() const;
+	size_t getSize() const;	//bytes held in memory
+
+protected:
+	typedef struct {
+		uint64_t key;
+		Image image;
+	} Entry;
+
+	size_t m_capacity;
+	std::string m_directory;
+	std::list<Entry> m_entries;		//most recently used first
+	std::map<uint64_t, std::list<Entry>::iterator> m_index;
+	size_t m_size;
+	size_t m_hits, m_misses;
+	mutable pthread_mutex_t m_mutex;
+
+	void add(uint64_t key, Image image);	//takes ownership, m_mutex held
+	std::string path(uint64_t key) const;
+	bool readFile(uint64_t key, Image &image) const;
+	bool writeFile(uint64_t key, const Image &image) const;
+};
+}
@@ -9,8 +9,10 @@
 #include "ReinhardGlobal.h"
 #include "opencl/reinhardGlobal.h"
 #if ENABLE_HALIDE
-#include "halide/blur_cpu.h"
-#include "halide/blur_gpu.h"
+#include "halide/reinhardGlobal_cpu.h"
+#include "halide/reinhardGlobal_gpu.h"
+#include "halide/reinhardGlobal_auto.h"
+#include "halide/buffer.h"
 #endif
 
 /* 
@@ -24,9 +26,16 @@ ReinhardGlobal::ReinhardGlobal(float _key, float _sat) : Filter() {
 	m_name = "ReinhardGlobal";
 	key = _key;
 	sat = _sat;
+	addParameter("key", &key, 0.001f, 4.f, "the value the log average luminance maps to");
+	addParameter("sat", &sat, 0.f, 4.f, "colour saturation");
+}
+
+Filter* ReinhardGlobal::clone() const {
+	return new ReinhardGlobal(key, sat);
 }
 
 bool ReinhardGlobal::setupOpenCL(cl_context_properties context_prop[], const Params& params) {
+	TraceScope trace(m_trace, "setupOpenCL", m_name);
 
 	char flags[1024];
 	sprintf(flags, "-cl-fast-relaxed-math -D NUM_CHANNELS=%d -Dimage_size=%d -D WIDTH=%d -D HEIGHT=%d",
@@ -82,22 +91,8 @@ bool ReinhardGlobal::setupOpenCL(cl_context_properties context_prop[], const Par
 	mems["Lwhite"] = clCreateBuffer(m_clContext, CL_MEM_READ_WRITE, sizeof(float)*num_wg, NULL, &err);
 	CHECK_ERROR_OCL(err, "creating Lwhite memory", return false);
 
-	if (params.opengl) {
-		mem_images[0] = clCreateFromGLTexture2D(m_clContext, CL_MEM_READ_ONLY, GL_TEXTURE_2D, 0, in_tex, &err);
-		CHECK_ERROR_OCL(err, "creating gl input texture", return false);
-		
-		mem_images[1] = clCreateFromGLTexture2D(m_clContext, CL_MEM_WRITE_ONLY, GL_TEXTURE_2D, 0, out_tex, &err);
-		CHECK_ERROR_OCL(err, "creating gl output texture", return false);
-	}
-	else {
-		cl_image_format format;
-		format.image_channel_order = CL_RGBA;
-		format.image_channel_data_type = CL_UNSIGNED_INT8;
-		mem_images[0] = clCreateImage2D(m_clContext, CL_MEM_READ_ONLY, &format, image_width, image_height, 0, NULL, &err);
-		CHECK_ERROR_OCL(err, "creating input image memory", return false);
-	
-		mem_images[1] = clCreateImage2D(m_clContext, CL_MEM_WRITE_ONLY, &format, image_width, image_height, 0, NULL, &err);
-		CHECK_ERROR_OCL(err, "creating output image memory", return false);
+	if (!createImageMemory(params)) {
+		return false;
 	}
 
 	/////////////////////////////////////////////////////////////////setting kernel arguements
@@ -118,26 +113,42 @@ bool ReinhardGlobal::setupOpenCL(cl_context_properties context_prop[], const Par
 	err  = clSetKernelArg(kernels["reinhardGlobal"], 1, sizeof(cl_mem), &mem_images[1]);
 	err  = clSetKernelArg(kernels["reinhardGlobal"], 2, sizeof(cl_mem), &mems["logAvgLum"]);
 	err  = clSetKernelArg(kernels["reinhardGlobal"], 3, sizeof(cl_mem), &mems["Lwhite"]);
-	err  = clSetKernelArg(kernels["reinhardGlobal"], 4, sizeof(float), &key);
-	err  = clSetKernelArg(kernels["reinhardGlobal"], 5, sizeof(float), &sat);
 	CHECK_ERROR_OCL(err, "setting globalTMO arguments", return false);
+	if (!updateParameters()) return false;
 
 	reportStatus("\n\n");
 
 	return true;
 }
 
+bool ReinhardGlobal::updateParameters() {
+	cl_int err;
+	err  = clSetKernelArg(kernels["reinhardGlobal"], 4, sizeof(float), &key);
+	err |= clSetKernelArg(kernels["reinhardGlobal"], 5, sizeof(float), &sat);
+	CHECK_ERROR_OCL(err, "setting globalTMO parameters", return false);
+	return true;
+}
+
 double ReinhardGlobal::runCLKernels(bool recomputeMapping) {
+	TraceScope trace(m_trace, "runCLKernels", m_name);
 	double start = omp_get_wtime();
 
 	cl_int err;
-	err = clEnqueueNDRangeKernel(m_queue, kernels["computeLogAvgLum"], 2, NULL, global_sizes["computeLogAvgLum"], local_sizes["computeLogAvgLum"], 0, NULL, NULL);
-	CHECK_ERROR_OCL(err, "enqueuing computeLogAvgLum kernel", return false);
+	if (m_fixedStatistics) {
+		//the reductions would only see this tile
+		err  = clEnqueueWriteBuffer(m_queue, mems["logAvgLum"], CL_FALSE, 0, sizeof(float), &stats_logAvgLum, 0, NULL, NULL);
+		err |= clEnqueueWriteBuffer(m_queue, mems["Lwhite"], CL_FALSE, 0, sizeof(float), &stats_Lwhite, 0, NULL, NULL);
+		CHECK_ERROR_OCL(err, "writing fixed statistics", return false);
+	}
+	else {
+		err = clEnqueueNDRangeKernel(m_queue, kernels["computeLogAvgLum"], 2, NULL, global_sizes["computeLogAvgLum"], local_sizes["computeLogAvgLum"], 0, NULL, traceEvent("computeLogAvgLum"));
+		CHECK_ERROR_OCL(err, "enqueuing computeLogAvgLum kernel", return false);
 
-	err = clEnqueueNDRangeKernel(m_queue, kernels["finalReduc"], 1, NULL, &global_sizes["finalReduc"][0], &local_sizes["finalReduc"][0], 0, NULL, NULL);
-	CHECK_ERROR_OCL(err, "enqueuing finalReduc kernel", return false);
+		err = clEnqueueNDRangeKernel(m_queue, kernels["finalReduc"], 1, NULL, &global_sizes["finalReduc"][0], &local_sizes["finalReduc"][0], 0, NULL, traceEvent("finalReduc"));
+		CHECK_ERROR_OCL(err, "enqueuing finalReduc kernel", return false);
+	}
 
-	err = clEnqueueNDRangeKernel(m_queue, kernels["reinhardGlobal"], 2, NULL, global_sizes["reinhardGlobal"], local_sizes["reinhardGlobal"], 0, NULL, NULL);
+	err = clEnqueueNDRangeKernel(m_queue, kernels["reinhardGlobal"], 2, NULL, global_sizes["reinhardGlobal"], local_sizes["reinhardGlobal"], 0, NULL, traceEvent("reinhardGlobal"));
 	CHECK_ERROR_OCL(err, "enqueuing transfer_data kernel", return false);
 
 	err = clFinish(m_queue);
@@ -157,6 +168,7 @@ bool ReinhardGlobal::runOpenCL(int input_texid, int output_texid, bool recompute
 	err = clEnqueueReleaseGLObjects(m_queue, 2, &mem_images[0], 0, 0, 0);
 	CHECK_ERROR_OCL(err, "releasing GL objects", return false);
 
+	recordFrame(0, runTime, 0, 0, 0);
 	reportStatus("Finished OpenCL kernels in %lf ms", runTime*1000);
 
 	return false;
@@ -169,27 +181,79 @@ bool ReinhardGlobal::runOpenCL(Image input, Image output, bool recomputeMapping)
 
  	const size_t origin[] = {0, 0, 0};
  	const size_t region[] = {input.width, input.height, 1};
-	err = clEnqueueWriteImage(m_queue, mem_images[0], CL_TRUE, origin, region, sizeof(uchar)*input.width*NUM_CHANNELS, 0, input.data, 0, NULL, NULL);
+	double upload = metricsTime();
+	err = clEnqueueWriteImage(m_queue, mem_images[0], CL_TRUE, origin, region, rowBytes(input), 0, input.data, 0, NULL, traceEvent("upload"));
 	CHECK_ERROR_OCL(err, "writing image memory", return false);
+	upload = metricsTime() - upload;
 
 	//let it begin
 	double runTime = runCLKernels(recomputeMapping);
 
 	//read results back
-	err = clEnqueueReadImage(m_queue, mem_images[1], CL_TRUE, origin, region, sizeof(uchar)*input.width*NUM_CHANNELS, 0, output.data, 0, NULL, NULL);
+	double download = metricsTime();
+	err = clEnqueueReadImage(m_queue, mem_images[1], CL_TRUE, origin, region, rowBytes(output), 0, output.data, 0, NULL, traceEvent("download"));
 	CHECK_ERROR_OCL(err, "reading image memory", return false);
+	recordFrame(upload, runTime, metricsTime() - download, bytesPerPixel(input.format)*input.width*input.height, sizeof(uchar)*input.width*input.height*NUM_CHANNELS);
 
 	reportStatus("Finished OpenCL kernel");
 
-	bool passed = verify(input, output);
-	reportStatus(
-		"Finished in %lf ms (verification %s)",
-		runTime*1000, passed ? "passed" : "failed");
+	bool passed = true;
+	if (m_params.verify) {
+		passed = verify(input, output);
+		reportStatus(
+			"Finished in %lf ms (verification %s)",
+			runTime*1000, passed ? "passed" : "failed");
+	}
+	else reportStatus("Finished in %lf ms", runTime*1000);
 
 	return passed;
 }
 
 
+bool ReinhardGlobal::runHalideCPU(Image input, Image output, const Params& params) {
+	return runHalide(input, output, params, METHOD_HALIDE_CPU);
+}
+
+bool ReinhardGlobal::runHalideGPU(Image input, Image output, const Params& params) {
+	return runHalide(input, output, params, METHOD_HALIDE_GPU);
+}
+
+bool ReinhardGlobal::runHalideAuto(Image input, Image output, const Params& params) {
+	return runHalide(input, output, params, METHOD_HALIDE_AUTO);
+}
+
+bool ReinhardGlobal::runHalide(Image input, Image output, const Params& params, unsigned int method) {
+#if ENABLE_HALIDE
+	//the pipelines take linear radiance, as the OpenCL kernels read it
+	Image in = input;
+	if (in.format != IMAGE_RGBA32F) toFloat(in);
+	HalideImage in_buf(in);
+	HalideImage out_buf(output);
+
+	reportStatus("Running Halide %s pipeline", halideScheduleName(method));
+	double start = getCurrentTime();
+	int err;
+	switch (method) {
+		case METHOD_HALIDE_GPU:  err = halide_reinhardGlobal_gpu(&in_buf.buf, key, sat, &out_buf.buf); break;
+		case METHOD_HALIDE_AUTO: err = halide_reinhardGlobal_auto(&in_buf.buf, key, sat, &out_buf.buf); break;
+		default:                 err = halide_reinhardGlobal_cpu(&in_buf.buf, key, sat, &out_buf.buf); break;
+	}
+	if (!err) err = halideFinish(&in_buf.buf, &out_buf.buf);
+	double runTime = (getCurrentTime() - start)/1e6;
+
+	if (in.data != input.data) free(in.data);
+	if (err) {
+		reportStatus("Error running Halide pipeline (%d)", err);
+		return false;
+	}
+	return finishHalide(input, output, params, runTime);
+#else
+	reportStatus("Built without Halide, build with HALIDE=1 to run %s with it", m_name);
+	return false;
+#endif
+}
+
+
 bool ReinhardGlobal::cleanupOpenCL() {
 	clReleaseMemObject(mem_images[0]);
 	clReleaseMemObject(mem_images[1]);
@@ -203,11 +267,75 @@ bool ReinhardGlobal::cleanupOpenCL() {
 }
 
 
+bool ReinhardGlobal::supportsTiling() const {
+	return true;
+}
+
+void ReinhardGlobal::beginStatistics() {
+	Filter::beginStatistics();
+	stats_logLumSum = 0.0;
+	stats_pixels = 0;
+	stats_Lwhite = 0.f;
+}
+
+void ReinhardGlobal::accumulateStatistics(Image rows) {
+	double logLumSum = 0.0;
+	float Lwhite = stats_Lwhite;
+
+	#pragma omp parallel reduction(+:logLumSum) reduction(max:Lwhite)
+	{
+		float* row = (float*) malloc(rows.width*NUM_CHANNELS*sizeof(float));
+
+		#pragma omp for
+		for (int y = 0; y < rows.height; y++) {
+			readRow(rows, y, row);
+			for (int x = 0; x < rows.width; x++) {
+				const float* pixel = row + x*NUM_CHANNELS;
+				float3 hdr = {pixel[0], pixel[1], pixel[2]};
+				float lum = getPixelLuminance(hdr);
+				logLumSum += log(lum + 0.000001);
+				if (lum > Lwhite) Lwhite = lum;
+			}
+		}
+
+		free(row);
+	}
+
+	stats_logLumSum += logLumSum;
+	stats_pixels += rows.width*rows.height;
+	stats_Lwhite = Lwhite;
+}
+
+void ReinhardGlobal::endStatistics() {
+	Filter::endStatistics();
+	stats_logAvgLum = exp(stats_logLumSum/stats_pixels);
+	reportStatus("Whole image logAvgLum: %f, Lwhite: %f", stats_logAvgLum, stats_Lwhite);
+}
+
+void ReinhardGlobal::copyStatistics(const Filter& other) {
+	const ReinhardGlobal* from = dynamic_cast<const ReinhardGlobal*>(&other);
+	if (!from) return;
+	Filter::copyStatistics(other);
+	stats_logLumSum = from->stats_logLumSum;
+	stats_pixels = from->stats_pixels;
+	stats_logAvgLum = from->stats_logAvgLum;
+	stats_Lwhite = from->stats_Lwhite;
+}
+
+
+uint64_t ReinhardGlobal::hashParameters(uint64_t hash) const {
+	const float parameters[] = {key, sat};
+	const float statistics[] = {stats_logAvgLum, stats_Lwhite};
+	hash = Filter::hashParameters(hash);
+	hash = hashBytes(parameters, sizeof(parameters), hash);
+	if (m_fixedStatistics) hash = hashBytes(statistics, sizeof(statistics), hash);
+	return hash;
+}
+
 bool ReinhardGlobal::runReference(Image input, Image output) {
 
 	// Check for cached result
-	if (m_reference.data) {
-		memcpy(output.data, m_reference.data, output.width*output.height*4);
+	if (lookupReference(input, output)) {
 		reportStatus("Finished reference (cached)");
 		return true;
 	}
@@ -217,50 +345,62 @@ bool ReinhardGlobal::runReference(Image input, Image output) {
 	float logAvgLum = 0.f;
 	float Lwhite = 0.f;	//smallest luminance that'll be mapped to pure white
 
-	for (int y = 0; y < input.height; y++) {
-		for (int x = 0; x < input.width; x++) {
-
-			float3 hdr = {getPixel(input, x, y, 0),
-				getPixel(input, x, y, 1), getPixel(input, x, y, 2)};
-
-			float lum = getPixelLuminance(hdr);
-			logAvgLum += log(lum + 0.000001);
-
-			if (lum > Lwhite) Lwhite = lum;
+	if (m_fixedStatistics) {
+		logAvgLum = stats_logAvgLum;
+		Lwhite = stats_Lwhite;
+	}
+	else {
+		float* row = (float*) malloc(input.width*NUM_CHANNELS*sizeof(float));
+		for (int y = 0; y < input.height; y++) {
+			readRow(input, y, row);
+			for (int x = 0; x < input.width; x++) {
+				const float* pixel = row + x*NUM_CHANNELS;
+				float3 hdr = {pixel[0], pixel[1], pixel[2]};
+
+				float lum = getPixelLuminance(hdr);
+				logAvgLum += log(lum + 0.000001);
+
+				if (lum > Lwhite) Lwhite = lum;
+			}
 		}
+		free(row);
+		logAvgLum = exp(logAvgLum/(input.width*input.height));
 	}
-	logAvgLum = exp(logAvgLum/(input.width*input.height));
-
-	//Global Tone-mapping operator
-	for (int y = 0; y < input.height; y++) {
-		for (int x = 0; x < input.width; x++) {
-			float3 rgb, xyz;
-			rgb.x = getPixel(input, x, y, 0);
-			rgb.y = getPixel(input, x, y, 1);
-			rgb.z = getPixel(input, x, y, 2);
-
-			xyz = RGBtoXYZ(rgb);
 
-			float L  = (key/logAvgLum) * xyz.y;
-			float Ld = (L * (1.f + L/(Lwhite * Lwhite)) )/(1.f + L);
-
-			rgb.x = pow(rgb.x/xyz.y, sat) * Ld;
-			rgb.y = pow(rgb.y/xyz.y, sat) * Ld;
-			rgb.z = pow(rgb.z/xyz.y, sat) * Ld;
-
-			setPixel(output, x, y, 0, rgb.x*PIXEL_RANGE);
-			setPixel(output, x, y, 1, rgb.y*PIXEL_RANGE);
-			setPixel(output, x, y, 2, rgb.z*PIXEL_RANGE);
+	//Global Tone-mapping operator, alpha is passed through as the kernel does
+	#pragma omp parallel
+	{
+		float* row = (float*) malloc(input.width*NUM_CHANNELS*sizeof(float));
+
+		#pragma omp for
+		for (int y = 0; y < input.height; y++) {
+			readRow(input, y, row);
+			for (int x = 0; x < input.width; x++) {
+				float* pixel = row + x*NUM_CHANNELS;
+				float3 rgb, xyz;
+				rgb.x = pixel[0];
+				rgb.y = pixel[1];
+				rgb.z = pixel[2];
+
+				xyz = RGBtoXYZ(rgb);
+
+				float L  = (key/logAvgLum) * xyz.y;
+				float Ld = (L * (1.f + L/(Lwhite * Lwhite)) )/(1.f + L);
+
+				pixel[0] = pow(rgb.x/xyz.y, sat) * Ld * PIXEL_RANGE;
+				pixel[1] = pow(rgb.y/xyz.y, sat) * Ld * PIXEL_RANGE;
+				pixel[2] = pow(rgb.z/xyz.y, sat) * Ld * PIXEL_RANGE;
+			}
+			writeRow(output, y, row);
 		}
+
+		free(row);
 	}
 
 	reportStatus("Finished reference");
 
 	// Cache result
-	m_reference.width = output.width;
-	m_reference.height = output.height;
-	m_reference.data = new uchar[output.width*output.height*NUM_CHANNELS];
-	memcpy(m_reference.data, output.data, output.width*output.height*NUM_CHANNELS);
+	cacheReference(output);
 
 	return true;
 }
\ No newline at end of file
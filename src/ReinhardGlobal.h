@@ -6,16 +6,38 @@ class ReinhardGlobal : public Filter {
 public:
 	ReinhardGlobal(float _key=0.18f, float _sat=1.6f);
 
+	virtual Filter* clone() const;
+
 	virtual bool setupOpenCL(cl_context_properties context_prop[], const Params& params);
 	virtual double runCLKernels(bool recomputeMapping);
 	virtual bool runOpenCL(int input_texid, int output_texid, bool recomputeMapping);
 	virtual bool runOpenCL(Image input, Image output, bool recomputeMapping);
 	virtual bool cleanupOpenCL();
 	virtual bool runReference(Image input, Image output);
+	virtual bool runHalideCPU(Image input, Image output, const Params& params);
+	virtual bool runHalideGPU(Image input, Image output, const Params& params);
+	virtual bool runHalideAuto(Image input, Image output, const Params& params);
+
+	virtual bool supportsTiling() const;
+	virtual void beginStatistics();
+	virtual void accumulateStatistics(Image rows);
+	virtual void endStatistics();
+	virtual void copyStatistics(const Filter& other);
 
 protected:
+	bool runHalide(Image input, Image output, const Params& params, unsigned int method);
+
 	//some parameters
 	float key;
 	float sat;
+
+	//whole image statistics, see Filter::beginStatistics
+	double stats_logLumSum;
+	size_t stats_pixels;
+	float stats_logAvgLum;
+	float stats_Lwhite;
+
+	virtual uint64_t hashParameters(uint64_t hash) const;
+	virtual bool updateParameters();
 };
 }
\ No newline at end of file
@@ -8,8 +8,10 @@
 #include "ReinhardLocal.h"
 #include "opencl/reinhardLocal.h"
 #if ENABLE_HALIDE
-#include "halide/blur_cpu.h"
-#include "halide/blur_gpu.h"
+#include "halide/reinhardLocal_cpu.h"
+#include "halide/reinhardLocal_gpu.h"
+#include "halide/reinhardLocal_auto.h"
+#include "halide/buffer.h"
 #endif
 
 /* 
@@ -26,13 +28,23 @@ ReinhardLocal::ReinhardLocal(float _key, float _sat, float _epsilon, float _phi)
 	epsilon = _epsilon;
 	phi = _phi;
 	num_mipmaps = 8;
+	addParameter("key", &key, 0.001f, 4.f, "the value the log average luminance maps to", PARAMETER_MAPPING);
+	addParameter("sat", &sat, 0.f, 4.f, "colour saturation");
+	addParameter("epsilon", &epsilon, 0.0001f, 1.f, "how far the average may change before a smaller scale is used", PARAMETER_MAPPING);
+	addParameter("phi", &phi, 1.f, 32.f, "sharpening, larger keeps more of the surround", PARAMETER_MAPPING);
+}
+
+Filter* ReinhardLocal::clone() const {
+	return new ReinhardLocal(key, sat, epsilon, phi);
 }
 
 bool ReinhardLocal::setupOpenCL(cl_context_properties context_prop[], const Params& params) {
+	TraceScope trace(m_trace, "setupOpenCL", m_name);
 
 	char flags[1024];
-	sprintf(flags, "-cl-fast-relaxed-math -D NUM_CHANNELS=%d -Dimage_size=%d -D WIDTH=%d -D HEIGHT=%d -D NUM_MIPMAPS=%d -D PHI=%f -D EPSILON=%f",
-				NUM_CHANNELS, image_width*image_height, image_width, image_height, num_mipmaps, phi, epsilon);
+	sprintf(flags, "-cl-fast-relaxed-math -D NUM_CHANNELS=%d -Dimage_size=%d -D WIDTH=%d -D HEIGHT=%d -D NUM_MIPMAPS=%d%s",
+				NUM_CHANNELS, image_width*image_height, image_width, image_height, num_mipmaps,
+				params.halfPrecision ? " -D HALF_STORAGE" : "");
 
 	if (!initCL(context_prop, params, reinhardLocal_kernel, flags)) {
 		return false;
@@ -103,8 +115,10 @@ bool ReinhardLocal::setupOpenCL(cl_context_properties context_prop[], const Para
 		m_offset[level] = m_offset[level-1] + m_width[level-1]*m_height[level-1];
 	}
 
-	mems["logLum_Mips"] = clCreateBuffer(m_clContext, CL_MEM_READ_WRITE, sizeof(float)*image_width*image_height*2, NULL, &err);
-	CHECK_ERROR_OCL(err, "creating logLum_Mip1 memory", return false);
+	//size of one element of the intermediate planes
+	const size_t storage_size = params.halfPrecision ? sizeof(cl_half) : sizeof(float);
+	reportStatus("Intermediate storage: %s", params.halfPrecision ? "half" : "float");
+
 
 	mems["m_width"] = clCreateBuffer(m_clContext, CL_MEM_COPY_HOST_PTR, sizeof(int)*num_mipmaps, m_width, &err);
 	CHECK_ERROR_OCL(err, "creating m_width memory", return false);
@@ -115,28 +129,18 @@ bool ReinhardLocal::setupOpenCL(cl_context_properties context_prop[], const Para
 	mems["m_offset"] = clCreateBuffer(m_clContext, CL_MEM_COPY_HOST_PTR, sizeof(int)*num_mipmaps, m_offset, &err);
 	CHECK_ERROR_OCL(err, "creating m_offset memory", return false);
 
-	mems["logAvgLum"] = clCreateBuffer(m_clContext, CL_MEM_READ_WRITE, sizeof(float)*num_wg, NULL, &err);
-	CHECK_ERROR_OCL(err, "creating logAvgLum memory", return false);
-
-	mems["Ld_array"] = clCreateBuffer(m_clContext, CL_MEM_READ_WRITE, sizeof(float)*image_width*image_height, NULL, &err);
-	CHECK_ERROR_OCL(err, "creating Ld_array memory", return false);
-
-	if (params.opengl) {
-		mem_images[0] = clCreateFromGLTexture2D(m_clContext, CL_MEM_READ_ONLY, GL_TEXTURE_2D, 0, in_tex, &err);
-		CHECK_ERROR_OCL(err, "creating gl input texture", return false);
-		
-		mem_images[1] = clCreateFromGLTexture2D(m_clContext, CL_MEM_WRITE_ONLY, GL_TEXTURE_2D, 0, out_tex, &err);
-		CHECK_ERROR_OCL(err, "creating gl output texture", return false);
+	//live ranges in kernel steps: 0 computeLogAvgLum, 1 finalReduc, 2 channel_mipmap, 3 reinhardLocal, 4 tonemap.
+	//everything is live throughout: runs that don't recompute the mapping reuse Ld_array,
+	//and a key, phi or epsilon change reruns reinhardLocal on the kept mipmaps
+	planBuffer("logLum_Mips", storage_size*image_width*image_height*2, 0, 4);
+	planBuffer("logAvgLum", sizeof(float)*num_wg, 0, 4);
+	planBuffer("Ld_array", storage_size*image_width*image_height, 0, 4);
+	if (!allocateBuffers()) {
+		return false;
 	}
-	else {
-		cl_image_format format;
-		format.image_channel_order = CL_RGBA;
-		format.image_channel_data_type = CL_UNSIGNED_INT8;
-		mem_images[0] = clCreateImage2D(m_clContext, CL_MEM_READ_ONLY, &format, image_width, image_height, 0, NULL, &err);
-		CHECK_ERROR_OCL(err, "creating input image memory", return false);
-	
-		mem_images[1] = clCreateImage2D(m_clContext, CL_MEM_WRITE_ONLY, &format, image_width, image_height, 0, NULL, &err);
-		CHECK_ERROR_OCL(err, "creating output image memory", return false);
+
+	if (!createImageMemory(params)) {
+		return false;
 	}
 
 	/////////////////////////////////////////////////////////////////setting kernel arguements
@@ -160,30 +164,47 @@ bool ReinhardLocal::setupOpenCL(cl_context_properties context_prop[], const Para
 	err  = clSetKernelArg(kernels["reinhardLocal"], 3, sizeof(cl_mem), &mems["m_height"]);
 	err  = clSetKernelArg(kernels["reinhardLocal"], 4, sizeof(cl_mem), &mems["m_offset"]);
 	err  = clSetKernelArg(kernels["reinhardLocal"], 5, sizeof(cl_mem), &mems["logAvgLum"]);
-	err  = clSetKernelArg(kernels["reinhardLocal"], 6, sizeof(float), &key);
 	CHECK_ERROR_OCL(err, "setting reinhardLocal arguments", return false);
 
 	err  = clSetKernelArg(kernels["tonemap"], 0, sizeof(cl_mem), &mem_images[0]);
 	err  = clSetKernelArg(kernels["tonemap"], 1, sizeof(cl_mem), &mem_images[1]);
 	err  = clSetKernelArg(kernels["tonemap"], 2, sizeof(cl_mem), &mems["Ld_array"]);
-	err  = clSetKernelArg(kernels["tonemap"], 3, sizeof(float), &sat);
 	CHECK_ERROR_OCL(err, "setting tonemap arguments", return false);
+	if (!updateParameters()) return false;
 
 	reportStatus("\n\n");
 
 	return true;
 }
 
+bool ReinhardLocal::updateParameters() {
+	cl_int err;
+	err  = clSetKernelArg(kernels["reinhardLocal"], 6, sizeof(float), &key);
+	err |= clSetKernelArg(kernels["reinhardLocal"], 7, sizeof(float), &phi);
+	err |= clSetKernelArg(kernels["reinhardLocal"], 8, sizeof(float), &epsilon);
+	err |= clSetKernelArg(kernels["tonemap"], 3, sizeof(float), &sat);
+	CHECK_ERROR_OCL(err, "setting reinhardLocal parameters", return false);
+	return true;
+}
+
 double ReinhardLocal::runCLKernels(bool recomputeMapping) {
+	TraceScope trace(m_trace, "runCLKernels", m_name);
 	double start = omp_get_wtime();
 
 	cl_int err;
 	if (recomputeMapping) {
-		err = clEnqueueNDRangeKernel(m_queue, kernels["computeLogAvgLum"], 2, NULL, global_sizes["computeLogAvgLum"], local_sizes["computeLogAvgLum"], 0, NULL, NULL);
+		err = clEnqueueNDRangeKernel(m_queue, kernels["computeLogAvgLum"], 2, NULL, global_sizes["computeLogAvgLum"], local_sizes["computeLogAvgLum"], 0, NULL, traceEvent("computeLogAvgLum"));
 		CHECK_ERROR_OCL(err, "enqueuing computeLogAvgLum kernel", return false);
 	
-		err = clEnqueueNDRangeKernel(m_queue, kernels["finalReduc"], 1, NULL, &global_sizes["finalReduc"][0], &local_sizes["finalReduc"][0], 0, NULL, NULL);
-		CHECK_ERROR_OCL(err, "enqueuing finalReduc kernel", return false);
+		if (m_fixedStatistics) {
+			//computeLogAvgLum still fills in the luminance plane, only its sum is replaced
+			err = clEnqueueWriteBuffer(m_queue, mems["logAvgLum"], CL_FALSE, 0, sizeof(float), &stats_logAvgLum, 0, NULL, NULL);
+			CHECK_ERROR_OCL(err, "writing fixed statistics", return false);
+		}
+		else {
+			err = clEnqueueNDRangeKernel(m_queue, kernels["finalReduc"], 1, NULL, &global_sizes["finalReduc"][0], &local_sizes["finalReduc"][0], 0, NULL, traceEvent("finalReduc"));
+			CHECK_ERROR_OCL(err, "enqueuing finalReduc kernel", return false);
+		}
 	
 		//creating mipmaps
 		for (int level=1; level<num_mipmaps; level++) {
@@ -194,15 +215,19 @@ double ReinhardLocal::runCLKernels(bool recomputeMapping) {
 			err  = clSetKernelArg(kernels["channel_mipmap"], 5, sizeof(int), &m_offset[level]);
 			CHECK_ERROR_OCL(err, "setting channel_mipmap arguments", return false);
 	
-			err = clEnqueueNDRangeKernel(m_queue, kernels["channel_mipmap"], 2, NULL, global_sizes["channel_mipmap"], local_sizes["channel_mipmap"], 0, NULL, NULL);
+			err = clEnqueueNDRangeKernel(m_queue, kernels["channel_mipmap"], 2, NULL, global_sizes["channel_mipmap"], local_sizes["channel_mipmap"], 0, NULL, traceEvent("channel_mipmap"));
 			CHECK_ERROR_OCL(err, "enqueuing channel_mipmap kernel", return false);
 		}
-	
-		err = clEnqueueNDRangeKernel(m_queue, kernels["reinhardLocal"], 2, NULL, global_sizes["reinhardLocal"], local_sizes["reinhardLocal"], 0, NULL, NULL);
+	}
+
+	//the luminance and its mipmaps don't depend on the parameters, only this does
+	if (recomputeMapping || m_mappingChanged) {
+		err = clEnqueueNDRangeKernel(m_queue, kernels["reinhardLocal"], 2, NULL, global_sizes["reinhardLocal"], local_sizes["reinhardLocal"], 0, NULL, traceEvent("reinhardLocal"));
 		CHECK_ERROR_OCL(err, "enqueuing reinhardLocal kernel", return false);
+		m_mappingChanged = false;
 	}
 
-	err = clEnqueueNDRangeKernel(m_queue, kernels["tonemap"], 2, NULL, global_sizes["tonemap"], local_sizes["tonemap"], 0, NULL, NULL);
+	err = clEnqueueNDRangeKernel(m_queue, kernels["tonemap"], 2, NULL, global_sizes["tonemap"], local_sizes["tonemap"], 0, NULL, traceEvent("tonemap"));
 	CHECK_ERROR_OCL(err, "enqueuing tonemap kernel", return false);
 
 	err = clFinish(m_queue);
@@ -223,6 +248,7 @@ bool ReinhardLocal::runOpenCL(int input_texid, int output_texid, bool recomputeM
 	err = clEnqueueReleaseGLObjects(m_queue, 2, &mem_images[0], 0, 0, 0);
 	CHECK_ERROR_OCL(err, "releasing GL objects", return false);
 
+	recordFrame(0, runTime, 0, 0, 0);
 	reportStatus("Finished OpenCL kernels in %lf ms", runTime*1000);
 
 	return true;
@@ -235,27 +261,79 @@ bool ReinhardLocal::runOpenCL(Image input, Image output, bool recomputeMapping)
 
  	const size_t origin[] = {0, 0, 0};
  	const size_t region[] = {input.width, input.height, 1};
-	err = clEnqueueWriteImage(m_queue, mem_images[0], CL_TRUE, origin, region, sizeof(uchar)*input.width*NUM_CHANNELS, 0, input.data, 0, NULL, NULL);
+	double upload = metricsTime();
+	err = clEnqueueWriteImage(m_queue, mem_images[0], CL_TRUE, origin, region, rowBytes(input), 0, input.data, 0, NULL, traceEvent("upload"));
 	CHECK_ERROR_OCL(err, "writing image memory", return false);
+	upload = metricsTime() - upload;
 
 	//let it begin
 	double runTime = runCLKernels(recomputeMapping);
 
 	//read results back
-	err = clEnqueueReadImage(m_queue, mem_images[1], CL_TRUE, origin, region, sizeof(uchar)*input.width*NUM_CHANNELS, 0, output.data, 0, NULL, NULL);
+	double download = metricsTime();
+	err = clEnqueueReadImage(m_queue, mem_images[1], CL_TRUE, origin, region, rowBytes(output), 0, output.data, 0, NULL, traceEvent("download"));
 	CHECK_ERROR_OCL(err, "reading image memory", return false);
+	recordFrame(upload, runTime, metricsTime() - download, bytesPerPixel(input.format)*input.width*input.height, sizeof(uchar)*input.width*input.height*NUM_CHANNELS);
 
 	reportStatus("Finished OpenCL kernel");
 
-	bool passed = verify(input, output);
-	reportStatus(
-		"Finished in %lf ms (verification %s)",
-		runTime*1000, passed ? "passed" : "failed");
+	bool passed = true;
+	if (m_params.verify) {
+		passed = verify(input, output, m_params.halfPrecision ? VERIFY_TOLERANCE_HALF : VERIFY_TOLERANCE);
+		reportStatus(
+			"Finished in %lf ms (verification %s)",
+			runTime*1000, passed ? "passed" : "failed");
+	}
+	else reportStatus("Finished in %lf ms", runTime*1000);
 
 	return passed;
 }
 
 
+bool ReinhardLocal::runHalideCPU(Image input, Image output, const Params& params) {
+	return runHalide(input, output, params, METHOD_HALIDE_CPU);
+}
+
+bool ReinhardLocal::runHalideGPU(Image input, Image output, const Params& params) {
+	return runHalide(input, output, params, METHOD_HALIDE_GPU);
+}
+
+bool ReinhardLocal::runHalideAuto(Image input, Image output, const Params& params) {
+	return runHalide(input, output, params, METHOD_HALIDE_AUTO);
+}
+
+bool ReinhardLocal::runHalide(Image input, Image output, const Params& params, unsigned int method) {
+#if ENABLE_HALIDE
+	//the pipelines take linear radiance, as the OpenCL kernels read it
+	Image in = input;
+	if (in.format != IMAGE_RGBA32F) toFloat(in);
+	HalideImage in_buf(in);
+	HalideImage out_buf(output);
+
+	reportStatus("Running Halide %s pipeline", halideScheduleName(method));
+	double start = getCurrentTime();
+	int err;
+	switch (method) {
+		case METHOD_HALIDE_GPU:  err = halide_reinhardLocal_gpu(&in_buf.buf, key, sat, epsilon, phi, &out_buf.buf); break;
+		case METHOD_HALIDE_AUTO: err = halide_reinhardLocal_auto(&in_buf.buf, key, sat, epsilon, phi, &out_buf.buf); break;
+		default:                 err = halide_reinhardLocal_cpu(&in_buf.buf, key, sat, epsilon, phi, &out_buf.buf); break;
+	}
+	if (!err) err = halideFinish(&in_buf.buf, &out_buf.buf);
+	double runTime = (getCurrentTime() - start)/1e6;
+
+	if (in.data != input.data) free(in.data);
+	if (err) {
+		reportStatus("Error running Halide pipeline (%d)", err);
+		return false;
+	}
+	return finishHalide(input, output, params, runTime);
+#else
+	reportStatus("Built without Halide, build with HALIDE=1 to run %s with it", m_name);
+	return false;
+#endif
+}
+
+
 bool ReinhardLocal::cleanupOpenCL() {
 	clReleaseMemObject(mem_images[0]);
 	clReleaseMemObject(mem_images[1]);
@@ -275,11 +353,76 @@ bool ReinhardLocal::cleanupOpenCL() {
 }
 
 
+bool ReinhardLocal::supportsTiling() const {
+	return true;
+}
+
+//each mipmap level averages 2x2 blocks of the one below, so a pixel's surround
+//is the aligned block of this size that contains it. Tiles on that grid build the
+//same pyramid as the whole image would, without needing a halo
+int ReinhardLocal::getTileAlignment() const {
+	return 1 << (num_mipmaps-1);
+}
+
+void ReinhardLocal::beginStatistics() {
+	Filter::beginStatistics();
+	stats_logLumSum = 0.0;
+	stats_pixels = 0;
+}
+
+void ReinhardLocal::accumulateStatistics(Image rows) {
+	double logLumSum = 0.0;
+
+	#pragma omp parallel reduction(+:logLumSum)
+	{
+		float* row = (float*) malloc(rows.width*NUM_CHANNELS*sizeof(float));
+
+		#pragma omp for
+		for (int y = 0; y < rows.height; y++) {
+			readRow(rows, y, row);
+			for (int x = 0; x < rows.width; x++) {
+				const float* pixel = row + x*NUM_CHANNELS;
+				float3 rgb = {pixel[0], pixel[1], pixel[2]};
+				logLumSum += log(getPixelLuminance(rgb) + 0.000001);
+			}
+		}
+
+		free(row);
+	}
+
+	stats_logLumSum += logLumSum;
+	stats_pixels += rows.width*rows.height;
+}
+
+void ReinhardLocal::endStatistics() {
+	Filter::endStatistics();
+	stats_logAvgLum = exp(stats_logLumSum/stats_pixels);
+	reportStatus("Whole image logAvgLum: %f", stats_logAvgLum);
+}
+
+void ReinhardLocal::copyStatistics(const Filter& other) {
+	const ReinhardLocal* from = dynamic_cast<const ReinhardLocal*>(&other);
+	if (!from) return;
+	Filter::copyStatistics(other);
+	stats_logLumSum = from->stats_logLumSum;
+	stats_pixels = from->stats_pixels;
+	stats_logAvgLum = from->stats_logAvgLum;
+}
+
+
+uint64_t ReinhardLocal::hashParameters(uint64_t hash) const {
+	const float parameters[] = {key, sat, epsilon, phi};
+	hash = Filter::hashParameters(hash);
+	hash = hashBytes(parameters, sizeof(parameters), hash);
+	hash = hashBytes(&num_mipmaps, sizeof(num_mipmaps), hash);
+	if (m_fixedStatistics) hash = hashBytes(&stats_logAvgLum, sizeof(stats_logAvgLum), hash);
+	return hash;
+}
+
 bool ReinhardLocal::runReference(Image input, Image output) {
 
 	// Check for cached result
-	if (m_reference.data) {
-		memcpy(output.data, m_reference.data, output.width*output.height*NUM_CHANNELS);
+	if (lookupReference(input, output)) {
 		reportStatus("Finished reference (cached)");
 		return true;
 	}
@@ -289,93 +432,114 @@ bool ReinhardLocal::runReference(Image input, Image output) {
 
 	float logAvgLum = 0.f;
 
-	for (int y = 0; y < input.height; y++) {
-		for (int x = 0; x < input.width; x++) {
-
-			float3 rgb = {getPixel(input, x, y, 0),
-				getPixel(input, x, y, 1), getPixel(input, x, y, 2)};
-
-			logAvgLum += log(getPixelLuminance(rgb) + 0.000001);
+	if (m_fixedStatistics) logAvgLum = stats_logAvgLum;
+	else {
+		float* row = (float*) malloc(input.width*NUM_CHANNELS*sizeof(float));
+		for (int y = 0; y < input.height; y++) {
+			readRow(input, y, row);
+			for (int x = 0; x < input.width; x++) {
+				const float* pixel = row + x*NUM_CHANNELS;
+				float3 rgb = {pixel[0], pixel[1], pixel[2]};
+
+				logAvgLum += log(getPixelLuminance(rgb) + 0.000001);
+			}
 		}
+		free(row);
+		logAvgLum = exp(logAvgLum/(input.width*input.height));
 	}
-	logAvgLum = exp(logAvgLum/(input.width*input.height));
 
 	float factor = key/logAvgLum;
+
+	//only the levels with pixels, an image narrower or shorter than the
+	//coarsest level, like the edge tiles of a tiled run, has fewer
+	int levels = 1;
+	while (levels < num_mipmaps && (input.width >> levels) > 0 && (input.height >> levels) > 0) levels++;
 	float scale[num_mipmaps-1];
 
-	Image* mipmap_pyramid = (Image*) calloc(num_mipmaps, sizeof(Image));
+	Image* mipmap_pyramid = (Image*) calloc(levels, sizeof(Image));
 	mipmap_pyramid[0] = input;
-	for (int i=1; i<num_mipmaps; i++) {
+	for (int i=1; i<levels; i++) {
 		mipmap_pyramid[i] = image_mipmap(input, i);
 		scale[i-1] = pow(2, i-1);
 	}
 
-	for (int y = 0; y < input.height; y++) {
-		for (int x = 0; x < input.width; x++) {
-
-			float local_logAvgLum = 0.f;
-			int centre_x = 0;
-			int centre_y = 0;
-			int surround_x = x;
-			int surround_y = y;
-
-			for (int i=0; i<num_mipmaps-1; i++) {
-				centre_x = surround_x;
-				centre_y = surround_y;
-				surround_x = centre_x/2;
-				surround_y = centre_y/2;
-
-				float3 centre_pixel = { getPixel(mipmap_pyramid[i], centre_x, centre_y, 0)/((float)PIXEL_RANGE),
-										getPixel(mipmap_pyramid[i], centre_x, centre_y, 1)/((float)PIXEL_RANGE),
-										getPixel(mipmap_pyramid[i], centre_x, centre_y, 2)/((float)PIXEL_RANGE)};
-				float3 surround_pixel= {getPixel(mipmap_pyramid[i+1], surround_x, surround_y, 0)/((float)PIXEL_RANGE),
-										getPixel(mipmap_pyramid[i+1], surround_x, surround_y, 1)/((float)PIXEL_RANGE),
-										getPixel(mipmap_pyramid[i+1], surround_x, surround_y, 2)/((float)PIXEL_RANGE)};
-				float centre_logAvgLum = getPixelLuminance(centre_pixel)*(key/logAvgLum);
-				float surround_logAvgLum = getPixelLuminance(surround_pixel)*(key/logAvgLum);
-
-
-				float logAvgLum_diff = centre_logAvgLum - surround_logAvgLum;
-				logAvgLum_diff = logAvgLum_diff >= 0 ? logAvgLum_diff : -logAvgLum_diff;
-
-				if (logAvgLum_diff/(pow(2.f, phi)*key/(scale[i]*scale[i]) + centre_logAvgLum) > epsilon) {
-					local_logAvgLum = centre_logAvgLum;
-					break;
-				}
-				else local_logAvgLum = surround_logAvgLum;			
+	//alpha is passed through as the kernel does
+	#pragma omp parallel
+	{
+		//the row of each level that contains the row being mapped, clamped to
+		//the edge as getPixel would
+		float** rows = (float**) malloc(levels*sizeof(float*));
+		for (int i=0; i<levels; i++) rows[i] = (float*) malloc(mipmap_pyramid[i].width*NUM_CHANNELS*sizeof(float));
+		float* out = (float*) malloc(input.width*NUM_CHANNELS*sizeof(float));
+
+		#pragma omp for
+		for (int y = 0; y < input.height; y++) {
+			for (int i=0; i<levels; i++) {
+				readRow(mipmap_pyramid[i], std::min(y >> i, (int) mipmap_pyramid[i].height-1), rows[i]);
 			}
 
-			float3 rgb, xyz;
-			rgb.x = getPixel(input, x, y, 0);
-			rgb.y = getPixel(input, x, y, 1);
-			rgb.z = getPixel(input, x, y, 2);
+			for (int x = 0; x < input.width; x++) {
 
-			xyz = RGBtoXYZ(rgb);
+				float local_logAvgLum = 0.f;
+				int centre_x = 0;
+				int surround_x = x;
 
-			float L  = (key/logAvgLum) * xyz.y;
-			float Ld = L /(1.0 + local_logAvgLum);
+				for (int i=0; i<levels-1; i++) {
+					centre_x = surround_x;
+					surround_x = centre_x/2;
 
-			rgb.x = (pow(rgb.x/xyz.y, sat) * Ld)*PIXEL_RANGE;
-			rgb.y = (pow(rgb.y/xyz.y, sat) * Ld)*PIXEL_RANGE;
-			rgb.z = (pow(rgb.z/xyz.y, sat) * Ld)*PIXEL_RANGE;
+					const float* centre = rows[i] + std::min(centre_x, (int) mipmap_pyramid[i].width-1)*NUM_CHANNELS;
+					const float* surround = rows[i+1] + std::min(surround_x, (int) mipmap_pyramid[i+1].width-1)*NUM_CHANNELS;
+					float3 centre_pixel = { centre[0]/((float)PIXEL_RANGE),
+											centre[1]/((float)PIXEL_RANGE),
+											centre[2]/((float)PIXEL_RANGE)};
+					float3 surround_pixel= {surround[0]/((float)PIXEL_RANGE),
+											surround[1]/((float)PIXEL_RANGE),
+											surround[2]/((float)PIXEL_RANGE)};
+					float centre_logAvgLum = getPixelLuminance(centre_pixel)*(key/logAvgLum);
+					float surround_logAvgLum = getPixelLuminance(surround_pixel)*(key/logAvgLum);
 
-			//printf("%f, %f, %f\n", rgb.x, rgb.y, rgb.z);
 
-			setPixel(output, x, y, 0, rgb.x);
-			setPixel(output, x, y, 1, rgb.y);
-			setPixel(output, x, y, 2, rgb.z);
-		}
-	}
+					float logAvgLum_diff = centre_logAvgLum - surround_logAvgLum;
+					logAvgLum_diff = logAvgLum_diff >= 0 ? logAvgLum_diff : -logAvgLum_diff;
+
+					if (logAvgLum_diff/(pow(2.f, phi)*key/(scale[i]*scale[i]) + centre_logAvgLum) > epsilon) {
+						local_logAvgLum = centre_logAvgLum;
+						break;
+					}
+					else local_logAvgLum = surround_logAvgLum;
+				}
+
+				const float* pixel = rows[0] + x*NUM_CHANNELS;
+				float3 rgb, xyz;
+				rgb.x = pixel[0];
+				rgb.y = pixel[1];
+				rgb.z = pixel[2];
+
+				xyz = RGBtoXYZ(rgb);
 
+				float L  = (key/logAvgLum) * xyz.y;
+				float Ld = L /(1.0 + local_logAvgLum);
 
+				out[x*NUM_CHANNELS + 0] = (pow(rgb.x/xyz.y, sat) * Ld)*PIXEL_RANGE;
+				out[x*NUM_CHANNELS + 1] = (pow(rgb.y/xyz.y, sat) * Ld)*PIXEL_RANGE;
+				out[x*NUM_CHANNELS + 2] = (pow(rgb.z/xyz.y, sat) * Ld)*PIXEL_RANGE;
+				out[x*NUM_CHANNELS + 3] = pixel[3];
+			}
+			writeRow(output, y, out);
+		}
+
+		for (int i=0; i<levels; i++) free(rows[i]);
+		free(rows);
+		free(out);
+	}
+	for (int i=1; i<levels; i++) releaseImage(mipmap_pyramid[i]);
+	free(mipmap_pyramid);
 
 	reportStatus("Finished reference");
 
 	// Cache result
-	m_reference.width = output.width;
-	m_reference.height = output.height;
-	m_reference.data = new uchar[output.width*output.height*4];
-	memcpy(m_reference.data, output.data, output.width*output.height*4);
+	cacheReference(output);
 
 	return true;
 }
\ No newline at end of file
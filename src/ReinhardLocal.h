@@ -6,25 +6,46 @@ class ReinhardLocal : public Filter {
 public:
 	ReinhardLocal(float _key=0.18f, float _sat=1.6f, float _epsilon=0.05, float _phi=8.0);
 
+	virtual Filter* clone() const;
+
 	virtual bool setupOpenCL(cl_context_properties context_prop[], const Params& params);
 	virtual double runCLKernels(bool recomputeMapping);
 	virtual bool runOpenCL(int input_texid, int output_texid, bool recomputeMapping);
 	virtual bool runOpenCL(Image input, Image output, bool recomputeMapping);
 	virtual bool cleanupOpenCL();
 	virtual bool runReference(Image input, Image output);
+	virtual bool runHalideCPU(Image input, Image output, const Params& params);
+	virtual bool runHalideGPU(Image input, Image output, const Params& params);
+	virtual bool runHalideAuto(Image input, Image output, const Params& params);
+
+	virtual bool supportsTiling() const;
+	virtual int getTileAlignment() const;
+	virtual void beginStatistics();
+	virtual void accumulateStatistics(Image rows);
+	virtual void endStatistics();
+	virtual void copyStatistics(const Filter& other);
 
 protected:
+	bool runHalide(Image input, Image output, const Params& params, unsigned int method);
+
 	//some parameters
 	float key;
 	float sat;
 	float epsilon;
 	float phi;
 
+	//whole image statistics, see Filter::beginStatistics
+	double stats_logLumSum;
+	size_t stats_pixels;
+	float stats_logAvgLum;
+
 	//information regarding all mipmap levels
 	int num_mipmaps;
 	int* m_width;		//at index i this contains the width of the mipmap at index i
 	int* m_height;		//at index i this contains the height of the mipmap at index i
 	int* m_offset;		//at index i this contains the start point to store the mipmap at level i
 
+	virtual uint64_t hashParameters(uint64_t hash) const;
+	virtual bool updateParameters();
 };
 }
\ No newline at end of file
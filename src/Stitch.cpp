@@ -0,0 +1,326 @@
+#include <string.h>
+#include <iostream>
+#include <cstdio>
+#include <algorithm>
+#include <omp.h>
+
+#include "Stitch.h"
+#include "opencl/stitching.h"
+
+/*
+Combines different exposure images to create HDR, as proposed here:
+http://www.ceng.metu.edu.tr/~akyuz/files/hdrgpu.pdf
+*/
+
+#define MIN_WEIGHT	0.01f	//weight of pixels clipped in an exposure
+#define MIDTONE_MIN	0.1f	//luminance range, as a fraction of PIXEL_RANGE, trusted
+#define MIDTONE_MAX	0.9f	//in both exposures when estimating their ratio
+
+using namespace hdr;
+
+static float weight(float luminance) {
+	if (luminance < 0.5f) return std::max(luminance*2.f, MIN_WEIGHT);
+	else return std::max((1.f - luminance)*2.f, MIN_WEIGHT);
+}
+
+static float getLuminance(Image &image, int x, int y) {
+	float3 pixel = {getPixel(image, x, y, 0), getPixel(image, x, y, 1), getPixel(image, x, y, 2)};
+	return getPixelLuminance(pixel);
+}
+
+Stitch::Stitch() : Filter() {
+	m_name = "Stitch";
+	num_images = 0;
+}
+
+Image Stitch::stackExposures(const std::vector<Image>& images) {
+	Image stack = {NULL, 0, 0, IMAGE_RGBA8, 0};
+	if (images.empty()) return stack;
+
+	size_t width = images[0].width;
+	size_t height = images[0].height;
+	for (size_t i = 0; i < images.size(); i++) {
+		if (images[i].width != width || images[i].height != height || images[i].format != IMAGE_RGBA8) {
+			reportStatus("Exposure %lu doesn't match the size or format of the first", i);
+			return stack;
+		}
+	}
+
+	size_t image_size = width*height*NUM_CHANNELS;
+	stack.data = (uchar*) calloc(image_size*images.size(), sizeof(uchar));
+	stack.width = width;
+	stack.height = height*images.size();
+	for (size_t i = 0; i < images.size(); i++) {
+		memcpy(&stack.data[i*image_size], images[i].data, image_size);
+	}
+
+	num_images = images.size();
+	return stack;
+}
+
+void Stitch::setExposures(const std::vector<float>& _exposures) {
+	given_exposures = _exposures;
+}
+
+//chains the luminance ratios of neighbouring exposures, darkest to brightest,
+//over the pixels that are mid-tones in both, then normalises to the middle one
+void Stitch::estimateExposures(Image input) {
+	if (given_exposures.size() == (size_t) num_images) {
+		exposures = given_exposures;
+		return;
+	}
+
+	int height = input.height/num_images;
+	std::vector<double> mean(num_images, 0.0);
+	for (int i = 0; i < num_images; i++) {
+		double sum = 0.0;
+		#pragma omp parallel for reduction(+:sum)
+		for (int y = 0; y < height; y++) {
+			for (int x = 0; x < input.width; x++) {
+				sum += getLuminance(input, x, y + i*height);
+			}
+		}
+		mean[i] = sum/(input.width*height);
+	}
+
+	std::vector<std::pair<double, int> > brightness(num_images);
+	for (int i = 0; i < num_images; i++) brightness[i] = std::make_pair(mean[i], i);
+	std::sort(brightness.begin(), brightness.end());
+
+	std::vector<int> order(num_images);
+	for (int i = 0; i < num_images; i++) order[i] = brightness[i].second;
+
+	exposures.assign(num_images, 1.f);
+	for (int k = 1; k < num_images; k++) {
+		int a = order[k-1];
+		int b = order[k];
+
+		double sum_a = 0.0, sum_b = 0.0;
+		#pragma omp parallel for reduction(+:sum_a,sum_b)
+		for (int y = 0; y < height; y++) {
+			for (int x = 0; x < input.width; x++) {
+				float la = getLuminance(input, x, y + a*height)/PIXEL_RANGE;
+				float lb = getLuminance(input, x, y + b*height)/PIXEL_RANGE;
+				if (la > MIDTONE_MIN && la < MIDTONE_MAX && lb > MIDTONE_MIN && lb < MIDTONE_MAX) {
+					sum_a += la;
+					sum_b += lb;
+				}
+			}
+		}
+
+		float ratio = 1.f;
+		if (sum_a > 0.0) ratio = sum_b/sum_a;
+		else if (mean[a] > 0.0) ratio = mean[b]/mean[a];	//no common mid-tones
+		exposures[b] = exposures[a]*ratio;
+	}
+
+	float middle = exposures[order[num_images/2]];
+	for (int i = 0; i < num_images; i++) {
+		exposures[i] /= middle;
+		reportStatus("Exposure %d: %f", i, exposures[i]);
+	}
+}
+
+bool Stitch::setupOpenCL(cl_context_properties context_prop[], const Params& params) {
+	TraceScope trace(m_trace, "setupOpenCL", m_name);
+	char flags[1024];
+	sprintf(flags, "-cl-fast-relaxed-math -D NUM_CHANNELS=%d -D PIXEL_RANGE=%d -D NUM_IMAGES=%d -Dimage_size=%d -D WIDTH=%d -D HEIGHT=%d -D MIN_WEIGHT=%ff",
+				NUM_CHANNELS, PIXEL_RANGE, num_images, image_width*image_height, image_width, image_height, MIN_WEIGHT);
+
+	if (!initCL(context_prop, params, stitching_kernel, flags)) {
+		return false;
+	}
+
+	cl_int err;
+
+	/////////////////////////////////////////////////////////////////kernels
+
+	//merges the exposures into a float image
+	kernels["stitch"] = clCreateKernel(m_program, "stitch", &err);
+	CHECK_ERROR_OCL(err, "creating stitch kernel", return false);
+
+
+	/////////////////////////////////////////////////////////////////kernel sizes
+
+	kernel2DSizes("stitch");
+
+
+	/////////////////////////////////////////////////////////////////allocating memory
+
+	mems["LDRimages"] = clCreateBuffer(m_clContext, CL_MEM_READ_ONLY, sizeof(cl_uchar4)*image_width*image_height*num_images, NULL, &err);
+	CHECK_ERROR_OCL(err, "creating LDRimages memory", return false);
+
+	mems["exposures"] = clCreateBuffer(m_clContext, CL_MEM_READ_ONLY, sizeof(float)*num_images, NULL, &err);
+	CHECK_ERROR_OCL(err, "creating exposures memory", return false);
+
+	//read-write so that it can be the input of a tone mapping filter
+	mem_images[0] = 0;
+	if (m_outputImage) {
+		mem_images[1] = m_outputImage;
+		clRetainMemObject(mem_images[1]);
+	}
+	else {
+		cl_image_format format;
+		format.image_channel_order = CL_RGBA;
+		format.image_channel_data_type = CL_FLOAT;
+		mem_images[1] = clCreateImage2D(m_clContext, CL_MEM_READ_WRITE, &format, image_width, image_height, 0, NULL, &err);
+		CHECK_ERROR_OCL(err, "creating output image memory", return false);
+	}
+
+
+	/////////////////////////////////////////////////////////////////setting kernel arguements
+
+	err  = clSetKernelArg(kernels["stitch"], 0, sizeof(cl_mem), &mems["LDRimages"]);
+	err |= clSetKernelArg(kernels["stitch"], 1, sizeof(cl_mem), &mems["exposures"]);
+	err |= clSetKernelArg(kernels["stitch"], 2, sizeof(cl_mem), &mem_images[1]);
+	CHECK_ERROR_OCL(err, "setting stitch arguments", return false);
+
+	reportStatus("\n\n");
+
+	return true;
+}
+
+double Stitch::runCLKernels(bool recomputeMapping) {
+	TraceScope trace(m_trace, "runCLKernels", m_name);
+	double start = omp_get_wtime();
+
+	cl_int err;
+	err = clEnqueueNDRangeKernel(m_queue, kernels["stitch"], 2, NULL, global_sizes["stitch"], local_sizes["stitch"], 0, NULL, traceEvent("stitch"));
+	CHECK_ERROR_OCL(err, "enqueuing stitch kernel", return false);
+
+	err = clFinish(m_queue);
+	CHECK_ERROR_OCL(err, "running kernels", return false);
+	return omp_get_wtime() - start;
+}
+
+bool Stitch::runOpenCL(int input_texid, int output_texid, bool recomputeMapping) {
+	reportStatus("Stitching from GL textures is not supported");
+	return false;
+}
+
+//output.data may be NULL to leave the result on the device, see getOutputImage
+bool Stitch::runOpenCL(Image input, Image output, bool recomputeMapping) {
+	cl_int err;
+
+	if (!uploadInput(input)) return false;
+
+	double runTime = runCLKernels(recomputeMapping);
+
+	//the upload was recorded by uploadInput
+	if (!output.data) {
+		recordFrame(0, runTime, 0, 0, 0);
+		reportStatus("Finished in %lf ms", runTime*1000);
+		return true;
+	}
+
+	const size_t origin[] = {0, 0, 0};
+	const size_t region[] = {output.width, output.height, 1};
+	double download = metricsTime();
+	err = clEnqueueReadImage(m_queue, mem_images[1], CL_TRUE, origin, region, rowBytes(output), 0, output.data, 0, NULL, traceEvent("download"));
+	CHECK_ERROR_OCL(err, "reading image memory", return false);
+	recordFrame(0, runTime, metricsTime() - download, 0, bytesPerPixel(output.format)*output.width*output.height);
+
+	reportStatus("Finished OpenCL kernel");
+
+	bool passed = true;
+	if (m_params.verify) {
+		passed = verify(input, output);
+		reportStatus(
+			"Finished in %lf ms (verification %s)",
+			runTime*1000, passed ? "passed" : "failed");
+	}
+	else reportStatus("Finished in %lf ms", runTime*1000);
+
+	return passed;
+}
+
+//the exposures are estimated on the host, from the stacked input
+bool Stitch::uploadInput(Image input) {
+	cl_int err;
+
+	estimateExposures(input);
+	err = clEnqueueWriteBuffer(m_queue, mems["exposures"], CL_FALSE, 0, sizeof(float)*num_images, &exposures[0], 0, NULL, NULL);
+	CHECK_ERROR_OCL(err, "writing exposures memory", return false);
+
+	err = clEnqueueWriteBuffer(m_queue, mems["LDRimages"], CL_TRUE, 0, sizeof(cl_uchar4)*input.width*input.height, input.data, 0, NULL, NULL);
+	CHECK_ERROR_OCL(err, "writing LDRimages memory", return false);
+	return true;
+}
+
+int Stitch::getOutputFormat() const {
+	return IMAGE_RGBA32F;
+}
+
+bool Stitch::cleanupOpenCL() {
+	clReleaseMemObject(mem_images[1]);
+	clReleaseMemObject(mems["LDRimages"]);
+	clReleaseMemObject(mems["exposures"]);
+	clReleaseKernel(kernels["stitch"]);
+	releaseCL();
+	return true;
+}
+
+bool Stitch::runReference(Image input, Image output) {
+	if (num_images == 0) {
+		reportStatus("No exposures to stitch");
+		return false;
+	}
+
+	estimateExposures(input);
+
+	int height = input.height/num_images;
+	#pragma omp parallel for
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < input.width; x++) {
+			float weightedSum = 0.f;
+			float3 hdr = {0.f, 0.f, 0.f};
+			for (int i = 0; i < num_images; i++) {
+				float3 ldr = {getPixel(input, x, y + i*height, 0), getPixel(input, x, y + i*height, 1), getPixel(input, x, y + i*height, 2)};
+
+				float w = weight(getPixelLuminance(ldr)/PIXEL_RANGE);
+				hdr.x += (ldr.x/exposures[i]) * w;
+				hdr.y += (ldr.y/exposures[i]) * w;
+				hdr.z += (ldr.z/exposures[i]) * w;
+				weightedSum += w;
+			}
+
+			setPixel(output, x, y, 0, hdr.x/weightedSum);
+			setPixel(output, x, y, 1, hdr.y/weightedSum);
+			setPixel(output, x, y, 2, hdr.z/weightedSum);
+			setPixel(output, x, y, 3, PIXEL_RANGE);	//opaque, the tonemappers pass alpha through
+		}
+	}
+
+	reportStatus("Finished reference");
+
+	return true;
+}
+
+Image Stitch::runFilter(Image input, Params params, unsigned int method) {
+	size_t height = num_images ? input.height/num_images : 0;
+	Image output = createImage(input.width, height, IMAGE_RGBA32F);
+
+	std::cout << "--------------------------------Stitching " << num_images << " exposures" << std::endl;
+
+	bool ran = true;
+	switch (method)
+	{
+		case METHOD_REFERENCE:
+		case METHOD_CPU:	//the reference is the CPU implementation
+			ran = runReference(input, output);
+			break;
+		case METHOD_OPENCL:
+			image_width = output.width;
+			image_height = output.height;
+			image_format = input.format;
+			ran = setupOpenCL(NULL, params);
+			if (ran) ran = runOpenCL(input, output, true);
+			cleanupOpenCL();
+			break;
+		default:
+			assert(false && "Invalid method.");
+	}
+	//as Filter::runFilter, no data when the stitch failed
+	if (!ran) releaseImage(output);
+	return output;
+}
@@ -0,0 +1,40 @@
+#include <vector>
+
+#include "Filter.h"
+
+namespace hdr
+{
+//Merges bracketed LDR exposures into a radiance map. The input image is the
+//exposures stacked on top of each other (see stackExposures), and the output
+//is an IMAGE_RGBA32F image that the tone mapping filters can take directly,
+//or on the device through getOutputImage and setInputImage.
+class Stitch : public Filter {
+public:
+	Stitch();
+
+	//stacks the exposures, which must all be the same size, into one image
+	//for the other methods; the caller frees it
+	Image stackExposures(const std::vector<Image>& images);
+
+	//relative exposure times in stacking order,
+	//estimated from the images when none are given
+	void setExposures(const std::vector<float>& _exposures);
+
+	virtual bool setupOpenCL(cl_context_properties context_prop[], const Params& params);
+	virtual double runCLKernels(bool recomputeMapping);
+	virtual bool runOpenCL(int input_texid, int output_texid, bool recomputeMapping);
+	virtual bool runOpenCL(Image input, Image output, bool recomputeMapping);
+	virtual bool cleanupOpenCL();
+	virtual bool runReference(Image input, Image output);
+	virtual Image runFilter(Image input, Params params, unsigned int method);
+	virtual bool uploadInput(Image input);
+	virtual int getOutputFormat() const;
+
+protected:
+	int num_images;
+	std::vector<float> exposures;
+	std::vector<float> given_exposures;
+
+	void estimateExposures(Image input);
+};
+}
@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <iostream>
+#include <algorithm>
+#include <exception>
+
+#include "Sweep.h"
+#include "ImageIO.h"
+
+#define DEFAULT_THUMBNAIL_WIDTH 256
+#define SHEET_GAP 4		//black pixels around each thumbnail
+
+using namespace hdr;
+
+Sweep::Sweep(Filter* filter, const Filter::Params& params) {
+	m_filter = filter;
+	m_params = params;
+	m_thumbnailWidth = DEFAULT_THUMBNAIL_WIDTH;
+	m_setupTime = 0;
+	m_elapsed = 0;
+}
+
+bool Sweep::addRange(const char* name, float min, float max, int steps) {
+	if (steps < 1) {
+		std::cerr << "A sweep of " << name << " needs at least one step" << std::endl;
+		return false;
+	}
+	std::vector<float> values;
+	for (int i = 0; i < steps; i++) values.push_back(steps == 1 ? min : min + (max - min)*i/(steps - 1));
+	return addValues(name, values);
+}
+
+bool Sweep::addValues(const char* name, const std::vector<float>& values) {
+	const std::vector<Filter::Parameter>& parameters = m_filter->getParameters();
+	size_t p = 0;
+	while (p < parameters.size() && strcmp(parameters[p].name, name)) p++;
+	if (p == parameters.size()) {
+		std::cerr << m_filter->getName() << " has no parameter " << name << std::endl;
+		return false;
+	}
+	if (values.empty()) return false;
+	for (size_t i = 0; i < values.size(); i++) {
+		if (values[i] < parameters[p].min || values[i] > parameters[p].max) {
+			std::cerr << name << " must be from " << parameters[p].min << " to " << parameters[p].max << std::endl;
+			return false;
+		}
+	}
+
+	//after the ranges that cost as much or more to change
+	Range range = {name, parameters[p].scope, values};
+	std::vector<Range>::iterator r = m_ranges.begin();
+	while (r != m_ranges.end() && r->scope >= range.scope) r++;
+	m_ranges.insert(r, range);
+	return true;
+}
+
+size_t Sweep::getNumSettings() const {
+	size_t settings = 1;
+	for (size_t r = 0; r < m_ranges.size(); r++) settings *= m_ranges[r].values.size();
+	return settings;
+}
+
+std::string Sweep::describe(size_t setting) const {
+	std::string description;
+	for (size_t r = 0; r < m_ranges.size(); r++) {
+		char text[64];
+		snprintf(text, sizeof(text), "%s%s=%g", r ? " " : "", m_ranges[r].name.c_str(), value(setting, r));
+		description += text;
+	}
+	return description;
+}
+
+void Sweep::setThumbnailWidth(size_t width) {
+	if (width > 0) m_thumbnailWidth = width;
+}
+
+double Sweep::getSetupTime() const {
+	return m_setupTime;
+}
+
+double Sweep::getElapsedTime() const {
+	return m_elapsed;
+}
+
+size_t Sweep::getNumRun() const {
+	return m_settingTimes.size();
+}
+
+double Sweep::getSettingTime(size_t setting) const {
+	return m_settingTimes[setting];
+}
+
+bool Sweep::getSettingPassed(size_t setting) const {
+	return m_settingPassed[setting];
+}
+
+//the last range varies fastest
+float Sweep::value(size_t setting, size_t range) const {
+	size_t stride = 1;
+	for (size_t r = range + 1; r < m_ranges.size(); r++) stride *= m_ranges[r].values.size();
+	return m_ranges[range].values[setting/stride % m_ranges[range].values.size()];
+}
+
+bool Sweep::run(Image input, unsigned int method, const char* sheetPath, const char* outputDir) {
+	if (method != METHOD_REFERENCE && method != METHOD_OPENCL) {
+		std::cerr << "Sweeps can only be run with the reference or opencl methods" << std::endl;
+		return false;
+	}
+
+	std::vector<float> saved(m_ranges.size());
+	for (size_t r = 0; r < m_ranges.size(); r++) m_filter->getParameter(m_ranges[r].name.c_str(), saved[r]);
+
+	const size_t settings = getNumSettings();
+	const size_t columns = (size_t) ceil(sqrt((double) settings));
+	const size_t rows = (settings + columns - 1)/columns;
+	const size_t thumbWidth = std::min(m_thumbnailWidth, input.width);
+	const size_t thumbHeight = std::max((size_t) 1, input.height*thumbWidth/input.width);
+
+	ImageBuffer sheet(columns*(thumbWidth + SHEET_GAP) + SHEET_GAP, rows*(thumbHeight + SHEET_GAP) + SHEET_GAP);
+	ImageBuffer output(input.width, input.height);
+	if (!sheet.image().data || !output.image().data) {
+		std::cerr << "Out of memory for sweep images" << std::endl;
+		return false;
+	}
+
+	m_settingTimes.clear();
+	m_settingPassed.clear();
+	double start = getCurrentTime();
+	bool ready = false;		//OpenCL set up, with the input uploaded
+	bool passed = true;
+
+	for (size_t s = 0; s < settings; s++) {
+		double settingStart = getCurrentTime();
+		bool ok = runSetting(s, input, output.image(), method, ready);
+		if (s == 0) m_setupTime = (getCurrentTime() - start)/1e6;
+		m_settingTimes.push_back((getCurrentTime() - settingStart)/1e6);
+		m_settingPassed.push_back(ok);
+		passed = passed && ok;
+		if (!ok && !ready && method == METHOD_OPENCL) break;	//the rest would fail the same way
+		if (!ok) continue;
+
+		addThumbnail(sheet.image(), output.image(), s, columns);
+
+		if (outputDir) {
+			char path[1024];
+			snprintf(path, sizeof(path), "%s/%lu.jpg", outputDir, s);
+			try {
+				writeJPG(output.image(), path);
+			}
+			catch (std::exception& e) {
+				std::cerr << path << ": " << e.what() << std::endl;
+				passed = false;
+			}
+		}
+	}
+
+	if (ready) m_filter->cleanupOpenCL();
+	for (size_t r = 0; r < m_ranges.size(); r++) m_filter->setParameter(m_ranges[r].name.c_str(), saved[r]);
+
+	try {
+		writeJPG(sheet.image(), sheetPath);
+	}
+	catch (std::exception& e) {
+		std::cerr << sheetPath << ": " << e.what() << std::endl;
+		passed = false;
+	}
+
+	m_elapsed = (getCurrentTime() - start)/1e6;
+	return passed;
+}
+
+//sets the parameters that differ from the previous setting, rebuilding the
+//kernels if one of them changes their layout, and runs the filter
+bool Sweep::runSetting(size_t setting, Image input, Image output, unsigned int method, bool &ready) {
+	std::vector<size_t> changed;
+	for (size_t r = 0; r < m_ranges.size(); r++) {
+		if (setting == 0 || value(setting, r) != value(setting - 1, r)) changed.push_back(r);
+	}
+
+	for (size_t i = 0; i < changed.size() && ready; i++) {
+		if (m_ranges[changed[i]].scope == PARAMETER_SETUP) {
+			m_filter->cleanupOpenCL();
+			ready = false;
+		}
+	}
+	for (size_t i = 0; i < changed.size(); i++) {
+		const size_t r = changed[i];
+		if (!m_filter->setParameter(m_ranges[r].name.c_str(), value(setting, r))) return false;
+	}
+
+	if (method == METHOD_REFERENCE) return m_filter->runReference(input, output);
+
+	//the input stays on the device, so only the first run after setup
+	//computes the parts of the mapping no parameter feeds
+	bool recomputeMapping = false;
+	if (!ready) {
+		m_filter->setImageSize(input.width, input.height);
+		m_filter->setImageFormat(input.format);
+		if (!m_filter->setupOpenCL(NULL, m_params)) return false;
+		ready = true;
+		if (!m_filter->uploadInput(input)) return false;
+		recomputeMapping = true;
+	}
+
+	return m_filter->runOpenCLOnDevice(output, recomputeMapping);
+}
+
+//box filters image down into its cell of the sheet
+void Sweep::addThumbnail(Image sheet, Image image, size_t setting, size_t columns) {
+	const size_t thumbWidth = std::min(m_thumbnailWidth, image.width);
+	const size_t thumbHeight = std::max((size_t) 1, image.height*thumbWidth/image.width);
+	Image cell = subImage(sheet,
+		SHEET_GAP + setting%columns*(thumbWidth + SHEET_GAP),
+		SHEET_GAP + setting/columns*(thumbHeight + SHEET_GAP),
+		thumbWidth, thumbHeight);
+
+	#pragma omp parallel for
+	for (size_t ty = 0; ty < thumbHeight; ty++) {
+		std::vector<float> row(image.width*NUM_CHANNELS);
+		std::vector<float> sum(thumbWidth*NUM_CHANNELS, 0.f);
+		std::vector<float> count(thumbWidth, 0.f);
+		const size_t y0 = ty*image.height/thumbHeight;
+		const size_t y1 = std::max(y0 + 1, (ty + 1)*image.height/thumbHeight);
+
+		for (size_t y = y0; y < y1; y++) {
+			readRow(image, y, &row[0]);
+			for (size_t x = 0; x < image.width; x++) {
+				const size_t tx = x*thumbWidth/image.width;
+				for (int c = 0; c < NUM_CHANNELS; c++) sum[tx*NUM_CHANNELS + c] += row[x*NUM_CHANNELS + c];
+				count[tx]++;
+			}
+		}
+		for (size_t tx = 0; tx < thumbWidth; tx++) {
+			for (int c = 0; c < NUM_CHANNELS; c++) sum[tx*NUM_CHANNELS + c] /= count[tx];
+		}
+		writeRow(cell, ty, &sum[0]);
+	}
+}
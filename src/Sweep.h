@@ -0,0 +1,68 @@
+#pragma once
+
+#include <vector>
+#include <string>
+
+#include "Filter.h"
+
+namespace hdr
+{
+//Tonemaps one image with every combination of a few of the filter's parameters
+//(see Filter::setParameter), e.g. to pick a key and saturation. The image is
+//read and uploaded once and OpenCL set up once. Settings are ordered so the
+//parameters that change least work vary slowest: those that only feed the
+//final pass change every setting and reuse the mapping, mapping parameters
+//recompute it, and layout parameters rebuild the kernels. Results go to a
+//contact sheet of thumbnails, in setting order left to right and top to
+//bottom, and optionally to one JPEG per setting.
+class Sweep {
+public:
+	Sweep(Filter* filter, const Filter::Params& params);
+
+	//steps values from min to max inclusive, false if the filter has no such
+	//parameter or the range is outside it
+	bool addRange(const char* name, float min, float max, int steps);
+	bool addValues(const char* name, const std::vector<float>& values);
+
+	//how many settings, the product of every range's size
+	size_t getNumSettings() const;
+	//e.g. "key=0.18 sat=1.6"
+	std::string describe(size_t setting) const;
+
+	//outputDir, if given, gets <outputDir>/<setting>.jpg for each. The filter's
+	//parameters are restored afterwards. False if a setting failed
+	bool run(Image input, unsigned int method, const char* sheetPath, const char* outputDir=NULL);
+
+	void setThumbnailWidth(size_t width);
+
+	//in seconds
+	double getSetupTime() const;	//the first setting, including OpenCL setup and upload
+	double getElapsedTime() const;	//every setting, and writing them out
+
+	//the settings the last run got to, in setting order, fewer than
+	//getNumSettings if OpenCL couldn't be set up
+	size_t getNumRun() const;
+	double getSettingTime(size_t setting) const;	//in seconds
+	bool getSettingPassed(size_t setting) const;
+
+protected:
+	typedef struct {
+		std::string name;
+		int scope;
+		std::vector<float> values;
+	} Range;
+
+	Filter* m_filter;
+	Filter::Params m_params;
+	std::vector<Range> m_ranges;	//slowest varying first
+	size_t m_thumbnailWidth;
+	double m_setupTime;
+	double m_elapsed;
+	std::vector<double> m_settingTimes;
+	std::vector<bool> m_settingPassed;
+
+	float value(size_t setting, size_t range) const;
+	bool runSetting(size_t setting, Image input, Image output, unsigned int method, bool &ready);
+	void addThumbnail(Image sheet, Image image, size_t setting, size_t columns);
+};
+}
@@ -0,0 +1,231 @@
+#include <string.h>
+#include <stdlib.h>
+#include <iostream>
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+
+#include "Tiled.h"
+#include "ImageIO.h"
+
+#define DEFAULT_TILE_SIZE 2048	//within the smallest CL_DEVICE_IMAGE2D_MAX_WIDTH an OpenCL 1.2 device may have
+
+using namespace hdr;
+
+static size_t roundUp(size_t x, size_t multiple) {
+	return (x + multiple-1)/multiple*multiple;
+}
+
+Tiled::Tiled(Filter* filter, const Filter::Params& params) {
+	m_filter = filter;
+	m_params = params;
+	m_tileSize = DEFAULT_TILE_SIZE;
+	m_numTiles = 0;
+	m_statisticsTime = 0;
+	m_elapsed = 0;
+}
+
+void Tiled::setTileSize(size_t size) {
+	if (size > 0) m_tileSize = size;
+}
+
+size_t Tiled::getNumTiles() const {
+	return m_numTiles;
+}
+
+double Tiled::getStatisticsTime() const {
+	return m_statisticsTime;
+}
+
+double Tiled::getElapsedTime() const {
+	return m_elapsed;
+}
+
+bool Tiled::run(const char* inputPath, const char* outputPath, unsigned int method) {
+	if (!m_filter->supportsTiling()) {
+		std::cerr << m_filter->getName() << " can't be run in tiles, it needs the whole image at once" << std::endl;
+		return false;
+	}
+	if (method != METHOD_REFERENCE && method != METHOD_OPENCL) {
+		std::cerr << "Tiles can only be run with the reference or opencl methods" << std::endl;
+		return false;
+	}
+
+	//tile origins, including their halos, stay on the filter's alignment grid
+	const size_t alignment = m_filter->getTileAlignment();
+	const size_t tile = roundUp(m_tileSize, alignment);
+	const size_t halo = roundUp(m_filter->getTileHalo(), alignment);
+
+	double start = getCurrentTime();
+	m_numTiles = 0;
+
+	if (!accumulateStatistics(inputPath, tile)) {
+		m_filter->clearStatistics();
+		return false;
+	}
+	m_statisticsTime = (getCurrentTime() - start)/1e6;
+
+	ScanlineReader* reader = NULL;
+	JPGWriter* writer = NULL;
+	Image band = {NULL, 0, 0, IMAGE_RGBA8, 0};		//input rows [bandStart, bandStart + band.height)
+	Image outBand = {NULL, 0, 0, IMAGE_RGBA8, 0};	//tonemapped rows of the current tile row
+	Image tileOut = {NULL, 0, 0, IMAGE_RGBA8, 0};
+	bool passed = true;
+
+	try {
+		reader = openScanlineReader(inputPath);
+		const size_t width = reader->width;
+		const size_t height = reader->height;
+		const size_t pixel_size = bytesPerPixel(reader->format);
+		const size_t row_size = width*pixel_size;
+		const size_t max_tile = tile + 2*halo;
+
+		band = createImage(width, max_tile, reader->format);
+		band.height = 0;
+		outBand = createImage(width, tile);
+		tileOut = createImage(max_tile, max_tile);
+		if (!band.data || !outBand.data || !tileOut.data) throw std::runtime_error("Out of memory for tile buffers");
+
+		writer = new JPGWriter(outputPath, width, height);
+
+		size_t bandStart = 0;
+		for (size_t y0 = 0; y0 < height; y0 += tile) {
+			const size_t y1 = std::min(y0 + tile, height);
+			const size_t ey0 = y0 > halo ? y0 - halo : 0;
+			const size_t ey1 = std::min(y1 + halo, height);
+
+			//keep the rows the halo shares with the previous tile row, read the rest
+			if (ey0 > bandStart) {
+				const size_t dropped = ey0 - bandStart;
+				memmove(band.data, &band.data[dropped*row_size], (band.height - dropped)*row_size);
+				band.height -= dropped;
+				bandStart = ey0;
+			}
+			while (bandStart + band.height < ey1) {
+				reader->readScanline(&band.data[band.height*row_size]);
+				band.height++;
+			}
+
+			for (size_t x0 = 0; x0 < width; x0 += tile) {
+				const size_t x1 = std::min(x0 + tile, width);
+				const size_t ex0 = x0 > halo ? x0 - halo : 0;
+				const size_t ex1 = std::min(x1 + halo, width);
+
+				//the tile is uploaded straight from the band, row by row
+				Image tileIn = subImage(band, ex0, ey0 - bandStart, ex1 - ex0, ey1 - ey0);
+				tileOut.width = tileIn.width;
+				tileOut.height = tileIn.height;
+
+				if (!runTile(tileIn, tileOut, method)) passed = false;
+				m_numTiles++;
+
+				//only the core of the tile goes out, its halo belongs to the neighbours
+				Image core = subImage(outBand, x0, 0, x1 - x0, y1 - y0);
+				copyImage(subImage(tileOut, x0 - ex0, y0 - ey0, x1 - x0, y1 - y0), core);
+			}
+
+			for (size_t y = y0; y < y1; y++) writer->writeScanline(&outBand.data[(y - y0)*width*NUM_CHANNELS]);
+		}
+
+		writer->finish();
+	}
+	catch (std::exception& e) {
+		std::cerr << inputPath << ": " << e.what() << std::endl;
+		passed = false;
+	}
+
+	releaseTile();
+	m_filter->clearStatistics();
+
+	delete writer;
+	delete reader;
+	releaseImage(band);
+	releaseImage(outBand);
+	releaseImage(tileOut);
+
+	m_elapsed = (getCurrentTime() - start)/1e6;
+	return passed;
+}
+
+//streams the whole input through the filter's statistics, a band of rows at a time
+bool Tiled::accumulateStatistics(const char* inputPath, size_t rows) {
+	ScanlineReader* reader = NULL;
+	Image band = {NULL, 0, 0, IMAGE_RGBA8, 0};
+	bool passed = true;
+
+	try {
+		reader = openScanlineReader(inputPath);
+		const size_t row_size = reader->width*bytesPerPixel(reader->format);
+
+		band = createImage(reader->width, rows, reader->format);
+		if (!band.data) throw std::runtime_error("Out of memory for tile buffers");
+
+		m_filter->beginStatistics();
+		while (reader->next_scanline < reader->height) {
+			band.height = std::min(rows, reader->height - reader->next_scanline);
+			for (size_t y = 0; y < band.height; y++) reader->readScanline(&band.data[y*row_size]);
+			m_filter->accumulateStatistics(band);
+		}
+		m_filter->endStatistics();
+	}
+	catch (std::exception& e) {
+		std::cerr << inputPath << ": " << e.what() << std::endl;
+		passed = false;
+	}
+
+	delete reader;
+	free(band.data);
+	return passed;
+}
+
+bool Tiled::runTile(Image input, Image output, unsigned int method) {
+	if (method == METHOD_REFERENCE) return m_filter->runReference(input, output);
+
+	Filter* filter = tileFilter(input);
+	return filter && filter->runOpenCL(input, output);
+}
+
+//kernels are built for a fixed size and format, only the edge tiles differ, in
+//at most three widths and three heights. NULL if setting up failed
+Filter* Tiled::tileFilter(Image input) {
+	for (size_t i = 0; i < m_tileFilters.size(); i++) {
+		const TileFilter& tile = m_tileFilters[i];
+		if (tile.width == input.width && tile.height == input.height && tile.format == input.format) return tile.filter;
+	}
+
+	//a filter that can't be cloned is set up again for each new size instead
+	Filter* filter = m_tileFilters.empty() ? m_filter : m_filter->clone();
+	if (!filter) {
+		releaseTile();
+		filter = m_filter;
+	}
+	if (filter != m_filter) {
+		filter->setStatusCallback(m_filter->getStatusCallback());
+		filter->setMetrics(m_filter->getMetrics());
+		filter->setTrace(m_filter->getTrace());
+		filter->setReferenceCache(m_filter->getReferenceCache());
+		filter->copyStatistics(*m_filter);
+		filter->setSharedContext(m_filter->getContext(), m_filter->getQueue(), m_filter->getDevice());
+	}
+
+	filter->setImageSize(input.width, input.height);
+	filter->setImageFormat(input.format);
+	if (!filter->setupOpenCL(NULL, m_params)) {
+		if (filter != m_filter) delete filter;
+		return NULL;
+	}
+
+	TileFilter tile = {filter, input.width, input.height, input.format};
+	m_tileFilters.push_back(tile);
+	return filter;
+}
+
+void Tiled::releaseTile() {
+	//the clones hold references to the filter's context, which outlives them
+	for (size_t i = m_tileFilters.size(); i-- > 0; ) {
+		Filter* filter = m_tileFilters[i].filter;
+		filter->cleanupOpenCL();
+		if (filter != m_filter) delete filter;
+	}
+	m_tileFilters.clear();
+}
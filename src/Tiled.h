@@ -0,0 +1,54 @@
+#pragma once
+
+#include <vector>
+
+#include "Filter.h"
+
+namespace hdr
+{
+//Tonemaps images too large to hold in memory or in one OpenCL image. A first
+//pass streams the input through the filter's statistics (see
+//Filter::beginStatistics), then the input is read again one band of tile rows
+//at a time. Each tile is padded with the filter's halo, tonemapped on its own,
+//and its core is streamed out to a JPEG. Only one band of input and output rows
+//is ever held, about width*(tile size + 2*halo) pixels of each.
+class Tiled {
+public:
+	Tiled(Filter* filter, const Filter::Params& params);
+
+	//rounded up to the filter's tile alignment
+	void setTileSize(size_t size);
+
+	//returns false if the filter can't be tiled or reading, a tile or writing failed
+	bool run(const char* inputPath, const char* outputPath, unsigned int method);
+
+	size_t getNumTiles() const;
+
+	//in seconds
+	double getStatisticsTime() const;	//the first pass
+	double getElapsedTime() const;		//both passes
+
+protected:
+	Filter* m_filter;
+	Filter::Params m_params;
+	size_t m_tileSize;
+	size_t m_numTiles;
+	double m_statisticsTime;
+	double m_elapsed;
+
+	//a filter set up for each size and format of tile met so far, so that edge
+	//tiles don't rebuild the kernels twice a tile row. The first size runs on
+	//the filter itself, the others on clones of it in its context
+	typedef struct {
+		Filter* filter;
+		size_t width, height;
+		int format;
+	} TileFilter;
+	std::vector<TileFilter> m_tileFilters;
+
+	bool accumulateStatistics(const char* inputPath, size_t rows);
+	bool runTile(Image input, Image output, unsigned int method);
+	Filter* tileFilter(Image input);
+	void releaseTile();
+};
+}
@@ -0,0 +1,125 @@
+#include <cstdio>
+#include <sys/time.h>
+
+#include "Trace.h"
+
+#define HOST_PID	1
+#define DEVICE_PID	2
+
+using namespace hdr;
+
+Trace::Trace() {
+	pthread_mutex_init(&m_mutex, NULL);
+	m_origin = now();
+}
+
+Trace::~Trace() {
+	pthread_mutex_destroy(&m_mutex);
+}
+
+double Trace::now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec*1e-6;
+}
+
+void Trace::addSpan(const char* name, const char* category, double start, double end) {
+	pthread_mutex_lock(&m_mutex);
+	std::map<pthread_t, int>::iterator itr = m_threads.find(pthread_self());
+	if (itr == m_threads.end()) {
+		itr = m_threads.insert(std::make_pair(pthread_self(), (int) m_threads.size() + 1)).first;
+	}
+
+	Span span = {name, category, start - m_origin, end - m_origin, HOST_PID, itr->second};
+	m_spans.push_back(span);
+	pthread_mutex_unlock(&m_mutex);
+}
+
+bool Trace::addDeviceSpan(const char* name, const char* category, cl_event event, double queued, cl_command_queue queue, const char* label) {
+	cl_ulong queued_ns, start_ns, end_ns;
+	cl_int err;
+	err  = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &queued_ns, NULL);
+	err |= clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start_ns, NULL);
+	err |= clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end_ns, NULL);
+	if (err != CL_SUCCESS) return false;
+
+	//device clock to host clock
+	const double offset = queued - queued_ns*1e-9;
+
+	pthread_mutex_lock(&m_mutex);
+	std::map<cl_command_queue, int>::iterator itr = m_queues.find(queue);
+	if (itr == m_queues.end()) {
+		itr = m_queues.insert(std::make_pair(queue, (int) m_queues.size() + 1)).first;
+		m_labels[itr->second] = label;
+	}
+
+	Span span = {name, category, start_ns*1e-9 + offset - m_origin, end_ns*1e-9 + offset - m_origin, DEVICE_PID, itr->second};
+	m_spans.push_back(span);
+	pthread_mutex_unlock(&m_mutex);
+	return true;
+}
+
+size_t Trace::getNumSpans() const {
+	pthread_mutex_lock(&m_mutex);
+	size_t spans = m_spans.size();
+	pthread_mutex_unlock(&m_mutex);
+	return spans;
+}
+
+void Trace::clear() {
+	pthread_mutex_lock(&m_mutex);
+	m_spans.clear();
+	pthread_mutex_unlock(&m_mutex);
+}
+
+//names are filter and kernel names, but may hold anything
+static std::string escape(const std::string& name) {
+	std::string escaped;
+	for (size_t i = 0; i < name.size(); i++) {
+		if (name[i] == '"' || name[i] == '\\') escaped += '\\';
+		if (name[i] == '\n') escaped += "\\n";
+		else escaped += name[i];
+	}
+	return escaped;
+}
+
+//complete ("X") events in microseconds, with metadata events naming the
+//processes and tracks
+std::string Trace::toJSON() const {
+	pthread_mutex_lock(&m_mutex);
+
+	std::string json = "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+	char line[1024];
+	sprintf(line, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": 0, \"args\": {\"name\": \"Host\"}},\n", HOST_PID);
+	json += line;
+	sprintf(line, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": 0, \"args\": {\"name\": \"OpenCL\"}}", DEVICE_PID);
+	json += line;
+
+	for (size_t t = 1; t <= m_threads.size(); t++) {
+		sprintf(line, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %lu, \"args\": {\"name\": \"Thread %lu\"}}", HOST_PID, (unsigned long) t, (unsigned long) t);
+		json += line;
+	}
+	for (std::map<int, std::string>::const_iterator itr = m_labels.begin(); itr != m_labels.end(); itr++) {
+		sprintf(line, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, \"args\": {\"name\": \"%s\"}}", DEVICE_PID, itr->first, escape(itr->second).c_str());
+		json += line;
+	}
+
+	for (size_t i = 0; i < m_spans.size(); i++) {
+		const Span& span = m_spans[i];
+		sprintf(line, ",\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": %d, \"tid\": %d}",
+			escape(span.name).c_str(), escape(span.category).c_str(), span.start*1e6, (span.end - span.start)*1e6, span.pid, span.tid);
+		json += line;
+	}
+	json += "\n]}\n";
+
+	pthread_mutex_unlock(&m_mutex);
+	return json;
+}
+
+bool Trace::write(const char* path) const {
+	FILE* file = fopen(path, "w");
+	if (!file) return false;
+	std::string json = toJSON();
+	bool written = fwrite(json.data(), 1, json.size(), file) == json.size();
+	return fclose(file) == 0 && written;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <CL/cl.h>
+
+namespace hdr
+{
+//Spans of host work and of OpenCL commands on one timeline, written in the
+//Trace Event format that chrome://tracing and Perfetto load. Host spans go on
+//a track per thread, device spans on a track per command queue. Device
+//timestamps are moved onto the host clock by matching the time a command was
+//queued on the host with its CL_PROFILING_COMMAND_QUEUED, which is good to the
+//cost of an enqueue. Filters only record into one once it's attached with
+//Filter::setTrace, which must happen before setupOpenCL so that their queues
+//are created with profiling enabled
+class Trace {
+public:
+	Trace();
+	~Trace();
+
+	static double now();	//host clock, in seconds
+
+	//a span on the calling thread's track, times from now()
+	void addSpan(const char* name, const char* category, double start, double end);
+	//a span of a finished command, whose event came from a queue with profiling
+	//enabled. queued is now() just before it was enqueued, label names the track.
+	//False if the event has no profiling information
+	bool addDeviceSpan(const char* name, const char* category, cl_event event, double queued, cl_command_queue queue, const char* label);
+
+	size_t getNumSpans() const;
+	void clear();
+
+	std::string toJSON() const;
+	bool write(const char* path) const;
+
+protected:
+	typedef struct {
+		std::string name, category;
+		double start, end;	//seconds since m_origin
+		int pid, tid;
+	} Span;
+
+	double m_origin;
+	std::vector<Span> m_spans;
+	std::map<pthread_t, int> m_threads;		//host track of each thread
+	std::map<cl_command_queue, int> m_queues;	//device track of each queue
+	std::map<int, std::string> m_labels;	//device track names
+	mutable pthread_mutex_t m_mutex;
+};
+
+//records a host span from construction to destruction, nothing without a trace
+class TraceScope {
+public:
+	TraceScope(Trace* trace, const char* name, const char* category="host") {
+		m_trace = trace;
+		m_name = name;
+		m_category = category;
+		m_start = trace ? Trace::now() : 0;
+	}
+	~TraceScope() {
+		if (m_trace) m_trace->addSpan(m_name, m_category, m_start, Trace::now());
+	}
+
+protected:
+	Trace* m_trace;
+	const char* m_name;
+	const char* m_category;
+	double m_start;
+};
+}
@@ -5,7 +5,7 @@ int main(int argc, char *argv[])
 {
   if (argc != 4)
   {
-    cout << "Usage: " << argv[0] << " cpu|gpu out_func out_prefix" << endl;
+    cout << "Usage: " << argv[0] << " cpu|gpu|auto out_func out_prefix" << endl;
     return 1;
   }
 
@@ -15,6 +15,7 @@ int main(int argc, char *argv[])
   Func weight("weight");
   Func bilateral("bilateral");
   Var c("c"), x("x"), y("y"), i("i"), j("j");
+  Var xo("xo"), yo("yo"), xi("xi"), yi("yi");
 
   // Algorithm
   clamped(x, y, c) = input(
@@ -45,11 +46,11 @@ int main(int argc, char *argv[])
     );
 
   // Channel order
-  input.set_stride(0, 4);
-  input.set_extent(2, 4);
+  input.dim(0).set_stride(4);
+  input.dim(2).set_stride(1).set_extent(4);
   bilateral.reorder_storage(c, x, y);
-  bilateral.output_buffer().set_stride(0, 4);
-  bilateral.output_buffer().set_extent(2, 4);
+  bilateral.output_buffer().dim(0).set_stride(4);
+  bilateral.output_buffer().dim(2).set_stride(1).set_extent(4);
 
   // Schedules
   if (!strcmp(argv[1], "cpu"))
@@ -58,7 +59,11 @@ int main(int argc, char *argv[])
   }
   else if (!strcmp(argv[1], "gpu"))
   {
-    bilateral.cuda_tile(x, y, 16, 4);
+    bilateral.gpu_tile(x, y, xo, yo, xi, yi, 16, 4);
+  }
+  else if (!strcmp(argv[1], "auto"))
+  {
+    autoSchedule(bilateral, input);
   }
   else
   {
@@ -5,7 +5,7 @@ int main(int argc, char *argv[])
 {
   if (argc != 4)
   {
-    cout << "Usage: " << argv[0] << " cpu|gpu out_func out_prefix" << endl;
+    cout << "Usage: " << argv[0] << " cpu|gpu|auto out_func out_prefix" << endl;
     return 1;
   }
 
@@ -13,6 +13,7 @@ int main(int argc, char *argv[])
   Func clamped("clamped");
   Func blur_x("blur_x"), blur_y("blur_y");
   Var c("c"), x("x"), y("y");
+  Var xo("xo"), yo("yo"), xi("xi"), yi("yi");
 
   // Algorithm
   clamped(x, y, c) = input(
@@ -35,11 +36,11 @@ int main(int argc, char *argv[])
     ) / 5.f * 255);
 
   // Channel order
-  input.set_stride(0, 4);
-  input.set_extent(2, 4);
+  input.dim(0).set_stride(4);
+  input.dim(2).set_stride(1).set_extent(4);
   blur_y.reorder_storage(c, x, y);
-  blur_y.output_buffer().set_stride(0, 4);
-  blur_y.output_buffer().set_extent(2, 4);
+  blur_y.output_buffer().dim(0).set_stride(4);
+  blur_y.output_buffer().dim(2).set_stride(1).set_extent(4);
 
   // Schedules
   if (!strcmp(argv[1], "cpu"))
@@ -48,7 +49,11 @@ int main(int argc, char *argv[])
   }
   else if (!strcmp(argv[1], "gpu"))
   {
-    blur_y.cuda_tile(x, y, 16, 4);
+    blur_y.gpu_tile(x, y, xo, yo, xi, yi, 16, 4);
+  }
+  else if (!strcmp(argv[1], "auto"))
+  {
+    autoSchedule(blur_y, input);
   }
   else
   {
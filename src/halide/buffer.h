@@ -0,0 +1,58 @@
+#pragma once
+
+//Host side of the generated Halide pipelines, include after one of the
+//generated headers, which include HalideRuntime.h for halide_buffer_t
+
+#include "Filter.h"
+
+namespace hdr
+{
+//describes an interleaved RGBA Image with dimensions x, y and channel. The
+//buffer points at the dimensions held alongside it, so it isn't copied
+struct HalideImage {
+	halide_buffer_t buf;
+	halide_dimension_t dim[3];
+
+	HalideImage(Image image) {
+		memset(&buf, 0, sizeof(buf));
+		memset(dim, 0, sizeof(dim));
+		switch (image.format) {
+			case IMAGE_RGBA32F: buf.type = halide_type_t(halide_type_float, 32); break;
+			case IMAGE_RGBA16F: buf.type = halide_type_t(halide_type_float, 16); break;
+			default:            buf.type = halide_type_t(halide_type_uint, 8); break;
+		}
+		const int elem_size = bytesPerPixel(image.format)/NUM_CHANNELS;
+		dim[0].extent = image.width;
+		dim[0].stride = NUM_CHANNELS;
+		dim[1].extent = image.height;
+		dim[1].stride = rowBytes(image)/elem_size;	//strides are in elements
+		dim[2].extent = NUM_CHANNELS;
+		dim[2].stride = 1;
+		buf.host = image.data;
+		buf.dimensions = 3;
+		buf.dim = dim;
+		buf.set_host_dirty(true);	//so GPU schedules copy it to the device
+	}
+
+private:
+	HalideImage(const HalideImage&);
+	HalideImage& operator=(const HalideImage&);
+};
+
+inline const char* halideScheduleName(unsigned int method) {
+	switch (method) {
+		case METHOD_HALIDE_GPU:  return "GPU";
+		case METHOD_HALIDE_AUTO: return "autoscheduled CPU";
+		default:                 return "CPU";
+	}
+}
+
+//GPU schedules leave their output on the device
+inline int halideFinish(halide_buffer_t* input, halide_buffer_t* output) {
+	int err = 0;
+	if (output->device_dirty()) err = halide_copy_to_host(NULL, output);
+	if (input->device) halide_device_free(NULL, input);
+	if (output->device) halide_device_free(NULL, output);
+	return err;
+}
+}
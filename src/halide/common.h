@@ -15,7 +15,7 @@ Expr u16(Expr x)
 
 Expr u32(Expr x)
 {
-  return cast(UInt(16), x);
+  return cast(UInt(32), x);
 }
 
 Expr s8(Expr x)
@@ -30,7 +30,7 @@ Expr s16(Expr x)
 
 Expr s32(Expr x)
 {
-  return cast(Int(16), x);
+  return cast(Int(32), x);
 }
 
 Expr f16(Expr x)
@@ -50,3 +50,25 @@ void compile(Func func, ImageParam input, string fnName, string prefix)
   func.compile_to_assembly(prefix+".s", args, fnName);
   func.compile_to_header(prefix+".h", args, fnName);
 }
+
+// For pipelines with scalar parameters after the input
+void compile(Func func, vector<Argument> args, string fnName, string prefix)
+{
+  func.compile_to_assembly(prefix+".s", args, fnName);
+  func.compile_to_header(prefix+".h", args, fnName);
+}
+
+// Leaves the whole schedule to the autoscheduler, tuned for the host CPU and
+// for images around the given size. Funcs must not be scheduled by hand before
+void autoSchedule(Func func, ImageParam input, int width=1920, int height=1080)
+{
+  vector<Var> args = func.args();
+  func.estimate(args[0], 0, width)
+      .estimate(args[1], 0, height)
+      .estimate(args[2], 0, 4);
+  input.dim(0).set_bounds_estimate(0, width);
+  input.dim(1).set_bounds_estimate(0, height);
+  input.dim(2).set_bounds_estimate(0, 4);
+
+  Pipeline(func).auto_schedule(get_host_target());
+}
@@ -1,12 +1,12 @@
 #!/bin/bash
 
-functions="bilateral blur sharpen sobel"
+functions="bilateral blur sharpen sobel reinhardGlobal reinhardLocal histEq"
 
 if [ "$1" == clean ]
 then
   for name in $functions
   do
-    rm -rf "$name"{,_cpu{.s,.h},_gpu{.s,.h}}
+    rm -rf "$name"{,_cpu{.s,.h},_gpu{.s,.h},_auto{.s,.h}}
   done
   exit 0
 fi
@@ -14,25 +14,35 @@ fi
 OUTDIR=${1:-.}
 mkdir -p $OUTDIR
 
+# HL_TARGET only applies to the gpu schedules, the cpu and autoscheduled
+# pipelines are built for the host
+GPU_TARGET=${HL_TARGET:-host-opencl}
+
 for name in $functions
 do
   if [ $name.cpp -ot $OUTDIR/$name\_cpu.s ] && \
-     [ $name.cpp -ot $OUTDIR/$name\_gpu.s ]
+     [ $name.cpp -ot $OUTDIR/$name\_gpu.s ] && \
+     [ $name.cpp -ot $OUTDIR/$name\_auto.s ]
   then
     echo "Skipping generation of halide $name"
     continue
   fi
   echo "Generating halide $name functions"
 
-  g++ -lHalide -o $name $name.cpp
+  g++ -o $name $name.cpp -lHalide -lpthread -ldl
   if [ $? -ne 0 ]
   then
     exit 1
   fi
 
-  for schedule in cpu gpu
+  for schedule in cpu gpu auto
   do
-    ./$name $schedule halide_$name\_$schedule $OUTDIR/$name\_$schedule
+    target=host
+    if [ $schedule == gpu ]
+    then
+      target=$GPU_TARGET
+    fi
+    HL_TARGET=$target ./$name $schedule halide_$name\_$schedule $OUTDIR/$name\_$schedule
     if [ $? -ne 0 ]
     then
       exit 1
@@ -0,0 +1,96 @@
+#include "common.h"
+#include <iostream>
+
+#define HIST_SIZE 256
+
+int main(int argc, char *argv[])
+{
+  if (argc != 4)
+  {
+    cout << "Usage: " << argv[0] << " cpu|gpu|auto out_func out_prefix" << endl;
+    return 1;
+  }
+
+  // RGBA32F, linear radiance with 1.0 == 255
+  ImageParam input(Float(32), 3, "input");
+  Func rgb("rgb"), brightness("brightness");
+  Func rowHist("rowHist"), hist("hist"), cdf("cdf");
+  Func histEq("histEq");
+  Var c("c"), x("x"), y("y"), i("i");
+  Var xo("xo"), yo("yo"), xi("xi"), yi("yi");
+
+  // Algorithm
+  // brightness indexes the histogram, so radiance beyond the 8-bit range is clipped
+  rgb(x, y, c) = clamp(input(
+    clamp(x, 0, input.width()-1),
+    clamp(y, 0, input.height()-1),
+    c) * 255.f, 0.f, 255.f);
+  brightness(x, y) = max(max(rgb(x, y, 0), rgb(x, y, 1)), rgb(x, y, 2));
+
+  // Histogram of brightness, counted a row at a time so rows can run in parallel
+  RDom rx(0, input.width(), "rx");
+  RDom ry(0, input.height(), "ry");
+  rowHist(i, y) = u32(0);
+  rowHist(clamp(s32(brightness(rx, y)), 0, HIST_SIZE-1), y) += u32(1);
+  hist(i) = u32(0);
+  hist(i) += rowHist(i, ry);
+
+  RDom rh(1, HIST_SIZE-1, "rh");
+  cdf(i) = u32(0);
+  cdf(0) = hist(0);
+  cdf(rh) = cdf(rh-1) + hist(rh);
+
+  // The equalised brightness, scaled onto the pixel's colour. Converting to HSV
+  // and back with only V changed is the same as scaling RGB by the new V over the old
+  Expr v = brightness(x, y);
+  Expr total = max(cdf(HIST_SIZE-1) - cdf(0), u32(1));
+  Expr equalised = f32(u32(
+    cast(UInt(64), HIST_SIZE-1) * (cdf(clamp(s32(v), 0, HIST_SIZE-1)) - cdf(0)) / total));
+  Expr mapped = select(v > 0, rgb(x, y, c) * equalised / v, equalised);
+  histEq(x, y, c) =
+    select(
+      c==3,
+      u8(clamp(input(x, y, 3) * 255.f, 0, 255)),
+      u8(clamp(mapped, 0, 255))
+    );
+
+  // Channel order
+  input.dim(0).set_stride(4);
+  input.dim(2).set_stride(1).set_extent(4);
+  histEq.reorder_storage(c, x, y);
+  histEq.output_buffer().dim(0).set_stride(4);
+  histEq.output_buffer().dim(2).set_stride(1).set_extent(4);
+
+  // Schedules
+  if (!strcmp(argv[1], "cpu"))
+  {
+    rowHist.compute_root();
+    rowHist.update().parallel(y);
+    hist.compute_root();
+    cdf.compute_root();
+    histEq.reorder(c, x, y).bound(c, 0, 4).unroll(c)
+      .parallel(y).vectorize(x, 8);
+  }
+  else if (!strcmp(argv[1], "gpu"))
+  {
+    // the histogram stays on the host, only the mapping runs on the device
+    rowHist.compute_root();
+    hist.compute_root();
+    cdf.compute_root();
+    histEq.reorder(c, x, y).bound(c, 0, 4).unroll(c)
+      .gpu_tile(x, y, xo, yo, xi, yi, 16, 4);
+  }
+  else if (!strcmp(argv[1], "auto"))
+  {
+    autoSchedule(histEq, input);
+  }
+  else
+  {
+    cout << "Invalid schedule type '" << argv[1] << "'" << endl;
+    return 1;
+  }
+
+  compile(histEq, input, argv[2], argv[3]);
+
+  return 0;
+}
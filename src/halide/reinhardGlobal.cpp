@@ -0,0 +1,100 @@
+#include "common.h"
+#include <iostream>
+
+int main(int argc, char *argv[])
+{
+  if (argc != 4)
+  {
+    cout << "Usage: " << argv[0] << " cpu|gpu|auto out_func out_prefix" << endl;
+    return 1;
+  }
+
+  // RGBA32F, linear radiance with 1.0 == 255
+  ImageParam input(Float(32), 3, "input");
+  Param<float> key("key"), sat("sat");
+  Func rgb("rgb"), lum("lum");
+  Func rowLogSum("rowLogSum"), rowMax("rowMax");
+  Func logAvgLum("logAvgLum"), Lwhite("Lwhite");
+  Func scale("scale");
+  Func reinhardGlobal("reinhardGlobal");
+  Var c("c"), x("x"), y("y");
+  Var xo("xo"), yo("yo"), xi("xi"), yi("yi");
+
+  // Algorithm
+  rgb(x, y, c) = input(
+    clamp(x, 0, input.width()-1),
+    clamp(y, 0, input.height()-1),
+    c) * 255.f;
+  lum(x, y) =
+    rgb(x, y, 0)*0.2126f +
+    rgb(x, y, 1)*0.7152f +
+    rgb(x, y, 2)*0.0722f;
+
+  // Image statistics, reduced a row at a time so rows can run in parallel
+  RDom rx(0, input.width(), "rx");
+  RDom ry(0, input.height(), "ry");
+  rowLogSum(y) = sum(log(lum(rx, y) + 0.000001f));
+  rowMax(y) = maximum(lum(rx, y));
+  logAvgLum() = f32(exp(sum(cast(Float(64), rowLogSum(ry))) / (input.width()*input.height())));
+  Lwhite() = maximum(rowMax(ry));
+
+  Expr L = key/logAvgLum() * lum(x, y);
+  scale(x, y) = (L * (1.f + L/(Lwhite()*Lwhite()))) / (1.f + L);
+
+  // black pixels have no chromaticity and stay black
+  Expr mapped = select(lum(x, y) > 0,
+    pow(rgb(x, y, c)/lum(x, y), sat) * scale(x, y) * 255,
+    0.f);
+  reinhardGlobal(x, y, c) =
+    select(
+      c==3,
+      u8(clamp(rgb(x, y, 3), 0, 255)),
+      u8(clamp(mapped, 0, 255))
+    );
+
+  // Channel order
+  input.dim(0).set_stride(4);
+  input.dim(2).set_stride(1).set_extent(4);
+  reinhardGlobal.reorder_storage(c, x, y);
+  reinhardGlobal.output_buffer().dim(0).set_stride(4);
+  reinhardGlobal.output_buffer().dim(2).set_stride(1).set_extent(4);
+
+  // Schedules
+  if (!strcmp(argv[1], "cpu"))
+  {
+    rowLogSum.compute_root().parallel(y);
+    rowMax.compute_root().parallel(y);
+    logAvgLum.compute_root();
+    Lwhite.compute_root();
+    scale.compute_at(reinhardGlobal, y).vectorize(x, 8);
+    reinhardGlobal.reorder(c, x, y).bound(c, 0, 4).unroll(c)
+      .parallel(y).vectorize(x, 8);
+  }
+  else if (!strcmp(argv[1], "gpu"))
+  {
+    // the reductions stay on the host, only the mapping runs on the device
+    rowLogSum.compute_root();
+    rowMax.compute_root();
+    logAvgLum.compute_root();
+    Lwhite.compute_root();
+    reinhardGlobal.reorder(c, x, y).bound(c, 0, 4).unroll(c)
+      .gpu_tile(x, y, xo, yo, xi, yi, 16, 4);
+  }
+  else if (!strcmp(argv[1], "auto"))
+  {
+    autoSchedule(reinhardGlobal, input);
+  }
+  else
+  {
+    cout << "Invalid schedule type '" << argv[1] << "'" << endl;
+    return 1;
+  }
+
+  vector<Argument> args;
+  args.push_back(input);
+  args.push_back(key);
+  args.push_back(sat);
+  compile(reinhardGlobal, args, argv[2], argv[3]);
+
+  return 0;
+}
@@ -0,0 +1,137 @@
+#include "common.h"
+#include <iostream>
+
+#define NUM_MIPMAPS 8
+
+int main(int argc, char *argv[])
+{
+  if (argc != 4)
+  {
+    cout << "Usage: " << argv[0] << " cpu|gpu|auto out_func out_prefix" << endl;
+    return 1;
+  }
+
+  // RGBA32F, linear radiance with 1.0 == 255
+  ImageParam input(Float(32), 3, "input");
+  Param<float> key("key"), sat("sat"), epsilon("epsilon"), phi("phi");
+  Func rgb("rgb"), lum("lum");
+  Func rowLogSum("rowLogSum"), logAvgLum("logAvgLum");
+  Func mipmap[NUM_MIPMAPS], clampedMipmap[NUM_MIPMAPS];
+  Func scale("scale");
+  Func reinhardLocal("reinhardLocal");
+  Var c("c"), x("x"), y("y");
+  Var xo("xo"), yo("yo"), xi("xi"), yi("yi");
+
+  // Algorithm
+  rgb(x, y, c) = input(
+    clamp(x, 0, input.width()-1),
+    clamp(y, 0, input.height()-1),
+    c) * 255.f;
+  lum(x, y) =
+    rgb(x, y, 0)*0.2126f +
+    rgb(x, y, 1)*0.7152f +
+    rgb(x, y, 2)*0.0722f;
+
+  // Image statistics, reduced a row at a time so rows can run in parallel
+  RDom rx(0, input.width(), "rx");
+  RDom ry(0, input.height(), "ry");
+  rowLogSum(y) = sum(log(lum(rx, y) + 0.000001f));
+  logAvgLum() = f32(exp(sum(cast(Float(64), rowLogSum(ry))) / (input.width()*input.height())));
+
+  // Pyramid of luminance, each level averaging 2x2 pixels of the one below
+  mipmap[0](x, y) = lum(x, y) / 255.f;
+  for (int i = 0; i < NUM_MIPMAPS; i++)
+  {
+    if (i > 0)
+    {
+      mipmap[i](x, y) = (
+        clampedMipmap[i-1](2*x,   2*y) +
+        clampedMipmap[i-1](2*x+1, 2*y) +
+        clampedMipmap[i-1](2*x,   2*y+1) +
+        clampedMipmap[i-1](2*x+1, 2*y+1)
+        ) / 4.f;
+    }
+    clampedMipmap[i](x, y) = mipmap[i](
+      clamp(x, 0, max((input.width() >> i)-1, 0)),
+      clamp(y, 0, max((input.height() >> i)-1, 0)));
+  }
+
+  // The local average is the largest surround around the pixel that stays
+  // close to its centre, found by walking down the pyramid
+  Expr factor = key/logAvgLum();
+  Expr local = clampedMipmap[NUM_MIPMAPS-1](x >> (NUM_MIPMAPS-1), y >> (NUM_MIPMAPS-1)) * factor;
+  for (int i = NUM_MIPMAPS-2; i >= 0; i--)
+  {
+    Expr centre = clampedMipmap[i](x >> i, y >> i) * factor;
+    Expr surround = clampedMipmap[i+1](x >> (i+1), y >> (i+1)) * factor;
+    float s = 1 << i;
+    local = select(
+      abs(centre - surround)/(pow(Expr(2.f), phi)*key/(s*s) + centre) > epsilon,
+      centre,
+      local);
+  }
+  scale(x, y) = factor / (1.f + local) * lum(x, y);
+
+  // black pixels have no chromaticity and stay black
+  Expr mapped = select(lum(x, y) > 0,
+    pow(rgb(x, y, c)/lum(x, y), sat) * scale(x, y) * 255,
+    0.f);
+  reinhardLocal(x, y, c) =
+    select(
+      c==3,
+      u8(clamp(rgb(x, y, 3), 0, 255)),
+      u8(clamp(mapped, 0, 255))
+    );
+
+  // Channel order
+  input.dim(0).set_stride(4);
+  input.dim(2).set_stride(1).set_extent(4);
+  reinhardLocal.reorder_storage(c, x, y);
+  reinhardLocal.output_buffer().dim(0).set_stride(4);
+  reinhardLocal.output_buffer().dim(2).set_stride(1).set_extent(4);
+
+  // Schedules
+  if (!strcmp(argv[1], "cpu"))
+  {
+    rowLogSum.compute_root().parallel(y);
+    logAvgLum.compute_root();
+    for (int i = 0; i < NUM_MIPMAPS; i++)
+    {
+      mipmap[i].compute_root().parallel(y).vectorize(x, 8);
+    }
+    scale.compute_at(reinhardLocal, y).vectorize(x, 8);
+    reinhardLocal.reorder(c, x, y).bound(c, 0, 4).unroll(c)
+      .parallel(y).vectorize(x, 8);
+  }
+  else if (!strcmp(argv[1], "gpu"))
+  {
+    // the reduction stays on the host, the pyramid and mapping run on the device
+    rowLogSum.compute_root();
+    logAvgLum.compute_root();
+    for (int i = 0; i < NUM_MIPMAPS; i++)
+    {
+      mipmap[i].compute_root().gpu_tile(x, y, xo, yo, xi, yi, 16, 4);
+    }
+    reinhardLocal.reorder(c, x, y).bound(c, 0, 4).unroll(c)
+      .gpu_tile(x, y, xo, yo, xi, yi, 16, 4);
+  }
+  else if (!strcmp(argv[1], "auto"))
+  {
+    autoSchedule(reinhardLocal, input);
+  }
+  else
+  {
+    cout << "Invalid schedule type '" << argv[1] << "'" << endl;
+    return 1;
+  }
+
+  vector<Argument> args;
+  args.push_back(input);
+  args.push_back(key);
+  args.push_back(sat);
+  args.push_back(epsilon);
+  args.push_back(phi);
+  compile(reinhardLocal, args, argv[2], argv[3]);
+
+  return 0;
+}
@@ -5,7 +5,7 @@ int main(int argc, char *argv[])
 {
   if (argc != 4)
   {
-    cout << "Usage: " << argv[0] << " cpu|gpu out_func out_prefix" << endl;
+    cout << "Usage: " << argv[0] << " cpu|gpu|auto out_func out_prefix" << endl;
     return 1;
   }
 
@@ -14,6 +14,7 @@ int main(int argc, char *argv[])
   Func convolved("convolved");
   Func sharpen("sharpen");
   Var c("c"), x("x"), y("y");
+  Var xo("xo"), yo("yo"), xi("xi"), yi("yi");
 
   // Algorithm
   clamped(x, y, c) = input(
@@ -21,7 +22,7 @@ int main(int argc, char *argv[])
     clamp(y, 0, input.height()-1),
     c) / 255.f;
 
-  Image<int16_t> kernel(3, 3);
+  Buffer<int16_t> kernel(3, 3);
   kernel(0, 0) = -1;
   kernel(0, 1) = -1;
   kernel(0, 2) = -1;
@@ -39,11 +40,11 @@ int main(int argc, char *argv[])
   );
 
   // Channel order
-  input.set_stride(0, 4);
-  input.set_extent(2, 4);
+  input.dim(0).set_stride(4);
+  input.dim(2).set_stride(1).set_extent(4);
   sharpen.reorder_storage(c, x, y);
-  sharpen.output_buffer().set_stride(0, 4);
-  sharpen.output_buffer().set_extent(2, 4);
+  sharpen.output_buffer().dim(0).set_stride(4);
+  sharpen.output_buffer().dim(2).set_stride(1).set_extent(4);
 
   // Schedules
   if (!strcmp(argv[1], "cpu"))
@@ -52,7 +53,11 @@ int main(int argc, char *argv[])
   }
   else if (!strcmp(argv[1], "gpu"))
   {
-    sharpen.cuda_tile(x, y, 16, 4);
+    sharpen.gpu_tile(x, y, xo, yo, xi, yi, 16, 4);
+  }
+  else if (!strcmp(argv[1], "auto"))
+  {
+    autoSchedule(sharpen, input);
   }
   else
   {
@@ -5,7 +5,7 @@ int main(int argc, char *argv[])
 {
   if (argc != 4)
   {
-    cout << "Usage: " << argv[0] << " cpu|gpu out_func out_prefix" << endl;
+    cout << "Usage: " << argv[0] << " cpu|gpu|auto out_func out_prefix" << endl;
     return 1;
   }
 
@@ -14,6 +14,7 @@ int main(int argc, char *argv[])
   Func g_x("g_x"), g_y("g_y"), g_mag("g_mag");
   Func sobel("sobel");
   Var c("c"), x("x"), y("y");
+  Var xo("xo"), yo("yo"), xi("xi"), yi("yi");
 
   // Algorithm
   clamped(x, y, c) = input(
@@ -25,7 +26,7 @@ int main(int argc, char *argv[])
     clamped(x, y, 1)*0.587f +
     clamped(x, y, 2)*0.114f;
 
-  Image<int16_t> kernel(3, 3);
+  Buffer<int16_t> kernel(3, 3);
   kernel(0, 0) = -1;
   kernel(0, 1) = -2;
   kernel(0, 2) = -1;
@@ -43,11 +44,11 @@ int main(int argc, char *argv[])
   sobel(x, y, c) = select(c==3, 255, u8(clamp(g_mag(x, y), 0, 1)*255));
 
   // Channel order
-  input.set_stride(0, 4);
-  input.set_extent(2, 4);
+  input.dim(0).set_stride(4);
+  input.dim(2).set_stride(1).set_extent(4);
   sobel.reorder_storage(c, x, y);
-  sobel.output_buffer().set_stride(0, 4);
-  sobel.output_buffer().set_extent(2, 4);
+  sobel.output_buffer().dim(0).set_stride(4);
+  sobel.output_buffer().dim(2).set_stride(1).set_extent(4);
 
   // Schedules
   if (!strcmp(argv[1], "cpu"))
@@ -56,7 +57,11 @@ int main(int argc, char *argv[])
   }
   else if (!strcmp(argv[1], "gpu"))
   {
-    sobel.cuda_tile(x, y, 16, 4);
+    sobel.gpu_tile(x, y, xo, yo, xi, yi, 16, 4);
+  }
+  else if (!strcmp(argv[1], "auto"))
+  {
+    autoSchedule(sobel, input);
   }
   else
   {
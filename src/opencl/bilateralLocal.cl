@@ -0,0 +1,202 @@
+
+//The bilateral filter of the log luminance is computed on a coarse grid over
+//space and log luminance (Chen, Paris and Durand, "Real-time Edge-Aware Image
+//Processing with the Bilateral Grid", SIGGRAPH 2007), so its cost doesn't
+//depend on the spatial sigma. The grid is stored as (sum of log luminance,
+//number of pixels) pairs, z major: cell (x, y, z) is at x + (y + z*GRID_HEIGHT)*GRID_WIDTH
+
+float GL_to_CL(uint val);
+
+const sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_NONE | CLK_FILTER_NEAREST;
+
+//reads a pixel in the 0..255 range, float inputs carry linear radiance that may exceed it
+float4 read_pixel(read_only image2d_t image, int2 pos) {
+#ifdef FLOAT_INPUT
+	return read_imagef(image, sampler, pos)*255.f;
+#else
+	uint4 pixel = read_imageui(image, sampler, pos);
+	return (float4)(GL_to_CL(pixel.x), GL_to_CL(pixel.y), GL_to_CL(pixel.z), GL_to_CL(pixel.w));
+#endif
+}
+
+float luminance(float4 pixel) {
+	return (pixel.x*0.2126f + pixel.y*0.7152f + pixel.z*0.0722f)/255.f;
+}
+
+float logLuminance(float lum) {
+	return log10(lum + 0.000001f);
+}
+
+//position of a log luminance along the grid's range axis
+float gridDepth(float logLum) {
+	return (clamp(logLum, GRID_LOG_MIN, GRID_LOG_MAX) - GRID_LOG_MIN)/SIGMA_R;
+}
+
+//trilinear interpolation of the blurred grid, normalised by the pixel count
+float sliceGrid(__global const float2* grid, int2 pos, float logLum) {
+	const float fx = pos.x/(float)CELL_SIZE;
+	const float fy = pos.y/(float)CELL_SIZE;
+	const float fz = gridDepth(logLum);
+	const int x = (int)fx, y = (int)fy, z = (int)fz;
+	const float dx = fx - x, dy = fy - y, dz = fz - z;
+
+	float2 acc = 0.f;
+	for (int k = 0; k < 2; k++) {
+		for (int j = 0; j < 2; j++) {
+			const int row = x + (y+j + (z+k)*GRID_HEIGHT)*GRID_WIDTH;
+			const float w = (k ? dz : 1.f-dz)*(j ? dy : 1.f-dy);
+			acc += grid[row]*w*(1.f-dx) + grid[row+1]*w*dx;
+		}
+	}
+	return acc.y > 0.f ? acc.x/acc.y : logLum;
+}
+
+//each work item owns a column of cells and sums every pixel that falls in
+//it, so no atomics are needed
+kernel void splat(	__read_only image2d_t input_image,
+					__global float2* grid) {
+	float2 column[GRID_DEPTH];
+	int2 cell, pos;
+	for (cell.y = get_global_id(1); cell.y < GRID_HEIGHT; cell.y += get_global_size(1)) {
+		for (cell.x = get_global_id(0); cell.x < GRID_WIDTH; cell.x += get_global_size(0)) {
+			for (int z = 0; z < GRID_DEPTH; z++) column[z] = 0.f;
+
+			//pixels whose nearest cell this is
+			const int x0 = max(cell.x*CELL_SIZE - CELL_SIZE/2, 0);
+			const int y0 = max(cell.y*CELL_SIZE - CELL_SIZE/2, 0);
+			const int x1 = min(cell.x*CELL_SIZE - CELL_SIZE/2 + CELL_SIZE, WIDTH);
+			const int y1 = min(cell.y*CELL_SIZE - CELL_SIZE/2 + CELL_SIZE, HEIGHT);
+			for (pos.y = y0; pos.y < y1; pos.y++) {
+				for (pos.x = x0; pos.x < x1; pos.x++) {
+					const float logLum = logLuminance(luminance(read_pixel(input_image, pos)));
+					column[(int)(gridDepth(logLum) + 0.5f)] += (float2)(logLum, 1.f);
+				}
+			}
+
+			for (int z = 0; z < GRID_DEPTH; z++) {
+				grid[cell.x + (cell.y + z*GRID_HEIGHT)*GRID_WIDTH] = column[z];
+			}
+		}
+	}
+}
+
+//one pass of a separable [1 4 6 4 1]/16 blur along the axis whose cells are
+//stride apart, cells beyond the grid are empty
+kernel void blur(	__global const float2* src,
+					__global float2* dst,
+					const int stride,
+					const int extent) {
+	const float weights[5] = {1.f/16, 4.f/16, 6.f/16, 4.f/16, 1.f/16};
+	for (int i = get_global_id(0); i < GRID_SIZE; i += get_global_size(0)) {
+		const int coord = (i/stride)%extent;
+		float2 acc = 0.f;
+		for (int k = -2; k <= 2; k++) {
+			if (coord+k >= 0 && coord+k < extent) acc += src[i + k*stride]*weights[k+2];
+		}
+		dst[i] = acc;
+	}
+}
+
+//this kernel computes the range of the base layer by performing reduction
+//the results are stored in arrays of size num_work_groups
+kernel void baseRange(	__read_only image2d_t input_image,
+						__global const float2* grid,
+						__global float* baseMin,
+						__global float* baseMax,
+						__local float* baseMin_loc,
+						__local float* baseMax_loc) {
+	float min_acc = GRID_LOG_MAX;
+	float max_acc = GRID_LOG_MIN;
+
+	int2 pos;
+	for (pos.y = get_global_id(1); pos.y < HEIGHT; pos.y += get_global_size(1)) {
+		for (pos.x = get_global_id(0); pos.x < WIDTH; pos.x += get_global_size(0)) {
+			const float logLum = logLuminance(luminance(read_pixel(input_image, pos)));
+			const float base = sliceGrid(grid, pos, logLum);
+			min_acc = min(min_acc, base);
+			max_acc = max(max_acc, base);
+		}
+	}
+
+	const int lid = get_local_id(0) + get_local_id(1)*get_local_size(0);	//local id in one dimension
+	baseMin_loc[lid] = min_acc;
+	baseMax_loc[lid] = max_acc;
+
+	// Perform parallel reduction
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for(int offset = (get_local_size(0)*get_local_size(1))/2; offset > 0; offset = offset/2) {
+		if (lid < offset) {
+			baseMin_loc[lid] = min(baseMin_loc[lid], baseMin_loc[lid + offset]);
+			baseMax_loc[lid] = max(baseMax_loc[lid], baseMax_loc[lid + offset]);
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	const int num_work_groups = get_global_size(0)/get_local_size(0);	//number of workgroups in x dim
+	const int group_id = get_group_id(0) + get_group_id(1)*num_work_groups;
+	if (lid == 0) {
+		baseMin[group_id] = baseMin_loc[0];
+		baseMax[group_id] = baseMax_loc[0];
+	}
+}
+
+kernel void finalReduc(	__global float* baseMin,
+						__global float* baseMax,
+						const unsigned int num_reduc_bins) {
+	if (get_global_id(0)==0) {
+		float min_acc = baseMin[0];
+		float max_acc = baseMax[0];
+		for (int i=1; i<num_reduc_bins; i++) {
+			min_acc = min(min_acc, baseMin[i]);
+			max_acc = max(max_acc, baseMax[i]);
+		}
+		baseMin[0] = min_acc;
+		baseMax[0] = max_acc;
+	}
+	else return;
+}
+
+//compresses the base layer to the target contrast and keeps the detail layer
+kernel void tonemap(__read_only image2d_t input_image,
+					__write_only image2d_t output_image,
+					__global const float2* grid,
+					__global const float* baseMin,
+					__global const float* baseMax,
+					const float logContrast,
+					const float sat,
+					const float invGamma) {
+	const float range = baseMax[0] - baseMin[0];
+	const float compression = range > 0.000001f ? min(logContrast/range, 1.f) : 1.f;
+
+	int2 pos;
+	uint4 pixel;
+	for (pos.y = get_global_id(1); pos.y < HEIGHT; pos.y += get_global_size(1)) {
+		for (pos.x = get_global_id(0); pos.x < WIDTH; pos.x += get_global_size(0)) {
+			const float4 in = read_pixel(input_image, pos);
+			const float lum = luminance(in);
+			const float logLum = logLuminance(lum);
+			const float base = sliceGrid(grid, pos, logLum);
+
+			//the brightest base maps to 1
+			const float Ld = pow(10.f, (base - baseMax[0])*compression + logLum - base);
+			const float3 rgb = lum > 0.f ? pow(in.xyz/255.f/lum, (float3)(sat))*Ld : (float3)(0.f);
+
+			pixel.x = clamp(pow(rgb.x, invGamma)*255.f, 0.f, 255.f);
+			pixel.y = clamp(pow(rgb.y, invGamma)*255.f, 0.f, 255.f);
+			pixel.z = clamp(pow(rgb.z, invGamma)*255.f, 0.f, 255.f);
+			pixel.w = clamp(in.w, 0.f, 255.f);
+			write_imageui(output_image, pos, pixel);
+		}
+	}
+}
+
+float GL_to_CL(uint val) {
+	if (val >= 14340) return round(0.1245790*val - 1658.44);	//>=128
+	if (val >= 13316) return round(0.0622869*val - 765.408);	//>=64
+	if (val >= 12292) return round(0.0311424*val - 350.800);	//>=32
+	if (val >= 11268) return round(0.0155702*val - 159.443);	//>=16
+
+	float v = (float) val;
+	return round(0.0000000000000125922*pow(v,4.f) - 0.00000000026729*pow(v,3.f) + 0.00000198135*pow(v,2.f) - 0.00496681*v - 0.0000808829);
+}
@@ -0,0 +1,204 @@
+const char *bilateralLocal_kernel =
+"\n"
+"//The bilateral filter of the log luminance is computed on a coarse grid over\n"
+"//space and log luminance (Chen, Paris and Durand, \"Real-time Edge-Aware Image\n"
+"//Processing with the Bilateral Grid\", SIGGRAPH 2007), so its cost doesn't\n"
+"//depend on the spatial sigma. The grid is stored as (sum of log luminance,\n"
+"//number of pixels) pairs, z major: cell (x, y, z) is at x + (y + z*GRID_HEIGHT)*GRID_WIDTH\n"
+"\n"
+"float GL_to_CL(uint val);\n"
+"\n"
+"const sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_NONE | CLK_FILTER_NEAREST;\n"
+"\n"
+"//reads a pixel in the 0..255 range, float inputs carry linear radiance that may exceed it\n"
+"float4 read_pixel(read_only image2d_t image, int2 pos) {\n"
+"#ifdef FLOAT_INPUT\n"
+"	return read_imagef(image, sampler, pos)*255.f;\n"
+"#else\n"
+"	uint4 pixel = read_imageui(image, sampler, pos);\n"
+"	return (float4)(GL_to_CL(pixel.x), GL_to_CL(pixel.y), GL_to_CL(pixel.z), GL_to_CL(pixel.w));\n"
+"#endif\n"
+"}\n"
+"\n"
+"float luminance(float4 pixel) {\n"
+"	return (pixel.x*0.2126f + pixel.y*0.7152f + pixel.z*0.0722f)/255.f;\n"
+"}\n"
+"\n"
+"float logLuminance(float lum) {\n"
+"	return log10(lum + 0.000001f);\n"
+"}\n"
+"\n"
+"//position of a log luminance along the grid's range axis\n"
+"float gridDepth(float logLum) {\n"
+"	return (clamp(logLum, GRID_LOG_MIN, GRID_LOG_MAX) - GRID_LOG_MIN)/SIGMA_R;\n"
+"}\n"
+"\n"
+"//trilinear interpolation of the blurred grid, normalised by the pixel count\n"
+"float sliceGrid(__global const float2* grid, int2 pos, float logLum) {\n"
+"	const float fx = pos.x/(float)CELL_SIZE;\n"
+"	const float fy = pos.y/(float)CELL_SIZE;\n"
+"	const float fz = gridDepth(logLum);\n"
+"	const int x = (int)fx, y = (int)fy, z = (int)fz;\n"
+"	const float dx = fx - x, dy = fy - y, dz = fz - z;\n"
+"\n"
+"	float2 acc = 0.f;\n"
+"	for (int k = 0; k < 2; k++) {\n"
+"		for (int j = 0; j < 2; j++) {\n"
+"			const int row = x + (y+j + (z+k)*GRID_HEIGHT)*GRID_WIDTH;\n"
+"			const float w = (k ? dz : 1.f-dz)*(j ? dy : 1.f-dy);\n"
+"			acc += grid[row]*w*(1.f-dx) + grid[row+1]*w*dx;\n"
+"		}\n"
+"	}\n"
+"	return acc.y > 0.f ? acc.x/acc.y : logLum;\n"
+"}\n"
+"\n"
+"//each work item owns a column of cells and sums every pixel that falls in\n"
+"//it, so no atomics are needed\n"
+"kernel void splat(	__read_only image2d_t input_image,\n"
+"					__global float2* grid) {\n"
+"	float2 column[GRID_DEPTH];\n"
+"	int2 cell, pos;\n"
+"	for (cell.y = get_global_id(1); cell.y < GRID_HEIGHT; cell.y += get_global_size(1)) {\n"
+"		for (cell.x = get_global_id(0); cell.x < GRID_WIDTH; cell.x += get_global_size(0)) {\n"
+"			for (int z = 0; z < GRID_DEPTH; z++) column[z] = 0.f;\n"
+"\n"
+"			//pixels whose nearest cell this is\n"
+"			const int x0 = max(cell.x*CELL_SIZE - CELL_SIZE/2, 0);\n"
+"			const int y0 = max(cell.y*CELL_SIZE - CELL_SIZE/2, 0);\n"
+"			const int x1 = min(cell.x*CELL_SIZE - CELL_SIZE/2 + CELL_SIZE, WIDTH);\n"
+"			const int y1 = min(cell.y*CELL_SIZE - CELL_SIZE/2 + CELL_SIZE, HEIGHT);\n"
+"			for (pos.y = y0; pos.y < y1; pos.y++) {\n"
+"				for (pos.x = x0; pos.x < x1; pos.x++) {\n"
+"					const float logLum = logLuminance(luminance(read_pixel(input_image, pos)));\n"
+"					column[(int)(gridDepth(logLum) + 0.5f)] += (float2)(logLum, 1.f);\n"
+"				}\n"
+"			}\n"
+"\n"
+"			for (int z = 0; z < GRID_DEPTH; z++) {\n"
+"				grid[cell.x + (cell.y + z*GRID_HEIGHT)*GRID_WIDTH] = column[z];\n"
+"			}\n"
+"		}\n"
+"	}\n"
+"}\n"
+"\n"
+"//one pass of a separable [1 4 6 4 1]/16 blur along the axis whose cells are\n"
+"//stride apart, cells beyond the grid are empty\n"
+"kernel void blur(	__global const float2* src,\n"
+"					__global float2* dst,\n"
+"					const int stride,\n"
+"					const int extent) {\n"
+"	const float weights[5] = {1.f/16, 4.f/16, 6.f/16, 4.f/16, 1.f/16};\n"
+"	for (int i = get_global_id(0); i < GRID_SIZE; i += get_global_size(0)) {\n"
+"		const int coord = (i/stride)%extent;\n"
+"		float2 acc = 0.f;\n"
+"		for (int k = -2; k <= 2; k++) {\n"
+"			if (coord+k >= 0 && coord+k < extent) acc += src[i + k*stride]*weights[k+2];\n"
+"		}\n"
+"		dst[i] = acc;\n"
+"	}\n"
+"}\n"
+"\n"
+"//this kernel computes the range of the base layer by performing reduction\n"
+"//the results are stored in arrays of size num_work_groups\n"
+"kernel void baseRange(	__read_only image2d_t input_image,\n"
+"						__global const float2* grid,\n"
+"						__global float* baseMin,\n"
+"						__global float* baseMax,\n"
+"						__local float* baseMin_loc,\n"
+"						__local float* baseMax_loc) {\n"
+"	float min_acc = GRID_LOG_MAX;\n"
+"	float max_acc = GRID_LOG_MIN;\n"
+"\n"
+"	int2 pos;\n"
+"	for (pos.y = get_global_id(1); pos.y < HEIGHT; pos.y += get_global_size(1)) {\n"
+"		for (pos.x = get_global_id(0); pos.x < WIDTH; pos.x += get_global_size(0)) {\n"
+"			const float logLum = logLuminance(luminance(read_pixel(input_image, pos)));\n"
+"			const float base = sliceGrid(grid, pos, logLum);\n"
+"			min_acc = min(min_acc, base);\n"
+"			max_acc = max(max_acc, base);\n"
+"		}\n"
+"	}\n"
+"\n"
+"	const int lid = get_local_id(0) + get_local_id(1)*get_local_size(0);	//local id in one dimension\n"
+"	baseMin_loc[lid] = min_acc;\n"
+"	baseMax_loc[lid] = max_acc;\n"
+"\n"
+"	// Perform parallel reduction\n"
+"	barrier(CLK_LOCAL_MEM_FENCE);\n"
+"\n"
+"	for(int offset = (get_local_size(0)*get_local_size(1))/2; offset > 0; offset = offset/2) {\n"
+"		if (lid < offset) {\n"
+"			baseMin_loc[lid] = min(baseMin_loc[lid], baseMin_loc[lid + offset]);\n"
+"			baseMax_loc[lid] = max(baseMax_loc[lid], baseMax_loc[lid + offset]);\n"
+"		}\n"
+"		barrier(CLK_LOCAL_MEM_FENCE);\n"
+"	}\n"
+"\n"
+"	const int num_work_groups = get_global_size(0)/get_local_size(0);	//number of workgroups in x dim\n"
+"	const int group_id = get_group_id(0) + get_group_id(1)*num_work_groups;\n"
+"	if (lid == 0) {\n"
+"		baseMin[group_id] = baseMin_loc[0];\n"
+"		baseMax[group_id] = baseMax_loc[0];\n"
+"	}\n"
+"}\n"
+"\n"
+"kernel void finalReduc(	__global float* baseMin,\n"
+"						__global float* baseMax,\n"
+"						const unsigned int num_reduc_bins) {\n"
+"	if (get_global_id(0)==0) {\n"
+"		float min_acc = baseMin[0];\n"
+"		float max_acc = baseMax[0];\n"
+"		for (int i=1; i<num_reduc_bins; i++) {\n"
+"			min_acc = min(min_acc, baseMin[i]);\n"
+"			max_acc = max(max_acc, baseMax[i]);\n"
+"		}\n"
+"		baseMin[0] = min_acc;\n"
+"		baseMax[0] = max_acc;\n"
+"	}\n"
+"	else return;\n"
+"}\n"
+"\n"
+"//compresses the base layer to the target contrast and keeps the detail layer\n"
+"kernel void tonemap(__read_only image2d_t input_image,\n"
+"					__write_only image2d_t output_image,\n"
+"					__global const float2* grid,\n"
+"					__global const float* baseMin,\n"
+"					__global const float* baseMax,\n"
+"					const float logContrast,\n"
+"					const float sat,\n"
+"					const float invGamma) {\n"
+"	const float range = baseMax[0] - baseMin[0];\n"
+"	const float compression = range > 0.000001f ? min(logContrast/range, 1.f) : 1.f;\n"
+"\n"
+"	int2 pos;\n"
+"	uint4 pixel;\n"
+"	for (pos.y = get_global_id(1); pos.y < HEIGHT; pos.y += get_global_size(1)) {\n"
+"		for (pos.x = get_global_id(0); pos.x < WIDTH; pos.x += get_global_size(0)) {\n"
+"			const float4 in = read_pixel(input_image, pos);\n"
+"			const float lum = luminance(in);\n"
+"			const float logLum = logLuminance(lum);\n"
+"			const float base = sliceGrid(grid, pos, logLum);\n"
+"\n"
+"			//the brightest base maps to 1\n"
+"			const float Ld = pow(10.f, (base - baseMax[0])*compression + logLum - base);\n"
+"			const float3 rgb = lum > 0.f ? pow(in.xyz/255.f/lum, (float3)(sat))*Ld : (float3)(0.f);\n"
+"\n"
+"			pixel.x = clamp(pow(rgb.x, invGamma)*255.f, 0.f, 255.f);\n"
+"			pixel.y = clamp(pow(rgb.y, invGamma)*255.f, 0.f, 255.f);\n"
+"			pixel.z = clamp(pow(rgb.z, invGamma)*255.f, 0.f, 255.f);\n"
+"			pixel.w = clamp(in.w, 0.f, 255.f);\n"
+"			write_imageui(output_image, pos, pixel);\n"
+"		}\n"
+"	}\n"
+"}\n"
+"\n"
+"float GL_to_CL(uint val) {\n"
+"	if (val >= 14340) return round(0.1245790*val - 1658.44);	//>=128\n"
+"	if (val >= 13316) return round(0.0622869*val - 765.408);	//>=64\n"
+"	if (val >= 12292) return round(0.0311424*val - 350.800);	//>=32\n"
+"	if (val >= 11268) return round(0.0155702*val - 159.443);	//>=16\n"
+"\n"
+"	float v = (float) val;\n"
+"	return round(0.0000000000000125922*pow(v,4.f) - 0.00000000026729*pow(v,3.f) + 0.00000198135*pow(v,2.f) - 0.00496681*v - 0.0000808829);\n"
+"}\n"
+;
@@ -1,28 +1,53 @@
 
+//intermediate planes are stored as half floats when HALF_STORAGE is defined,
+//all arithmetic is still done in float
+#ifdef HALF_STORAGE
+	#ifdef cl_khr_fp16
+		#pragma OPENCL EXTENSION cl_khr_fp16 : enable
+	#endif
+	#define storage_t half
+	#define LOAD(buf, i)		vload_half((i), (buf))
+	#define STORE(buf, i, val)	vstore_half((val), (i), (buf))
+#else
+	#define storage_t float
+	#define LOAD(buf, i)		(buf)[(i)]
+	#define STORE(buf, i, val)	(buf)[(i)] = (val)
+#endif
+
 float GL_to_CL(uint val);
 float3 RGBtoXYZ(float3 rgb);
 
 const sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_NONE | CLK_FILTER_NEAREST;
 
+//reads a pixel in the 0..255 range, float inputs carry linear radiance that may exceed it
+float4 read_pixel(read_only image2d_t image, int2 pos) {
+#ifdef FLOAT_INPUT
+	return read_imagef(image, sampler, pos)*255.f;
+#else
+	uint4 pixel = read_imageui(image, sampler, pos);
+	return (float4)(GL_to_CL(pixel.x), GL_to_CL(pixel.y), GL_to_CL(pixel.z), GL_to_CL(pixel.w));
+#endif
+}
+
 //this kernel computes logLum
 kernel void computeLogLum( 	__read_only image2d_t image,
-							__global float* logLum) {
+							__global storage_t* logLum) {
 
 	int2 pos;
-	uint4 pixel;
+	float4 pixel;
 	float lum;
 	for (pos.y = get_global_id(1); pos.y < HEIGHT; pos.y += get_global_size(1)) {
 		for (pos.x = get_global_id(0); pos.x < WIDTH; pos.x += get_global_size(0)) {
-			pixel = read_imageui(image, sampler, pos);
-			lum = GL_to_CL(pixel.x)*0.2126
-				+ GL_to_CL(pixel.y)*0.7152
-				+ GL_to_CL(pixel.z)*0.0722;
-			logLum[pos.x + pos.y*WIDTH] = log(lum + 0.000001);
+			pixel = read_pixel(image, pos);
+			lum = pixel.x*0.2126
+				+ pixel.y*0.7152
+				+ pixel.z*0.0722;
+			STORE(logLum, pos.x + pos.y*WIDTH, log(lum + 0.000001));
 		}
 	}
 }
 
-kernel void channel_mipmap(	__global float* mipmap,	//array containing all the mipmap levels
+kernel void channel_mipmap(	__global storage_t* mipmap,	//array containing all the mipmap levels
 							const int prev_width,	//width of the previous mipmap
 							const int prev_offset, 	//start point of the previous mipmap 
 							const int m_width,		//width of the mipmap being generated
@@ -33,17 +58,17 @@ kernel void channel_mipmap(	__global float* mipmap,	//array containing all the m
 		for (pos.x = get_global_id(0); pos.x < m_width; pos.x += get_global_size(0)) {
 			int _x = 2*pos.x;
 			int _y = 2*pos.y;
-			mipmap[pos.x + pos.y*m_width + m_offset] = 	(mipmap[_x + _y*prev_width + prev_offset]
-														+ mipmap[_x+1 + _y*prev_width + prev_offset]
-														+ mipmap[_x + (_y+1)*prev_width + prev_offset]
-														+ mipmap[(_x+1) + (_y+1)*prev_width + prev_offset])/4.f;
+			STORE(mipmap, pos.x + pos.y*m_width + m_offset, (LOAD(mipmap, _x + _y*prev_width + prev_offset)
+															+ LOAD(mipmap, _x+1 + _y*prev_width + prev_offset)
+															+ LOAD(mipmap, _x + (_y+1)*prev_width + prev_offset)
+															+ LOAD(mipmap, (_x+1) + (_y+1)*prev_width + prev_offset))/4.f);
 		}
 	}
 }
 
 //computing gradient magnitude using central differences at level k
-kernel void gradient_mag(	__global float* lum,		//array containing all the luminance mipmap levels
-							__global float* gradient,	//array to store all the gradients at different levels
+kernel void gradient_mag(	__global storage_t* lum,		//array containing all the luminance mipmap levels
+							__global storage_t* gradient,	//array to store all the gradients at different levels
 							const int g_width,			//width of the gradient being generated
 							const int g_height,			//height of the gradient being generated
 							const int offset,			//start point to store the current gradient
@@ -63,26 +88,27 @@ kernel void gradient_mag(	__global float* lum,		//array containing all the lumin
 			y_north = clamp(pos.y-1, 0, g_height-1);
 			y_south = clamp(pos.y+1, 0, g_height-1);
 
-			x_grad = (lum[x_west + pos.y*g_width + offset]  - lum[x_east + pos.y*g_width + offset])/divider;
-			y_grad = (lum[pos.x + y_south*g_width + offset] - lum[pos.x + y_north*g_width + offset])/divider;
+			x_grad = (LOAD(lum, x_west + pos.y*g_width + offset)  - LOAD(lum, x_east + pos.y*g_width + offset))/divider;
+			y_grad = (LOAD(lum, pos.x + y_south*g_width + offset) - LOAD(lum, pos.x + y_north*g_width + offset))/divider;
 
-			gradient[pos.x + pos.y*g_width + offset] = sqrt(pow(x_grad, 2.f) + pow(y_grad, 2.f));
+			STORE(gradient, pos.x + pos.y*g_width + offset, sqrt(pow(x_grad, 2.f) + pow(y_grad, 2.f)));
 		}
 	}
 }
 
 
-kernel void partialReduc(	__global float* gradient,
+kernel void partialReduc(	__global storage_t* gradient,
 							__global float* gradient_partial_sum,
 							__local float* gradient_loc,
 							const int height,
 							const int width,
-							const int g_offset) {
+							const int g_offset,
+							const int mipmap_level) {
 
 	float gradient_acc = 0.f;
 
 	for (int gid = get_global_id(0); gid < height*width; gid += get_global_size(0)) {
-		gradient_acc += gradient[g_offset + gid];
+		gradient_acc += LOAD(gradient, g_offset + gid);
 	}
 
 	const int lid = get_local_id(0);	//local id in one dimension
@@ -100,7 +126,8 @@ kernel void partialReduc(	__global float* gradient,
 
 	const int group_id = get_group_id(0);
 	if (lid == 0) {
-		gradient_partial_sum[group_id] = gradient_loc[0];
+		//each level keeps its own sums, so finalReduc can be rerun without them
+		gradient_partial_sum[mipmap_level*get_num_groups(0) + group_id] = gradient_loc[0];
 	}
 }
 
@@ -110,34 +137,37 @@ kernel void finalReduc(	__global float* gradient_partial_sum,
 						const int mipmap_level,
 						const int width,
 						const int height,
-						const unsigned int num_reduc_bins) {
+						const unsigned int num_reduc_bins,
+						const float adjust_alpha) {
 	if (get_global_id(0)==0) {
 
 		float sum_grads = 0.f;
 	
 		for (int i=0; i<num_reduc_bins; i++) {
-			sum_grads += gradient_partial_sum[i];
+			sum_grads += gradient_partial_sum[mipmap_level*num_reduc_bins + i];
 		}
-		alphas[mipmap_level] = ADJUST_ALPHA*exp(sum_grads/((float)width*height));
+		alphas[mipmap_level] = adjust_alpha*exp(sum_grads/((float)width*height));
 	}
 	else return;
 }
 
 
-kernel void coarsest_level_attenfunc(	__global float* gradient,
-										__global float* atten_func,
+kernel void coarsest_level_attenfunc(	__global storage_t* gradient,
+										__global storage_t* atten_func,
 										__global float* k_alpha,
 										const int width,
 										const int height,
-										const int offset) {
+										const int offset,
+										const float beta) {
 
 	for (int gid = get_global_id(0); gid < width*height; gid+= get_global_size(0) ) {
-		atten_func[gid+offset] = (k_alpha[0]/gradient[gid+offset])*pow(gradient[gid+offset]/k_alpha[0], (float)BETA);
+		float grad = LOAD(gradient, gid+offset);
+		STORE(atten_func, gid+offset, (k_alpha[0]/grad)*pow(grad/k_alpha[0], beta));
 	}
 }
 
-kernel void atten_func(	__global float* gradient,
-						__global float* atten_func,
+kernel void atten_func(	__global storage_t* gradient,
+						__global storage_t* atten_func,
 						__global float* k_alpha,
 						const int width,
 						const int height,
@@ -145,7 +175,8 @@ kernel void atten_func(	__global float* gradient,
 						const int c_width,
 						const int c_height,
 						const int c_offset,
-						const int level) {
+						const int level,
+						const float beta) {
 	int2 pos;
 	int2 c_pos;
 	int2 neighbour;
@@ -153,7 +184,8 @@ kernel void atten_func(	__global float* gradient,
 	float k_xy_scale_factor;
 	for (pos.y = get_global_id(1); pos.y < height; pos.y += get_global_size(1)) {
 		for (pos.x = get_global_id(0); pos.x < width; pos.x += get_global_size(0)) {
-			if (gradient[pos.x + pos.y*width + offset] != 0) {
+			float grad = LOAD(gradient, pos.x + pos.y*width + offset);
+			if (grad != 0) {
 
 				c_pos = pos/2;	//position in the coarser grid
 
@@ -170,50 +202,52 @@ kernel void atten_func(	__global float* gradient,
 				if (c_pos.x == c_width)  c_pos.x -= 1;
 				if (c_pos.y == c_height) c_pos.y -= 1;
 
-				k_xy_atten_func = 9.0*atten_func[c_pos.x 				+ c_pos.y					*c_width	+ c_offset]
-								+ 3.0*atten_func[c_pos.x+neighbour.x 	+ c_pos.y					*c_width	+ c_offset]
-								+ 3.0*atten_func[c_pos.x 				+ (c_pos.y+neighbour.y)		*c_width	+ c_offset]
-								+ 1.0*atten_func[c_pos.x+neighbour.x 	+ (c_pos.y+neighbour.y)		*c_width	+ c_offset];
+				k_xy_atten_func = 9.0*LOAD(atten_func, c_pos.x 				+ c_pos.y					*c_width	+ c_offset)
+								+ 3.0*LOAD(atten_func, c_pos.x+neighbour.x 	+ c_pos.y					*c_width	+ c_offset)
+								+ 3.0*LOAD(atten_func, c_pos.x 				+ (c_pos.y+neighbour.y)		*c_width	+ c_offset)
+								+ 1.0*LOAD(atten_func, c_pos.x+neighbour.x 	+ (c_pos.y+neighbour.y)		*c_width	+ c_offset);
 
-				k_xy_scale_factor = (k_alpha[level]/gradient[pos.x + pos.y*width + offset])*pow(gradient[pos.x + pos.y*width + offset]/k_alpha[level], (float)BETA);
-				atten_func[pos.x + pos.y*width + offset] = (1.f/16.f)*(k_xy_atten_func)*k_xy_scale_factor;
+				k_xy_scale_factor = (k_alpha[level]/grad)*pow(grad/k_alpha[level], beta);
+				STORE(atten_func, pos.x + pos.y*width + offset, (1.f/16.f)*(k_xy_atten_func)*k_xy_scale_factor);
 			}
-			else atten_func[pos.x + pos.y*width + offset] = 0.f;
+			else STORE(atten_func, pos.x + pos.y*width + offset, 0.f);
 		}
 	}
 }
 
 
-kernel void grad_atten(	__global float* atten_grad_x,
-						__global float* atten_grad_y,
-						__global float* lum,
-						__global float* atten_func) {
+kernel void grad_atten(	__global storage_t* atten_grad_x,
+						__global storage_t* atten_grad_y,
+						__global storage_t* lum,
+						__global storage_t* atten_func) {
 	int2 pos;
 	float2 grad;
 	for (pos.y = get_global_id(1); pos.y < HEIGHT; pos.y += get_global_size(1)) {
 		for (pos.x = get_global_id(0); pos.x < WIDTH; pos.x += get_global_size(0)) {	
-			grad.x = (pos.x < WIDTH-1 ) ? (lum[pos.x+1 +  	 pos.y*WIDTH] - lum[pos.x + pos.y*WIDTH]) : 0;
-			grad.y = (pos.y < HEIGHT-1) ? (lum[pos.x   + (pos.y+1)*WIDTH] - lum[pos.x + pos.y*WIDTH]) : 0;
-			atten_grad_x[pos.x + pos.y*WIDTH] = grad.x*atten_func[pos.x + pos.y*WIDTH];
-			atten_grad_y[pos.x + pos.y*WIDTH] = grad.y*atten_func[pos.x + pos.y*WIDTH];
+			float centre = LOAD(lum, pos.x + pos.y*WIDTH);
+			float atten  = LOAD(atten_func, pos.x + pos.y*WIDTH);
+			grad.x = (pos.x < WIDTH-1 ) ? (LOAD(lum, pos.x+1 +  	 pos.y*WIDTH) - centre) : 0;
+			grad.y = (pos.y < HEIGHT-1) ? (LOAD(lum, pos.x   + (pos.y+1)*WIDTH) - centre) : 0;
+			STORE(atten_grad_x, pos.x + pos.y*WIDTH, grad.x*atten);
+			STORE(atten_grad_y, pos.x + pos.y*WIDTH, grad.y*atten);
 		}
 	}
 }
 
 
-kernel void divG(	__global float* atten_grad_x,
-					__global float* atten_grad_y,
-					__global float* div_grad) {
-	div_grad[0] = 0;
+kernel void divG(	__global storage_t* atten_grad_x,
+					__global storage_t* atten_grad_y,
+					__global storage_t* div_grad) {
+	STORE(div_grad, 0, 0.f);
 	int2 pos;
 	for (pos.x = get_global_id(0) + 1; pos.x < WIDTH; pos.x += get_global_size(0)) {
-		div_grad[pos.x] = atten_grad_x[pos.x] - atten_grad_x[pos.x-1];
+		STORE(div_grad, pos.x, LOAD(atten_grad_x, pos.x) - LOAD(atten_grad_x, pos.x-1));
 	}
 	for (pos.y = get_global_id(1) + 1; pos.y < HEIGHT; pos.y += get_global_size(1)) {
-		div_grad[pos.y*WIDTH] = atten_grad_y[pos.y*WIDTH] - atten_grad_y[(pos.y-1)*WIDTH];
+		STORE(div_grad, pos.y*WIDTH, LOAD(atten_grad_y, pos.y*WIDTH) - LOAD(atten_grad_y, (pos.y-1)*WIDTH));
 		for (pos.x = get_global_id(0)+1; pos.x < WIDTH; pos.x += get_global_size(0)) {
-			div_grad[pos.x + pos.y*WIDTH] 	= (atten_grad_x[pos.x + pos.y*WIDTH] - atten_grad_x[(pos.x-1) + pos.y*WIDTH])
-											+ (atten_grad_y[pos.x + pos.y*WIDTH] - atten_grad_y[pos.x + (pos.y-1)*WIDTH]);
+			STORE(div_grad, pos.x + pos.y*WIDTH, (LOAD(atten_grad_x, pos.x + pos.y*WIDTH) - LOAD(atten_grad_x, (pos.x-1) + pos.y*WIDTH))
+												+ (LOAD(atten_grad_y, pos.x + pos.y*WIDTH) - LOAD(atten_grad_y, pos.x + (pos.y-1)*WIDTH)));
 		}
 	}	
 }
@@ -1,29 +1,54 @@
 const char *gradDom_kernel =
 "\n"
+"//intermediate planes are stored as half floats when HALF_STORAGE is defined,\n"
+"//all arithmetic is still done in float\n"
+"#ifdef HALF_STORAGE\n"
+"	#ifdef cl_khr_fp16\n"
+"		#pragma OPENCL EXTENSION cl_khr_fp16 : enable\n"
+"	#endif\n"
+"	#define storage_t half\n"
+"	#define LOAD(buf, i)		vload_half((i), (buf))\n"
+"	#define STORE(buf, i, val)	vstore_half((val), (i), (buf))\n"
+"#else\n"
+"	#define storage_t float\n"
+"	#define LOAD(buf, i)		(buf)[(i)]\n"
+"	#define STORE(buf, i, val)	(buf)[(i)] = (val)\n"
+"#endif\n"
+"\n"
 "float GL_to_CL(uint val);\n"
 "float3 RGBtoXYZ(float3 rgb);\n"
 "\n"
 "const sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_NONE | CLK_FILTER_NEAREST;\n"
 "\n"
+"//reads a pixel in the 0..255 range, float inputs carry linear radiance that may exceed it\n"
+"float4 read_pixel(read_only image2d_t image, int2 pos) {\n"
+"#ifdef FLOAT_INPUT\n"
+"	return read_imagef(image, sampler, pos)*255.f;\n"
+"#else\n"
+"	uint4 pixel = read_imageui(image, sampler, pos);\n"
+"	return (float4)(GL_to_CL(pixel.x), GL_to_CL(pixel.y), GL_to_CL(pixel.z), GL_to_CL(pixel.w));\n"
+"#endif\n"
+"}\n"
+"\n"
 "//this kernel computes logLum\n"
 "kernel void computeLogLum( 	__read_only image2d_t image,\n"
-"							__global float* logLum) {\n"
+"							__global storage_t* logLum) {\n"
 "\n"
 "	int2 pos;\n"
-"	uint4 pixel;\n"
+"	float4 pixel;\n"
 "	float lum;\n"
 "	for (pos.y = get_global_id(1); pos.y < HEIGHT; pos.y += get_global_size(1)) {\n"
 "		for (pos.x = get_global_id(0); pos.x < WIDTH; pos.x += get_global_size(0)) {\n"
-"			pixel = read_imageui(image, sampler, pos);\n"
-"			lum = GL_to_CL(pixel.x)*0.2126\n"
-"				+ GL_to_CL(pixel.y)*0.7152\n"
-"				+ GL_to_CL(pixel.z)*0.0722;\n"
-"			logLum[pos.x + pos.y*WIDTH] = log(lum + 0.000001);\n"
+"			pixel = read_pixel(image, pos);\n"
+"			lum = pixel.x*0.2126\n"
+"				+ pixel.y*0.7152\n"
+"				+ pixel.z*0.0722;\n"
+"			STORE(logLum, pos.x + pos.y*WIDTH, log(lum + 0.000001));\n"
 "		}\n"
 "	}\n"
 "}\n"
 "\n"
-"kernel void channel_mipmap(	__global float* mipmap,	//array containing all the mipmap levels\n"
+"kernel void channel_mipmap(	__global storage_t* mipmap,	//array containing all the mipmap levels\n"
 "							const int prev_width,	//width of the previous mipmap\n"
 "							const int prev_offset, 	//start point of the previous mipmap \n"
 "							const int m_width,		//width of the mipmap being generated\n"
@@ -34,17 +59,17 @@ const char *gradDom_kernel =
 "		for (pos.x = get_global_id(0); pos.x < m_width; pos.x += get_global_size(0)) {\n"
 "			int _x = 2*pos.x;\n"
 "			int _y = 2*pos.y;\n"
-"			mipmap[pos.x + pos.y*m_width + m_offset] = 	(mipmap[_x + _y*prev_width + prev_offset]\n"
-"														+ mipmap[_x+1 + _y*prev_width + prev_offset]\n"
-"														+ mipmap[_x + (_y+1)*prev_width + prev_offset]\n"
-"														+ mipmap[(_x+1) + (_y+1)*prev_width + prev_offset])/4.f;\n"
+"			STORE(mipmap, pos.x + pos.y*m_width + m_offset, (LOAD(mipmap, _x + _y*prev_width + prev_offset)\n"
+"															+ LOAD(mipmap, _x+1 + _y*prev_width + prev_offset)\n"
+"															+ LOAD(mipmap, _x + (_y+1)*prev_width + prev_offset)\n"
+"															+ LOAD(mipmap, (_x+1) + (_y+1)*prev_width + prev_offset))/4.f);\n"
 "		}\n"
 "	}\n"
 "}\n"
 "\n"
 "//computing gradient magnitude using central differences at level k\n"
-"kernel void gradient_mag(	__global float* lum,		//array containing all the luminance mipmap levels\n"
-"							__global float* gradient,	//array to store all the gradients at different levels\n"
+"kernel void gradient_mag(	__global storage_t* lum,		//array containing all the luminance mipmap levels\n"
+"							__global storage_t* gradient,	//array to store all the gradients at different levels\n"
 "							const int g_width,			//width of the gradient being generated\n"
 "							const int g_height,			//height of the gradient being generated\n"
 "							const int offset,			//start point to store the current gradient\n"
@@ -64,26 +89,27 @@ const char *gradDom_kernel =
 "			y_north = clamp(pos.y-1, 0, g_height-1);\n"
 "			y_south = clamp(pos.y+1, 0, g_height-1);\n"
 "\n"
-"			x_grad = (lum[x_west + pos.y*g_width + offset]\t- lum[x_east + pos.y*g_width + offset])/divider;\n"
-"			y_grad = (lum[pos.x + y_south*g_width + offset] - lum[pos.x + y_north*g_width + offset])/divider;\n"
+"			x_grad = (LOAD(lum, x_west + pos.y*g_width + offset)\t- LOAD(lum, x_east + pos.y*g_width + offset))/divider;\n"
+"			y_grad = (LOAD(lum, pos.x + y_south*g_width + offset) - LOAD(lum, pos.x + y_north*g_width + offset))/divider;\n"
 "\n"
-"			gradient[pos.x + pos.y*g_width + offset] = sqrt(pow(x_grad, 2.f) + pow(y_grad, 2.f));\n"
+"			STORE(gradient, pos.x + pos.y*g_width + offset, sqrt(pow(x_grad, 2.f) + pow(y_grad, 2.f)));\n"
 "		}\n"
 "	}\n"
 "}\n"
 "\n"
 "\n"
-"kernel void partialReduc(	__global float* gradient,\n"
+"kernel void partialReduc(	__global storage_t* gradient,\n"
 "							__global float* gradient_partial_sum,\n"
 "							__local float* gradient_loc,\n"
 "							const int height,\n"
 "							const int width,\n"
-"							const int g_offset) {\n"
+"							const int g_offset,\n"
+"							const int mipmap_level) {\n"
 "\n"
 "	float gradient_acc = 0.f;\n"
 "\n"
 "	for (int gid = get_global_id(0); gid < height*width; gid += get_global_size(0)) {\n"
-"		gradient_acc += gradient[g_offset + gid];\n"
+"		gradient_acc += LOAD(gradient, g_offset + gid);\n"
 "	}\n"
 "\n"
 "	const int lid = get_local_id(0);	//local id in one dimension\n"
@@ -101,7 +127,8 @@ const char *gradDom_kernel =
 "\n"
 "	const int group_id = get_group_id(0);\n"
 "	if (lid == 0) {\n"
-"		gradient_partial_sum[group_id] = gradient_loc[0];\n"
+"		//each level keeps its own sums, so finalReduc can be rerun without them\n"
+"		gradient_partial_sum[mipmap_level*get_num_groups(0) + group_id] = gradient_loc[0];\n"
 "	}\n"
 "}\n"
 "\n"
@@ -111,34 +138,37 @@ const char *gradDom_kernel =
 "						const int mipmap_level,\n"
 "						const int width,\n"
 "						const int height,\n"
-"						const unsigned int num_reduc_bins) {\n"
+"						const unsigned int num_reduc_bins,\n"
+"						const float adjust_alpha) {\n"
 "	if (get_global_id(0)==0) {\n"
 "\n"
 "		float sum_grads = 0.f;\n"
 "	\n"
 "		for (int i=0; i<num_reduc_bins; i++) {\n"
-"			sum_grads += gradient_partial_sum[i];\n"
+"			sum_grads += gradient_partial_sum[mipmap_level*num_reduc_bins + i];\n"
 "		}\n"
-"		alphas[mipmap_level] = ADJUST_ALPHA*exp(sum_grads/((float)width*height));\n"
+"		alphas[mipmap_level] = adjust_alpha*exp(sum_grads/((float)width*height));\n"
 "	}\n"
 "	else return;\n"
 "}\n"
 "\n"
 "\n"
-"kernel void coarsest_level_attenfunc(	__global float* gradient,\n"
-"										__global float* atten_func,\n"
+"kernel void coarsest_level_attenfunc(	__global storage_t* gradient,\n"
+"										__global storage_t* atten_func,\n"
 "										__global float* k_alpha,\n"
 "										const int width,\n"
 "										const int height,\n"
-"										const int offset) {\n"
+"										const int offset,\n"
+"										const float beta) {\n"
 "\n"
 "	for (int gid = get_global_id(0); gid < width*height; gid+= get_global_size(0) ) {\n"
-"		atten_func[gid+offset] = (k_alpha[0]/gradient[gid+offset])*pow(gradient[gid+offset]/k_alpha[0], (float)BETA);\n"
+"		float grad = LOAD(gradient, gid+offset);\n"
+"		STORE(atten_func, gid+offset, (k_alpha[0]/grad)*pow(grad/k_alpha[0], beta));\n"
 "	}\n"
 "}\n"
 "\n"
-"kernel void atten_func(	__global float* gradient,\n"
-"						__global float* atten_func,\n"
+"kernel void atten_func(	__global storage_t* gradient,\n"
+"						__global storage_t* atten_func,\n"
 "						__global float* k_alpha,\n"
 "						const int width,\n"
 "						const int height,\n"
@@ -146,7 +176,8 @@ const char *gradDom_kernel =
 "						const int c_width,\n"
 "						const int c_height,\n"
 "						const int c_offset,\n"
-"						const int level) {\n"
+"						const int level,\n"
+"						const float beta) {\n"
 "	int2 pos;\n"
 "	int2 c_pos;\n"
 "	int2 neighbour;\n"
@@ -154,7 +185,8 @@ const char *gradDom_kernel =
 "	float k_xy_scale_factor;\n"
 "	for (pos.y = get_global_id(1); pos.y < height; pos.y += get_global_size(1)) {\n"
 "		for (pos.x = get_global_id(0); pos.x < width; pos.x += get_global_size(0)) {\n"
-"			if (gradient[pos.x + pos.y*width + offset] != 0) {\n"
+"			float grad = LOAD(gradient, pos.x + pos.y*width + offset);\n"
+"			if (grad != 0) {\n"
 "\n"
 "				c_pos = pos/2;	//position in the coarser grid\n"
 "\n"
@@ -171,50 +203,52 @@ const char *gradDom_kernel =
 "				if (c_pos.x == c_width)\tc_pos.x -= 1;\n"
 "				if (c_pos.y == c_height) c_pos.y -= 1;\n"
 "\n"
-"				k_xy_atten_func = 9.0*atten_func[c_pos.x 				+ c_pos.y					*c_width	+ c_offset]\n"
-"								+ 3.0*atten_func[c_pos.x+neighbour.x 	+ c_pos.y					*c_width	+ c_offset]\n"
-"								+ 3.0*atten_func[c_pos.x 				+ (c_pos.y+neighbour.y)		*c_width	+ c_offset]\n"
-"								+ 1.0*atten_func[c_pos.x+neighbour.x 	+ (c_pos.y+neighbour.y)		*c_width	+ c_offset];\n"
+"				k_xy_atten_func = 9.0*LOAD(atten_func, c_pos.x 				+ c_pos.y					*c_width	+ c_offset)\n"
+"								+ 3.0*LOAD(atten_func, c_pos.x+neighbour.x 	+ c_pos.y					*c_width	+ c_offset)\n"
+"								+ 3.0*LOAD(atten_func, c_pos.x 				+ (c_pos.y+neighbour.y)		*c_width	+ c_offset)\n"
+"								+ 1.0*LOAD(atten_func, c_pos.x+neighbour.x 	+ (c_pos.y+neighbour.y)		*c_width	+ c_offset);\n"
 "\n"
-"				k_xy_scale_factor = (k_alpha[level]/gradient[pos.x + pos.y*width + offset])*pow(gradient[pos.x + pos.y*width + offset]/k_alpha[level], (float)BETA);\n"
-"				atten_func[pos.x + pos.y*width + offset] = (1.f/16.f)*(k_xy_atten_func)*k_xy_scale_factor;\n"
+"				k_xy_scale_factor = (k_alpha[level]/grad)*pow(grad/k_alpha[level], beta);\n"
+"				STORE(atten_func, pos.x + pos.y*width + offset, (1.f/16.f)*(k_xy_atten_func)*k_xy_scale_factor);\n"
 "			}\n"
-"			else atten_func[pos.x + pos.y*width + offset] = 0.f;\n"
+"			else STORE(atten_func, pos.x + pos.y*width + offset, 0.f);\n"
 "		}\n"
 "	}\n"
 "}\n"
 "\n"
 "\n"
-"kernel void grad_atten(	__global float* atten_grad_x,\n"
-"						__global float* atten_grad_y,\n"
-"						__global float* lum,\n"
-"						__global float* atten_func) {\n"
+"kernel void grad_atten(	__global storage_t* atten_grad_x,\n"
+"						__global storage_t* atten_grad_y,\n"
+"						__global storage_t* lum,\n"
+"						__global storage_t* atten_func) {\n"
 "	int2 pos;\n"
 "	float2 grad;\n"
 "	for (pos.y = get_global_id(1); pos.y < HEIGHT; pos.y += get_global_size(1)) {\n"
 "		for (pos.x = get_global_id(0); pos.x < WIDTH; pos.x += get_global_size(0)) {	\n"
-"			grad.x = (pos.x < WIDTH-1 ) ? (lum[pos.x+1 +\t	 pos.y*WIDTH] - lum[pos.x + pos.y*WIDTH]) : 0;\n"
-"			grad.y = (pos.y < HEIGHT-1) ? (lum[pos.x\t + (pos.y+1)*WIDTH] - lum[pos.x + pos.y*WIDTH]) : 0;\n"
-"			atten_grad_x[pos.x + pos.y*WIDTH] = grad.x*atten_func[pos.x + pos.y*WIDTH];\n"
-"			atten_grad_y[pos.x + pos.y*WIDTH] = grad.y*atten_func[pos.x + pos.y*WIDTH];\n"
+"			float centre = LOAD(lum, pos.x + pos.y*WIDTH);\n"
+"			float atten\t= LOAD(atten_func, pos.x + pos.y*WIDTH);\n"
+"			grad.x = (pos.x < WIDTH-1 ) ? (LOAD(lum, pos.x+1 +\t	 pos.y*WIDTH) - centre) : 0;\n"
+"			grad.y = (pos.y < HEIGHT-1) ? (LOAD(lum, pos.x\t + (pos.y+1)*WIDTH) - centre) : 0;\n"
+"			STORE(atten_grad_x, pos.x + pos.y*WIDTH, grad.x*atten);\n"
+"			STORE(atten_grad_y, pos.x + pos.y*WIDTH, grad.y*atten);\n"
 "		}\n"
 "	}\n"
 "}\n"
 "\n"
 "\n"
-"kernel void divG(	__global float* atten_grad_x,\n"
-"					__global float* atten_grad_y,\n"
-"					__global float* div_grad) {\n"
-"	div_grad[0] = 0;\n"
+"kernel void divG(	__global storage_t* atten_grad_x,\n"
+"					__global storage_t* atten_grad_y,\n"
+"					__global storage_t* div_grad) {\n"
+"	STORE(div_grad, 0, 0.f);\n"
 "	int2 pos;\n"
 "	for (pos.x = get_global_id(0) + 1; pos.x < WIDTH; pos.x += get_global_size(0)) {\n"
-"		div_grad[pos.x] = atten_grad_x[pos.x] - atten_grad_x[pos.x-1];\n"
+"		STORE(div_grad, pos.x, LOAD(atten_grad_x, pos.x) - LOAD(atten_grad_x, pos.x-1));\n"
 "	}\n"
 "	for (pos.y = get_global_id(1) + 1; pos.y < HEIGHT; pos.y += get_global_size(1)) {\n"
-"		div_grad[pos.y*WIDTH] = atten_grad_y[pos.y*WIDTH] - atten_grad_y[(pos.y-1)*WIDTH];\n"
+"		STORE(div_grad, pos.y*WIDTH, LOAD(atten_grad_y, pos.y*WIDTH) - LOAD(atten_grad_y, (pos.y-1)*WIDTH));\n"
 "		for (pos.x = get_global_id(0)+1; pos.x < WIDTH; pos.x += get_global_size(0)) {\n"
-"			div_grad[pos.x + pos.y*WIDTH] 	= (atten_grad_x[pos.x + pos.y*WIDTH] - atten_grad_x[(pos.x-1) + pos.y*WIDTH])\n"
-"											+ (atten_grad_y[pos.x + pos.y*WIDTH] - atten_grad_y[pos.x + (pos.y-1)*WIDTH]);\n"
+"			STORE(div_grad, pos.x + pos.y*WIDTH, (LOAD(atten_grad_x, pos.x + pos.y*WIDTH) - LOAD(atten_grad_x, (pos.x-1) + pos.y*WIDTH))\n"
+"												+ (LOAD(atten_grad_y, pos.x + pos.y*WIDTH) - LOAD(atten_grad_y, pos.x + (pos.y-1)*WIDTH)));\n"
 "		}\n"
 "	}	\n"
 "}\n"
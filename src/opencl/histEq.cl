@@ -5,17 +5,28 @@ uint4 HSVtoRGB(float3 hsv);
 
 const sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_NONE | CLK_FILTER_NEAREST;
 
+//reads a pixel in the 0..255 range, float inputs carry linear radiance that may exceed it
+float4 read_pixel(read_only image2d_t image, int2 pos) {
+#ifdef FLOAT_INPUT
+	return read_imagef(image, sampler, pos)*255.f;
+#else
+	uint4 pixel = read_imageui(image, sampler, pos);
+	return (float4)(GL_to_CL(pixel.x), GL_to_CL(pixel.y), GL_to_CL(pixel.z), GL_to_CL(pixel.w));
+#endif
+}
+
 //use this one for android because android's opencl specification is buggy
 kernel void transfer_data(__read_only image2d_t input_image, __global float* image) {
 	int2 pos;
-	uint4 pixel;
+	float4 pixel;
 	for (pos.y = get_global_id(1); pos.y < height; pos.y += get_global_size(1)) {
 		for (pos.x = get_global_id(0); pos.x < width; pos.x += get_global_size(0)) {
-			pixel = read_imageui(input_image, sampler, pos);
-			image[(pos.x + pos.y*width)*NUM_CHANNELS + 0] = GL_to_CL(pixel.x);
-			image[(pos.x + pos.y*width)*NUM_CHANNELS + 1] = GL_to_CL(pixel.y);
-			image[(pos.x + pos.y*width)*NUM_CHANNELS + 2] = GL_to_CL(pixel.z);		
-			image[(pos.x + pos.y*width)*NUM_CHANNELS + 3] = GL_to_CL(pixel.w);
+			//brightness indexes the histogram, so radiance beyond the 8-bit range is clipped
+			pixel = clamp(read_pixel(input_image, pos), 0.f, (float)PIXEL_RANGE);
+			image[(pos.x + pos.y*width)*NUM_CHANNELS + 0] = pixel.x;
+			image[(pos.x + pos.y*width)*NUM_CHANNELS + 1] = pixel.y;
+			image[(pos.x + pos.y*width)*NUM_CHANNELS + 2] = pixel.z;		
+			image[(pos.x + pos.y*width)*NUM_CHANNELS + 3] = pixel.w;
 		}
 	}
 }
@@ -35,22 +46,35 @@ kernel void transfer_data(__read_only image2d_t input_image, __global float* ima
 }*/
 
 
-//computes the histogram for brightness
-kernel void partial_hist(__global float* image, __global uint* partial_histogram) {
-	const int global_size = get_global_size(0);
+//the image is split into TILES_X by TILES_Y tiles of TILE_WIDTH by TILE_HEIGHT
+//pixels, the ones on the right and bottom edges may be smaller. Global
+//equalisation is a single tile covering the whole image
+#define NUM_TILES (TILES_X*TILES_Y)
+
+//computes the histogram for brightness, groups_per_tile workgroups share each
+//tile so the histograms of all tiles are computed in one launch. Only every
+//SAMPLE_STEP-th pixel of every SAMPLE_STEP-th row is counted
+kernel void partial_hist(__global float* image, __global uint* partial_histogram, const int groups_per_tile) {
 	const int group_size = get_local_size(0);
 	const int group_id = get_group_id(0);
 	const int lid = get_local_id(0);
 
+	const int tile = group_id/groups_per_tile;
+	const int x0 = (tile%TILES_X)*TILE_WIDTH;
+	const int y0 = (tile/TILES_X)*TILE_HEIGHT;
+	const int samples_x = (min(TILE_WIDTH, width - x0) + SAMPLE_STEP-1)/SAMPLE_STEP;
+	const int samples = samples_x*((min(TILE_HEIGHT, height - y0) + SAMPLE_STEP-1)/SAMPLE_STEP);
+
 	__local uint l_hist[HIST_SIZE];
 	for (int i = lid; i < HIST_SIZE; i+=group_size) {
 		l_hist[i] = 0;
 	}
+	barrier(CLK_LOCAL_MEM_FENCE);
 
-	int brightness;
-	for (int i = get_global_id(0); i < image_size; i += global_size) {
-		brightness = max(max(image[i*NUM_CHANNELS + 0], image[i*NUM_CHANNELS + 1]), image[i*NUM_CHANNELS + 2]);
-		barrier(CLK_LOCAL_MEM_FENCE);
+	int brightness, pixel;
+	for (int i = (group_id%groups_per_tile)*group_size + lid; i < samples; i += groups_per_tile*group_size) {
+		pixel = x0 + (i%samples_x)*SAMPLE_STEP + (y0 + (i/samples_x)*SAMPLE_STEP)*width;
+		brightness = max(max(image[pixel*NUM_CHANNELS + 0], image[pixel*NUM_CHANNELS + 1]), image[pixel*NUM_CHANNELS + 2]);
 		atomic_inc(&l_hist[brightness]);
 	}
 
@@ -60,27 +84,97 @@ kernel void partial_hist(__global float* image, __global uint* partial_histogram
 	}
 }
 
-//requires global work group size to be equal to HIST_SIZE
+//requires global work group size to be equal to HIST_SIZE*NUM_TILES
 kernel void merge_hist(__global uint* partial_histogram, __global uint* histogram, __local uint* l_Data, const int num_hists) {
 	const int gid = get_global_id(0);
+	const int tile = gid/HIST_SIZE;
+	const int bin = gid%HIST_SIZE;
 
 	uint sum = 0;
 	for(uint i = 0; i < num_hists; i++)
-		sum += partial_histogram[gid + i*HIST_SIZE];
+		sum += partial_histogram[bin + (tile*num_hists + i)*HIST_SIZE];
 
 	histogram[gid] = sum;
 }
 
 //TODO: even though this takes barely anytime at all, could look into parrallel scan in future
-//computes the cdf of the brightness histogram
-kernel void hist_cdf( __global uint* hist) {
-	const int gid = get_global_id(0);
-	const int global_size = get_global_size(0);
+//computes the cdf of the brightness histogram of each tile. With a clip_limit,
+//counts above it are clipped and spread evenly over all bins first, which
+//limits how much contrast a tile dominated by a few levels gets
+kernel void hist_cdf( __global uint* hist, const uint clip_limit) {
+	const int tile = get_global_id(0);
+	if (tile >= NUM_TILES) return;
+	hist += tile*HIST_SIZE;
 
-	if (gid==0)
-		for (int i=1; i<global_size; i++) {
-			hist[i] += hist[i-1];
+	if (clip_limit) {
+		uint excess = 0;
+		for (int i=0; i<HIST_SIZE; i++) {
+			if (hist[i] > clip_limit) {
+				excess += hist[i] - clip_limit;
+				hist[i] = clip_limit;
+			}
+		}
+		for (int i=0; i<HIST_SIZE; i++) {
+			hist[i] += excess/HIST_SIZE + (i < excess%HIST_SIZE ? 1 : 0);
 		}
+	}
+
+	for (int i=1; i<HIST_SIZE; i++) {
+		hist[i] += hist[i-1];
+	}
+}
+
+//for video: the frame's histogram, as fractions of the pixels sampled, is blended
+//into a running histogram with the given weight. The cdf last used is kept until
+//the running one differs from it by more than threshold anywhere, so the mapping
+//doesn't pump from frame to frame. Either way it is written to hist as a uint cdf
+//of FIXED_CDF_TOTAL pixels for hist_gain
+kernel void hist_rolling(__global uint* hist, __global float* running, __global float* rolling_cdf,
+						const float weight, const float threshold, const int reset) {
+	if (get_global_id(0) != 0) return;
+
+	uint total = 0;
+	for (int i=0; i<HIST_SIZE; i++) {
+		total += hist[i];
+	}
+
+	float cdf = 0.f, drift = 0.f;
+	for (int i=0; i<HIST_SIZE; i++) {
+		const float fraction = hist[i]/(float)max(total, 1u);
+		running[i] = reset ? fraction : mix(running[i], fraction, weight);
+		cdf += running[i];
+		drift = max(drift, fabs(cdf - rolling_cdf[i]));
+	}
+
+	cdf = 0.f;
+	for (int i=0; i<HIST_SIZE; i++) {
+		if (reset || drift > threshold) {
+			cdf += running[i];
+			rolling_cdf[i] = cdf;
+		}
+		hist[i] = rolling_cdf[i]*FIXED_CDF_TOTAL;
+	}
+}
+
+//equalised brightness from the cdf of one tile
+float tile_equalise(__global const uint* cdf, int v) {
+	const uint range = cdf[HIST_SIZE-1] - cdf[0];
+	return range ? (HIST_SIZE-1)*(float)(cdf[v] - cdf[0])/range : v;
+}
+
+//the brightness equalised by the four tiles around a pixel, weighted by how close
+//their centres are, so there are no seams between tiles
+float interpolate_tiles(__global const uint* cdf, int2 pos, int v) {
+	const float fx = clamp((pos.x + 0.5f)/TILE_WIDTH - 0.5f, 0.f, TILES_X-1.f);
+	const float fy = clamp((pos.y + 0.5f)/TILE_HEIGHT - 0.5f, 0.f, TILES_Y-1.f);
+	const int tx0 = (int)fx, ty0 = (int)fy;
+	const int tx1 = min(tx0+1, TILES_X-1), ty1 = min(ty0+1, TILES_Y-1);
+	const float dx = fx - tx0, dy = fy - ty0;
+
+	return mix(
+		mix(tile_equalise(cdf + (tx0 + ty0*TILES_X)*HIST_SIZE, v), tile_equalise(cdf + (tx1 + ty0*TILES_X)*HIST_SIZE, v), dx),
+		mix(tile_equalise(cdf + (tx0 + ty1*TILES_X)*HIST_SIZE, v), tile_equalise(cdf + (tx1 + ty1*TILES_X)*HIST_SIZE, v), dx),
+		dy);
 }
 
 //kernel to perform histogram equalisation using the modified brightness cdf
@@ -97,8 +191,13 @@ kernel void histogram_equalisation(__global float* image, write_only image2d_t o
 
 			hsv = RGBtoHSV(pixel);		//Convert to HSV to get Hue and Saturation
 
+#if NUM_TILES > 1
+			hsv.z = interpolate_tiles(brightness_cdf, pos, (int)hsv.z);
+#else
+			//the last cdf entry is the pixel count, which isn't width*height for a fixed cdf
 			hsv.z = ((HIST_SIZE-1)*(brightness_cdf[(int)hsv.z] - brightness_cdf[0]))
-						/(height*width - brightness_cdf[0]);
+						/(brightness_cdf[HIST_SIZE-1] - brightness_cdf[0]);
+#endif
 
 			pixel = HSVtoRGB(hsv);	//Convert back to RGB with the modified brightness for V
 
@@ -107,6 +206,37 @@ kernel void histogram_equalisation(__global float* image, write_only image2d_t o
 	}
 }
 
+//Scaling RGB by the new brightness over the old is the same as converting to HSV
+//and back with only V changed. gain holds (equalised V << 16)/V for every V, so
+//the mapping is a lookup, a multiply and a shift per channel with no branches
+kernel void hist_gain(__global const uint* brightness_cdf, __global uint* gain) {
+	const int v = get_global_id(0);
+	if (v >= HIST_SIZE) return;
+
+	const uint equalised = ((ulong)(HIST_SIZE-1)*(brightness_cdf[v] - brightness_cdf[0]))
+								/max(brightness_cdf[HIST_SIZE-1] - brightness_cdf[0], 1u);
+	gain[v] = equalised*((1 << 16)/max(v, 1));	//16.16, equalised*255 << 16 fits a uint
+}
+
+kernel void histogram_equalisation_fixed(__global float* image, write_only image2d_t output_image, __global const uint* gain) {
+	__local uint l_gain[HIST_SIZE];
+	for (int i = get_local_id(0) + get_local_id(1)*get_local_size(0); i < HIST_SIZE; i += get_local_size(0)*get_local_size(1)) {
+		l_gain[i] = gain[i];
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	int2 pos;
+	uint4 pixel;
+	for (pos.y = get_global_id(1); pos.y < height; pos.y += get_global_size(1)) {
+		for (pos.x = get_global_id(0); pos.x < width; pos.x += get_global_size(0)) {
+			pixel = convert_uint4(vload4(pos.x + pos.y*width, image));
+			const uint g = l_gain[max(max(pixel.x, pixel.y), pixel.z)];
+			pixel.xyz = (pixel.xyz*g) >> 16;
+			write_imageui(output_image, pos, pixel);
+		}
+	}
+}
+
 float3 RGBtoHSV(uint4 rgb) {
 	float r = rgb.x;
 	float g = rgb.y;
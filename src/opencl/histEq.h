@@ -6,17 +6,28 @@ const char *histEq_kernel =
 "\n"
 "const sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_NONE | CLK_FILTER_NEAREST;\n"
 "\n"
+"//reads a pixel in the 0..255 range, float inputs carry linear radiance that may exceed it\n"
+"float4 read_pixel(read_only image2d_t image, int2 pos) {\n"
+"#ifdef FLOAT_INPUT\n"
+"	return read_imagef(image, sampler, pos)*255.f;\n"
+"#else\n"
+"	uint4 pixel = read_imageui(image, sampler, pos);\n"
+"	return (float4)(GL_to_CL(pixel.x), GL_to_CL(pixel.y), GL_to_CL(pixel.z), GL_to_CL(pixel.w));\n"
+"#endif\n"
+"}\n"
+"\n"
 "//use this one for android because android's opencl specification is buggy\n"
 "kernel void transfer_data(__read_only image2d_t input_image, __global float* image) {\n"
 "	int2 pos;\n"
-"	uint4 pixel;\n"
+"	float4 pixel;\n"
 "	for (pos.y = get_global_id(1); pos.y < height; pos.y += get_global_size(1)) {\n"
 "		for (pos.x = get_global_id(0); pos.x < width; pos.x += get_global_size(0)) {\n"
-"			pixel = read_imageui(input_image, sampler, pos);\n"
-"			image[(pos.x + pos.y*width)*NUM_CHANNELS + 0] = GL_to_CL(pixel.x);\n"
-"			image[(pos.x + pos.y*width)*NUM_CHANNELS + 1] = GL_to_CL(pixel.y);\n"
-"			image[(pos.x + pos.y*width)*NUM_CHANNELS + 2] = GL_to_CL(pixel.z);		\n"
-"			image[(pos.x + pos.y*width)*NUM_CHANNELS + 3] = GL_to_CL(pixel.w);\n"
+"			//brightness indexes the histogram, so radiance beyond the 8-bit range is clipped\n"
+"			pixel = clamp(read_pixel(input_image, pos), 0.f, (float)PIXEL_RANGE);\n"
+"			image[(pos.x + pos.y*width)*NUM_CHANNELS + 0] = pixel.x;\n"
+"			image[(pos.x + pos.y*width)*NUM_CHANNELS + 1] = pixel.y;\n"
+"			image[(pos.x + pos.y*width)*NUM_CHANNELS + 2] = pixel.z;		\n"
+"			image[(pos.x + pos.y*width)*NUM_CHANNELS + 3] = pixel.w;\n"
 "		}\n"
 "	}\n"
 "}\n"
@@ -36,22 +47,35 @@ const char *histEq_kernel =
 "}*/\n"
 "\n"
 "\n"
-"//computes the histogram for brightness\n"
-"kernel void partial_hist(__global float* image, __global uint* partial_histogram) {\n"
-"	const int global_size = get_global_size(0);\n"
+"//the image is split into TILES_X by TILES_Y tiles of TILE_WIDTH by TILE_HEIGHT\n"
+"//pixels, the ones on the right and bottom edges may be smaller. Global\n"
+"//equalisation is a single tile covering the whole image\n"
+"#define NUM_TILES (TILES_X*TILES_Y)\n"
+"\n"
+"//computes the histogram for brightness, groups_per_tile workgroups share each\n"
+"//tile so the histograms of all tiles are computed in one launch. Only every\n"
+"//SAMPLE_STEP-th pixel of every SAMPLE_STEP-th row is counted\n"
+"kernel void partial_hist(__global float* image, __global uint* partial_histogram, const int groups_per_tile) {\n"
 "	const int group_size = get_local_size(0);\n"
 "	const int group_id = get_group_id(0);\n"
 "	const int lid = get_local_id(0);\n"
 "\n"
+"	const int tile = group_id/groups_per_tile;\n"
+"	const int x0 = (tile%TILES_X)*TILE_WIDTH;\n"
+"	const int y0 = (tile/TILES_X)*TILE_HEIGHT;\n"
+"	const int samples_x = (min(TILE_WIDTH, width - x0) + SAMPLE_STEP-1)/SAMPLE_STEP;\n"
+"	const int samples = samples_x*((min(TILE_HEIGHT, height - y0) + SAMPLE_STEP-1)/SAMPLE_STEP);\n"
+"\n"
 "	__local uint l_hist[HIST_SIZE];\n"
 "	for (int i = lid; i < HIST_SIZE; i+=group_size) {\n"
 "		l_hist[i] = 0;\n"
 "	}\n"
+"	barrier(CLK_LOCAL_MEM_FENCE);\n"
 "\n"
-"	int brightness;\n"
-"	for (int i = get_global_id(0); i < image_size; i += global_size) {\n"
-"		brightness = max(max(image[i*NUM_CHANNELS + 0], image[i*NUM_CHANNELS + 1]), image[i*NUM_CHANNELS + 2]);\n"
-"		barrier(CLK_LOCAL_MEM_FENCE);\n"
+"	int brightness, pixel;\n"
+"	for (int i = (group_id%groups_per_tile)*group_size + lid; i < samples; i += groups_per_tile*group_size) {\n"
+"		pixel = x0 + (i%samples_x)*SAMPLE_STEP + (y0 + (i/samples_x)*SAMPLE_STEP)*width;\n"
+"		brightness = max(max(image[pixel*NUM_CHANNELS + 0], image[pixel*NUM_CHANNELS + 1]), image[pixel*NUM_CHANNELS + 2]);\n"
 "		atomic_inc(&l_hist[brightness]);\n"
 "	}\n"
 "\n"
@@ -61,27 +85,97 @@ const char *histEq_kernel =
 "	}\n"
 "}\n"
 "\n"
-"//requires global work group size to be equal to HIST_SIZE\n"
+"//requires global work group size to be equal to HIST_SIZE*NUM_TILES\n"
 "kernel void merge_hist(__global uint* partial_histogram, __global uint* histogram, __local uint* l_Data, const int num_hists) {\n"
 "	const int gid = get_global_id(0);\n"
+"	const int tile = gid/HIST_SIZE;\n"
+"	const int bin = gid%HIST_SIZE;\n"
 "\n"
 "	uint sum = 0;\n"
 "	for(uint i = 0; i < num_hists; i++)\n"
-"		sum += partial_histogram[gid + i*HIST_SIZE];\n"
+"		sum += partial_histogram[bin + (tile*num_hists + i)*HIST_SIZE];\n"
 "\n"
 "	histogram[gid] = sum;\n"
 "}\n"
 "\n"
 "//TODO: even though this takes barely anytime at all, could look into parrallel scan in future\n"
-"//computes the cdf of the brightness histogram\n"
-"kernel void hist_cdf( __global uint* hist) {\n"
-"	const int gid = get_global_id(0);\n"
-"	const int global_size = get_global_size(0);\n"
+"//computes the cdf of the brightness histogram of each tile. With a clip_limit,\n"
+"//counts above it are clipped and spread evenly over all bins first, which\n"
+"//limits how much contrast a tile dominated by a few levels gets\n"
+"kernel void hist_cdf( __global uint* hist, const uint clip_limit) {\n"
+"	const int tile = get_global_id(0);\n"
+"	if (tile >= NUM_TILES) return;\n"
+"	hist += tile*HIST_SIZE;\n"
 "\n"
-"	if (gid==0)\n"
-"		for (int i=1; i<global_size; i++) {\n"
-"			hist[i] += hist[i-1];\n"
+"	if (clip_limit) {\n"
+"		uint excess = 0;\n"
+"		for (int i=0; i<HIST_SIZE; i++) {\n"
+"			if (hist[i] > clip_limit) {\n"
+"				excess += hist[i] - clip_limit;\n"
+"				hist[i] = clip_limit;\n"
+"			}\n"
+"		}\n"
+"		for (int i=0; i<HIST_SIZE; i++) {\n"
+"			hist[i] += excess/HIST_SIZE + (i < excess%HIST_SIZE ? 1 : 0);\n"
 "		}\n"
+"	}\n"
+"\n"
+"	for (int i=1; i<HIST_SIZE; i++) {\n"
+"		hist[i] += hist[i-1];\n"
+"	}\n"
+"}\n"
+"\n"
+"//for video: the frame's histogram, as fractions of the pixels sampled, is blended\n"
+"//into a running histogram with the given weight. The cdf last used is kept until\n"
+"//the running one differs from it by more than threshold anywhere, so the mapping\n"
+"//doesn't pump from frame to frame. Either way it is written to hist as a uint cdf\n"
+"//of FIXED_CDF_TOTAL pixels for hist_gain\n"
+"kernel void hist_rolling(__global uint* hist, __global float* running, __global float* rolling_cdf,\n"
+"						const float weight, const float threshold, const int reset) {\n"
+"	if (get_global_id(0) != 0) return;\n"
+"\n"
+"	uint total = 0;\n"
+"	for (int i=0; i<HIST_SIZE; i++) {\n"
+"		total += hist[i];\n"
+"	}\n"
+"\n"
+"	float cdf = 0.f, drift = 0.f;\n"
+"	for (int i=0; i<HIST_SIZE; i++) {\n"
+"		const float fraction = hist[i]/(float)max(total, 1u);\n"
+"		running[i] = reset ? fraction : mix(running[i], fraction, weight);\n"
+"		cdf += running[i];\n"
+"		drift = max(drift, fabs(cdf - rolling_cdf[i]));\n"
+"	}\n"
+"\n"
+"	cdf = 0.f;\n"
+"	for (int i=0; i<HIST_SIZE; i++) {\n"
+"		if (reset || drift > threshold) {\n"
+"			cdf += running[i];\n"
+"			rolling_cdf[i] = cdf;\n"
+"		}\n"
+"		hist[i] = rolling_cdf[i]*FIXED_CDF_TOTAL;\n"
+"	}\n"
+"}\n"
+"\n"
+"//equalised brightness from the cdf of one tile\n"
+"float tile_equalise(__global const uint* cdf, int v) {\n"
+"	const uint range = cdf[HIST_SIZE-1] - cdf[0];\n"
+"	return range ? (HIST_SIZE-1)*(float)(cdf[v] - cdf[0])/range : v;\n"
+"}\n"
+"\n"
+"//the brightness equalised by the four tiles around a pixel, weighted by how close\n"
+"//their centres are, so there are no seams between tiles\n"
+"float interpolate_tiles(__global const uint* cdf, int2 pos, int v) {\n"
+"	const float fx = clamp((pos.x + 0.5f)/TILE_WIDTH - 0.5f, 0.f, TILES_X-1.f);\n"
+"	const float fy = clamp((pos.y + 0.5f)/TILE_HEIGHT - 0.5f, 0.f, TILES_Y-1.f);\n"
+"	const int tx0 = (int)fx, ty0 = (int)fy;\n"
+"	const int tx1 = min(tx0+1, TILES_X-1), ty1 = min(ty0+1, TILES_Y-1);\n"
+"	const float dx = fx - tx0, dy = fy - ty0;\n"
+"\n"
+"	return mix(\n"
+"		mix(tile_equalise(cdf + (tx0 + ty0*TILES_X)*HIST_SIZE, v), tile_equalise(cdf + (tx1 + ty0*TILES_X)*HIST_SIZE, v), dx),\n"
+"		mix(tile_equalise(cdf + (tx0 + ty1*TILES_X)*HIST_SIZE, v), tile_equalise(cdf + (tx1 + ty1*TILES_X)*HIST_SIZE, v), dx),\n"
+"		dy);\n"
 "}\n"
 "\n"
 "//kernel to perform histogram equalisation using the modified brightness cdf\n"
@@ -98,8 +192,13 @@ const char *histEq_kernel =
 "\n"
 "			hsv = RGBtoHSV(pixel);		//Convert to HSV to get Hue and Saturation\n"
 "\n"
+"#if NUM_TILES > 1\n"
+"			hsv.z = interpolate_tiles(brightness_cdf, pos, (int)hsv.z);\n"
+"#else\n"
+"			//the last cdf entry is the pixel count, which isn't width*height for a fixed cdf\n"
 "			hsv.z = ((HIST_SIZE-1)*(brightness_cdf[(int)hsv.z] - brightness_cdf[0]))\n"
-"						/(height*width - brightness_cdf[0]);\n"
+"						/(brightness_cdf[HIST_SIZE-1] - brightness_cdf[0]);\n"
+"#endif\n"
 "\n"
 "			pixel = HSVtoRGB(hsv);	//Convert back to RGB with the modified brightness for V\n"
 "\n"
@@ -108,6 +207,37 @@ const char *histEq_kernel =
 "	}\n"
 "}\n"
 "\n"
+"//Scaling RGB by the new brightness over the old is the same as converting to HSV\n"
+"//and back with only V changed. gain holds (equalised V << 16)/V for every V, so\n"
+"//the mapping is a lookup, a multiply and a shift per channel with no branches\n"
+"kernel void hist_gain(__global const uint* brightness_cdf, __global uint* gain) {\n"
+"	const int v = get_global_id(0);\n"
+"	if (v >= HIST_SIZE) return;\n"
+"\n"
+"	const uint equalised = ((ulong)(HIST_SIZE-1)*(brightness_cdf[v] - brightness_cdf[0]))\n"
+"								/max(brightness_cdf[HIST_SIZE-1] - brightness_cdf[0], 1u);\n"
+"	gain[v] = equalised*((1 << 16)/max(v, 1));	//16.16, equalised*255 << 16 fits a uint\n"
+"}\n"
+"\n"
+"kernel void histogram_equalisation_fixed(__global float* image, write_only image2d_t output_image, __global const uint* gain) {\n"
+"	__local uint l_gain[HIST_SIZE];\n"
+"	for (int i = get_local_id(0) + get_local_id(1)*get_local_size(0); i < HIST_SIZE; i += get_local_size(0)*get_local_size(1)) {\n"
+"		l_gain[i] = gain[i];\n"
+"	}\n"
+"	barrier(CLK_LOCAL_MEM_FENCE);\n"
+"\n"
+"	int2 pos;\n"
+"	uint4 pixel;\n"
+"	for (pos.y = get_global_id(1); pos.y < height; pos.y += get_global_size(1)) {\n"
+"		for (pos.x = get_global_id(0); pos.x < width; pos.x += get_global_size(0)) {\n"
+"			pixel = convert_uint4(vload4(pos.x + pos.y*width, image));\n"
+"			const uint g = l_gain[max(max(pixel.x, pixel.y), pixel.z)];\n"
+"			pixel.xyz = (pixel.xyz*g) >> 16;\n"
+"			write_imageui(output_image, pos, pixel);\n"
+"		}\n"
+"	}\n"
+"}\n"
+"\n"
 "float3 RGBtoHSV(uint4 rgb) {\n"
 "	float r = rgb.x;\n"
 "	float g = rgb.y;\n"
@@ -4,6 +4,16 @@ float3 RGBtoXYZ(float3 rgb);
 
 const sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_NONE | CLK_FILTER_NEAREST;
 
+//reads a pixel in the 0..255 range, float inputs carry linear radiance that may exceed it
+float4 read_pixel(read_only image2d_t image, int2 pos) {
+#ifdef FLOAT_INPUT
+	return read_imagef(image, sampler, pos)*255.f;
+#else
+	uint4 pixel = read_imageui(image, sampler, pos);
+	return (float4)(GL_to_CL(pixel.x), GL_to_CL(pixel.y), GL_to_CL(pixel.z), GL_to_CL(pixel.w));
+#endif
+}
+
 //this kernel computes logAvgLum and Lwhite by performing reduction
 //the results are stored in an array of size num_work_groups
 kernel void computeLogAvgLum( 	__read_only image2d_t image,
@@ -17,13 +27,13 @@ kernel void computeLogAvgLum( 	__read_only image2d_t image,
 	float logAvgLum_acc = 0.f;
 
 	int2 pos;
-	uint4 pixel;
+	float4 pixel;
 	for (pos.y = get_global_id(1); pos.y < HEIGHT; pos.y += get_global_size(1)) {
 		for (pos.x = get_global_id(0); pos.x < WIDTH; pos.x += get_global_size(0)) {
-			pixel = read_imageui(image, sampler, pos);
-			lum = GL_to_CL(pixel.x)*0.2126
-				+ GL_to_CL(pixel.y)*0.7152
-				+ GL_to_CL(pixel.z)*0.0722;
+			pixel = read_pixel(image, pos);
+			lum = pixel.x*0.2126
+				+ pixel.y*0.7152
+				+ pixel.z*0.0722;
 
 			Lwhite_acc = (lum > Lwhite_acc) ? lum : Lwhite_acc;
 			logAvgLum_acc += log(lum + 0.000001);
@@ -85,14 +95,12 @@ kernel void reinhardGlobal(	__read_only image2d_t input_image,
 
 	int2 pos;
 	uint4 pixel;
+	float4 in;
 	float3 rgb, xyz;
 	for (pos.y = get_global_id(1); pos.y < HEIGHT; pos.y += get_global_size(1)) {
 		for (pos.x = get_global_id(0); pos.x < WIDTH; pos.x += get_global_size(0)) {
-			pixel = read_imageui(input_image, sampler, pos);
-
-			rgb.x = GL_to_CL(pixel.x);
-			rgb.y = GL_to_CL(pixel.y);
-			rgb.z = GL_to_CL(pixel.z);
+			in = read_pixel(input_image, pos);
+			rgb = in.xyz;
 
 			xyz = RGBtoXYZ(rgb);
 
@@ -102,6 +110,7 @@ kernel void reinhardGlobal(	__read_only image2d_t input_image,
 			pixel.x = clamp((pow(rgb.x/xyz.y, sat)*Ld)*255.f, 0.f, 255.f);
 			pixel.y = clamp((pow(rgb.y/xyz.y, sat)*Ld)*255.f, 0.f, 255.f);
 			pixel.z = clamp((pow(rgb.z/xyz.y, sat)*Ld)*255.f, 0.f, 255.f);
+			pixel.w = clamp(in.w, 0.f, 255.f);
 			write_imageui(output_image, pos, pixel);
 		}
 	}
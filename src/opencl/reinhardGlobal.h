@@ -5,6 +5,16 @@ const char *reinhardGlobal_kernel =
 "\n"
 "const sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_NONE | CLK_FILTER_NEAREST;\n"
 "\n"
+"//reads a pixel in the 0..255 range, float inputs carry linear radiance that may exceed it\n"
+"float4 read_pixel(read_only image2d_t image, int2 pos) {\n"
+"#ifdef FLOAT_INPUT\n"
+"	return read_imagef(image, sampler, pos)*255.f;\n"
+"#else\n"
+"	uint4 pixel = read_imageui(image, sampler, pos);\n"
+"	return (float4)(GL_to_CL(pixel.x), GL_to_CL(pixel.y), GL_to_CL(pixel.z), GL_to_CL(pixel.w));\n"
+"#endif\n"
+"}\n"
+"\n"
 "//this kernel computes logAvgLum and Lwhite by performing reduction\n"
 "//the results are stored in an array of size num_work_groups\n"
 "kernel void computeLogAvgLum( 	__read_only image2d_t image,\n"
@@ -18,13 +28,13 @@ const char *reinhardGlobal_kernel =
 "	float logAvgLum_acc = 0.f;\n"
 "\n"
 "	int2 pos;\n"
-"	uint4 pixel;\n"
+"	float4 pixel;\n"
 "	for (pos.y = get_global_id(1); pos.y < HEIGHT; pos.y += get_global_size(1)) {\n"
 "		for (pos.x = get_global_id(0); pos.x < WIDTH; pos.x += get_global_size(0)) {\n"
-"			pixel = read_imageui(image, sampler, pos);\n"
-"			lum = GL_to_CL(pixel.x)*0.2126\n"
-"				+ GL_to_CL(pixel.y)*0.7152\n"
-"				+ GL_to_CL(pixel.z)*0.0722;\n"
+"			pixel = read_pixel(image, pos);\n"
+"			lum = pixel.x*0.2126\n"
+"				+ pixel.y*0.7152\n"
+"				+ pixel.z*0.0722;\n"
 "\n"
 "			Lwhite_acc = (lum > Lwhite_acc) ? lum : Lwhite_acc;\n"
 "			logAvgLum_acc += log(lum + 0.000001);\n"
@@ -86,14 +96,12 @@ const char *reinhardGlobal_kernel =
 "\n"
 "	int2 pos;\n"
 "	uint4 pixel;\n"
+"	float4 in;\n"
 "	float3 rgb, xyz;\n"
 "	for (pos.y = get_global_id(1); pos.y < HEIGHT; pos.y += get_global_size(1)) {\n"
 "		for (pos.x = get_global_id(0); pos.x < WIDTH; pos.x += get_global_size(0)) {\n"
-"			pixel = read_imageui(input_image, sampler, pos);\n"
-"\n"
-"			rgb.x = GL_to_CL(pixel.x);\n"
-"			rgb.y = GL_to_CL(pixel.y);\n"
-"			rgb.z = GL_to_CL(pixel.z);\n"
+"			in = read_pixel(input_image, pos);\n"
+"			rgb = in.xyz;\n"
 "\n"
 "			xyz = RGBtoXYZ(rgb);\n"
 "\n"
@@ -103,6 +111,7 @@ const char *reinhardGlobal_kernel =
 "			pixel.x = clamp((pow(rgb.x/xyz.y, sat)*Ld)*255.f, 0.f, 255.f);\n"
 "			pixel.y = clamp((pow(rgb.y/xyz.y, sat)*Ld)*255.f, 0.f, 255.f);\n"
 "			pixel.z = clamp((pow(rgb.z/xyz.y, sat)*Ld)*255.f, 0.f, 255.f);\n"
+"			pixel.w = clamp(in.w, 0.f, 255.f);\n"
 "			write_imageui(output_image, pos, pixel);\n"
 "		}\n"
 "	}\n"
@@ -1,13 +1,38 @@
 
+//intermediate planes are stored as half floats when HALF_STORAGE is defined,
+//all arithmetic is still done in float
+#ifdef HALF_STORAGE
+	#ifdef cl_khr_fp16
+		#pragma OPENCL EXTENSION cl_khr_fp16 : enable
+	#endif
+	#define storage_t half
+	#define LOAD(buf, i)		vload_half((i), (buf))
+	#define STORE(buf, i, val)	vstore_half((val), (i), (buf))
+#else
+	#define storage_t float
+	#define LOAD(buf, i)		(buf)[(i)]
+	#define STORE(buf, i, val)	(buf)[(i)] = (val)
+#endif
+
 float GL_to_CL(uint val);
 float3 RGBtoXYZ(float3 rgb);
 
 const sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_NONE | CLK_FILTER_NEAREST;
 
+//reads a pixel in the 0..255 range, float inputs carry linear radiance that may exceed it
+float4 read_pixel(read_only image2d_t image, int2 pos) {
+#ifdef FLOAT_INPUT
+	return read_imagef(image, sampler, pos)*255.f;
+#else
+	uint4 pixel = read_imageui(image, sampler, pos);
+	return (float4)(GL_to_CL(pixel.x), GL_to_CL(pixel.y), GL_to_CL(pixel.z), GL_to_CL(pixel.w));
+#endif
+}
+
 //this kernel computes logAvgLum and Lwhite by performing reduction
 //the results are stored in an array of size num_work_groups
 kernel void computeLogAvgLum( 	__read_only image2d_t image,
-								__global float* logLum,
+								__global storage_t* logLum,
 								__global float* logAvgLum,
 								__local float* logAvgLum_loc) {
 
@@ -16,19 +41,19 @@ kernel void computeLogAvgLum( 	__read_only image2d_t image,
 	float logAvgLum_acc = 0.f;
 
 	int2 pos;
-	uint4 pixel;
+	float4 pixel;
 	for (pos.y = get_global_id(1); pos.y < HEIGHT; pos.y += get_global_size(1)) {
 		for (pos.x = get_global_id(0); pos.x < WIDTH; pos.x += get_global_size(0)) {
-			pixel = read_imageui(image, sampler, pos);
-			lum = GL_to_CL(pixel.x)*0.2126
-				+ GL_to_CL(pixel.y)*0.7152
-				+ GL_to_CL(pixel.z)*0.0722;
+			pixel = read_pixel(image, pos);
+			lum = pixel.x*0.2126
+				+ pixel.y*0.7152
+				+ pixel.z*0.0722;
 
 			Lwhite_acc = (lum > Lwhite_acc) ? lum : Lwhite_acc;
 			logAvgLum_acc += log(lum + 0.000001);
-			logLum[pos.x + pos.y*WIDTH] = (GL_to_CL(pixel.x)/255.f)*0.2126
-										+ (GL_to_CL(pixel.y)/255.f)*0.7152
-										+ (GL_to_CL(pixel.z)/255.f)*0.0722;
+			STORE(logLum, pos.x + pos.y*WIDTH, (pixel.x/255.f)*0.2126
+											+ (pixel.y/255.f)*0.7152
+											+ (pixel.z/255.f)*0.0722);
 		}
 	}
 
@@ -55,7 +80,7 @@ kernel void computeLogAvgLum( 	__read_only image2d_t image,
 	}
 }
 
-kernel void channel_mipmap(	__global float* mipmap,	//array containing all the mipmap levels
+kernel void channel_mipmap(	__global storage_t* mipmap,	//array containing all the mipmap levels
 							const int prev_width,	//width of the previous mipmap
 							const int prev_offset, 	//start point of the previous mipmap 
 							const int m_width,		//width of the mipmap being generated
@@ -66,10 +91,10 @@ kernel void channel_mipmap(	__global float* mipmap,	//array containing all the m
 		for (pos.x = get_global_id(0); pos.x < m_width; pos.x += get_global_size(0)) {
 			int _x = 2*pos.x;
 			int _y = 2*pos.y;
-			mipmap[pos.x + pos.y*m_width + m_offset] = 	(mipmap[_x + _y*prev_width + prev_offset]
-														+ mipmap[_x+1 + _y*prev_width + prev_offset]
-														+ mipmap[_x + (_y+1)*prev_width + prev_offset]
-														+ mipmap[(_x+1) + (_y+1)*prev_width + prev_offset])/4.f;
+			STORE(mipmap, pos.x + pos.y*m_width + m_offset, (LOAD(mipmap, _x + _y*prev_width + prev_offset)
+															+ LOAD(mipmap, _x+1 + _y*prev_width + prev_offset)
+															+ LOAD(mipmap, _x + (_y+1)*prev_width + prev_offset)
+															+ LOAD(mipmap, (_x+1) + (_y+1)*prev_width + prev_offset))/4.f);
 		}
 	}
 }
@@ -90,15 +115,18 @@ kernel void finalReduc(	__global float* logAvgLum_acc,
 }
 
 
-kernel void reinhardLocal(	__global float* Ld_array,
-							__global float* logLumMips,
+kernel void reinhardLocal(	__global storage_t* Ld_array,
+							__global storage_t* logLumMips,
 							__global int* m_width,
 							__global int* m_height,
 							__global int* m_offset,
 							__global float* logAvgLum_acc,
-							const float key) {
+							const float key,
+							const float phi,
+							const float epsilon) {
 
 	float factor = key/logAvgLum_acc[0];
+	const float sharpening = pow(2.f, phi)*key;
 
 	const float scale[7] = {1.f, 2.f, 4.f, 8.f, 16.f, 32.f, 64.f};
 	int2 pos, centre_pos, surround_pos;
@@ -112,45 +140,45 @@ kernel void reinhardLocal(	__global float* Ld_array,
 				centre_pos = surround_pos;
 				surround_pos = centre_pos/2;
 
-				float centre_logAvgLum = logLumMips[centre_pos.x + centre_pos.y*m_width[i] + m_offset[i]]*factor;
-				float surround_logAvgLum = logLumMips[surround_pos.x + surround_pos.y*m_width[i+1] + m_offset[i+1]]*factor;
+				float centre_logAvgLum = LOAD(logLumMips, centre_pos.x + centre_pos.y*m_width[i] + m_offset[i])*factor;
+				float surround_logAvgLum = LOAD(logLumMips, surround_pos.x + surround_pos.y*m_width[i+1] + m_offset[i+1])*factor;
 
 				float logAvgLum_diff = centre_logAvgLum - surround_logAvgLum;
 				logAvgLum_diff = logAvgLum_diff >= 0 ? logAvgLum_diff : -logAvgLum_diff;
 
-				if (logAvgLum_diff/(pow(2.f, (float)PHI)*key/(scale[i]*scale[i]) + centre_logAvgLum) > EPSILON) {
+				if (logAvgLum_diff/(sharpening/(scale[i]*scale[i]) + centre_logAvgLum) > epsilon) {
 					local_logAvgLum = centre_logAvgLum;
 					break;
 				}
 				else local_logAvgLum = surround_logAvgLum;
 			}
-			Ld_array[pos.x + pos.y*WIDTH] = factor /(1.0 + local_logAvgLum);
+			STORE(Ld_array, pos.x + pos.y*WIDTH, factor /(1.0 + local_logAvgLum));
 		}
 	}
 }
 
 kernel void tonemap(__read_only image2d_t input_image,
 					__write_only image2d_t output_image,
-					__global float* Ld_array,
+					__global storage_t* Ld_array,
 					const float sat) {
 
 	int2 pos;
 	uint4 pixel;
+	float4 in;
 	float3 rgb, xyz;
 	for (pos.y = get_global_id(1); pos.y < HEIGHT; pos.y += get_global_size(1)) {
 		for (pos.x = get_global_id(0); pos.x < WIDTH; pos.x += get_global_size(0)) {
-			pixel = read_imageui(input_image, sampler, pos);
-			rgb.x = GL_to_CL(pixel.x);
-			rgb.y = GL_to_CL(pixel.y);
-			rgb.z = GL_to_CL(pixel.z);
+			in = read_pixel(input_image, pos);
+			rgb = in.xyz;
 
 			xyz = RGBtoXYZ(rgb);
 
-			float Ld  = Ld_array[pos.x + pos.y*WIDTH] * xyz.y;
+			float Ld  = LOAD(Ld_array, pos.x + pos.y*WIDTH) * xyz.y;
 
 			pixel.x = clamp((pow(rgb.x/xyz.y, sat)*Ld)*255.f, 0.f, 255.f);
 			pixel.y = clamp((pow(rgb.y/xyz.y, sat)*Ld)*255.f, 0.f, 255.f);
 			pixel.z = clamp((pow(rgb.z/xyz.y, sat)*Ld)*255.f, 0.f, 255.f);
+			pixel.w = clamp(in.w, 0.f, 255.f);
 			write_imageui(output_image, pos, pixel);
 		}
 	}
@@ -1,14 +1,39 @@
 const char *reinhardLocal_kernel =
 "\n"
+"//intermediate planes are stored as half floats when HALF_STORAGE is defined,\n"
+"//all arithmetic is still done in float\n"
+"#ifdef HALF_STORAGE\n"
+"	#ifdef cl_khr_fp16\n"
+"		#pragma OPENCL EXTENSION cl_khr_fp16 : enable\n"
+"	#endif\n"
+"	#define storage_t half\n"
+"	#define LOAD(buf, i)		vload_half((i), (buf))\n"
+"	#define STORE(buf, i, val)	vstore_half((val), (i), (buf))\n"
+"#else\n"
+"	#define storage_t float\n"
+"	#define LOAD(buf, i)		(buf)[(i)]\n"
+"	#define STORE(buf, i, val)	(buf)[(i)] = (val)\n"
+"#endif\n"
+"\n"
 "float GL_to_CL(uint val);\n"
 "float3 RGBtoXYZ(float3 rgb);\n"
 "\n"
 "const sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_NONE | CLK_FILTER_NEAREST;\n"
 "\n"
+"//reads a pixel in the 0..255 range, float inputs carry linear radiance that may exceed it\n"
+"float4 read_pixel(read_only image2d_t image, int2 pos) {\n"
+"#ifdef FLOAT_INPUT\n"
+"	return read_imagef(image, sampler, pos)*255.f;\n"
+"#else\n"
+"	uint4 pixel = read_imageui(image, sampler, pos);\n"
+"	return (float4)(GL_to_CL(pixel.x), GL_to_CL(pixel.y), GL_to_CL(pixel.z), GL_to_CL(pixel.w));\n"
+"#endif\n"
+"}\n"
+"\n"
 "//this kernel computes logAvgLum and Lwhite by performing reduction\n"
 "//the results are stored in an array of size num_work_groups\n"
 "kernel void computeLogAvgLum( 	__read_only image2d_t image,\n"
-"								__global float* logLum,\n"
+"								__global storage_t* logLum,\n"
 "								__global float* logAvgLum,\n"
 "								__local float* logAvgLum_loc) {\n"
 "\n"
@@ -17,19 +42,19 @@ const char *reinhardLocal_kernel =
 "	float logAvgLum_acc = 0.f;\n"
 "\n"
 "	int2 pos;\n"
-"	uint4 pixel;\n"
+"	float4 pixel;\n"
 "	for (pos.y = get_global_id(1); pos.y < HEIGHT; pos.y += get_global_size(1)) {\n"
 "		for (pos.x = get_global_id(0); pos.x < WIDTH; pos.x += get_global_size(0)) {\n"
-"			pixel = read_imageui(image, sampler, pos);\n"
-"			lum = GL_to_CL(pixel.x)*0.2126\n"
-"				+ GL_to_CL(pixel.y)*0.7152\n"
-"				+ GL_to_CL(pixel.z)*0.0722;\n"
+"			pixel = read_pixel(image, pos);\n"
+"			lum = pixel.x*0.2126\n"
+"				+ pixel.y*0.7152\n"
+"				+ pixel.z*0.0722;\n"
 "\n"
 "			Lwhite_acc = (lum > Lwhite_acc) ? lum : Lwhite_acc;\n"
 "			logAvgLum_acc += log(lum + 0.000001);\n"
-"			logLum[pos.x + pos.y*WIDTH] = (GL_to_CL(pixel.x)/255.f)*0.2126\n"
-"										+ (GL_to_CL(pixel.y)/255.f)*0.7152\n"
-"										+ (GL_to_CL(pixel.z)/255.f)*0.0722;\n"
+"			STORE(logLum, pos.x + pos.y*WIDTH, (pixel.x/255.f)*0.2126\n"
+"											+ (pixel.y/255.f)*0.7152\n"
+"											+ (pixel.z/255.f)*0.0722);\n"
 "		}\n"
 "	}\n"
 "\n"
@@ -56,7 +81,7 @@ const char *reinhardLocal_kernel =
 "	}\n"
 "}\n"
 "\n"
-"kernel void channel_mipmap(	__global float* mipmap,	//array containing all the mipmap levels\n"
+"kernel void channel_mipmap(	__global storage_t* mipmap,	//array containing all the mipmap levels\n"
 "							const int prev_width,	//width of the previous mipmap\n"
 "							const int prev_offset, 	//start point of the previous mipmap \n"
 "							const int m_width,		//width of the mipmap being generated\n"
@@ -67,10 +92,10 @@ const char *reinhardLocal_kernel =
 "		for (pos.x = get_global_id(0); pos.x < m_width; pos.x += get_global_size(0)) {\n"
 "			int _x = 2*pos.x;\n"
 "			int _y = 2*pos.y;\n"
-"			mipmap[pos.x + pos.y*m_width + m_offset] = 	(mipmap[_x + _y*prev_width + prev_offset]\n"
-"														+ mipmap[_x+1 + _y*prev_width + prev_offset]\n"
-"														+ mipmap[_x + (_y+1)*prev_width + prev_offset]\n"
-"														+ mipmap[(_x+1) + (_y+1)*prev_width + prev_offset])/4.f;\n"
+"			STORE(mipmap, pos.x + pos.y*m_width + m_offset, (LOAD(mipmap, _x + _y*prev_width + prev_offset)\n"
+"															+ LOAD(mipmap, _x+1 + _y*prev_width + prev_offset)\n"
+"															+ LOAD(mipmap, _x + (_y+1)*prev_width + prev_offset)\n"
+"															+ LOAD(mipmap, (_x+1) + (_y+1)*prev_width + prev_offset))/4.f);\n"
 "		}\n"
 "	}\n"
 "}\n"
@@ -91,15 +116,18 @@ const char *reinhardLocal_kernel =
 "}\n"
 "\n"
 "\n"
-"kernel void reinhardLocal(	__global float* Ld_array,\n"
-"							__global float* logLumMips,\n"
+"kernel void reinhardLocal(	__global storage_t* Ld_array,\n"
+"							__global storage_t* logLumMips,\n"
 "							__global int* m_width,\n"
 "							__global int* m_height,\n"
 "							__global int* m_offset,\n"
 "							__global float* logAvgLum_acc,\n"
-"							const float key) {\n"
+"							const float key,\n"
+"							const float phi,\n"
+"							const float epsilon) {\n"
 "\n"
 "	float factor = key/logAvgLum_acc[0];\n"
+"	const float sharpening = pow(2.f, phi)*key;\n"
 "\n"
 "	const float scale[7] = {1.f, 2.f, 4.f, 8.f, 16.f, 32.f, 64.f};\n"
 "	int2 pos, centre_pos, surround_pos;\n"
@@ -113,45 +141,45 @@ const char *reinhardLocal_kernel =
 "				centre_pos = surround_pos;\n"
 "				surround_pos = centre_pos/2;\n"
 "\n"
-"				float centre_logAvgLum = logLumMips[centre_pos.x + centre_pos.y*m_width[i] + m_offset[i]]*factor;\n"
-"				float surround_logAvgLum = logLumMips[surround_pos.x + surround_pos.y*m_width[i+1] + m_offset[i+1]]*factor;\n"
+"				float centre_logAvgLum = LOAD(logLumMips, centre_pos.x + centre_pos.y*m_width[i] + m_offset[i])*factor;\n"
+"				float surround_logAvgLum = LOAD(logLumMips, surround_pos.x + surround_pos.y*m_width[i+1] + m_offset[i+1])*factor;\n"
 "\n"
 "				float logAvgLum_diff = centre_logAvgLum - surround_logAvgLum;\n"
 "				logAvgLum_diff = logAvgLum_diff >= 0 ? logAvgLum_diff : -logAvgLum_diff;\n"
 "\n"
-"				if (logAvgLum_diff/(pow(2.f, (float)PHI)*key/(scale[i]*scale[i]) + centre_logAvgLum) > EPSILON) {\n"
+"				if (logAvgLum_diff/(sharpening/(scale[i]*scale[i]) + centre_logAvgLum) > epsilon) {\n"
 "					local_logAvgLum = centre_logAvgLum;\n"
 "					break;\n"
 "				}\n"
 "				else local_logAvgLum = surround_logAvgLum;\n"
 "			}\n"
-"			Ld_array[pos.x + pos.y*WIDTH] = factor /(1.0 + local_logAvgLum);\n"
+"			STORE(Ld_array, pos.x + pos.y*WIDTH, factor /(1.0 + local_logAvgLum));\n"
 "		}\n"
 "	}\n"
 "}\n"
 "\n"
 "kernel void tonemap(__read_only image2d_t input_image,\n"
 "					__write_only image2d_t output_image,\n"
-"					__global float* Ld_array,\n"
+"					__global storage_t* Ld_array,\n"
 "					const float sat) {\n"
 "\n"
 "	int2 pos;\n"
 "	uint4 pixel;\n"
+"	float4 in;\n"
 "	float3 rgb, xyz;\n"
 "	for (pos.y = get_global_id(1); pos.y < HEIGHT; pos.y += get_global_size(1)) {\n"
 "		for (pos.x = get_global_id(0); pos.x < WIDTH; pos.x += get_global_size(0)) {\n"
-"			pixel = read_imageui(input_image, sampler, pos);\n"
-"			rgb.x = GL_to_CL(pixel.x);\n"
-"			rgb.y = GL_to_CL(pixel.y);\n"
-"			rgb.z = GL_to_CL(pixel.z);\n"
+"			in = read_pixel(input_image, pos);\n"
+"			rgb = in.xyz;\n"
 "\n"
 "			xyz = RGBtoXYZ(rgb);\n"
 "\n"
-"			float Ld\t= Ld_array[pos.x + pos.y*WIDTH] * xyz.y;\n"
+"			float Ld\t= LOAD(Ld_array, pos.x + pos.y*WIDTH) * xyz.y;\n"
 "\n"
 "			pixel.x = clamp((pow(rgb.x/xyz.y, sat)*Ld)*255.f, 0.f, 255.f);\n"
 "			pixel.y = clamp((pow(rgb.y/xyz.y, sat)*Ld)*255.f, 0.f, 255.f);\n"
 "			pixel.z = clamp((pow(rgb.z/xyz.y, sat)*Ld)*255.f, 0.f, 255.f);\n"
+"			pixel.w = clamp(in.w, 0.f, 255.f);\n"
 "			write_imageui(output_image, pos, pixel);\n"
 "		}\n"
 "	}\n"
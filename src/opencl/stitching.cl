@@ -2,48 +2,38 @@
 float weight(float luminance);
 float getPixelLuminance(float3 pixel_val);
 
-kernel void stitch( __global float* LDRimages, __global float* exposures, __global float* HDRimage) {
-	//this kernel takes num_images LDR images in input_images
+kernel void stitch(__global const uchar4* LDRimages, __constant float* exposures, __write_only image2d_t HDRimage) {
+	//this kernel takes NUM_IMAGES LDR images stacked one after the other in LDRimages
 	//and combines them together according to their exposures
 
-	int gid = get_global_id(0);	//id in the entire global memory
-
-	if (gid < image_size) {
-	float weightedSum = 0;
-	float3 hdr, ldr;
-	hdr.x = hdr.y = hdr.z = 0;
-	for (int i=0; i < num_images; i++) {
-		ldr.x = LDRimages[i*image_size*4 + (gid*4 + 0)]*255.f;
-		ldr.y = LDRimages[i*image_size*4 + (gid*4 + 1)]*255.f;
-		ldr.z = LDRimages[i*image_size*4 + (gid*4 + 2)]*255.f;
-
-		float luminance = getPixelLuminance(ldr);
-		float w = weight(luminance);
-		float exposure = exposures[i];
-
-		hdr.x += (ldr.x/exposure) * w;
-		hdr.y += (ldr.y/exposure) * w;
-		hdr.z += (ldr.z/exposure) * w;
-
-		weightedSum += w;
-	}
-
-	hdr.x = hdr.x/(weightedSum + 0.000001);
-	hdr.y = hdr.y/(weightedSum + 0.000001);
-	hdr.z = hdr.z/(weightedSum + 0.000001);
-
-	HDRimage[gid*4 + 0] = hdr.x/255.f;
-	HDRimage[gid*4 + 1] = hdr.y/255.f;
-	HDRimage[gid*4 + 2] = hdr.z/255.f;
-	HDRimage[gid*4 + 3] = getPixelLuminance(hdr);
+	int2 pos;
+	for (pos.y = get_global_id(1); pos.y < HEIGHT; pos.y += get_global_size(1)) {
+		for (pos.x = get_global_id(0); pos.x < WIDTH; pos.x += get_global_size(0)) {
+			float weightedSum = 0;
+			float3 hdr, ldr;
+			hdr.x = hdr.y = hdr.z = 0;
+			for (int i=0; i < NUM_IMAGES; i++) {
+				ldr = convert_float3(LDRimages[i*image_size + pos.x + pos.y*WIDTH].xyz);
+
+				float w = weight(getPixelLuminance(ldr)/PIXEL_RANGE);
+				hdr += (ldr/exposures[i]) * w;
+				weightedSum += w;
+			}
+			hdr = hdr/weightedSum;
+
+			//float images store radiance with 1.0 == PIXEL_RANGE
+			write_imagef(HDRimage, pos, (float4)(hdr/PIXEL_RANGE, 1.f));
+		}
 	}
 }
 
+//triangle weight on normalised luminance, never quite zero so that pixels
+//clipped in every exposure still get a value
 float weight(float luminance) {
-	if (luminance < 0.5) return luminance*2.0;
-	else return (1.0 - luminance)*2.0;
+	if (luminance < 0.5f) return max(luminance*2.f, MIN_WEIGHT);
+	else return max((1.f - luminance)*2.f, MIN_WEIGHT);
 }
 
 float getPixelLuminance(float3 pixel_val) {
-	return pixel_val.x*0.2126 + pixel_val.y*0.7152 + pixel_val.z*0.0722;
-}
\ No newline at end of file
+	return pixel_val.x*0.2126f + pixel_val.y*0.7152f + pixel_val.z*0.0722f;
+}
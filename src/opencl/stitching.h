@@ -0,0 +1,41 @@
+const char *stitching_kernel =
+"\n"
+"float weight(float luminance);\n"
+"float getPixelLuminance(float3 pixel_val);\n"
+"\n"
+"kernel void stitch(__global const uchar4* LDRimages, __constant float* exposures, __write_only image2d_t HDRimage) {\n"
+"	//this kernel takes NUM_IMAGES LDR images stacked one after the other in LDRimages\n"
+"	//and combines them together according to their exposures\n"
+"\n"
+"	int2 pos;\n"
+"	for (pos.y = get_global_id(1); pos.y < HEIGHT; pos.y += get_global_size(1)) {\n"
+"		for (pos.x = get_global_id(0); pos.x < WIDTH; pos.x += get_global_size(0)) {\n"
+"			float weightedSum = 0;\n"
+"			float3 hdr, ldr;\n"
+"			hdr.x = hdr.y = hdr.z = 0;\n"
+"			for (int i=0; i < NUM_IMAGES; i++) {\n"
+"				ldr = convert_float3(LDRimages[i*image_size + pos.x + pos.y*WIDTH].xyz);\n"
+"\n"
+"				float w = weight(getPixelLuminance(ldr)/PIXEL_RANGE);\n"
+"				hdr += (ldr/exposures[i]) * w;\n"
+"				weightedSum += w;\n"
+"			}\n"
+"			hdr = hdr/weightedSum;\n"
+"\n"
+"			//float images store radiance with 1.0 == PIXEL_RANGE\n"
+"			write_imagef(HDRimage, pos, (float4)(hdr/PIXEL_RANGE, 1.f));\n"
+"		}\n"
+"	}\n"
+"}\n"
+"\n"
+"//triangle weight on normalised luminance, never quite zero so that pixels\n"
+"//clipped in every exposure still get a value\n"
+"float weight(float luminance) {\n"
+"	if (luminance < 0.5f) return max(luminance*2.f, MIN_WEIGHT);\n"
+"	else return max((1.f - luminance)*2.f, MIN_WEIGHT);\n"
+"}\n"
+"\n"
+"float getPixelLuminance(float3 pixel_val) {\n"
+"	return pixel_val.x*0.2126f + pixel_val.y*0.7152f + pixel_val.z*0.0722f;\n"
+"}\n"
+;
@@ -1,6 +1,6 @@
 #!/bin/bash
 
-kernels="histEq reinhardGlobal reinhardLocal gradDom"
+kernels="histEq reinhardGlobal reinhardLocal gradDom stitching bilateralLocal"
 
 for name in $kernels
 do